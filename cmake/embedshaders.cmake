@@ -0,0 +1,83 @@
+# Writes OUTPUT with the SPIR-V of every shader in SHADERS (comma separated,
+# compiled to SPIRV_DIR/<shader>.spv) as constexpr word arrays. An empty
+# list writes a lookup that never finds anything.
+
+string(REPLACE "," ";" SHADER_LIST "${SHADERS}")
+
+set(ARRAYS "")
+set(ENTRIES "")
+set(ALL_HEX "")
+
+foreach(SHADER ${SHADER_LIST})
+    file(READ ${SPIRV_DIR}/${SHADER}.spv HEX HEX)
+    string(LENGTH "${HEX}" HEX_LENGTH)
+    math(EXPR REMAINDER "${HEX_LENGTH} % 8")
+    if(NOT REMAINDER EQUAL 0)
+        message(FATAL_ERROR "${SHADER}.spv is not whole 32-bit words")
+    endif()
+
+    # SPIR-V words are little endian in the file
+    string(REGEX REPLACE "(..)(..)(..)(..)" "0x\\4\\3\\2\\1u," WORDS "${HEX}")
+    set(WORD "0x........u,")
+    string(REGEX REPLACE "(${WORD}${WORD}${WORD}${WORD}${WORD}${WORD}${WORD}${WORD})" "\\1\n    " WORDS "${WORDS}")
+    string(STRIP "${WORDS}" WORDS)
+    string(MAKE_C_IDENTIFIER "${SHADER}" ID)
+
+    string(APPEND ARRAYS "constexpr uint32_t ${ID}[] = {\n    ${WORDS}\n};\n\n")
+    string(APPEND ENTRIES "    { \"${SHADER}.spv\", ${ID} },\n")
+    string(APPEND ALL_HEX "${SHADER}${HEX}")
+endforeach()
+
+if(SHADER_LIST)
+    string(SHA256 HASH "${ALL_HEX}")
+    string(SUBSTRING "${HASH}" 0 16 HASH)
+
+    set(BODY "namespace {
+
+struct EmbeddedShader {
+    std::string_view name;
+    std::span<const uint32_t> code;
+};
+
+${ARRAYS}constexpr EmbeddedShader EMBEDDED_SHADERS[] = {
+${ENTRIES}};
+
+}
+
+std::optional<std::span<const uint32_t>> findEmbeddedShader(std::string_view name)
+{
+    for (const EmbeddedShader &shader : EMBEDDED_SHADERS) {
+        if (shader.name == name)
+            return shader.code;
+    }
+    return std::nullopt;
+}
+
+uint64_t embeddedShaderHash()
+{
+    return 0x${HASH}ull;
+}
+")
+else()
+    set(BODY "std::optional<std::span<const uint32_t>> findEmbeddedShader(std::string_view)
+{
+    return std::nullopt;
+}
+
+uint64_t embeddedShaderHash()
+{
+    return 0;
+}
+")
+endif()
+
+file(WRITE ${OUTPUT} "// Generated by cmake/embedshaders.cmake from the compiled shaders
+
+#include \"embeddedshaders.hh\"
+
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string_view>
+
+${BODY}")
@@ -0,0 +1,203 @@
+#include "archive.hh"
+
+#include "utils.hh"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#ifdef WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ull
+#define FNV_PRIME 0x100000001b3ull
+
+uint64_t hashAssetName(std::string_view name)
+{
+    uint64_t hash = FNV_OFFSET_BASIS;
+    for (char c : name) {
+        hash ^= static_cast<uint8_t>(c == '\\' ? '/' : c);
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+// Stored names always use forward slashes
+static bool sameName(std::string_view name, std::string_view stored)
+{
+    return name.size() == stored.size() && std::equal(name.begin(), name.end(), stored.begin(), [](char a, char b) {
+        return (a == '\\' ? '/' : a) == b;
+    });
+}
+
+AssetArchive::AssetArchive(const Path &path):
+    m_data(nullptr),
+    m_size(0),
+#ifdef WIN32
+    m_file(INVALID_HANDLE_VALUE),
+    m_mapping(nullptr),
+#endif
+    m_entries(nullptr),
+    m_entryCount(0),
+    m_names(nullptr)
+{
+#ifdef WIN32
+    m_file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, nullptr);
+    LARGE_INTEGER fileSize;
+    if (m_file == INVALID_HANDLE_VALUE || !GetFileSizeEx(m_file, &fileSize))
+        throw std::runtime_error("Failed to open asset archive: " + path.string());
+    m_size = static_cast<size_t>(fileSize.QuadPart);
+
+    m_mapping = CreateFileMappingW(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (m_mapping)
+        m_data = static_cast<const uint8_t *>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+    if (!m_data)
+        throw std::runtime_error("Failed to map asset archive: " + path.string());
+#else
+    // The mapping keeps the file alive on its own
+    int fd = open(cpath(path), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0)
+            close(fd);
+        throw std::runtime_error("Failed to open asset archive: " + path.string());
+    }
+    m_size = static_cast<size_t>(st.st_size);
+
+    void *data = m_size ? mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (data == MAP_FAILED)
+        throw std::runtime_error("Failed to map asset archive: " + path.string());
+    m_data = static_cast<const uint8_t *>(data);
+#endif
+
+    ArchiveHeader header;
+    if (m_size < sizeof(header))
+        throw std::runtime_error("Truncated asset archive: " + path.string());
+    memcpy(&header, m_data, sizeof(header));
+
+    if (memcmp(header.magic, ARCHIVE_MAGIC, sizeof(header.magic)) != 0 || header.version != ARCHIVE_VERSION)
+        throw std::runtime_error("Not a version " + std::to_string(ARCHIVE_VERSION) + " asset archive: " + path.string());
+
+    uint64_t tocSize = static_cast<uint64_t>(header.entryCount) * sizeof(ArchiveEntry);
+    if (header.tocOffset % alignof(ArchiveEntry) || header.tocOffset > m_size || tocSize > m_size - header.tocOffset ||
+        header.namesOffset < header.tocOffset + tocSize || header.namesOffset > m_size)
+        throw std::runtime_error("Corrupt asset archive table of contents: " + path.string());
+
+    m_entries = reinterpret_cast<const ArchiveEntry *>(m_data + header.tocOffset);
+    m_entryCount = header.entryCount;
+    m_names = reinterpret_cast<const char *>(m_data + header.namesOffset);
+
+    // Checked once so that lookups can trust the table, uncompressed
+    // entries are handed out as they are stored
+    size_t namesSize = m_size - header.namesOffset;
+    for (uint32_t i = 0; i < m_entryCount; ++i) {
+        const ArchiveEntry &entry = m_entries[i];
+        if (entry.offset > m_size || entry.storedSize > m_size - entry.offset || entry.nameOffset >= namesSize ||
+            (entry.compression == ARCHIVE_COMPRESSION_NONE && entry.size != entry.storedSize) ||
+            !memchr(m_names + entry.nameOffset, '\0', namesSize - entry.nameOffset) || (i && entry.hash < m_entries[i - 1].hash))
+            throw std::runtime_error("Corrupt asset archive entry " + std::to_string(i) + ": " + path.string());
+    }
+}
+
+AssetArchive::~AssetArchive()
+{
+#ifdef WIN32
+    if (m_data)
+        UnmapViewOfFile(m_data);
+    if (m_mapping)
+        CloseHandle(m_mapping);
+    if (m_file != INVALID_HANDLE_VALUE)
+        CloseHandle(m_file);
+#else
+    if (m_data)
+        munmap(const_cast<uint8_t *>(m_data), m_size);
+#endif
+}
+
+std::optional<std::span<const uint8_t>> AssetArchive::find(std::string_view name) const
+{
+    uint64_t hash = hashAssetName(name);
+    const ArchiveEntry *end = m_entries + m_entryCount;
+    const ArchiveEntry *entry = std::lower_bound(m_entries, end, hash, [](const ArchiveEntry &e, uint64_t h) {
+        return e.hash < h;
+    });
+
+    // The names settle hash collisions
+    for (; entry != end && entry->hash == hash; ++entry) {
+        if (!sameName(name, m_names + entry->nameOffset))
+            continue;
+
+        if (entry->compression != ARCHIVE_COMPRESSION_NONE)
+            throw std::runtime_error("Asset " + std::string(name) + " uses unsupported compression " + std::to_string(entry->compression));
+
+        return std::span<const uint8_t>(m_data + entry->offset, entry->size);
+    }
+
+    return std::nullopt;
+}
+
+uint32_t AssetArchive::entryCount() const
+{
+    return m_entryCount;
+}
+
+size_t AssetArchive::size() const
+{
+    return m_size;
+}
+
+AssetStream::Buffer::Buffer(std::span<const uint8_t> data)
+{
+    // Never written through, streambuf just has no const get area
+    char *begin = const_cast<char *>(reinterpret_cast<const char *>(data.data()));
+    setg(begin, begin, begin + data.size());
+}
+
+AssetStream::AssetStream(std::span<const uint8_t> data):
+    std::istream(nullptr),
+    m_buffer(data)
+{
+    rdbuf(&m_buffer);
+}
+
+const AssetArchive *assetArchive()
+{
+    static const std::unique_ptr<AssetArchive> archive = []() -> std::unique_ptr<AssetArchive> {
+        const char *env = getenv("VKLELU_ASSETPACK");
+        Path path = env ? env : "./assets.pak";
+        if (!env && !std::filesystem::exists(path))
+            return nullptr;
+
+        std::unique_ptr<AssetArchive> opened = std::make_unique<AssetArchive>(path);
+        fprintf(stderr, "Asset archive %s: %u assets, %zu bytes mapped\n", cpath(path), opened->entryCount(), opened->size());
+        return opened;
+    }();
+
+    return archive.get();
+}
+
+std::optional<std::span<const uint8_t>> findAsset(std::string_view file)
+{
+    const AssetArchive *archive = assetArchive();
+    if (!archive)
+        return std::nullopt;
+    return archive->find(file);
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "utils.hh"
+
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <optional>
+#include <span>
+#include <streambuf>
+#include <string_view>
+
+// Packed assets, a header followed by the payloads, a table of contents
+// sorted by name hash and the names. Everything is little endian.
+#define ARCHIVE_MAGIC "VKLPACK"
+#define ARCHIVE_VERSION 1
+// Payload offsets are multiples of this so that they can be read in place
+#define ARCHIVE_ALIGNMENT 64
+#define ARCHIVE_COMPRESSION_NONE 0
+
+struct ArchiveHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t entryCount;
+    uint64_t tocOffset;
+    uint64_t namesOffset;
+};
+
+struct ArchiveEntry {
+    uint64_t hash;
+    uint64_t offset;
+    // Stored size differs from the size only for compressed entries
+    uint64_t size;
+    uint64_t storedSize;
+    uint32_t compression;
+    // Null terminated in the names block, the same path the loose file
+    // has relative to the asset directory
+    uint32_t nameOffset;
+};
+
+// FNV-1a of the name with forward slashes
+uint64_t hashAssetName(std::string_view name);
+
+// Maps the whole archive and looks assets up without copying them
+class AssetArchive
+{
+public:
+    AssetArchive(const Path &path);
+    ~AssetArchive();
+    AssetArchive(const AssetArchive &) = delete;
+    AssetArchive &operator=(const AssetArchive &) = delete;
+
+    std::optional<std::span<const uint8_t>> find(std::string_view name) const;
+    uint32_t entryCount() const;
+    size_t size() const;
+
+private:
+    const uint8_t *m_data;
+    size_t m_size;
+#ifdef WIN32
+    void *m_file;
+    void *m_mapping;
+#endif
+    const ArchiveEntry *m_entries;
+    uint32_t m_entryCount;
+    const char *m_names;
+};
+
+// Reads a mapped asset through the standard streams
+class AssetStream : public std::istream
+{
+public:
+    AssetStream(std::span<const uint8_t> data);
+
+private:
+    struct Buffer : std::streambuf {
+        Buffer(std::span<const uint8_t> data);
+    };
+
+    Buffer m_buffer;
+};
+
+// The archive named by VKLELU_ASSETPACK, or assets.pak in the working
+// directory, opened on first use. Null when there is none.
+const AssetArchive *assetArchive();
+// Looks a file up in the asset archive, loose files are used when this
+// comes back empty
+std::optional<std::span<const uint8_t>> findAsset(std::string_view file);
@@ -0,0 +1,475 @@
+#include "context.hh"
+#include "himmeli.hh"
+#include "memory.hh"
+#include "scene.hh"
+#include "scenefile.hh"
+#include "upload.hh"
+#include "utils.hh"
+#include "vklelu.hh"
+
+#include "glm/glm.hpp"
+#include "glm/gtc/quaternion.hpp"
+#include "SDL3/SDL.h"
+#include "vulkan/vulkan.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <numeric>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define DEFAULT_ITERATIONS 50
+#define DEFAULT_TOLERANCE 0.1
+#define FRAME_WARMUP 10
+// Has Himmelit rotated off the Y axis in the scene file
+#define ROTATION_CHECK_SCENE "showcase.scene"
+#define ROTATION_TOLERANCE 1e-3f
+#define UPLOAD_SIZE (64 * 1024 * 1024)
+
+static const char *BENCH_MESHES[] = { "cone.obj", "cube.obj", "cylinder.obj", "icosphere.obj",
+                                      "plane.obj", "sphere.obj", "suzanne.obj", "torus.obj" };
+
+// Standard stress scene sizes for the per-frame benchmarks
+static const glm::uvec3 BENCH_GRIDS[] = { { 8, 8, 8 }, { 20, 20, 20 }, { 40, 40, 40 } };
+
+// Point light counts for the clustered lighting benchmarks, on the middle grid
+static const uint32_t BENCH_LIGHTS[] = { 1, 100, 1000, 10000 };
+
+// Share of static Himmelit in the shadow cache benchmarks
+#define BENCH_STATIC_FRACTION 0.875f
+
+struct BenchOptions {
+    std::string output;
+    std::string baseline;
+    std::string filter;
+    double tolerance = DEFAULT_TOLERANCE;
+    uint32_t iterations = DEFAULT_ITERATIONS;
+};
+
+struct BenchResult {
+    std::string name;
+    uint32_t iterations;
+    double medianMs;
+    double meanMs;
+    double minMs;
+    double maxMs;
+};
+
+struct Benchmark {
+    std::string name;
+    std::function<void(uint32_t iterations, std::vector<BenchResult> &results)> run;
+};
+
+static BenchOptions parseOptions(int argc, char *argv[])
+{
+    BenchOptions options;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        bool hasValue = i + 1 < argc;
+
+        if (arg == "--output" && hasValue) {
+            options.output = argv[++i];
+        } else if (arg == "--baseline" && hasValue) {
+            options.baseline = argv[++i];
+        } else if (arg == "--filter" && hasValue) {
+            options.filter = argv[++i];
+        } else if (arg == "--tolerance" && hasValue) {
+            options.tolerance = strtod(argv[++i], nullptr);
+        } else if (arg == "--iterations" && hasValue) {
+            options.iterations = static_cast<uint32_t>(std::max(1ul, strtoul(argv[++i], nullptr, 10)));
+        } else {
+            throw std::runtime_error("Unknown argument: " + arg + "\n"
+                                     "Usage: vklelu_bench [--output results.csv|results.json] [--baseline baseline.csv]\n"
+                                     "                    [--tolerance 0.1] [--iterations N] [--filter name]");
+        }
+    }
+
+    return options;
+}
+
+static BenchResult summarize(const std::string &name, std::vector<uint64_t> samples)
+{
+    std::sort(samples.begin(), samples.end());
+
+    double total = static_cast<double>(std::accumulate(samples.begin(), samples.end(), uint64_t{ 0 }));
+    double count = static_cast<double>(samples.size());
+
+    return BenchResult {
+        .name = name,
+        .iterations = static_cast<uint32_t>(samples.size()),
+        .medianMs = static_cast<double>(samples[samples.size() / 2]) / 1e6,
+        .meanMs = total / count / 1e6,
+        .minMs = static_cast<double>(samples.front()) / 1e6,
+        .maxMs = static_cast<double>(samples.back()) / 1e6
+    };
+}
+
+static void benchObjLoad(uint32_t iterations, std::vector<BenchResult> &results)
+{
+    std::vector<uint64_t> samples;
+
+    for (uint32_t i = 0; i < iterations; ++i) {
+        uint64_t start = SDL_GetTicksNS();
+        for (const char *mesh : BENCH_MESHES)
+            ObjFile obj(mesh);
+        samples.push_back(SDL_GetTicksNS() - start);
+    }
+
+    results.push_back(summarize("obj_load", samples));
+}
+
+static void benchVertexDedup(uint32_t iterations, std::vector<BenchResult> &results)
+{
+    // Expand the bundled meshes back into triangle soups to dedup
+    std::vector<std::vector<Vertex>> soups;
+    for (const char *mesh : BENCH_MESHES) {
+        ObjFile obj(mesh);
+        std::vector<Vertex> &soup = soups.emplace_back();
+        for (uint32_t index : obj.indices)
+            soup.push_back(obj.vertices[index]);
+    }
+
+    std::vector<uint64_t> samples;
+
+    for (uint32_t i = 0; i < iterations; ++i) {
+        uint64_t start = SDL_GetTicksNS();
+        for (const std::vector<Vertex> &soup : soups)
+            ObjFile obj(soup);
+        samples.push_back(SDL_GetTicksNS() - start);
+    }
+
+    results.push_back(summarize("vertex_dedup", samples));
+}
+
+static void benchUpload(uint32_t iterations, std::vector<BenchResult> &results)
+{
+    VulkanContext ctx(0, 0, true);
+    Uploader uploader(ctx, STAGING_BUFFER_SIZE);
+
+    std::vector<uint8_t> data(UPLOAD_SIZE);
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = static_cast<uint8_t>(i);
+
+    std::unique_ptr<BufferAllocation> buffer = ctx.allocateBuffer(UPLOAD_SIZE, VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+
+    std::vector<uint64_t> samples;
+
+    for (uint32_t i = 0; i < iterations; ++i) {
+        uint64_t start = SDL_GetTicksNS();
+        uploader.uploadBuffer(data.data(), data.size(), buffer->buffer());
+        uploader.flush();
+        samples.push_back(SDL_GetTicksNS() - start);
+    }
+
+    BenchResult result = summarize("upload_64mib", samples);
+    fprintf(stderr, "Upload throughput: %.1f MiB/s\n", 64.0 / (result.medianMs / MS_IN_SEC));
+    results.push_back(result);
+
+    // Written in place when the device has host visible device memory
+    std::unique_ptr<BufferAllocation> direct = uploader.allocateBuffer(UPLOAD_SIZE, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+    auto fill = [&data](void *out, size_t first, size_t count) {
+        memcpy(out, data.data() + first, count);
+    };
+
+    samples.clear();
+
+    for (uint32_t i = 0; i < iterations; ++i) {
+        uint64_t start = SDL_GetTicksNS();
+        uploader.writeBuffer(*direct, data.size(), 1, fill);
+        uploader.flush();
+        samples.push_back(SDL_GetTicksNS() - start);
+    }
+
+    result = summarize("upload_direct_64mib", samples);
+    fprintf(stderr, "Direct upload throughput: %.1f MiB/s, %s\n", 64.0 / (result.medianMs / MS_IN_SEC),
+            direct->hostVisible() ? "written in place" : "through staging");
+    results.push_back(result);
+}
+
+static void benchFrames(const Options &options, const std::string &suffix, uint32_t iterations, std::vector<BenchResult> &results)
+{
+    VKlelu vklelu(options);
+    vklelu.init();
+
+    for (uint32_t i = 0; i < FRAME_WARMUP; ++i)
+        vklelu.frame();
+
+    std::vector<uint64_t> transformSamples;
+    std::vector<uint64_t> recordSamples;
+    std::vector<uint64_t> frameSamples;
+    std::vector<uint64_t> simulationSamples;
+    std::vector<uint64_t> gpuShadowCacheSamples;
+    std::vector<uint64_t> gpuShadowSamples;
+    std::vector<uint64_t> gpuCullSamples;
+    std::vector<uint64_t> gpuPrepassSamples;
+    std::vector<uint64_t> gpuShadingSamples;
+    std::vector<uint64_t> gpuFrameSamples;
+
+    for (uint32_t i = 0; i < iterations; ++i) {
+        vklelu.frame();
+        const FrameStats &stats = vklelu.frameStats();
+        transformSamples.push_back(stats.transformNs);
+        recordSamples.push_back(stats.recordNs);
+        frameSamples.push_back(stats.frameNs);
+        simulationSamples.push_back(stats.simulationNs);
+        gpuShadowCacheSamples.push_back(stats.gpuShadowCacheNs);
+        gpuShadowSamples.push_back(stats.gpuShadowNs);
+        gpuCullSamples.push_back(stats.gpuCullNs);
+        gpuPrepassSamples.push_back(stats.gpuPrepassNs);
+        gpuShadingSamples.push_back(stats.gpuShadingNs);
+        gpuFrameSamples.push_back(stats.gpuFrameNs);
+    }
+
+    const FrameStats &stats = vklelu.frameStats();
+    fprintf(stderr, "Culling: %u drawn, %u occluded, %u outside the frustum\n",
+            stats.drawnObjects, stats.occludedObjects, stats.frustumCulledObjects);
+    if (options.meshlets)
+        fprintf(stderr, "Meshlets: %u drawn, %u culled\n", stats.drawnMeshlets, stats.culledMeshlets);
+    fprintf(stderr, "Shadows: %u casters in the last frame\n", stats.shadowCasters);
+
+    results.push_back(summarize("transform_update" + suffix, transformSamples));
+    results.push_back(summarize("command_record" + suffix, recordSamples));
+    results.push_back(summarize("frame" + suffix, frameSamples));
+    results.push_back(summarize("simulation_step" + suffix, simulationSamples));
+    results.push_back(summarize("gpu_shadow_cache" + suffix, gpuShadowCacheSamples));
+    results.push_back(summarize("gpu_shadow" + suffix, gpuShadowSamples));
+    results.push_back(summarize("gpu_cull" + suffix, gpuCullSamples));
+    results.push_back(summarize("gpu_prepass" + suffix, gpuPrepassSamples));
+    results.push_back(summarize("gpu_shading" + suffix, gpuShadingSamples));
+    results.push_back(summarize("gpu_frame" + suffix, gpuFrameSamples));
+}
+
+// Not timed, fails the run when the simulation drops the rotations a scene
+// was loaded with. Only a spin about Y goes on top of them, so the height
+// of each Himmeli's up axis has to stay what the file says.
+static void checkSceneRotations(uint32_t, std::vector<BenchResult> &)
+{
+    SceneFile sceneFile(ROTATION_CHECK_SCENE);
+    Options options {
+        .sceneFile = ROTATION_CHECK_SCENE,
+        .headless = true
+    };
+    VKlelu vklelu(options);
+    vklelu.init();
+    vklelu.frame();
+
+    std::vector<glm::quat> &rotations = vklelu.scene().rotations();
+    for (size_t i = 0; i < sceneFile.himmelit.size(); ++i) {
+        const SceneFile::HimmeliEntry &entry = sceneFile.himmelit[i];
+        float expected = (glm::quat(glm::radians(entry.rotation)) * glm::vec3(0, 1, 0)).y;
+        float actual = (rotations[i] * glm::vec3(0, 1, 0)).y;
+        if (std::abs(actual - expected) > ROTATION_TOLERANCE)
+            throw std::runtime_error("Himmeli " + entry.mesh + " in " ROTATION_CHECK_SCENE " lost its rotation after a frame");
+    }
+
+    fprintf(stderr, "Rotations of %zu Himmelit survived a frame\n", sceneFile.himmelit.size());
+}
+
+static std::unordered_map<std::string, double> readBaseline(const std::string &filename)
+{
+    std::ifstream file(filename);
+    if (!file) {
+        throw std::runtime_error("Failed to open baseline: " + filename);
+    }
+
+    // Same CSV layout as written by writeCsv, only the median is compared
+    std::unordered_map<std::string, double> medians;
+    std::string line;
+    std::getline(file, line);
+
+    while (std::getline(file, line)) {
+        std::istringstream fields(line);
+        std::string name;
+        std::string iterations;
+        std::string median;
+        if (std::getline(fields, name, ',') &&
+            std::getline(fields, iterations, ',') &&
+            std::getline(fields, median, ','))
+            medians[name] = strtod(median.c_str(), nullptr);
+    }
+
+    return medians;
+}
+
+static void writeCsv(FILE *f, const std::vector<BenchResult> &results)
+{
+    fprintf(f, "name,iterations,median_ms,mean_ms,min_ms,max_ms\n");
+    for (const BenchResult &r : results)
+        fprintf(f, "%s,%u,%.4f,%.4f,%.4f,%.4f\n", r.name.c_str(), r.iterations, r.medianMs, r.meanMs, r.minMs, r.maxMs);
+}
+
+static void writeJson(FILE *f, const std::vector<BenchResult> &results)
+{
+    fprintf(f, "[\n");
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchResult &r = results[i];
+        fprintf(f, "  { \"name\": \"%s\", \"iterations\": %u, \"median_ms\": %.4f, \"mean_ms\": %.4f, \"min_ms\": %.4f, \"max_ms\": %.4f }%s\n",
+                r.name.c_str(), r.iterations, r.medianMs, r.meanMs, r.minMs, r.maxMs,
+                i + 1 < results.size() ? "," : "");
+    }
+    fprintf(f, "]\n");
+}
+
+static int benchMain(int argc, char *argv[])
+{
+    BenchOptions options = parseOptions(argc, argv);
+
+    std::vector<Benchmark> benchmarks = {
+        { "obj_load", benchObjLoad },
+        { "vertex_dedup", benchVertexDedup },
+        { "upload", benchUpload },
+        { "check_scene_rotations", checkSceneRotations }
+    };
+
+    auto addFrameBenchmark = [&benchmarks](const Options &options, const std::string &suffix) {
+        benchmarks.push_back({ "frame" + suffix,
+                               [options, suffix](uint32_t iterations, std::vector<BenchResult> &results) {
+                                   benchFrames(options, suffix, iterations, results);
+                               } });
+    };
+
+    for (glm::uvec3 grid : BENCH_GRIDS) {
+        Options options {
+            .stressGrid = grid,
+            .headless = true
+        };
+        addFrameBenchmark(options, "_" + std::to_string(grid.x * grid.y * grid.z));
+    }
+
+    // Frustum culling only, to measure what occlusion culling buys on the largest grid
+    glm::uvec3 largest = BENCH_GRIDS[std::size(BENCH_GRIDS) - 1];
+    Options noOcclusion {
+        .stressGrid = largest,
+        .headless = true,
+        .occlusionCulling = false
+    };
+    addFrameBenchmark(noOcclusion, "_" + std::to_string(largest.x * largest.y * largest.z) + "_no_occlusion");
+
+    // Depth pre-pass on the two larger grids, compare against the plain runs
+    for (size_t i = 1; i < std::size(BENCH_GRIDS); ++i) {
+        glm::uvec3 grid = BENCH_GRIDS[i];
+        Options options {
+            .stressGrid = grid,
+            .headless = true,
+            .depthPrepass = true
+        };
+        addFrameBenchmark(options, "_" + std::to_string(grid.x * grid.y * grid.z) + "_prepass");
+    }
+
+    // Per-cluster culling on the middle grid, through mesh shaders when the
+    // device has them and through the compute fallback
+    glm::uvec3 middle = BENCH_GRIDS[1];
+    std::string middleSuffix = "_" + std::to_string(middle.x * middle.y * middle.z);
+    Options meshlets {
+        .stressGrid = middle,
+        .headless = true,
+        .meshlets = true
+    };
+    addFrameBenchmark(meshlets, middleSuffix + "_meshlets");
+
+    Options meshletFallback {
+        .stressGrid = middle,
+        .headless = true,
+        .meshlets = true,
+        .meshShaders = false
+    };
+    addFrameBenchmark(meshletFallback, middleSuffix + "_meshlets_fallback");
+
+    // The middle grid with mostly static casters, once with the statics
+    // cached and once with every caster into the shadow map every frame
+    Options shadowCache {
+        .stressGrid = middle,
+        .stressStatic = BENCH_STATIC_FRACTION,
+        .headless = true
+    };
+    addFrameBenchmark(shadowCache, middleSuffix + "_shadow_cache");
+
+    Options noShadowCache {
+        .stressGrid = middle,
+        .stressStatic = BENCH_STATIC_FRACTION,
+        .headless = true,
+        .shadowCache = false
+    };
+    addFrameBenchmark(noShadowCache, middleSuffix + "_no_shadow_cache");
+
+    for (uint32_t lights : BENCH_LIGHTS) {
+        Options options {
+            .stressGrid = BENCH_GRIDS[1],
+            .stressLights = lights,
+            .headless = true
+        };
+        addFrameBenchmark(options, "_lights_" + std::to_string(lights));
+    }
+
+    std::vector<BenchResult> results;
+
+    for (Benchmark &benchmark : benchmarks) {
+        if (benchmark.name.find(options.filter) == std::string::npos)
+            continue;
+
+        fprintf(stderr, "Running benchmark %s\n", benchmark.name.c_str());
+        benchmark.run(options.iterations, results);
+    }
+
+    writeCsv(stdout, results);
+
+    if (!options.output.empty()) {
+        FILE *f = fopen(options.output.c_str(), "w");
+        if (!f) {
+            throw std::runtime_error("Failed to open output: " + options.output);
+        }
+
+        if (options.output.ends_with(".json"))
+            writeJson(f, results);
+        else
+            writeCsv(f, results);
+
+        fclose(f);
+    }
+
+    if (options.baseline.empty())
+        return EXIT_SUCCESS;
+
+    std::unordered_map<std::string, double> baseline = readBaseline(options.baseline);
+    int regressions = 0;
+
+    for (const BenchResult &r : results) {
+        auto it = baseline.find(r.name);
+        if (it == baseline.end() || it->second <= 0.0)
+            continue;
+
+        double ratio = r.medianMs / it->second;
+        bool regressed = ratio > 1.0 + options.tolerance;
+        regressions += regressed;
+
+        fprintf(stderr, "%-24s %10.4f ms vs %10.4f ms baseline (%+.1f%%)%s\n",
+                r.name.c_str(), r.medianMs, it->second, (ratio - 1.0) * 100.0,
+                regressed ? "  REGRESSION" : "");
+    }
+
+    fprintf(stderr, "%d regressions with %.0f%% tolerance\n", regressions, options.tolerance * 100.0);
+
+    return regressions ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+    try {
+        return benchMain(argc, argv);
+    } catch (std::runtime_error& e) {
+        fprintf(stderr, "Unhandled exception: %s\n", e.what());
+        return EXIT_FAILURE;
+    }
+}
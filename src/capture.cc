@@ -0,0 +1,270 @@
+#include "capture.hh"
+
+#include "SDL3/SDL.h"
+#include "stb_image_write.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+static CaptureFormat captureFormat(const std::string &path)
+{
+    if (path.ends_with(".ppm"))
+        return CaptureFormat::Ppm;
+    if (path.ends_with(".png"))
+        return CaptureFormat::Png;
+    if (path.ends_with(".y4m"))
+        return CaptureFormat::Y4m;
+    return CaptureFormat::Raw;
+}
+
+static void writePng(void *context, void *data, int size)
+{
+    std::vector<uint8_t> *encoded = static_cast<std::vector<uint8_t> *>(context);
+    uint8_t *bytes = static_cast<uint8_t *>(data);
+    encoded->insert(encoded->end(), bytes, bytes + size);
+}
+
+FrameCapture::FrameCapture(const std::string &path, uint32_t width, uint32_t height, uint32_t fps, bool bgra):
+    m_path(path),
+    m_format(captureFormat(path)),
+    m_width(width),
+    m_height(height),
+    m_fps(fps),
+    m_bgra(bgra),
+    m_perFrameFiles(path.find('%') != std::string::npos && m_format != CaptureFormat::Y4m),
+    m_frameNumberWidth(0),
+    m_frameNumberPad(' '),
+    m_file(nullptr),
+    m_finishing(false),
+    m_startNs(SDL_GetTicksNS()),
+    m_bytes(0),
+    m_frames(0)
+{
+    if (m_perFrameFiles)
+        parseFramePattern(path);
+
+    if (!m_perFrameFiles) {
+        m_file = path == "-" ? stdout : fopen(path.c_str(), "wb");
+        if (!m_file) {
+            throw std::runtime_error("Failed to open capture output: " + path);
+        }
+    }
+
+    if (m_format == CaptureFormat::Y4m) {
+        char header[128];
+        int length = snprintf(header, sizeof(header), "YUV4MPEG2 W%u H%u F%u:1 Ip A1:1 C444\n", m_width, m_height, m_fps);
+        write(header, static_cast<size_t>(length));
+    }
+
+    m_thread = std::thread(&FrameCapture::writerLoop, this);
+
+    fprintf(stderr, "Capturing %ux%u frames to %s\n", m_width, m_height, path.c_str());
+}
+
+// The path is never used as a format string, the one integer conversion
+// is substituted by hand and %% stands for a plain %
+void FrameCapture::parseFramePattern(const std::string &path)
+{
+    std::string *name = &m_namePrefix;
+    bool found = false;
+
+    for (size_t i = 0; i < path.size(); ++i) {
+        if (path[i] != '%') {
+            name->push_back(path[i]);
+            continue;
+        }
+
+        if (i + 1 < path.size() && path[i + 1] == '%') {
+            name->push_back('%');
+            ++i;
+            continue;
+        }
+
+        size_t end = i + 1;
+        if (end < path.size() && path[end] == '0') {
+            m_frameNumberPad = '0';
+            ++end;
+        }
+        for (; end < path.size() && path[end] >= '0' && path[end] <= '9'; ++end)
+            m_frameNumberWidth = std::min<size_t>(m_frameNumberWidth * 10 + static_cast<size_t>(path[end] - '0'), 64);
+
+        bool conversion = end < path.size() && (path[end] == 'u' || path[end] == 'd' || path[end] == 'i');
+        if (found || !conversion)
+            throw std::runtime_error("Capture path needs exactly one integer conversion such as %05u: " + path);
+
+        found = true;
+        name = &m_nameSuffix;
+        i = end;
+    }
+
+    if (!found)
+        throw std::runtime_error("Capture path needs exactly one integer conversion such as %05u: " + path);
+}
+
+FrameCapture::~FrameCapture()
+{
+    finish();
+}
+
+std::vector<uint8_t> FrameCapture::acquire()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (m_free.empty())
+        return std::vector<uint8_t>(static_cast<size_t>(m_width) * m_height * 4);
+
+    std::vector<uint8_t> pixels = std::move(m_free.back());
+    m_free.pop_back();
+    return pixels;
+}
+
+void FrameCapture::submit(std::vector<uint8_t> &&pixels)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    // Back pressure instead of dropping frames when the disk can't keep up
+    m_written.wait(lock, [this]{ return m_queue.size() < CAPTURE_QUEUE_DEPTH; });
+    m_queue.push_back(std::move(pixels));
+    m_queued.notify_one();
+}
+
+void FrameCapture::finish()
+{
+    if (!m_thread.joinable())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_finishing = true;
+        m_queued.notify_one();
+    }
+
+    m_thread.join();
+
+    if (m_file && m_file != stdout)
+        fclose(m_file);
+    else if (m_file)
+        fflush(m_file);
+    m_file = nullptr;
+
+    double seconds = static_cast<double>(SDL_GetTicksNS() - m_startNs) / 1e9;
+    fprintf(stderr, "Captured %u frames in %.2f s, %.1f frames/s, %.1f MB/s\n",
+            m_frames, seconds, m_frames / seconds, static_cast<double>(m_bytes) / 1e6 / seconds);
+}
+
+uint32_t FrameCapture::framesWritten()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_frames;
+}
+
+uint64_t FrameCapture::bytesWritten()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_bytes;
+}
+
+void FrameCapture::writerLoop()
+{
+    for (;;) {
+        std::vector<uint8_t> pixels;
+
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_queued.wait(lock, [this]{ return !m_queue.empty() || m_finishing; });
+            if (m_queue.empty())
+                return;
+            pixels = std::move(m_queue.front());
+            m_queue.pop_front();
+        }
+
+        writeFrame(pixels);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        ++m_frames;
+        m_free.push_back(std::move(pixels));
+        m_written.notify_one();
+    }
+}
+
+void FrameCapture::writeFrame(const std::vector<uint8_t> &pixels)
+{
+    size_t count = static_cast<size_t>(m_width) * m_height;
+    int r = m_bgra ? 2 : 0;
+    int b = m_bgra ? 0 : 2;
+
+    if (m_perFrameFiles) {
+        std::string number = std::to_string(m_frames);
+        if (number.size() < m_frameNumberWidth)
+            number.insert(0, m_frameNumberWidth - number.size(), m_frameNumberPad);
+        std::string name = m_namePrefix + number + m_nameSuffix;
+        m_file = fopen(name.c_str(), "wb");
+        if (!m_file) {
+            fprintf(stderr, "Failed to open capture output: %s\n", name.c_str());
+            return;
+        }
+    }
+
+    m_encoded.clear();
+
+    if (m_format == CaptureFormat::Y4m) {
+        // Planar limited range BT.601, one plane after another
+        m_encoded.resize(count * 3);
+        uint8_t *y = m_encoded.data();
+        uint8_t *u = y + count;
+        uint8_t *v = u + count;
+        for (size_t i = 0; i < count; ++i) {
+            int R = pixels[i * 4 + r];
+            int G = pixels[i * 4 + 1];
+            int B = pixels[i * 4 + b];
+            y[i] = static_cast<uint8_t>(((66 * R + 129 * G + 25 * B + 128) >> 8) + 16);
+            u[i] = static_cast<uint8_t>(((-38 * R - 74 * G + 112 * B + 128) >> 8) + 128);
+            v[i] = static_cast<uint8_t>(((112 * R - 94 * G - 18 * B + 128) >> 8) + 128);
+        }
+        write("FRAME\n", 6);
+        write(m_encoded.data(), m_encoded.size());
+    } else {
+        std::vector<uint8_t> &rgb = m_rgb;
+        rgb.resize(count * 3);
+        for (size_t i = 0; i < count; ++i) {
+            rgb[i * 3 + 0] = pixels[i * 4 + r];
+            rgb[i * 3 + 1] = pixels[i * 4 + 1];
+            rgb[i * 3 + 2] = pixels[i * 4 + b];
+        }
+
+        if (m_format == CaptureFormat::Png) {
+            int w = static_cast<int>(m_width);
+            stbi_write_png_to_func(writePng, &m_encoded, w, static_cast<int>(m_height), 3, rgb.data(), w * 3);
+            write(m_encoded.data(), m_encoded.size());
+        } else {
+            if (m_format == CaptureFormat::Ppm) {
+                char header[64];
+                int length = snprintf(header, sizeof(header), "P6\n%u %u\n255\n", m_width, m_height);
+                write(header, static_cast<size_t>(length));
+            }
+            write(rgb.data(), rgb.size());
+        }
+    }
+
+    if (m_perFrameFiles) {
+        fclose(m_file);
+        m_file = nullptr;
+    }
+}
+
+void FrameCapture::write(const void *data, size_t size)
+{
+    if (fwrite(data, 1, size, m_file) != size) {
+        fprintf(stderr, "Failed to write capture output\n");
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_bytes += size;
+}
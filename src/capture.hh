@@ -0,0 +1,77 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Frames that may wait for the writer before submit() blocks
+#define CAPTURE_QUEUE_DEPTH 8
+
+enum class CaptureFormat {
+    Raw,
+    Ppm,
+    Png,
+    Y4m
+};
+
+// Encodes and writes captured frames on a background thread. The format
+// follows the file extension: raw RGB, binary PPM, PNG or a 4:4:4 Y4M
+// stream. A path with one printf style frame number, such as
+// frame%05u.png, writes one file per frame, otherwise the frames are
+// streamed into one file, or to stdout with "-" so that they can be piped
+// into an encoder.
+class FrameCapture
+{
+public:
+    FrameCapture(const std::string &path, uint32_t width, uint32_t height, uint32_t fps, bool bgra);
+    ~FrameCapture();
+    FrameCapture(const FrameCapture &) = delete;
+    FrameCapture &operator=(const FrameCapture &) = delete;
+
+    // Tightly packed 4 bytes per pixel, reused once the writer is done
+    std::vector<uint8_t> acquire();
+    void submit(std::vector<uint8_t> &&pixels);
+    void finish();
+
+    uint32_t framesWritten();
+    uint64_t bytesWritten();
+
+private:
+    void parseFramePattern(const std::string &path);
+    void writerLoop();
+    void writeFrame(const std::vector<uint8_t> &pixels);
+    void write(const void *data, size_t size);
+
+    std::string m_path;
+    CaptureFormat m_format;
+    uint32_t m_width;
+    uint32_t m_height;
+    uint32_t m_fps;
+    bool m_bgra;
+    bool m_perFrameFiles;
+    // Per-frame file names around the zero or space padded frame number
+    std::string m_namePrefix;
+    std::string m_nameSuffix;
+    size_t m_frameNumberWidth;
+    char m_frameNumberPad;
+    FILE *m_file;
+    std::vector<uint8_t> m_rgb;
+    std::vector<uint8_t> m_encoded;
+
+    std::mutex m_mutex;
+    std::condition_variable m_queued;
+    std::condition_variable m_written;
+    std::deque<std::vector<uint8_t>> m_queue;
+    std::vector<std::vector<uint8_t>> m_free;
+    bool m_finishing;
+    std::thread m_thread;
+
+    uint64_t m_startNs;
+    uint64_t m_bytes;
+    uint32_t m_frames;
+};
@@ -0,0 +1,93 @@
+#include "compute.hh"
+
+#include "context.hh"
+#include "utils.hh"
+
+#include "vulkan/vulkan.h"
+
+#include <cstdint>
+
+ComputeScheduler::ComputeScheduler(VulkanContext &ctx, uint32_t framesInFlight):
+    m_ctx(ctx),
+    m_device(ctx.device()),
+    m_queue(ctx.computeQueue()),
+    m_queueFamily(ctx.computeQueueFamily()),
+    m_frames(framesInFlight)
+{
+    for (Frame &frame : m_frames) {
+        VkCommandPoolCreateInfo poolInfo {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+            .queueFamilyIndex = m_queueFamily
+        };
+
+        VK_CHECK(vkCreateCommandPool(m_device, &poolInfo, nullptr, &frame.commandPool));
+
+        VkCommandBufferAllocateInfo cmdAllocInfo {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+            .commandPool = frame.commandPool,
+            .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+            .commandBufferCount = 1
+        };
+
+        VK_CHECK(vkAllocateCommandBuffers(m_device, &cmdAllocInfo, &frame.commandBuffer));
+
+        VkSemaphoreCreateInfo semaphoreInfo {
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO
+        };
+
+        VK_CHECK(vkCreateSemaphore(m_device, &semaphoreInfo, nullptr, &frame.semaphore));
+    }
+}
+
+ComputeScheduler::~ComputeScheduler()
+{
+    for (Frame &frame : m_frames) {
+        vkDestroySemaphore(m_device, frame.semaphore, nullptr);
+        vkDestroyCommandPool(m_device, frame.commandPool, nullptr);
+    }
+}
+
+VkCommandBuffer ComputeScheduler::begin(uint32_t frame)
+{
+    Frame &f = m_frames[frame];
+
+    VK_CHECK(vkResetCommandPool(m_device, f.commandPool, 0));
+
+    VkCommandBufferBeginInfo beginInfo {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+        .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT
+    };
+
+    VK_CHECK(vkBeginCommandBuffer(f.commandBuffer, &beginInfo));
+
+    return f.commandBuffer;
+}
+
+VkSemaphore ComputeScheduler::submit(uint32_t frame)
+{
+    Frame &f = m_frames[frame];
+
+    VK_CHECK(vkEndCommandBuffer(f.commandBuffer));
+
+    VkSubmitInfo submitInfo {
+        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+        .commandBufferCount = 1,
+        .pCommandBuffers = &f.commandBuffer,
+        .signalSemaphoreCount = 1,
+        .pSignalSemaphores = &f.semaphore
+    };
+
+    VK_CHECK(vkQueueSubmit(m_queue, 1, &submitInfo, VK_NULL_HANDLE));
+
+    return f.semaphore;
+}
+
+bool ComputeScheduler::async()
+{
+    return m_queueFamily != m_ctx.graphicsQueueFamily();
+}
+
+uint32_t ComputeScheduler::queueFamily()
+{
+    return m_queueFamily;
+}
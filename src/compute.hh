@@ -0,0 +1,41 @@
+#pragma once
+
+#include "context.hh"
+
+#include "vulkan/vulkan.h"
+
+#include <cstdint>
+#include <vector>
+
+// Per-frame command buffers on the compute queue. Work recorded between
+// begin() and submit() runs alongside the graphics queue, the returned
+// semaphore is waited on by the graphics submission of the same frame. The
+// frame fence guards reuse since graphics can't finish before compute does.
+// Without a separate compute family this still works, just serialized.
+class ComputeScheduler
+{
+public:
+    ComputeScheduler(VulkanContext &ctx, uint32_t framesInFlight);
+    ~ComputeScheduler();
+    ComputeScheduler(const ComputeScheduler &) = delete;
+    ComputeScheduler &operator=(const ComputeScheduler &) = delete;
+
+    VkCommandBuffer begin(uint32_t frame);
+    VkSemaphore submit(uint32_t frame);
+
+    bool async();
+    uint32_t queueFamily();
+
+private:
+    struct Frame {
+        VkCommandPool commandPool;
+        VkCommandBuffer commandBuffer;
+        VkSemaphore semaphore;
+    };
+
+    VulkanContext &m_ctx;
+    VkDevice m_device;
+    VkQueue m_queue;
+    uint32_t m_queueFamily;
+    std::vector<Frame> m_frames;
+};
@@ -16,23 +16,35 @@
 
 #define REQUIRED_VK_VERSION_MINOR 3
 
-VulkanContext::VulkanContext(int width, int height):
+VulkanContext::VulkanContext(int width, int height, bool headless):
     m_window(nullptr),
     m_instance(VK_NULL_HANDLE),
     m_device(VK_NULL_HANDLE),
     m_surface(VK_NULL_HANDLE),
+    m_computeQueue(VK_NULL_HANDLE),
+    m_computeQueueFamily(0),
+    m_transferQueue(VK_NULL_HANDLE),
+    m_transferQueueFamily(0),
+    m_computeQueueTimestamps(false),
+    m_meshShaderSupported(false),
+    m_dynamicBlendSupported(false),
+    m_outputLayerSupported(false),
     m_allocator(VK_NULL_HANDLE)
 {
-    if (!SDL_Init(SDL_INIT_VIDEO)) {
+    // Headless contexts have no window or surface and can run on devices
+    // without presentation support, e.g. lavapipe in CI
+    if (!SDL_Init(headless ? 0 : SDL_INIT_VIDEO)) {
         throw std::runtime_error("Failed to init SDL");
     }
 
-    m_window = SDL_CreateWindow("VKlelu",
-                                width,
-                                height,
-                                SDL_WINDOW_VULKAN);
-    if (!m_window) {
-        throw std::runtime_error("Failed to create SDL window");
+    if (!headless) {
+        m_window = SDL_CreateWindow("VKlelu",
+                                    width,
+                                    height,
+                                    SDL_WINDOW_VULKAN);
+        if (!m_window) {
+            throw std::runtime_error("Failed to create SDL window");
+        }
     }
 
 #if !defined(NDEBUG)
@@ -55,6 +67,7 @@ VulkanContext::VulkanContext(int width, int height):
         .use_default_debug_messenger()
 #endif
         .require_api_version(1, REQUIRED_VK_VERSION_MINOR)
+        .set_headless(headless)
         .build();
     if (!instRet) {
         throw std::runtime_error("Failed to create Vulkan instance. Error: " + instRet.error().message());
@@ -66,10 +79,18 @@ VulkanContext::VulkanContext(int width, int height):
     m_debugMessenger = vkbInst.debug_messenger;
 #endif
 
-    if (!SDL_Vulkan_CreateSurface(m_window, m_instance, NULL, &m_surface)) {
+    if (!headless && !SDL_Vulkan_CreateSurface(m_window, m_instance, NULL, &m_surface)) {
         throw std::runtime_error("Failed to create Vulkan surface");
     }
 
+    VkPhysicalDeviceFeatures requiredFeatures {
+        .drawIndirectFirstInstance = true
+    };
+
+    VkPhysicalDeviceVulkan12Features required12Features {
+        .drawIndirectCount = true
+    };
+
     VkPhysicalDeviceVulkan13Features required13Features {
         .synchronization2 = true,
         .dynamicRendering = true
@@ -77,7 +98,10 @@ VulkanContext::VulkanContext(int width, int height):
 
     vkb::PhysicalDeviceSelector selector{ vkbInst };
     auto physRet = selector.set_surface(m_surface)
+        .require_present(!headless)
         .set_minimum_version(1, REQUIRED_VK_VERSION_MINOR)
+        .set_required_features(requiredFeatures)
+        .set_required_features_12(required12Features)
         .set_required_features_13(required13Features)
         .select();
     if (!physRet) {
@@ -88,6 +112,36 @@ VulkanContext::VulkanContext(int width, int height):
     m_physicalDevice = vkbPhys.physical_device;
     m_physicalDeviceProperties = vkbPhys.properties;
 
+    // Mesh shaders are optional, the meshlet path falls back to compute
+    // compaction without them
+    VkPhysicalDeviceMeshShaderFeaturesEXT meshShaderFeatures {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MESH_SHADER_FEATURES_EXT,
+        .taskShader = true,
+        .meshShader = true
+    };
+
+    if (vkbPhys.enable_extension_if_present(VK_EXT_MESH_SHADER_EXTENSION_NAME))
+        m_meshShaderSupported = vkbPhys.enable_extension_features_if_present(meshShaderFeatures);
+
+    // Cull mode and depth state are dynamic in core 1.3, blending needs
+    // the third extended dynamic state extension
+    VkPhysicalDeviceExtendedDynamicState3FeaturesEXT dynamicState3Features {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTENDED_DYNAMIC_STATE_3_FEATURES_EXT,
+        .extendedDynamicState3ColorBlendEnable = true
+    };
+
+    if (vkbPhys.enable_extension_if_present(VK_EXT_EXTENDED_DYNAMIC_STATE_3_EXTENSION_NAME))
+        m_dynamicBlendSupported = vkbPhys.enable_extension_features_if_present(dynamicState3Features);
+
+    // Only the thumbnail renderer picks the array layer in the vertex
+    // shader
+    VkPhysicalDeviceVulkan12Features outputLayerFeatures {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES,
+        .shaderOutputLayer = true
+    };
+
+    m_outputLayerSupported = vkbPhys.enable_extension_features_if_present(outputLayerFeatures);
+
     VkPhysicalDeviceDriverProperties driverProps {
         .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DRIVER_PROPERTIES
     };
@@ -116,10 +170,40 @@ VulkanContext::VulkanContext(int width, int height):
     m_graphicsQueue = graphicsQueueRet.value();
     m_graphicsQueueFamily = vkbDev.get_queue_index(vkb::QueueType::graphics).value();
 
+    // Prefer a family of its own, then one that is just not the graphics
+    // family, then share the graphics queue
+    auto findQueue = [&](vkb::QueueType type, VkQueue &queue, uint32_t &family) {
+        auto queueRet = vkbDev.get_dedicated_queue(type);
+        auto indexRet = vkbDev.get_dedicated_queue_index(type);
+        if (!queueRet || !indexRet) {
+            queueRet = vkbDev.get_queue(type);
+            indexRet = vkbDev.get_queue_index(type);
+        }
+
+        if (queueRet && indexRet) {
+            queue = queueRet.value();
+            family = indexRet.value();
+        } else {
+            queue = m_graphicsQueue;
+            family = m_graphicsQueueFamily;
+        }
+    };
+
+    findQueue(vkb::QueueType::compute, m_computeQueue, m_computeQueueFamily);
+    findQueue(vkb::QueueType::transfer, m_transferQueue, m_transferQueueFamily);
+
+    std::vector<VkQueueFamilyProperties> queueFamilies = vkbPhys.get_queue_families();
+    m_computeQueueTimestamps = queueFamilies[m_computeQueueFamily].timestampValidBits > 0;
+
     fprintf(stderr, "Selected Vulkan device:\n");
     fprintf(stderr, "  Device name:\t%s\n", devProps2.properties.deviceName);
     fprintf(stderr, "  Driver name:\t%s\n", driverProps.driverName);
     fprintf(stderr, "  Driver info:\t%s\n", driverProps.driverInfo);
+    fprintf(stderr, "  Queue families:\tgraphics %u, compute %u, transfer %u\n",
+            m_graphicsQueueFamily, m_computeQueueFamily, m_transferQueueFamily);
+    fprintf(stderr, "  Mesh shaders:\t%s\n", m_meshShaderSupported ? "yes" : "no");
+    fprintf(stderr, "  Dynamic blend:\t%s\n", m_dynamicBlendSupported ? "yes" : "no");
+    fprintf(stderr, "  Output layer:\t%s\n", m_outputLayerSupported ? "yes" : "no");
     fprintf(stderr, "  API version:\t%d.%d.%d\n", VK_API_VERSION_MAJOR(devProps2.properties.apiVersion),
                                                   VK_API_VERSION_MINOR(devProps2.properties.apiVersion),
                                                   VK_API_VERSION_PATCH(devProps2.properties.apiVersion));
@@ -199,12 +283,66 @@ uint32_t VulkanContext::graphicsQueueFamily()
     return m_graphicsQueueFamily;
 }
 
+VkQueue VulkanContext::computeQueue()
+{
+    return m_computeQueue;
+}
+
+uint32_t VulkanContext::computeQueueFamily()
+{
+    return m_computeQueueFamily;
+}
+
+VkQueue VulkanContext::transferQueue()
+{
+    return m_transferQueue;
+}
+
+uint32_t VulkanContext::transferQueueFamily()
+{
+    return m_transferQueueFamily;
+}
+
+bool VulkanContext::computeQueueTimestamps()
+{
+    return m_computeQueueTimestamps;
+}
+
+bool VulkanContext::meshShaderSupported()
+{
+    return m_meshShaderSupported;
+}
+
+bool VulkanContext::dynamicBlendSupported()
+{
+    return m_dynamicBlendSupported;
+}
+
+bool VulkanContext::outputLayerSupported()
+{
+    return m_outputLayerSupported;
+}
+
+VmaAllocator VulkanContext::allocator()
+{
+    return m_allocator;
+}
+
 std::unique_ptr<BufferAllocation> VulkanContext::allocateBuffer(size_t size, VkBufferUsageFlags usage, VmaMemoryUsage memoryUsage)
 {
     return std::make_unique<BufferAllocation>(m_allocator, size, usage, memoryUsage);
 }
 
-std::unique_ptr<ImageAllocation> VulkanContext::allocateImage(VkExtent3D extent, VkFormat format, VkSampleCountFlagBits samples, VkImageUsageFlags usage, VmaMemoryUsage memoryUsage)
+std::unique_ptr<BufferAllocation> VulkanContext::allocateSharedBuffer(size_t size, VkBufferUsageFlags usage, VmaMemoryUsage memoryUsage)
+{
+    std::vector<uint32_t> queueFamilies = { m_graphicsQueueFamily };
+    if (m_computeQueueFamily != m_graphicsQueueFamily)
+        queueFamilies.push_back(m_computeQueueFamily);
+
+    return std::make_unique<BufferAllocation>(m_allocator, size, usage, memoryUsage, queueFamilies);
+}
+
+std::unique_ptr<ImageAllocation> VulkanContext::allocateImage(VkExtent3D extent, VkFormat format, VkSampleCountFlagBits samples, VkImageUsageFlags usage, VmaMemoryUsage memoryUsage, uint32_t mipLevels, uint32_t arrayLayers)
 {
-    return std::make_unique<ImageAllocation>(m_allocator, extent, format, samples, usage, memoryUsage);
+    return std::make_unique<ImageAllocation>(m_allocator, extent, format, samples, usage, memoryUsage, mipLevels, arrayLayers);
 }
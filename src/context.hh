@@ -12,7 +12,7 @@
 class VulkanContext
 {
 public:
-    VulkanContext(int width, int height);
+    VulkanContext(int width, int height, bool headless = false);
     ~VulkanContext();
     VulkanContext(const VulkanContext &) = delete;
     VulkanContext &operator=(const VulkanContext &) = delete;
@@ -25,9 +25,25 @@ public:
     VkSurfaceKHR surface();
     VkQueue graphicsQueue();
     uint32_t graphicsQueueFamily();
+    // Dedicated or separate queues when the device has them, the graphics
+    // queue otherwise
+    VkQueue computeQueue();
+    uint32_t computeQueueFamily();
+    VkQueue transferQueue();
+    uint32_t transferQueueFamily();
+    bool computeQueueTimestamps();
+    bool meshShaderSupported();
+    bool dynamicBlendSupported();
+    // Vertex shaders can write gl_Layer
+    bool outputLayerSupported();
+    // For memory that is placed by hand, like the render graph's
+    VmaAllocator allocator();
 
     std::unique_ptr<BufferAllocation> allocateBuffer(size_t size, VkBufferUsageFlags usage, VmaMemoryUsage memoryUsage);
-    std::unique_ptr<ImageAllocation> allocateImage(VkExtent3D extent, VkFormat format, VkSampleCountFlagBits samples, VkImageUsageFlags usage, VmaMemoryUsage memoryUsage);
+    // Accessed from both the graphics and the compute queue without
+    // ownership transfers
+    std::unique_ptr<BufferAllocation> allocateSharedBuffer(size_t size, VkBufferUsageFlags usage, VmaMemoryUsage memoryUsage);
+    std::unique_ptr<ImageAllocation> allocateImage(VkExtent3D extent, VkFormat format, VkSampleCountFlagBits samples, VkImageUsageFlags usage, VmaMemoryUsage memoryUsage, uint32_t mipLevels = 1, uint32_t arrayLayers = 1);
 
 private:
     SDL_Window *m_window;
@@ -41,5 +57,13 @@ private:
     VkSurfaceKHR m_surface;
     VkQueue m_graphicsQueue;
     uint32_t m_graphicsQueueFamily;
+    VkQueue m_computeQueue;
+    uint32_t m_computeQueueFamily;
+    VkQueue m_transferQueue;
+    uint32_t m_transferQueueFamily;
+    bool m_computeQueueTimestamps;
+    bool m_meshShaderSupported;
+    bool m_dynamicBlendSupported;
+    bool m_outputLayerSupported;
     VmaAllocator m_allocator;
 };
@@ -0,0 +1,188 @@
+#include "descriptors.hh"
+
+#include "utils.hh"
+
+#include "vulkan/vulkan.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+DescriptorAllocator::DescriptorAllocator(VkDevice device, std::vector<PoolRatio> ratios):
+    m_device(device),
+    m_ratios(std::move(ratios)),
+    m_setsPerPool(DESCRIPTOR_POOL_MIN_SETS),
+    m_current(VK_NULL_HANDLE)
+{
+}
+
+DescriptorAllocator::~DescriptorAllocator()
+{
+    if (m_current)
+        vkDestroyDescriptorPool(m_device, m_current, nullptr);
+    for (VkDescriptorPool pool : m_fullPools)
+        vkDestroyDescriptorPool(m_device, pool, nullptr);
+    for (VkDescriptorPool pool : m_freePools)
+        vkDestroyDescriptorPool(m_device, pool, nullptr);
+}
+
+VkDescriptorSet DescriptorAllocator::allocate(VkDescriptorSetLayout layout)
+{
+    if (!m_current)
+        m_current = grabPool();
+
+    VkDescriptorSetAllocateInfo allocInfo {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+        .descriptorPool = m_current,
+        .descriptorSetCount = 1,
+        .pSetLayouts = &layout
+    };
+
+    VkDescriptorSet set;
+    VkResult result = vkAllocateDescriptorSets(m_device, &allocInfo, &set);
+
+    if (result == VK_ERROR_OUT_OF_POOL_MEMORY || result == VK_ERROR_FRAGMENTED_POOL) {
+        m_fullPools.push_back(m_current);
+        m_current = grabPool();
+        allocInfo.descriptorPool = m_current;
+        result = vkAllocateDescriptorSets(m_device, &allocInfo, &set);
+    }
+
+    // A fresh pool failing means the set is larger than a whole pool
+    if (result != VK_SUCCESS)
+        throw std::runtime_error("Failed to allocate descriptor set");
+
+    return set;
+}
+
+void DescriptorAllocator::reset()
+{
+    if (m_current)
+        m_fullPools.push_back(m_current);
+    m_current = VK_NULL_HANDLE;
+
+    for (VkDescriptorPool pool : m_fullPools) {
+        VK_CHECK(vkResetDescriptorPool(m_device, pool, 0));
+        m_freePools.push_back(pool);
+    }
+    m_fullPools.clear();
+}
+
+size_t DescriptorAllocator::poolCount()
+{
+    return m_fullPools.size() + m_freePools.size() + (m_current ? 1 : 0);
+}
+
+VkDescriptorPool DescriptorAllocator::grabPool()
+{
+    if (!m_freePools.empty()) {
+        VkDescriptorPool pool = m_freePools.back();
+        m_freePools.pop_back();
+        return pool;
+    }
+
+    std::vector<VkDescriptorPoolSize> sizes;
+    for (const PoolRatio &ratio : m_ratios) {
+        sizes.push_back({
+            .type = ratio.type,
+            .descriptorCount = std::max(1u, static_cast<uint32_t>(ratio.perSet * static_cast<float>(m_setsPerPool)))
+        });
+    }
+
+    VkDescriptorPoolCreateInfo poolInfo {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+        .maxSets = m_setsPerPool,
+        .poolSizeCount = static_cast<uint32_t>(sizes.size()),
+        .pPoolSizes = sizes.data()
+    };
+
+    VkDescriptorPool pool;
+    VK_CHECK(vkCreateDescriptorPool(m_device, &poolInfo, nullptr, &pool));
+
+    m_setsPerPool = std::min(2 * m_setsPerPool, static_cast<uint32_t>(DESCRIPTOR_POOL_MAX_SETS));
+
+    return pool;
+}
+
+DescriptorLayoutCache::DescriptorLayoutCache(VkDevice device):
+    m_device(device)
+{
+}
+
+DescriptorLayoutCache::~DescriptorLayoutCache()
+{
+    for (const auto &[key, layout] : m_layouts)
+        vkDestroyDescriptorSetLayout(m_device, layout, nullptr);
+    for (VkDescriptorSetLayout layout : m_uncached)
+        vkDestroyDescriptorSetLayout(m_device, layout, nullptr);
+}
+
+VkDescriptorSetLayout DescriptorLayoutCache::create(const VkDescriptorSetLayoutCreateInfo &info)
+{
+    LayoutKey key {
+        .flags = info.flags,
+        .bindings = std::vector<VkDescriptorSetLayoutBinding>(info.pBindings, info.pBindings + info.bindingCount)
+    };
+
+    // Immutable samplers would need their handles in the key, nothing
+    // uses them so they are simply not cached
+    bool cacheable = !info.pNext;
+    for (const VkDescriptorSetLayoutBinding &binding : key.bindings)
+        cacheable &= !binding.pImmutableSamplers;
+
+    std::sort(key.bindings.begin(), key.bindings.end(), [](const VkDescriptorSetLayoutBinding &a, const VkDescriptorSetLayoutBinding &b) {
+        return a.binding < b.binding;
+    });
+
+    auto it = m_layouts.find(key);
+    if (cacheable && it != m_layouts.end())
+        return it->second;
+
+    VkDescriptorSetLayout layout;
+    VK_CHECK(vkCreateDescriptorSetLayout(m_device, &info, nullptr, &layout));
+
+    if (cacheable)
+        m_layouts.emplace(std::move(key), layout);
+    else
+        m_uncached.push_back(layout);
+
+    return layout;
+}
+
+size_t DescriptorLayoutCache::size()
+{
+    return m_layouts.size() + m_uncached.size();
+}
+
+bool DescriptorLayoutCache::LayoutKey::operator==(const LayoutKey &other) const
+{
+    if (flags != other.flags || bindings.size() != other.bindings.size())
+        return false;
+
+    for (size_t i = 0; i < bindings.size(); ++i) {
+        const VkDescriptorSetLayoutBinding &a = bindings[i];
+        const VkDescriptorSetLayoutBinding &b = other.bindings[i];
+        if (a.binding != b.binding || a.descriptorType != b.descriptorType
+            || a.descriptorCount != b.descriptorCount || a.stageFlags != b.stageFlags)
+            return false;
+    }
+
+    return true;
+}
+
+size_t DescriptorLayoutCache::LayoutKeyHash::operator()(const LayoutKey &key) const
+{
+    size_t hash = std::hash<uint32_t>()(key.flags);
+    for (const VkDescriptorSetLayoutBinding &binding : key.bindings) {
+        uint64_t packed = static_cast<uint64_t>(binding.binding)
+                        | static_cast<uint64_t>(binding.descriptorType) << 16
+                        | static_cast<uint64_t>(binding.descriptorCount) << 32
+                        | static_cast<uint64_t>(binding.stageFlags) << 48;
+        hash ^= std::hash<uint64_t>()(packed) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+    }
+    return hash;
+}
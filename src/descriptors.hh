@@ -0,0 +1,75 @@
+#pragma once
+
+#include "vulkan/vulkan.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#define DESCRIPTOR_POOL_MIN_SETS 64
+#define DESCRIPTOR_POOL_MAX_SETS 4096
+
+// Hands out sets from a chain of pools. Only the newest pool is tried, when
+// it runs out a fresh one twice the size is created, so allocation stays
+// O(1) and never hits a fixed limit. reset() recycles every pool at once
+// for sets that only live for a frame.
+class DescriptorAllocator
+{
+public:
+    struct PoolRatio {
+        VkDescriptorType type;
+        float perSet;
+    };
+
+    DescriptorAllocator(VkDevice device, std::vector<PoolRatio> ratios);
+    ~DescriptorAllocator();
+    DescriptorAllocator(const DescriptorAllocator &) = delete;
+    DescriptorAllocator &operator=(const DescriptorAllocator &) = delete;
+
+    VkDescriptorSet allocate(VkDescriptorSetLayout layout);
+    void reset();
+
+    size_t poolCount();
+
+private:
+    VkDescriptorPool grabPool();
+
+    VkDevice m_device;
+    std::vector<PoolRatio> m_ratios;
+    uint32_t m_setsPerPool;
+    VkDescriptorPool m_current;
+    std::vector<VkDescriptorPool> m_fullPools;
+    std::vector<VkDescriptorPool> m_freePools;
+};
+
+// Creates each distinct set layout once, layouts with the same bindings in
+// any order share one handle. The cache owns the layouts.
+class DescriptorLayoutCache
+{
+public:
+    DescriptorLayoutCache(VkDevice device);
+    ~DescriptorLayoutCache();
+    DescriptorLayoutCache(const DescriptorLayoutCache &) = delete;
+    DescriptorLayoutCache &operator=(const DescriptorLayoutCache &) = delete;
+
+    VkDescriptorSetLayout create(const VkDescriptorSetLayoutCreateInfo &info);
+
+    size_t size();
+
+private:
+    struct LayoutKey {
+        VkDescriptorSetLayoutCreateFlags flags;
+        std::vector<VkDescriptorSetLayoutBinding> bindings;
+
+        bool operator==(const LayoutKey &other) const;
+    };
+
+    struct LayoutKeyHash {
+        size_t operator()(const LayoutKey &key) const;
+    };
+
+    VkDevice m_device;
+    std::unordered_map<LayoutKey, VkDescriptorSetLayout, LayoutKeyHash> m_layouts;
+    std::vector<VkDescriptorSetLayout> m_uncached;
+};
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string_view>
+
+// Generated at build time, the shaders are only compiled in with
+// VKLELU_EMBED_SHADERS
+
+// SPIR-V of a compiled shader by its file name, e.g. "cull.comp.spv"
+std::optional<std::span<const uint32_t>> findEmbeddedShader(std::string_view name);
+// Changes whenever any embedded shader does, zero without them
+uint64_t embeddedShaderHash();
@@ -0,0 +1,32 @@
+#version 460
+
+layout (location = 0) in vec3 inPosition;
+
+layout (set = 0, binding = 0) uniform CameraData {
+    mat4 view;
+    mat4 proj;
+    mat4 viewProj;
+} cam;
+
+struct ObjectData {
+    mat4 model;
+    mat4 normalMat;
+};
+
+layout (set = 1, binding = 0) readonly buffer ObjectBuffer {
+    ObjectData objects[];
+} obj;
+
+layout (set = 1, binding = 1) readonly buffer VisibleBuffer {
+    uint ids[];
+} visible;
+
+// Must produce bit identical depth to shader.vert for the EQUAL depth test
+invariant gl_Position;
+
+void main()
+{
+    ObjectData object = obj.objects[visible.ids[gl_InstanceIndex]];
+    vec4 worldPos = object.model * vec4(inPosition, 1.0);
+    gl_Position = cam.viewProj * worldPos;
+}
@@ -0,0 +1,57 @@
+#version 460
+
+layout (set = 0, binding = 0) uniform CameraData {
+    mat4 view;
+    mat4 proj;
+    mat4 viewProj;
+} cam;
+
+struct ObjectData {
+    mat4 model;
+    mat4 normalMat;
+};
+
+layout (set = 1, binding = 0) readonly buffer ObjectBuffer {
+    ObjectData objects[];
+} obj;
+
+layout (set = 1, binding = 1) readonly buffer VisibleBuffer {
+    uint ids[];
+} visible;
+
+// Split vertex streams of every mesh as floats, vec3 would pad to 16
+// bytes. The draw's vertexOffset is the mesh's base in both and already
+// included in gl_VertexIndex.
+layout (set = 1, binding = 2) readonly buffer PositionBuffer {
+    float data[];
+} positions;
+
+// Normal in xyz and texture coordinate in the last two
+layout (set = 1, binding = 3) readonly buffer AttributeBuffer {
+    float data[];
+} attributes;
+
+layout (location = 0) out vec3 outFragPos;
+layout (location = 1) out vec3 outNormal;
+layout (location = 2) out vec2 outTexCoord;
+layout (location = 3) out float outViewDepth;
+
+// Must match pulleddepth.vert when the depth pre-pass is on
+invariant gl_Position;
+
+void main()
+{
+    uint p = 3 * gl_VertexIndex;
+    uint a = 5 * gl_VertexIndex;
+    vec3 inPosition = vec3(positions.data[p], positions.data[p + 1], positions.data[p + 2]);
+    vec3 inNormal = vec3(attributes.data[a], attributes.data[a + 1], attributes.data[a + 2]);
+    vec2 inTexCoord = vec2(attributes.data[a + 3], attributes.data[a + 4]);
+
+    ObjectData object = obj.objects[visible.ids[gl_InstanceIndex]];
+    vec4 worldPos = object.model * vec4(inPosition, 1.0);
+    outFragPos = vec3(worldPos);
+    outNormal = mat3(object.normalMat) * inNormal;
+    outTexCoord = inTexCoord;
+    outViewDepth = -(cam.view * worldPos).z;
+    gl_Position = cam.viewProj * worldPos;
+}
@@ -0,0 +1,38 @@
+#version 460
+
+layout (set = 0, binding = 0) uniform CameraData {
+    mat4 view;
+    mat4 proj;
+    mat4 viewProj;
+} cam;
+
+struct ObjectData {
+    mat4 model;
+    mat4 normalMat;
+};
+
+layout (set = 1, binding = 0) readonly buffer ObjectBuffer {
+    ObjectData objects[];
+} obj;
+
+layout (set = 1, binding = 1) readonly buffer VisibleBuffer {
+    uint ids[];
+} visible;
+
+// Only the position stream, the attributes are never touched
+layout (set = 1, binding = 2) readonly buffer PositionBuffer {
+    float data[];
+} positions;
+
+// Must produce bit identical depth to pulled.vert for the EQUAL depth test
+invariant gl_Position;
+
+void main()
+{
+    uint p = 3 * gl_VertexIndex;
+    vec3 inPosition = vec3(positions.data[p], positions.data[p + 1], positions.data[p + 2]);
+
+    ObjectData object = obj.objects[visible.ids[gl_InstanceIndex]];
+    vec4 worldPos = object.model * vec4(inPosition, 1.0);
+    gl_Position = cam.viewProj * worldPos;
+}
@@ -0,0 +1,33 @@
+#version 460
+
+layout (set = 0, binding = 1) uniform SceneData {
+    vec4 cameraPos;
+    vec4 lightPos;
+    vec4 lightColor;
+    vec4 clusterParams;
+    uvec4 clusterGrid;
+    mat4 lightViewProj;
+} scene;
+
+struct ObjectData {
+    mat4 model;
+    mat4 normalMat;
+};
+
+layout (set = 1, binding = 0) readonly buffer ObjectBuffer {
+    ObjectData objects[];
+} obj;
+
+layout (set = 1, binding = 2) readonly buffer PositionBuffer {
+    float data[];
+} positions;
+
+// Every caster is drawn, so the instance indexes the objects directly
+void main()
+{
+    uint p = 3 * gl_VertexIndex;
+    vec3 inPosition = vec3(positions.data[p], positions.data[p + 1], positions.data[p + 2]);
+
+    ObjectData object = obj.objects[gl_InstanceIndex];
+    gl_Position = scene.lightViewProj * object.model * vec4(inPosition, 1.0);
+}
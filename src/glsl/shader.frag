@@ -1,35 +1,110 @@
 #version 460
 
+// Must match MAX_LIGHTS_PER_CLUSTER in vklelu.hh
+#define MAX_LIGHTS_PER_CLUSTER 256
+
 layout (location = 0) in vec3 inFragPos;
 layout (location = 1) in vec3 inNormal;
 layout (location = 2) in vec2 inTexCoord;
+layout (location = 3) in float inViewDepth;
 
 layout (set = 0, binding = 1) uniform SceneData {
     vec4 cameraPos;
     vec4 lightPos;
     vec4 lightColor;
+    vec4 clusterParams;
+    uvec4 clusterGrid;
+    mat4 lightViewProj;
 } scene;
 
+struct PointLight {
+    vec4 positionRadius;
+    vec4 color;
+};
+
+struct Cluster {
+    uint count;
+    uint lights[MAX_LIGHTS_PER_CLUSTER];
+};
+
+layout (set = 0, binding = 2) readonly buffer LightBuffer {
+    PointLight lights[];
+} lightBuffer;
+
+layout (set = 0, binding = 3) readonly buffer ClusterBuffer {
+    Cluster clusters[];
+} clusterBuffer;
+
+layout (set = 0, binding = 4) uniform sampler2DShadow shadowMap;
+
 layout (set = 2, binding = 0) uniform texture2D texture0;
 
 layout (set = 2, binding = 1) uniform sampler s;
 
 layout (location = 0) out vec4 outFragColor;
 
+vec3 blinnPhong(vec3 objColor, vec3 norm, vec3 camDir, vec3 lightDir, vec3 lightColor)
+{
+    float diff = max(dot(norm, lightDir), 0.0);
+    vec3 diffuse = diff * objColor * lightColor;
+
+    vec3 halfDir = normalize(lightDir + camDir);
+    float spec = pow(max(dot(norm, halfDir), 0.0), 16.0);
+    vec3 specular = spec * lightColor;
+
+    return diffuse + specular;
+}
+
+// Four bilinear compares, 4x4 texels in total
+float shadow(vec3 worldPos)
+{
+    // Behind the light or past the far plane counts as lit, like outside
+    // the map
+    vec4 lightClip = scene.lightViewProj * vec4(worldPos, 1.0);
+    if (lightClip.w <= 0.0)
+        return 1.0;
+
+    vec3 p = lightClip.xyz / lightClip.w;
+    vec2 uv = p.xy * 0.5 + 0.5;
+    vec2 texel = 1.0 / vec2(textureSize(shadowMap, 0));
+
+    float lit = 0.0;
+    for (int y = 0; y < 2; ++y) {
+        for (int x = 0; x < 2; ++x) {
+            vec2 offset = (vec2(x, y) - 0.5) * 2.0 * texel;
+            lit += texture(shadowMap, vec3(uv + offset, min(p.z, 1.0)));
+        }
+    }
+
+    return lit * 0.25;
+}
+
 void main()
 {
-    vec3 objColor = texture(sampler2D(texture0, s), inTexCoord).rgb;
+    vec4 albedo = texture(sampler2D(texture0, s), inTexCoord);
+    vec3 objColor = albedo.rgb;
     vec3 ambient = 0.05 * objColor * scene.lightColor.rgb;
 
     vec3 norm = normalize(inNormal);
+    vec3 camDir = normalize(scene.cameraPos.xyz - inFragPos);
     vec3 lightDir = normalize(scene.lightPos.xyz - inFragPos);
-    float diff = max(dot(norm, lightDir), 0.0);
-    vec3 diffuse = diff * objColor * scene.lightColor.rgb;
+    vec3 color = ambient + shadow(inFragPos) * blinnPhong(objColor, norm, camDir, lightDir, scene.lightColor.rgb);
 
-    vec3 camDir = normalize(scene.cameraPos.xyz - inFragPos);
-    vec3 halfDir = normalize(lightDir + camDir);
-    float spec = pow(max(dot(norm, halfDir), 0.0), 16.0);
-    vec3 specular = spec * scene.lightColor.rgb;
+    // clusterParams holds the tile size and the depth slice scale and bias
+    uvec3 clusterId = uvec3(uvec2(gl_FragCoord.xy / scene.clusterParams.xy),
+                            uint(max(log(inViewDepth) * scene.clusterParams.z + scene.clusterParams.w, 0.0)));
+    clusterId = min(clusterId, scene.clusterGrid.xyz - 1);
+    uint cluster = clusterId.x + clusterId.y * scene.clusterGrid.x + clusterId.z * scene.clusterGrid.x * scene.clusterGrid.y;
+
+    uint count = clusterBuffer.clusters[cluster].count;
+    for (uint i = 0; i < count; ++i) {
+        PointLight light = lightBuffer.lights[clusterBuffer.clusters[cluster].lights[i]];
+        vec3 toLight = light.positionRadius.xyz - inFragPos;
+        float distance = length(toLight);
+        float falloff = clamp(1.0 - (distance * distance) / (light.positionRadius.w * light.positionRadius.w), 0.0, 1.0);
+        color += falloff * falloff * blinnPhong(objColor, norm, camDir, toLight / distance, light.color.rgb);
+    }
 
-    outFragColor = vec4(ambient + diffuse + specular, 1.0);
+    // Only blended materials use the alpha, straight from the texture
+    outFragColor = vec4(color, albedo.a);
 }
@@ -19,20 +19,25 @@ layout (set = 1, binding = 0) readonly buffer ObjectBuffer {
     ObjectData objects[];
 } obj;
 
-layout (push_constant) uniform PushConstants {
-    int modelIndex;
-} pcs;
+layout (set = 1, binding = 1) readonly buffer VisibleBuffer {
+    uint ids[];
+} visible;
 
 layout (location = 0) out vec3 outFragPos;
 layout (location = 1) out vec3 outNormal;
 layout (location = 2) out vec2 outTexCoord;
+layout (location = 3) out float outViewDepth;
+
+// Must match depth.vert when the depth pre-pass is on
+invariant gl_Position;
 
 void main()
 {
-    ObjectData object = obj.objects[pcs.modelIndex];
+    ObjectData object = obj.objects[visible.ids[gl_InstanceIndex]];
     vec4 worldPos = object.model * vec4(inPosition, 1.0);
     outFragPos = vec3(worldPos);
     outNormal = mat3(object.normalMat) * inNormal;
     outTexCoord = inTexCoord;
+    outViewDepth = -(cam.view * worldPos).z;
     gl_Position = cam.viewProj * worldPos;
 }
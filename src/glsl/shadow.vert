@@ -0,0 +1,28 @@
+#version 460
+
+layout (location = 0) in vec3 inPosition;
+
+layout (set = 0, binding = 1) uniform SceneData {
+    vec4 cameraPos;
+    vec4 lightPos;
+    vec4 lightColor;
+    vec4 clusterParams;
+    uvec4 clusterGrid;
+    mat4 lightViewProj;
+} scene;
+
+struct ObjectData {
+    mat4 model;
+    mat4 normalMat;
+};
+
+layout (set = 1, binding = 0) readonly buffer ObjectBuffer {
+    ObjectData objects[];
+} obj;
+
+// Every caster is drawn, so the instance indexes the objects directly
+void main()
+{
+    ObjectData object = obj.objects[gl_InstanceIndex];
+    gl_Position = scene.lightViewProj * object.model * vec4(inPosition, 1.0);
+}
@@ -0,0 +1,16 @@
+#version 460
+
+layout (location = 0) in vec3 inNormal;
+layout (location = 1) in vec2 inTexCoord;
+
+layout (location = 0) out vec4 outColor;
+
+layout (set = 0, binding = 0) uniform sampler2D albedo;
+
+void main()
+{
+    vec3 lightDir = normalize(vec3(0.5, 1.0, 0.75));
+    float diffuse = max(dot(normalize(inNormal), lightDir), 0.0);
+    vec3 color = texture(albedo, inTexCoord).rgb;
+    outColor = vec4(color * (0.25 + 0.75 * diffuse), 1.0);
+}
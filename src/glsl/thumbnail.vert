@@ -0,0 +1,24 @@
+#version 460
+#extension GL_ARB_shader_viewport_layer_array : require
+
+layout (location = 0) in vec3 inPosition;
+layout (location = 1) in vec3 inNormal;
+layout (location = 2) in vec2 inTexCoord;
+
+layout (location = 0) out vec3 outNormal;
+layout (location = 1) out vec2 outTexCoord;
+
+layout (push_constant) uniform ThumbnailConstants {
+    mat4 viewProj;
+    mat4 model;
+} pc;
+
+void main()
+{
+    // The first instance of the draw is the layer the asset belongs to
+    gl_Layer = gl_InstanceIndex;
+
+    outNormal = mat3(pc.model) * inNormal;
+    outTexCoord = inTexCoord;
+    gl_Position = pc.viewProj * pc.model * vec4(inPosition, 1.0);
+}
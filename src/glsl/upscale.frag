@@ -0,0 +1,41 @@
+#version 460
+
+layout (location = 0) in vec2 inUV;
+
+layout (location = 0) out vec4 outColor;
+
+layout (set = 0, binding = 0) uniform sampler2D scene;
+
+layout (push_constant) uniform UpscaleConstants {
+    // Rendered part of the target in uv and the size of one target texel
+    vec2 uvScale;
+    vec2 texelSize;
+    float sharpness;
+} pc;
+
+void main()
+{
+    // Stay half a texel inside the rendered area so that the bilinear
+    // filter never pulls in stale pixels from outside of it
+    vec2 uv = min(inUV * pc.uvScale, pc.uvScale - 0.5 * pc.texelSize);
+    vec3 center = texture(scene, uv).rgb;
+
+    if (pc.sharpness <= 0.0) {
+        outColor = vec4(center, 1.0);
+        return;
+    }
+
+    vec3 left = texture(scene, uv - vec2(pc.texelSize.x, 0.0)).rgb;
+    vec3 right = texture(scene, min(uv + vec2(pc.texelSize.x, 0.0), pc.uvScale - 0.5 * pc.texelSize)).rgb;
+    vec3 up = texture(scene, uv - vec2(0.0, pc.texelSize.y)).rgb;
+    vec3 down = texture(scene, min(uv + vec2(0.0, pc.texelSize.y), pc.uvScale - 0.5 * pc.texelSize)).rgb;
+
+    // Unsharp mask against the cross neighbourhood, clamped to its range
+    // to keep the edges from ringing
+    vec3 blur = (left + right + up + down) * 0.25;
+    vec3 lo = min(center, min(min(left, right), min(up, down)));
+    vec3 hi = max(center, max(max(left, right), max(up, down)));
+    vec3 color = clamp(center + (center - blur) * pc.sharpness, lo, hi);
+
+    outColor = vec4(color, 1.0);
+}
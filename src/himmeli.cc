@@ -1,5 +1,6 @@
 #include "himmeli.hh"
 
+#include "archive.hh"
 #include "utils.hh"
 
 #define GLM_ENABLE_EXPERIMENTAL
@@ -9,9 +10,14 @@
 #include "tiny_obj_loader.h"
 #include "vulkan/vulkan.h"
 
+#include <cmath>
 #include <cstddef>
 #include <cstdio>
+#include <map>
+#include <optional>
+#include <span>
 #include <stdexcept>
+#include <string>
 #include <string_view>
 
 bool Vertex::operator==(const Vertex &other) const {
@@ -58,16 +64,63 @@ VertexInputDescription Vertex::getDescription()
     return description;
 }
 
+VertexInputDescription Vertex::getPositionDescription()
+{
+    VertexInputDescription description;
+
+    VkVertexInputBindingDescription positionBinding {
+        .binding = 0,
+        .stride = sizeof(glm::vec3),
+        .inputRate = VK_VERTEX_INPUT_RATE_VERTEX
+    };
+    description.bindings.push_back(positionBinding);
+
+    VkVertexInputAttributeDescription positionAttribute {
+        .location = 0,
+        .binding = 0,
+        .format = VK_FORMAT_R32G32B32_SFLOAT,
+        .offset = 0
+    };
+    description.attributes.push_back(positionAttribute);
+
+    return description;
+}
+
 size_t std::hash<Vertex>::operator()(const Vertex &vertex) const {
     return hash<glm::vec3>()(vertex.position) ^
            (hash<glm::vec3>()(vertex.normal) << 1) ^
            (hash<glm::vec2>()(vertex.texcoord) << 2);
 }
 
-ObjFile::ObjFile(const std::string_view filename)
+// Resolves material libraries next to a packed model in the archive
+class ArchiveMaterialReader : public tinyobj::MaterialReader
 {
-    Path objPath = getAssetPath(filename);
+public:
+    ArchiveMaterialReader(const Path &directory):
+        m_directory(directory)
+    {
+    }
+
+    bool operator()(const std::string &matId, std::vector<tinyobj::material_t> *materials,
+                    std::map<std::string, int> *matMap, std::string *warn, std::string *err) override
+    {
+        std::optional<std::span<const uint8_t>> packed = findAsset((m_directory / matId).generic_string());
+        if (!packed) {
+            *warn += "Material file " + matId + " not found in the asset archive\n";
+            return false;
+        }
+
+        AssetStream stream(*packed);
+        tinyobj::LoadMtl(matMap, materials, &stream, warn, err);
+        return true;
+    }
 
+private:
+    Path m_directory;
+};
+
+ObjFile::ObjFile(const std::string_view filename)
+{
     tinyobj::attrib_t attrib;
     std::vector<tinyobj::shape_t> shapes;
     std::vector<tinyobj::material_t> materials;
@@ -75,7 +128,15 @@ ObjFile::ObjFile(const std::string_view filename)
     std::string warn;
     std::string err;
 
-    tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, cpath(objPath), cpath(assetdir()));
+    if (std::optional<std::span<const uint8_t>> packed = findAsset(filename)) {
+        AssetStream stream(*packed);
+        ArchiveMaterialReader materialReader(Path(filename).parent_path());
+        tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, &stream, &materialReader);
+    } else {
+        Path objPath = getAssetPath(filename);
+        // Material libraries are next to the OBJ, the same as in the archive
+        tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, cpath(objPath), cpath(objPath.parent_path()));
+    }
 
     if (!warn.empty())
         fprintf(stderr, "TinyObj warn: %s\n", warn.c_str());
@@ -83,9 +144,9 @@ ObjFile::ObjFile(const std::string_view filename)
     if (!err.empty())
         throw std::runtime_error("TinyObj err: " + err);
 
-    fprintf(stderr, "Model %s loaded\n", filename.data());
+    fprintf(stderr, "Model %.*s loaded\n", static_cast<int>(filename.size()), filename.data());
 
-    std::unordered_map<Vertex, uint32_t> uniqueVertices;
+    std::vector<Vertex> triangles;
 
     for (const tinyobj::shape_t &shape : shapes) {
         for (const tinyobj::index_t &index : shape.mesh.indices) {
@@ -98,27 +159,163 @@ ObjFile::ObjFile(const std::string_view filename)
             vert.normal.z = attrib.normals[3 * index.normal_index + 2];
             vert.texcoord.x = attrib.texcoords[2 * index.texcoord_index + 0];
             vert.texcoord.y = 1.0f - attrib.texcoords[2 * index.texcoord_index + 1];
+            triangles.push_back(vert);
+        }
+    }
+
+    deduplicate(triangles);
+}
+
+ObjFile::ObjFile(const std::vector<Vertex> &triangles)
+{
+    deduplicate(triangles);
+}
+
+void ObjFile::deduplicate(const std::vector<Vertex> &triangles)
+{
+    std::unordered_map<Vertex, uint32_t> uniqueVertices;
+
+    for (const Vertex &vert : triangles) {
+        if (uniqueVertices.count(vert) == 0) {
+            uniqueVertices[vert] = static_cast<uint32_t>(vertices.size());
+            vertices.push_back(vert);
+        }
+        indices.push_back(uniqueVertices[vert]);
+    }
+}
+
+glm::vec4 ObjFile::boundingSphere() const
+{
+    if (vertices.empty())
+        return glm::vec4{ 0.0f };
+
+    // Centered on the AABB, not minimal but good enough for culling
+    glm::vec3 lo = vertices[0].position;
+    glm::vec3 hi = vertices[0].position;
+    for (const Vertex &vertex : vertices) {
+        lo = glm::min(lo, vertex.position);
+        hi = glm::max(hi, vertex.position);
+    }
+
+    glm::vec3 center = 0.5f * (lo + hi);
+    float radius = 0.0f;
+    for (const Vertex &vertex : vertices)
+        radius = glm::max(radius, glm::length(vertex.position - center));
+
+    return glm::vec4{ center, radius };
+}
+
+void ObjFile::buildMeshlets()
+{
+    meshlets.clear();
+    meshletVertices.clear();
+    meshletTriangles.clear();
+
+    // Greedy in index order, the obj triangle order is usually coherent
+    // enough that neighbouring triangles share vertices
+    std::vector<uint32_t> localIndex(vertices.size(), UINT32_MAX);
+    Meshlet meshlet{};
+
+    auto finish = [&]() {
+        if (!meshlet.triangleCount)
+            return;
+
+        glm::vec3 lo = vertices[meshletVertices[meshlet.vertexOffset]].position;
+        glm::vec3 hi = lo;
+        for (uint32_t i = 0; i < meshlet.vertexCount; ++i) {
+            glm::vec3 position = vertices[meshletVertices[meshlet.vertexOffset + i]].position;
+            lo = glm::min(lo, position);
+            hi = glm::max(hi, position);
+            localIndex[meshletVertices[meshlet.vertexOffset + i]] = UINT32_MAX;
+        }
+
+        glm::vec3 center = 0.5f * (lo + hi);
+        float radius = 0.0f;
+        for (uint32_t i = 0; i < meshlet.vertexCount; ++i)
+            radius = glm::max(radius, glm::length(vertices[meshletVertices[meshlet.vertexOffset + i]].position - center));
+
+        // Cone around the average triangle normal, widened to the one
+        // that deviates most from it
+        std::vector<glm::vec3> normals;
+        glm::vec3 axis{ 0.0f };
+        for (uint32_t t = 0; t < meshlet.triangleCount; ++t) {
+            uint32_t packed = meshletTriangles[meshlet.triangleOffset + t];
+            glm::vec3 a = vertices[meshletVertices[meshlet.vertexOffset + (packed & 0xff)]].position;
+            glm::vec3 b = vertices[meshletVertices[meshlet.vertexOffset + ((packed >> 8) & 0xff)]].position;
+            glm::vec3 c = vertices[meshletVertices[meshlet.vertexOffset + ((packed >> 16) & 0xff)]].position;
+            glm::vec3 normal = glm::cross(b - a, c - a);
+            float area = glm::length(normal);
+            if (area <= 1e-12f)
+                continue;
+            normals.push_back(normal / area);
+            axis += normal / area;
+        }
+
+        float cutoff = 1.0f;
+        float axisLength = glm::length(axis);
+        if (axisLength > 1e-6f) {
+            axis /= axisLength;
+            float minDot = 1.0f;
+            for (const glm::vec3 &normal : normals)
+                minDot = glm::min(minDot, glm::dot(normal, axis));
+            if (minDot > 0.0f)
+                cutoff = std::sqrt(1.0f - minDot * minDot);
+        }
+
+        meshlet.sphere = glm::vec4{ center, radius };
+        meshlet.cone = glm::vec4{ axis, cutoff };
+        meshlets.push_back(meshlet);
+
+        meshlet = Meshlet{};
+        meshlet.vertexOffset = static_cast<uint32_t>(meshletVertices.size());
+        meshlet.triangleOffset = static_cast<uint32_t>(meshletTriangles.size());
+    };
 
-            if (uniqueVertices.count(vert) == 0) {
-                uniqueVertices[vert] = static_cast<uint32_t>(vertices.size());
-                vertices.push_back(vert);
+    for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+        uint32_t newVertices = 0;
+        for (size_t k = 0; k < 3; ++k)
+            newVertices += localIndex[indices[i + k]] == UINT32_MAX ? 1 : 0;
+
+        if (meshlet.vertexCount + newVertices > MESHLET_MAX_VERTICES || meshlet.triangleCount + 1 > MESHLET_MAX_TRIANGLES)
+            finish();
+
+        uint32_t packed = 0;
+        for (size_t k = 0; k < 3; ++k) {
+            uint32_t &local = localIndex[indices[i + k]];
+            if (local == UINT32_MAX) {
+                local = meshlet.vertexCount++;
+                meshletVertices.push_back(indices[i + k]);
             }
-            indices.push_back(uniqueVertices[vert]);
+            packed |= local << (8 * k);
         }
+
+        meshletTriangles.push_back(packed);
+        ++meshlet.triangleCount;
     }
+
+    finish();
 }
 
-ImageFile::ImageFile(const std::string_view filename)
+uint32_t MaterialState::key() const
 {
-    Path fullPath = getAssetPath(filename);
+    return static_cast<uint32_t>(cullMode) | (blend ? 1u : 0u) << 4;
+}
 
-    pixels = stbi_load(cpath(fullPath), &width, &height, &channels, STBI_rgb_alpha);
+ImageFile::ImageFile(const std::string_view filename)
+{
+    // Packed images decode straight from the mapping
+    if (std::optional<std::span<const uint8_t>> packed = findAsset(filename)) {
+        pixels = stbi_load_from_memory(packed->data(), static_cast<int>(packed->size()), &width, &height, &channels, STBI_rgb_alpha);
+    } else {
+        Path fullPath = getAssetPath(filename);
+        pixels = stbi_load(cpath(fullPath), &width, &height, &channels, STBI_rgb_alpha);
+    }
 
     if (!pixels) {
         throw std::runtime_error("Failed to load image: " + std::string(filename));
     }
 
-    fprintf(stderr, "Image %s loaded\n", filename.data());
+    fprintf(stderr, "Image %.*s loaded\n", static_cast<int>(filename.size()), filename.data());
 }
 
 ImageFile::~ImageFile()
@@ -3,12 +3,24 @@
 #include "memory.hh"
 
 #include "glm/glm.hpp"
+#include "glm/gtc/quaternion.hpp"
 #include "vulkan/vulkan.h"
 
+#include <cstdint>
 #include <memory>
 #include <string_view>
 #include <vector>
 
+using MeshHandle = uint32_t;
+using MaterialHandle = uint32_t;
+using TextureHandle = uint32_t;
+
+#define INVALID_HANDLE UINT32_MAX
+
+// Cluster limits, must match meshlet.mesh
+#define MESHLET_MAX_VERTICES 64
+#define MESHLET_MAX_TRIANGLES 124
+
 struct VertexInputDescription
 {
     std::vector<VkVertexInputBindingDescription> bindings;
@@ -20,6 +32,7 @@ struct Vertex
 {
     bool operator==(const Vertex &other) const;
     static VertexInputDescription getDescription();
+    static VertexInputDescription getPositionDescription();
     glm::vec3 position;
     glm::vec3 normal;
     glm::vec2 texcoord;
@@ -30,19 +43,51 @@ struct std::hash<Vertex> {
     size_t operator()(const Vertex &vertex) const;
 };
 
+struct Meshlet
+{
+    // Object space center in xyz, radius in w
+    glm::vec4 sphere;
+    // Normal cone axis in xyz and the sine of its half angle in w, the w
+    // is 1 when the triangles face too many ways to ever be culled
+    glm::vec4 cone;
+    uint32_t vertexOffset;
+    uint32_t triangleOffset;
+    uint32_t vertexCount;
+    uint32_t triangleCount;
+};
+
 struct ObjFile
 {
     ObjFile(const std::string_view filename);
+    ObjFile(const std::vector<Vertex> &triangles);
+    void deduplicate(const std::vector<Vertex> &triangles);
+    glm::vec4 boundingSphere() const;
+    void buildMeshlets();
     std::vector<Vertex> vertices;
     std::vector<uint32_t> indices;
+    // Empty until buildMeshlets(), triangles pack three 8-bit indices into
+    // the meshlet's vertex list
+    std::vector<Meshlet> meshlets;
+    std::vector<uint32_t> meshletVertices;
+    std::vector<uint32_t> meshletTriangles;
 };
 
 struct Mesh
 {
+    // Both null with vertex pulling, the shared streams are used instead
     std::unique_ptr<BufferAllocation> vertexBuffer;
+    // Tightly packed positions for the depth pre-pass, null when it's off
+    std::unique_ptr<BufferAllocation> positionBuffer;
     std::unique_ptr<BufferAllocation> indexBuffer;
     unsigned int numVertices;
     unsigned int numIndices;
+    // First vertex in the shared vertex pulling streams
+    uint32_t vertexOffset = 0;
+    // Object space center in xyz, radius in w
+    glm::vec4 boundingSphere;
+    // Range in the global meshlet buffers, empty without meshlets
+    uint32_t meshletOffset = 0;
+    uint32_t meshletCount = 0;
 };
 
 struct ImageFile
@@ -61,18 +106,33 @@ struct Texture
     VkImageView imageView;
 };
 
+// Fixed function state that varies per material. With extended dynamic
+// state it is set while recording, otherwise each combination is a pipeline.
+struct MaterialState
+{
+    VkCullModeFlags cullMode = VK_CULL_MODE_NONE;
+    bool blend = false;
+
+    bool operator==(const MaterialState &other) const = default;
+    uint32_t key() const;
+};
+
 struct Material
 {
     VkPipeline pipeline;
     VkPipelineLayout pipelineLayout;
     VkDescriptorSet textureSet = VK_NULL_HANDLE;
+    MaterialState state;
 };
 
 struct Himmeli
 {
-    Mesh *mesh;
-    Material *material;
-    glm::mat4 scale;
-    glm::mat4 rotate;
-    glm::mat4 translate;
+    MeshHandle mesh;
+    MaterialHandle material;
+    glm::vec3 position = glm::vec3{ 0.0f };
+    glm::quat rotation = glm::quat{ 1.0f, 0.0f, 0.0f, 0.0f };
+    glm::vec3 scale = glm::vec3{ 1.0f };
+    // Never moves unless Scene::moved() is called, its shadow is cached.
+    // Dynamic ones are animated by the simulation.
+    bool isStatic = false;
 };
@@ -5,24 +5,30 @@
 #include "vk_mem_alloc.h"
 #include "vulkan/vulkan.h"
 
-BufferAllocation::BufferAllocation(VmaAllocator allocator, size_t size, VkBufferUsageFlags usage, VmaMemoryUsage memoryUsage):
+BufferAllocation::BufferAllocation(VmaAllocator allocator, size_t size, VkBufferUsageFlags usage, VmaMemoryUsage memoryUsage, const std::vector<uint32_t> &queueFamilies, VmaAllocationCreateFlags flags):
     m_buffer(VK_NULL_HANDLE),
     m_allocation(VK_NULL_HANDLE),
     m_allocator(allocator),
+    m_memoryProperties(0),
     m_mapped(false),
     m_mapping(nullptr)
 {
     VkBufferCreateInfo bufferInfo {
         .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
         .size = size,
-        .usage = usage
+        .usage = usage,
+        .sharingMode = queueFamilies.size() > 1 ? VK_SHARING_MODE_CONCURRENT : VK_SHARING_MODE_EXCLUSIVE,
+        .queueFamilyIndexCount = queueFamilies.size() > 1 ? static_cast<uint32_t>(queueFamilies.size()) : 0,
+        .pQueueFamilyIndices = queueFamilies.size() > 1 ? queueFamilies.data() : nullptr
     };
 
     VmaAllocationCreateInfo allocInfo {
+        .flags = flags,
         .usage = memoryUsage
     };
 
     VK_CHECK(vmaCreateBuffer(m_allocator, &bufferInfo, &allocInfo, &m_buffer, &m_allocation, nullptr));
+    vmaGetAllocationMemoryProperties(m_allocator, m_allocation, &m_memoryProperties);
 }
 
 BufferAllocation::~BufferAllocation()
@@ -55,7 +61,22 @@ void BufferAllocation::unmap()
     }
 }
 
-ImageAllocation::ImageAllocation(VmaAllocator allocator, VkExtent3D extent, VkFormat format, VkSampleCountFlagBits samples, VkImageUsageFlags usage, VmaMemoryUsage memoryUsage):
+void BufferAllocation::flush()
+{
+    VK_CHECK(vmaFlushAllocation(m_allocator, m_allocation, 0, VK_WHOLE_SIZE));
+}
+
+void BufferAllocation::invalidate()
+{
+    VK_CHECK(vmaInvalidateAllocation(m_allocator, m_allocation, 0, VK_WHOLE_SIZE));
+}
+
+bool BufferAllocation::hostVisible()
+{
+    return m_memoryProperties & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+}
+
+ImageAllocation::ImageAllocation(VmaAllocator allocator, VkExtent3D extent, VkFormat format, VkSampleCountFlagBits samples, VkImageUsageFlags usage, VmaMemoryUsage memoryUsage, uint32_t mipLevels, uint32_t arrayLayers):
     m_image(VK_NULL_HANDLE),
     m_allocation(VK_NULL_HANDLE),
     m_allocator(allocator),
@@ -70,8 +91,8 @@ ImageAllocation::ImageAllocation(VmaAllocator allocator, VkExtent3D extent, VkFo
         .imageType = VK_IMAGE_TYPE_2D,
         .format = format,
         .extent = extent,
-        .mipLevels = 1,
-        .arrayLayers = 1,
+        .mipLevels = mipLevels,
+        .arrayLayers = arrayLayers,
         .samples = samples,
         .tiling = VK_IMAGE_TILING_OPTIMAL,
         .usage = usage
@@ -99,20 +120,20 @@ VkImage ImageAllocation::image()
     return m_image;
 }
 
-VkImageView ImageAllocation::createImageView(VkFormat format, VkImageAspectFlags aspectFlags)
+VkImageView ImageAllocation::createImageView(VkFormat format, VkImageAspectFlags aspectFlags, uint32_t baseMipLevel, uint32_t levelCount, uint32_t layerCount)
 {
     VkImageSubresourceRange range {
         .aspectMask = aspectFlags,
-        .baseMipLevel = 0,
-        .levelCount = 1,
+        .baseMipLevel = baseMipLevel,
+        .levelCount = levelCount,
         .baseArrayLayer = 0,
-        .layerCount = 1
+        .layerCount = layerCount
     };
 
     VkImageViewCreateInfo viewInfo {
         .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
         .image = m_image,
-        .viewType = VK_IMAGE_VIEW_TYPE_2D,
+        .viewType = layerCount > 1 ? VK_IMAGE_VIEW_TYPE_2D_ARRAY : VK_IMAGE_VIEW_TYPE_2D,
         .format = format,
         .subresourceRange = range
     };
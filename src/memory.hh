@@ -8,7 +8,8 @@
 class BufferAllocation
 {
 public:
-    BufferAllocation(VmaAllocator allocator, size_t size, VkBufferUsageFlags usage, VmaMemoryUsage memoryUsage);
+    // More than one queue family makes the buffer concurrently shared
+    BufferAllocation(VmaAllocator allocator, size_t size, VkBufferUsageFlags usage, VmaMemoryUsage memoryUsage, const std::vector<uint32_t> &queueFamilies = {}, VmaAllocationCreateFlags flags = 0);
     ~BufferAllocation();
     BufferAllocation(const BufferAllocation &) = delete;
     BufferAllocation &operator=(const BufferAllocation &) = delete;
@@ -16,11 +17,17 @@ public:
     VkBuffer buffer();
     void *map();
     void unmap();
+    void flush();
+    void invalidate();
+    // Where the allocation ended up, device local memory can be host
+    // visible too with resizable BAR or unified memory
+    bool hostVisible();
 
 private:
     VkBuffer m_buffer;
     VmaAllocation m_allocation;
     VmaAllocator m_allocator;
+    VkMemoryPropertyFlags m_memoryProperties;
     bool m_mapped;
     void *m_mapping;
 };
@@ -28,13 +35,14 @@ private:
 class ImageAllocation
 {
 public:
-    ImageAllocation(VmaAllocator allocator, VkExtent3D extent, VkFormat format, VkSampleCountFlagBits samples, VkImageUsageFlags usage, VmaMemoryUsage memoryUsage);
+    ImageAllocation(VmaAllocator allocator, VkExtent3D extent, VkFormat format, VkSampleCountFlagBits samples, VkImageUsageFlags usage, VmaMemoryUsage memoryUsage, uint32_t mipLevels = 1, uint32_t arrayLayers = 1);
     ~ImageAllocation();
     ImageAllocation(const ImageAllocation &) = delete;
     ImageAllocation &operator=(const ImageAllocation &) = delete;
 
     VkImage image();
-    VkImageView createImageView(VkFormat format, VkImageAspectFlags aspectFlags);
+    // More than one layer gives an array view
+    VkImageView createImageView(VkFormat format, VkImageAspectFlags aspectFlags, uint32_t baseMipLevel = 0, uint32_t levelCount = 1, uint32_t layerCount = 1);
 
 private:
     VkImage m_image;
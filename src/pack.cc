@@ -0,0 +1,162 @@
+#include "archive.hh"
+#include "utils.hh"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+struct PackOptions {
+    Path assets = assetdir();
+    Path output = "assets.pak";
+};
+
+struct PackEntry {
+    std::string name;
+    std::vector<char> data;
+    ArchiveEntry entry;
+};
+
+static PackOptions parseOptions(int argc, char *argv[])
+{
+    PackOptions options;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        bool hasValue = i + 1 < argc;
+
+        if (arg == "--output" && hasValue) {
+            options.output = argv[++i];
+        } else if (arg.starts_with("--")) {
+            throw std::runtime_error("Unknown argument: " + arg + "\n"
+                                     "Usage: vklelu_pack [asset directory] [--output assets.pak]");
+        } else {
+            options.assets = arg;
+        }
+    }
+
+    return options;
+}
+
+// The archive is written front to back, seeking would need offsets that
+// don't fit a 32-bit long past 2 GiB
+static void writeNext(FILE *f, uint64_t &offset, const void *data, size_t size)
+{
+    if (fwrite(data, 1, size, f) != size)
+        throw std::runtime_error("Failed to write the archive");
+    offset += size;
+}
+
+static void padTo(FILE *f, uint64_t &offset, uint64_t alignment)
+{
+    static const char zeros[ARCHIVE_ALIGNMENT] = {};
+    writeNext(f, offset, zeros, static_cast<size_t>((alignment - offset % alignment) % alignment));
+}
+
+static int packMain(int argc, char *argv[])
+{
+    PackOptions options = parseOptions(argc, argv);
+
+    std::vector<PackEntry> entries;
+    for (const std::filesystem::directory_entry &file : std::filesystem::recursive_directory_iterator(options.assets)) {
+        // Never pack an older archive into the new one
+        if (!file.is_regular_file() || file.path().extension() == ".pak")
+            continue;
+
+        PackEntry &entry = entries.emplace_back();
+        entry.name = std::filesystem::relative(file.path(), options.assets).generic_string();
+
+        std::ifstream in(file.path(), std::ios::binary);
+        entry.data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        if (!in && !in.eof())
+            throw std::runtime_error("Failed to read " + file.path().string());
+    }
+
+    // Lookups binary search the hashes, a collision is fine as long as
+    // the names differ
+    for (PackEntry &entry : entries)
+        entry.entry.hash = hashAssetName(entry.name);
+    std::sort(entries.begin(), entries.end(), [](const PackEntry &a, const PackEntry &b) {
+        return a.entry.hash != b.entry.hash ? a.entry.hash < b.entry.hash : a.name < b.name;
+    });
+
+    FILE *f = fopen(cpath(options.output), "wb");
+    if (!f)
+        throw std::runtime_error("Failed to open " + options.output.string());
+
+    // Payloads in TOC order right after the header, each one aligned. The
+    // header is filled in once the offsets are known.
+    ArchiveHeader header {
+        .version = ARCHIVE_VERSION,
+        .entryCount = static_cast<uint32_t>(entries.size())
+    };
+    memcpy(header.magic, ARCHIVE_MAGIC, sizeof(header.magic));
+
+    uint64_t offset = 0;
+    writeNext(f, offset, &header, sizeof(header));
+
+    std::string names;
+    for (PackEntry &entry : entries) {
+        padTo(f, offset, ARCHIVE_ALIGNMENT);
+        entry.entry.offset = offset;
+        entry.entry.size = entry.data.size();
+        entry.entry.storedSize = entry.data.size();
+        entry.entry.compression = ARCHIVE_COMPRESSION_NONE;
+        entry.entry.nameOffset = static_cast<uint32_t>(names.size());
+        names.append(entry.name).push_back('\0');
+
+        writeNext(f, offset, entry.data.data(), entry.data.size());
+    }
+
+    std::vector<ArchiveEntry> toc;
+    for (const PackEntry &entry : entries)
+        toc.push_back(entry.entry);
+
+    padTo(f, offset, alignof(ArchiveEntry));
+    header.tocOffset = offset;
+    writeNext(f, offset, toc.data(), toc.size() * sizeof(ArchiveEntry));
+    header.namesOffset = offset;
+    writeNext(f, offset, names.data(), names.size());
+
+    // Back to the start, the only place that is ever revisited
+    rewind(f);
+    uint64_t headerOffset = 0;
+    writeNext(f, headerOffset, &header, sizeof(header));
+
+    if (fclose(f) != 0)
+        throw std::runtime_error("Failed to write " + options.output.string());
+
+    // Read everything back through the loader before calling it done
+    AssetArchive archive(options.output);
+    for (const PackEntry &entry : entries) {
+        std::optional<std::span<const uint8_t>> packed = archive.find(entry.name);
+        if (!packed || packed->size() != entry.data.size() || !std::equal(packed->begin(), packed->end(), entry.data.begin(), [](uint8_t a, char b) {
+                return a == static_cast<uint8_t>(b);
+            }))
+            throw std::runtime_error("Asset " + entry.name + " did not read back from " + options.output.string());
+    }
+
+    fprintf(stderr, "Packed %zu assets from %s into %s, %llu bytes\n", entries.size(),
+            cpath(options.assets), cpath(options.output), static_cast<unsigned long long>(header.namesOffset + names.size()));
+
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+    try {
+        return packMain(argc, argv);
+    } catch (std::runtime_error& e) {
+        fprintf(stderr, "Unhandled exception: %s\n", e.what());
+        return EXIT_FAILURE;
+    }
+}
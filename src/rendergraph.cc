@@ -0,0 +1,416 @@
+#include "rendergraph.hh"
+
+#include "utils.hh"
+
+#include "vk_mem_alloc.h"
+#include "vulkan/vulkan.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <stdexcept>
+
+RenderGraph::RenderGraph(VkDevice device, VmaAllocator allocator):
+    m_device(device),
+    m_allocator(allocator),
+    m_compiled(false)
+{
+}
+
+RenderGraph::~RenderGraph()
+{
+    for (Resource &resource : m_resources) {
+        if (!resource.transient)
+            continue;
+        if (resource.view)
+            vkDestroyImageView(m_device, resource.view, nullptr);
+        if (resource.handle)
+            vkDestroyImage(m_device, resource.handle, nullptr);
+    }
+
+    for (VmaAllocation memory : m_memory)
+        vmaFreeMemory(m_allocator, memory);
+}
+
+GraphResource RenderGraph::createImage(const std::string &name, VkExtent3D extent, VkFormat format, VkImageUsageFlags usage, VkImageAspectFlags aspect)
+{
+    if (m_compiled)
+        throw std::runtime_error("Render graph image " + name + " added after compile");
+
+    Resource resource {
+        .name = name,
+        .image = true,
+        .transient = true,
+        .aspect = aspect,
+        .createInfo = {
+            .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+            .imageType = VK_IMAGE_TYPE_2D,
+            .format = format,
+            .extent = extent,
+            .mipLevels = 1,
+            .arrayLayers = 1,
+            .samples = VK_SAMPLE_COUNT_1_BIT,
+            .tiling = VK_IMAGE_TILING_OPTIMAL,
+            .usage = usage
+        }
+    };
+
+    m_resources.push_back(resource);
+    return static_cast<GraphResource>(m_resources.size() - 1);
+}
+
+GraphResource RenderGraph::importImage(const std::string &name, VkImage image, VkImageView view, VkImageAspectFlags aspect, uint32_t levelCount)
+{
+    Resource resource {
+        .name = name,
+        .image = true,
+        .transient = false,
+        .handle = image,
+        .view = view,
+        .aspect = aspect,
+        .levelCount = levelCount
+    };
+
+    m_resources.push_back(resource);
+    return static_cast<GraphResource>(m_resources.size() - 1);
+}
+
+GraphResource RenderGraph::importBuffer(const std::string &name)
+{
+    Resource resource {
+        .name = name,
+        .image = false,
+        .transient = false
+    };
+
+    m_resources.push_back(resource);
+    return static_cast<GraphResource>(m_resources.size() - 1);
+}
+
+void RenderGraph::setImage(GraphResource resource, VkImage image, VkImageView view, VkPipelineStageFlags2 stage)
+{
+    Resource &res = m_resources[resource];
+    res.handle = image;
+    res.view = view;
+    res.writeStages = stage;
+    res.writeAccess = 0;
+    res.readStages = VK_PIPELINE_STAGE_2_NONE;
+    res.discard = true;
+}
+
+void RenderGraph::addPass(const std::string &name, std::vector<GraphAccess> accesses, std::function<void(VkCommandBuffer)> &&record)
+{
+    if (m_compiled)
+        throw std::runtime_error("Render graph pass " + name + " added after compile");
+
+    m_passes.push_back({ name, std::move(accesses), std::move(record) });
+}
+
+void RenderGraph::setOutput(GraphResource resource)
+{
+    m_resources[resource].output = true;
+}
+
+void RenderGraph::compile()
+{
+    cullPasses();
+    placeTransients();
+    m_compiled = true;
+}
+
+void RenderGraph::cullPasses()
+{
+    std::vector<bool> needed(m_resources.size());
+    for (size_t i = 0; i < m_resources.size(); ++i)
+        needed[i] = m_resources[i].output;
+
+    // Walking back from the outputs, a pass is kept when something after it
+    // needs what it writes. Passes that only read, like the final present
+    // transition, are kept when they read an output.
+    for (auto pass = m_passes.rbegin(); pass != m_passes.rend(); ++pass) {
+        bool used = pass->accesses.empty();
+        for (const GraphAccess &access : pass->accesses)
+            used |= needed[access.resource] && (access.write || m_resources[access.resource].output);
+
+        pass->culled = !used;
+        if (pass->culled) {
+            fprintf(stderr, "Render graph pass %s culled\n", pass->name.c_str());
+            continue;
+        }
+
+        for (const GraphAccess &access : pass->accesses)
+            needed[access.resource] = true;
+    }
+}
+
+void RenderGraph::placeTransients()
+{
+    struct Placement {
+        GraphResource resource;
+        VkMemoryRequirements requirements;
+        VkDeviceSize offset;
+        size_t block;
+        // Passes from first to last use, empty when nothing uses the image
+        size_t first;
+        size_t last;
+    };
+
+    std::vector<Placement> placements;
+    for (GraphResource r = 0; r < m_resources.size(); ++r) {
+        Resource &resource = m_resources[r];
+        if (!resource.transient)
+            continue;
+
+        VK_CHECK(vkCreateImage(m_device, &resource.createInfo, nullptr, &resource.handle));
+
+        Placement placement {
+            .resource = r,
+            .offset = 0,
+            .block = 0,
+            .first = m_passes.size(),
+            .last = 0
+        };
+        vkGetImageMemoryRequirements(m_device, resource.handle, &placement.requirements);
+
+        for (size_t p = 0; p < m_passes.size(); ++p) {
+            if (m_passes[p].culled)
+                continue;
+            for (const GraphAccess &access : m_passes[p].accesses) {
+                if (access.resource != r)
+                    continue;
+                placement.first = std::min(placement.first, p);
+                placement.last = std::max(placement.last, p);
+            }
+        }
+
+        placements.push_back(placement);
+    }
+
+    // Largest first, each image goes to the lowest offset that doesn't
+    // collide with an image alive at the same time
+    std::sort(placements.begin(), placements.end(), [](const Placement &a, const Placement &b) {
+        return a.requirements.size > b.requirements.size;
+    });
+
+    std::vector<VkMemoryRequirements> blocks;
+    VkDeviceSize imageBytes = 0;
+
+    auto livesWith = [](const Placement &a, const Placement &b) {
+        return a.first <= b.last && b.first <= a.last;
+    };
+    auto sharesMemory = [](const Placement &a, const Placement &b) {
+        return a.block == b.block && a.offset < b.offset + b.requirements.size && b.offset < a.offset + a.requirements.size;
+    };
+
+    for (size_t i = 0; i < placements.size(); ++i) {
+        Placement &placement = placements[i];
+        imageBytes += placement.requirements.size;
+
+        size_t block = 0;
+        while (block < blocks.size() && !(blocks[block].memoryTypeBits & placement.requirements.memoryTypeBits))
+            ++block;
+        if (block == blocks.size())
+            blocks.push_back({ .size = 0, .alignment = 1, .memoryTypeBits = placement.requirements.memoryTypeBits });
+        placement.block = block;
+
+        // Candidate offsets are the start and the ends of the live images
+        std::vector<VkDeviceSize> candidates = { 0 };
+        for (size_t j = 0; j < i; ++j) {
+            if (placements[j].block == block && livesWith(placement, placements[j]))
+                candidates.push_back(placements[j].offset + placements[j].requirements.size);
+        }
+        std::sort(candidates.begin(), candidates.end());
+
+        VkDeviceSize alignment = placement.requirements.alignment;
+        for (VkDeviceSize candidate : candidates) {
+            placement.offset = (candidate + alignment - 1) / alignment * alignment;
+            bool collides = false;
+            for (size_t j = 0; j < i && !collides; ++j)
+                collides = livesWith(placement, placements[j]) && sharesMemory(placement, placements[j]);
+            if (!collides)
+                break;
+        }
+
+        VkMemoryRequirements &requirements = blocks[block];
+        requirements.size = std::max(requirements.size, placement.offset + placement.requirements.size);
+        requirements.alignment = std::max(requirements.alignment, alignment);
+        requirements.memoryTypeBits &= placement.requirements.memoryTypeBits;
+    }
+
+    VmaAllocationCreateInfo allocInfo {
+        .usage = VMA_MEMORY_USAGE_GPU_ONLY,
+        .requiredFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT
+    };
+
+    VkDeviceSize memoryBytes = 0;
+    for (const VkMemoryRequirements &requirements : blocks) {
+        VmaAllocation memory;
+        VK_CHECK(vmaAllocateMemory(m_allocator, &requirements, &allocInfo, &memory, nullptr));
+        m_memory.push_back(memory);
+        memoryBytes += requirements.size;
+    }
+
+    for (size_t i = 0; i < placements.size(); ++i) {
+        const Placement &placement = placements[i];
+        Resource &resource = m_resources[placement.resource];
+        VK_CHECK(vmaBindImageMemory2(m_allocator, m_memory[placement.block], placement.offset, resource.handle, nullptr));
+
+        VkImageViewCreateInfo viewInfo {
+            .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+            .image = resource.handle,
+            .viewType = VK_IMAGE_VIEW_TYPE_2D,
+            .format = resource.createInfo.format,
+            .subresourceRange = {
+                .aspectMask = resource.aspect,
+                .baseMipLevel = 0,
+                .levelCount = 1,
+                .baseArrayLayer = 0,
+                .layerCount = 1
+            }
+        };
+        VK_CHECK(vkCreateImageView(m_device, &viewInfo, nullptr, &resource.view));
+
+        for (size_t j = 0; j < placements.size(); ++j) {
+            if (j != i && sharesMemory(placement, placements[j]))
+                resource.aliases.push_back(placements[j].resource);
+        }
+    }
+
+    fprintf(stderr, "Render graph: %zu of %zu passes, %zu transient images of %zu KiB in %zu KiB\n",
+            m_passes.size() - culledPassCount(), m_passes.size(), placements.size(),
+            static_cast<size_t>(imageBytes / 1024), static_cast<size_t>(memoryBytes / 1024));
+}
+
+void RenderGraph::execute(VkCommandBuffer cmd)
+{
+    if (!m_compiled)
+        throw std::runtime_error("Render graph executed before compile");
+
+    for (Resource &resource : m_resources) {
+        if (resource.transient)
+            resource.discard = true;
+    }
+
+    std::vector<VkImageMemoryBarrier2> imageBarriers;
+
+    for (Pass &pass : m_passes) {
+        if (pass.culled)
+            continue;
+
+        VkMemoryBarrier2 memoryBarrier {
+            .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2
+        };
+        imageBarriers.clear();
+
+        for (const GraphAccess &access : pass.accesses) {
+            Resource &res = m_resources[access.resource];
+
+            // Layout changes need an image barrier, the transition itself
+            // then acts as the write this pass waits on
+            if (res.image && (res.discard || res.layout != access.layout)) {
+                VkPipelineStageFlags2 srcStages = res.writeStages | res.readStages;
+                VkAccessFlags2 srcAccess = res.writeAccess;
+                if (res.discard) {
+                    for (GraphResource alias : res.aliases) {
+                        srcStages |= m_resources[alias].writeStages | m_resources[alias].readStages;
+                        srcAccess |= m_resources[alias].writeAccess;
+                    }
+                }
+
+                imageBarriers.push_back({
+                    .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+                    .srcStageMask = srcStages,
+                    .srcAccessMask = srcAccess,
+                    .dstStageMask = access.stage,
+                    .dstAccessMask = access.access,
+                    .oldLayout = res.discard ? VK_IMAGE_LAYOUT_UNDEFINED : res.layout,
+                    .newLayout = access.layout,
+                    .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                    .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                    .image = res.handle,
+                    .subresourceRange = {
+                        .aspectMask = res.aspect,
+                        .baseMipLevel = 0,
+                        .levelCount = res.levelCount,
+                        .baseArrayLayer = 0,
+                        .layerCount = 1
+                    }
+                });
+
+                res.layout = access.layout;
+                res.discard = false;
+                res.writeStages = access.stage;
+                res.writeAccess = access.write ? access.access : 0;
+                res.readStages = VK_PIPELINE_STAGE_2_NONE;
+                res.visibleStages = access.write ? VK_PIPELINE_STAGE_2_NONE : access.stage;
+                res.visibleAccess = access.write ? 0 : access.access;
+                continue;
+            }
+
+            if (access.write) {
+                // Wait for the last write and every read since
+                VkPipelineStageFlags2 srcStages = res.writeStages | res.readStages;
+                if (srcStages) {
+                    memoryBarrier.srcStageMask |= srcStages;
+                    memoryBarrier.srcAccessMask |= res.writeAccess;
+                    memoryBarrier.dstStageMask |= access.stage;
+                    memoryBarrier.dstAccessMask |= access.access;
+                }
+
+                res.writeStages = access.stage;
+                res.writeAccess = access.access;
+                res.readStages = VK_PIPELINE_STAGE_2_NONE;
+                res.visibleStages = VK_PIPELINE_STAGE_2_NONE;
+                res.visibleAccess = 0;
+                continue;
+            }
+
+            // Reads only wait when the last write isn't visible to them yet
+            if (res.writeStages && ((access.stage & ~res.visibleStages) || (access.access & ~res.visibleAccess))) {
+                memoryBarrier.srcStageMask |= res.writeStages;
+                memoryBarrier.srcAccessMask |= res.writeAccess;
+                memoryBarrier.dstStageMask |= access.stage;
+                memoryBarrier.dstAccessMask |= access.access;
+                res.visibleStages |= access.stage;
+                res.visibleAccess |= access.access;
+            }
+            res.readStages |= access.stage;
+        }
+
+        bool memory = memoryBarrier.srcStageMask || memoryBarrier.dstStageMask;
+        if (memory || !imageBarriers.empty()) {
+            VkDependencyInfo dep {
+                .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+                .memoryBarrierCount = memory ? 1u : 0u,
+                .pMemoryBarriers = &memoryBarrier,
+                .imageMemoryBarrierCount = static_cast<uint32_t>(imageBarriers.size()),
+                .pImageMemoryBarriers = imageBarriers.data()
+            };
+            vkCmdPipelineBarrier2(cmd, &dep);
+        }
+
+        if (pass.record)
+            pass.record(cmd);
+    }
+}
+
+VkImage RenderGraph::image(GraphResource resource)
+{
+    return m_resources[resource].handle;
+}
+
+VkImageView RenderGraph::imageView(GraphResource resource)
+{
+    return m_resources[resource].view;
+}
+
+size_t RenderGraph::passCount()
+{
+    return m_passes.size();
+}
+
+size_t RenderGraph::culledPassCount()
+{
+    return static_cast<size_t>(std::count_if(m_passes.begin(), m_passes.end(), [](const Pass &pass) {
+        return pass.culled;
+    }));
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include "vk_mem_alloc.h"
+#include "vulkan/vulkan.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+using GraphResource = uint32_t;
+
+// One use of a resource by a pass. Writes may also read, the layout is
+// ignored for buffers.
+struct GraphAccess {
+    GraphResource resource;
+    VkPipelineStageFlags2 stage;
+    VkAccessFlags2 access;
+    VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED;
+    bool write = false;
+};
+
+// Passes run in the order they are added and declare what they touch, the
+// barriers in front of each pass are derived from the last use of every
+// resource, including the previous frame's. Passes whose writes never reach
+// an output are culled at compile time. Images created by the graph are
+// transient, their contents don't survive the frame and the ones whose
+// passes don't overlap share memory.
+class RenderGraph
+{
+public:
+    RenderGraph(VkDevice device, VmaAllocator allocator);
+    ~RenderGraph();
+    RenderGraph(const RenderGraph &) = delete;
+    RenderGraph &operator=(const RenderGraph &) = delete;
+
+    GraphResource createImage(const std::string &name, VkExtent3D extent, VkFormat format, VkImageUsageFlags usage, VkImageAspectFlags aspect);
+    // Owned elsewhere and kept across frames, unless set again every frame
+    GraphResource importImage(const std::string &name, VkImage image, VkImageView view, VkImageAspectFlags aspect, uint32_t levelCount = 1);
+    // Buffers only order accesses with memory barriers, so the per-frame
+    // copies of a buffer can share one resource
+    GraphResource importBuffer(const std::string &name);
+    // Swaps in this frame's image, its contents are discarded and the first
+    // use waits for stage, e.g. where the acquire semaphore is waited on
+    void setImage(GraphResource resource, VkImage image, VkImageView view, VkPipelineStageFlags2 stage);
+
+    void addPass(const std::string &name, std::vector<GraphAccess> accesses, std::function<void(VkCommandBuffer)> &&record = {});
+    void setOutput(GraphResource resource);
+
+    // Culls passes and places the transient images, must be called once
+    // before the image handles of created resources are used
+    void compile();
+    void execute(VkCommandBuffer cmd);
+
+    VkImage image(GraphResource resource);
+    VkImageView imageView(GraphResource resource);
+
+    size_t passCount();
+    size_t culledPassCount();
+
+private:
+    struct Resource {
+        std::string name;
+        bool image;
+        bool transient;
+        bool output = false;
+        VkImage handle = VK_NULL_HANDLE;
+        VkImageView view = VK_NULL_HANDLE;
+        VkImageAspectFlags aspect = 0;
+        uint32_t levelCount = 1;
+        VkImageCreateInfo createInfo{};
+        // Transients that share some of the memory, they must be waited
+        // for before the contents are thrown away
+        std::vector<GraphResource> aliases;
+
+        // Last writer and everything that read since
+        VkPipelineStageFlags2 writeStages = VK_PIPELINE_STAGE_2_NONE;
+        VkAccessFlags2 writeAccess = 0;
+        VkPipelineStageFlags2 readStages = VK_PIPELINE_STAGE_2_NONE;
+        // Stages and accesses that already see the last write
+        VkPipelineStageFlags2 visibleStages = VK_PIPELINE_STAGE_2_NONE;
+        VkAccessFlags2 visibleAccess = 0;
+        VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED;
+        bool discard = true;
+    };
+
+    struct Pass {
+        std::string name;
+        std::vector<GraphAccess> accesses;
+        std::function<void(VkCommandBuffer)> record;
+        bool culled = false;
+    };
+
+    void cullPasses();
+    void placeTransients();
+
+    VkDevice m_device;
+    VmaAllocator m_allocator;
+    std::vector<Resource> m_resources;
+    std::vector<Pass> m_passes;
+    std::vector<VmaAllocation> m_memory;
+    bool m_compiled;
+};
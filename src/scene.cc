@@ -0,0 +1,221 @@
+#include "scene.hh"
+
+#include "himmeli.hh"
+
+#include "glm/glm.hpp"
+#include "glm/gtc/quaternion.hpp"
+
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+#define SLOT_BITS 32
+#define SLOT_MASK ((1ull << SLOT_BITS) - 1)
+// Never handed out, so no live handle can equal INVALID_HIMMELI
+#define RETIRED_GENERATION UINT32_MAX
+
+static uint32_t slotOf(HimmeliId id)
+{
+    return static_cast<uint32_t>(id & SLOT_MASK);
+}
+
+static uint32_t generationOf(HimmeliId id)
+{
+    return static_cast<uint32_t>(id >> SLOT_BITS);
+}
+
+static HimmeliId makeId(uint32_t slot, uint32_t generation)
+{
+    return (static_cast<uint64_t>(generation) << SLOT_BITS) | slot;
+}
+
+Scene::Scene():
+    m_version(0),
+    m_staticVersion(0),
+    m_transformVersion(0)
+{
+}
+
+HimmeliId Scene::add(const Himmeli &himmeli)
+{
+    uint32_t slot;
+    if (!m_freeSlots.empty()) {
+        slot = m_freeSlots.back();
+        m_freeSlots.pop_back();
+    } else {
+        if (m_slots.size() >= SLOT_MASK)
+            throw std::runtime_error("Too many Himmelit in scene");
+        slot = static_cast<uint32_t>(m_slots.size());
+        m_slots.push_back(0);
+        m_generations.push_back(0);
+    }
+
+    HimmeliId id = makeId(slot, m_generations[slot]);
+    m_slots[slot] = static_cast<uint32_t>(m_ids.size());
+
+    m_positions.push_back(himmeli.position);
+    m_rotations.push_back(himmeli.rotation);
+    m_scales.push_back(himmeli.scale);
+    m_meshes.push_back(himmeli.mesh);
+    m_materials.push_back(himmeli.material);
+    m_statics.push_back(himmeli.isStatic);
+    m_ids.push_back(id);
+
+    ++m_version;
+    if (himmeli.isStatic)
+        ++m_staticVersion;
+    return id;
+}
+
+void Scene::remove(HimmeliId id)
+{
+    if (!valid(id))
+        return;
+
+    uint32_t slot = slotOf(id);
+    uint32_t dense = m_slots[slot];
+    uint32_t last = static_cast<uint32_t>(m_ids.size() - 1);
+
+    if (m_statics[dense])
+        ++m_staticVersion;
+
+    // Swap the last element into the hole to keep the arrays dense
+    if (dense != last) {
+        m_positions[dense] = m_positions[last];
+        m_rotations[dense] = m_rotations[last];
+        m_scales[dense] = m_scales[last];
+        m_meshes[dense] = m_meshes[last];
+        m_materials[dense] = m_materials[last];
+        m_statics[dense] = m_statics[last];
+        m_ids[dense] = m_ids[last];
+        m_slots[slotOf(m_ids[dense])] = dense;
+    }
+
+    m_positions.pop_back();
+    m_rotations.pop_back();
+    m_scales.pop_back();
+    m_meshes.pop_back();
+    m_materials.pop_back();
+    m_statics.pop_back();
+    m_ids.pop_back();
+
+    releaseSlot(slot);
+
+    ++m_version;
+}
+
+bool Scene::valid(HimmeliId id)
+{
+    uint32_t slot = slotOf(id);
+    return id != INVALID_HIMMELI &&
+           slot < m_slots.size() &&
+           m_generations[slot] == generationOf(id);
+}
+
+uint32_t Scene::index(HimmeliId id)
+{
+    if (!valid(id))
+        throw std::runtime_error("Invalid Himmeli handle");
+    return m_slots[slotOf(id)];
+}
+
+void Scene::clear()
+{
+    for (HimmeliId id : m_ids)
+        releaseSlot(slotOf(id));
+
+    m_positions.clear();
+    m_rotations.clear();
+    m_scales.clear();
+    m_meshes.clear();
+    m_materials.clear();
+    m_statics.clear();
+    m_ids.clear();
+
+    ++m_version;
+    ++m_staticVersion;
+}
+
+void Scene::setMesh(HimmeliId id, MeshHandle mesh)
+{
+    uint32_t dense = index(id);
+    m_meshes[dense] = mesh;
+    ++m_version;
+    if (m_statics[dense])
+        ++m_staticVersion;
+}
+
+void Scene::setMaterial(HimmeliId id, MaterialHandle material)
+{
+    m_materials[index(id)] = material;
+    ++m_version;
+}
+
+void Scene::moved(HimmeliId id)
+{
+    if (m_statics[index(id)])
+        ++m_staticVersion;
+    ++m_transformVersion;
+}
+
+void Scene::releaseSlot(uint32_t slot)
+{
+    // Old handles to the slot stay invalid for good once it is retired
+    if (++m_generations[slot] != RETIRED_GENERATION)
+        m_freeSlots.push_back(slot);
+}
+
+size_t Scene::size()
+{
+    return m_ids.size();
+}
+
+uint64_t Scene::version()
+{
+    return m_version;
+}
+
+uint64_t Scene::staticVersion()
+{
+    return m_staticVersion;
+}
+
+uint64_t Scene::transformVersion()
+{
+    return m_transformVersion;
+}
+
+std::vector<glm::vec3> &Scene::positions()
+{
+    return m_positions;
+}
+
+std::vector<glm::quat> &Scene::rotations()
+{
+    return m_rotations;
+}
+
+std::vector<glm::vec3> &Scene::scales()
+{
+    return m_scales;
+}
+
+std::vector<MeshHandle> &Scene::meshes()
+{
+    return m_meshes;
+}
+
+std::vector<MaterialHandle> &Scene::materials()
+{
+    return m_materials;
+}
+
+std::vector<uint8_t> &Scene::statics()
+{
+    return m_statics;
+}
+
+std::vector<HimmeliId> &Scene::ids()
+{
+    return m_ids;
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include "himmeli.hh"
+
+#include "glm/glm.hpp"
+#include "glm/gtc/quaternion.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Stable handle to a Himmeli: the low 32 bits index a slot and the high
+// 32 bits hold the slot generation so stale handles can be detected. A
+// slot whose generation runs out is retired instead of wrapping around.
+using HimmeliId = uint64_t;
+
+#define INVALID_HIMMELI UINT64_MAX
+
+template <typename T>
+class AssetStore
+{
+public:
+    uint32_t add(const std::string &name, T &&asset)
+    {
+        uint32_t handle = static_cast<uint32_t>(m_assets.size());
+        m_assets.push_back(std::move(asset));
+        m_names[name] = handle;
+        return handle;
+    }
+
+    uint32_t find(const std::string &name)
+    {
+        auto it = m_names.find(name);
+        if (it == m_names.end())
+            return INVALID_HANDLE;
+        return it->second;
+    }
+
+    T &operator[](uint32_t handle)
+    {
+        return m_assets[handle];
+    }
+
+    size_t size()
+    {
+        return m_assets.size();
+    }
+
+    void clear()
+    {
+        m_assets.clear();
+        m_names.clear();
+    }
+
+private:
+    std::vector<T> m_assets;
+    std::unordered_map<std::string, uint32_t> m_names;
+};
+
+class Scene
+{
+public:
+    Scene();
+
+    HimmeliId add(const Himmeli &himmeli);
+    void remove(HimmeliId id);
+    bool valid(HimmeliId id);
+    uint32_t index(HimmeliId id);
+    void clear();
+
+    void setMesh(HimmeliId id, MeshHandle mesh);
+    void setMaterial(HimmeliId id, MaterialHandle material);
+    // Must be called after moving a Himmeli through the component arrays.
+    // Dynamic Himmelit belong to the simulation, which only picks up the
+    // new transform from here and overwrites it otherwise.
+    void moved(HimmeliId id);
+
+    size_t size();
+    uint64_t version();
+    // Bumped whenever static Himmelit are added, removed, changed or moved
+    uint64_t staticVersion();
+    // Bumped whenever any Himmeli is moved
+    uint64_t transformVersion();
+
+    // Dense component arrays, all indexed by the same dense index.
+    // The dense order changes on remove() so don't hold on to indices.
+    std::vector<glm::vec3> &positions();
+    std::vector<glm::quat> &rotations();
+    std::vector<glm::vec3> &scales();
+    std::vector<MeshHandle> &meshes();
+    std::vector<MaterialHandle> &materials();
+    std::vector<uint8_t> &statics();
+    std::vector<HimmeliId> &ids();
+
+private:
+    void releaseSlot(uint32_t slot);
+
+    std::vector<glm::vec3> m_positions;
+    std::vector<glm::quat> m_rotations;
+    std::vector<glm::vec3> m_scales;
+    std::vector<MeshHandle> m_meshes;
+    std::vector<MaterialHandle> m_materials;
+    std::vector<uint8_t> m_statics;
+    std::vector<HimmeliId> m_ids;
+
+    std::vector<uint32_t> m_slots;
+    std::vector<uint32_t> m_generations;
+    std::vector<uint32_t> m_freeSlots;
+
+    uint64_t m_version;
+    uint64_t m_staticVersion;
+    uint64_t m_transformVersion;
+};
@@ -0,0 +1,222 @@
+#include "scenefile.hh"
+
+#include "archive.hh"
+#include "utils.hh"
+
+#include "glm/glm.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <optional>
+#include <random>
+#include <span>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#define STRESS_SPACING 3.0f
+#define STRESS_LIGHT_RADIUS (2.5f * STRESS_SPACING)
+#define DEFAULT_LIGHT_RADIUS 5.0f
+
+static const char *BUNDLED_ASSETS[] = { "cone", "cube", "cylinder", "icosphere",
+                                        "plane", "sphere", "suzanne", "torus" };
+
+// Trailing fields may be left out, but one that is there has to parse in
+// full so that a typo isn't silently replaced by the default
+static bool moreFields(std::istringstream &line)
+{
+    return !(line >> std::ws).eof();
+}
+
+static bool readFloat(std::istringstream &line, float &value)
+{
+    return !moreFields(line) || static_cast<bool>(line >> value);
+}
+
+static bool readVec3(std::istringstream &line, glm::vec3 &value)
+{
+    if (!moreFields(line))
+        return true;
+
+    glm::vec3 v;
+    if (!(line >> v.x >> v.y >> v.z))
+        return false;
+    value = v;
+    return true;
+}
+
+SceneFile::SceneFile(const std::string_view filename)
+{
+    // Files on disk win over packed ones so that scenes can be tried out
+    // without repacking
+    bool loose = std::filesystem::exists(filename);
+    std::optional<std::span<const uint8_t>> packed = loose ? std::nullopt : findAsset(filename);
+
+    AssetStream packedFile(packed.value_or(std::span<const uint8_t>{}));
+    std::ifstream looseFile;
+    if (!packed)
+        looseFile.open(loose ? Path(filename) : getAssetPath(filename));
+
+    std::istream &file = packed ? static_cast<std::istream &>(packedFile) : looseFile;
+    if (!file) {
+        throw std::runtime_error("Failed to open scene: " + std::string(filename));
+    }
+
+    std::string text;
+    int lineNumber = 0;
+
+    while (std::getline(file, text)) {
+        ++lineNumber;
+
+        size_t comment = text.find('#');
+        if (comment != std::string::npos)
+            text.resize(comment);
+
+        std::istringstream line(text);
+        std::string keyword;
+        if (!(line >> keyword))
+            continue;
+
+        bool ok = true;
+
+        if (keyword == "mesh") {
+            MeshEntry mesh;
+            ok = static_cast<bool>(line >> mesh.name >> mesh.file);
+            meshes.push_back(mesh);
+        } else if (keyword == "texture") {
+            TextureEntry texture;
+            ok = static_cast<bool>(line >> texture.name >> texture.file);
+            textures.push_back(texture);
+        } else if (keyword == "material") {
+            MaterialEntry material;
+            ok = static_cast<bool>(line >> material.name >> material.texture);
+            std::string flag;
+            while (ok && line >> flag) {
+                if (flag == "cull")
+                    material.cull = true;
+                else if (flag == "blend")
+                    material.blend = true;
+                else
+                    ok = false;
+            }
+            materials.push_back(material);
+        } else if (keyword == "himmeli" || keyword == "static") {
+            HimmeliEntry himmeli {
+                .position = glm::vec3{ 0.0f },
+                .rotation = glm::vec3{ 0.0f },
+                .scale = glm::vec3{ 1.0f },
+                .isStatic = keyword == "static"
+            };
+            ok = line >> himmeli.mesh >> himmeli.material &&
+                 readVec3(line, himmeli.position) &&
+                 readVec3(line, himmeli.rotation) &&
+                 readVec3(line, himmeli.scale);
+            himmelit.push_back(himmeli);
+        } else if (keyword == "camera") {
+            ok = readVec3(line, camera.position) &&
+                 readVec3(line, camera.target) &&
+                 readFloat(line, camera.fov) &&
+                 readFloat(line, camera.nearPlane) &&
+                 readFloat(line, camera.farPlane);
+        } else if (keyword == "light") {
+            ok = readVec3(line, light.position) &&
+                 readVec3(line, light.color);
+        } else if (keyword == "pointlight") {
+            PointLightEntry pointLight {
+                .position = glm::vec3{ 0.0f },
+                .color = glm::vec3{ 1.0f },
+                .radius = DEFAULT_LIGHT_RADIUS
+            };
+            ok = readVec3(line, pointLight.position) &&
+                 readVec3(line, pointLight.color) &&
+                 readFloat(line, pointLight.radius);
+            pointLights.push_back(pointLight);
+        } else {
+            fprintf(stderr, "Scene %.*s:%d: unknown keyword %s\n", static_cast<int>(filename.size()), filename.data(), lineNumber, keyword.c_str());
+            continue;
+        }
+
+        // Anything left over is a field too many or a misplaced one
+        if (ok && moreFields(line))
+            ok = false;
+
+        if (!ok) {
+            throw std::runtime_error("Scene " + std::string(filename) + ":" + std::to_string(lineNumber) + ": malformed " + keyword + " line");
+        }
+    }
+
+    fprintf(stderr, "Scene %.*s loaded\n", static_cast<int>(filename.size()), filename.data());
+}
+
+SceneFile SceneFile::stress(glm::uvec3 grid, uint32_t seed, uint32_t lights, float staticFraction)
+{
+    SceneFile scene;
+
+    for (const char *asset : BUNDLED_ASSETS) {
+        std::string name(asset);
+        scene.meshes.push_back({ name, name + ".obj" });
+        scene.textures.push_back({ name + "_diffuse", name + "_uv.png" });
+        scene.materials.push_back({ name + "_material", name + "_diffuse" });
+    }
+
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<size_t> assetDist(0, std::size(BUNDLED_ASSETS) - 1);
+    std::uniform_real_distribution<float> angleDist(0.0f, 360.0f);
+    std::uniform_real_distribution<float> scaleDist(0.5f, 1.0f);
+
+    glm::vec3 extent = glm::vec3(grid) * STRESS_SPACING;
+    glm::vec3 origin = -0.5f * (glm::vec3(grid) - 1.0f) * STRESS_SPACING;
+
+    scene.himmelit.reserve(static_cast<size_t>(grid.x) * grid.y * grid.z);
+
+    for (uint32_t x = 0; x < grid.x; ++x) {
+        for (uint32_t y = 0; y < grid.y; ++y) {
+            for (uint32_t z = 0; z < grid.z; ++z) {
+                // Statics are spread evenly without drawing from the random
+                // stream, so the rest of the scene is the same for any fraction
+                uint64_t index = scene.himmelit.size();
+                bool isStatic = static_cast<uint64_t>(static_cast<double>(index + 1) * staticFraction) !=
+                                static_cast<uint64_t>(static_cast<double>(index) * staticFraction);
+
+                std::string name(BUNDLED_ASSETS[assetDist(rng)]);
+                HimmeliEntry himmeli {
+                    .mesh = name,
+                    .material = name + "_material",
+                    .position = origin + glm::vec3{ x, y, z } * STRESS_SPACING,
+                    .rotation = { 0.0f, angleDist(rng), 0.0f },
+                    .scale = glm::vec3{ scaleDist(rng) },
+                    .isStatic = isStatic
+                };
+                scene.himmelit.push_back(himmeli);
+            }
+        }
+    }
+
+    // Lights fill the same box as the Himmelit
+    std::uniform_real_distribution<float> unitDist(0.0f, 1.0f);
+    std::uniform_real_distribution<float> colorDist(0.2f, 1.0f);
+    scene.pointLights.reserve(lights);
+
+    for (uint32_t i = 0; i < lights; ++i) {
+        PointLightEntry pointLight {
+            .position = origin - 0.5f * STRESS_SPACING + glm::vec3{ unitDist(rng), unitDist(rng), unitDist(rng) } * extent,
+            .color = { colorDist(rng), colorDist(rng), colorDist(rng) },
+            .radius = STRESS_LIGHT_RADIUS
+        };
+        scene.pointLights.push_back(pointLight);
+    }
+
+    float distance = glm::length(extent);
+    scene.camera.position = { 0.0f, 0.5f * extent.y + 0.35f * distance, 0.6f * distance };
+    scene.camera.farPlane = std::max(scene.camera.farPlane, 2.0f * distance);
+    scene.light.position = { 0.0f, extent.y + distance, 0.0f };
+
+    fprintf(stderr, "Generated stress scene with %ux%ux%u Himmelit and %u point lights\n", grid.x, grid.y, grid.z, lights);
+
+    return scene;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "glm/glm.hpp"
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Line based scene description in the spirit of .obj/.mtl, see
+// assets/default.scene for the syntax. Asset paths are relative to the
+// asset directory.
+struct SceneFile
+{
+    struct MeshEntry {
+        std::string name;
+        std::string file;
+    };
+
+    struct TextureEntry {
+        std::string name;
+        std::string file;
+    };
+
+    struct MaterialEntry {
+        std::string name;
+        std::string texture;
+        bool cull = false;
+        bool blend = false;
+    };
+
+    struct HimmeliEntry {
+        std::string mesh;
+        std::string material;
+        glm::vec3 position;
+        glm::vec3 rotation;
+        glm::vec3 scale;
+        bool isStatic = false;
+    };
+
+    struct CameraEntry {
+        glm::vec3 position = { 0.0f, 0.0f, 5.0f };
+        glm::vec3 target = { 0.0f, 0.0f, 0.0f };
+        float fov = 70.0f;
+        float nearPlane = 0.1f;
+        float farPlane = 200.0f;
+    };
+
+    struct LightEntry {
+        glm::vec3 position = { -1.0f, 1.0f, 5.0f };
+        glm::vec3 color = { 1.0f, 1.0f, 1.0f };
+    };
+
+    struct PointLightEntry {
+        glm::vec3 position;
+        glm::vec3 color;
+        float radius;
+    };
+
+    SceneFile() = default;
+    SceneFile(const std::string_view filename);
+    // A grid of random bundled assets, staticFraction of them static
+    static SceneFile stress(glm::uvec3 grid, uint32_t seed, uint32_t lights, float staticFraction = 0.0f);
+
+    std::vector<MeshEntry> meshes;
+    std::vector<TextureEntry> textures;
+    std::vector<MaterialEntry> materials;
+    std::vector<HimmeliEntry> himmelit;
+    CameraEntry camera;
+    LightEntry light;
+    std::vector<PointLightEntry> pointLights;
+};
@@ -0,0 +1,233 @@
+#include "shaderwatch.hh"
+
+#include "utils.hh"
+
+#include "vulkan/vulkan.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <filesystem>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#ifndef VKLELU_GLSLC
+#define VKLELU_GLSLC "glslc"
+#endif
+
+ShaderWatcher::ShaderWatcher(VkDevice device, const Path &sourceDir, const Path &spirvDir):
+    m_device(device),
+    m_sourceDir(sourceDir),
+    m_spirvDir(spirvDir),
+    m_running(false)
+{
+#ifdef __linux__
+    m_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (m_inotify < 0)
+        throw std::runtime_error("Failed to initialize inotify");
+
+    // Compilers and editors may replace the file instead of writing to it
+    uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO;
+    m_sourceWatch = inotify_add_watch(m_inotify, cpath(m_sourceDir), mask);
+    m_spirvWatch = inotify_add_watch(m_inotify, cpath(m_spirvDir), mask);
+
+    if (m_sourceWatch < 0)
+        fprintf(stderr, "Can't watch shader sources in %s, only SPIR-V changes reload\n", cpath(m_sourceDir));
+    if (m_spirvWatch < 0) {
+        close(m_inotify);
+        throw std::runtime_error("Failed to watch shader directory " + m_spirvDir.string());
+    }
+#endif
+}
+
+ShaderWatcher::~ShaderWatcher()
+{
+    m_running = false;
+    if (m_thread.joinable())
+        m_thread.join();
+
+    for (const Reload &reload : m_reloaded)
+        vkDestroyPipeline(m_device, reload.pipeline, nullptr);
+
+#ifdef __linux__
+    close(m_inotify);
+#endif
+}
+
+void ShaderWatcher::addPipeline(VkPipeline *slot, std::vector<std::string> shaders, BuildFunction &&build)
+{
+    // Material permutations keep coming in after start()
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_pipelines.push_back({ slot, std::move(shaders), std::move(build) });
+}
+
+void ShaderWatcher::start()
+{
+#ifndef __linux__
+    // The first scan only records the current write times
+    std::set<std::string> sources;
+    std::set<std::string> spirv;
+    waitForChanges(sources, spirv);
+#endif
+
+    m_running = true;
+    m_thread = std::thread(&ShaderWatcher::run, this);
+
+    fprintf(stderr, "Watching %s and %s for shader changes\n", cpath(m_sourceDir), cpath(m_spirvDir));
+}
+
+std::vector<ShaderWatcher::Reload> ShaderWatcher::takeReloaded()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::vector<Reload> reloaded;
+    reloaded.swap(m_reloaded);
+    return reloaded;
+}
+
+void ShaderWatcher::run()
+{
+    while (m_running) {
+        std::set<std::string> sources;
+        std::set<std::string> spirv;
+        waitForChanges(sources, spirv);
+
+        // Writing the SPIR-V shows up as a change of its own on the next
+        // round, that is where the pipelines get rebuilt
+        for (const std::string &source : sources)
+            compile(source);
+
+        if (!spirv.empty())
+            rebuild(spirv);
+    }
+}
+
+#ifdef __linux__
+void ShaderWatcher::waitForChanges(std::set<std::string> &sources, std::set<std::string> &spirv)
+{
+    pollfd pfd {
+        .fd = m_inotify,
+        .events = POLLIN
+    };
+
+    int timeout = SHADER_WATCH_INTERVAL_MS;
+    while (poll(&pfd, 1, timeout) > 0) {
+        alignas(inotify_event) char buffer[4096];
+        ssize_t length;
+        while ((length = read(m_inotify, buffer, sizeof(buffer))) > 0) {
+            for (char *p = buffer; p < buffer + length;) {
+                const inotify_event *event = reinterpret_cast<const inotify_event *>(p);
+                if (event->len) {
+                    if (event->wd == m_sourceWatch)
+                        sources.insert(event->name);
+                    else if (event->wd == m_spirvWatch)
+                        spirv.insert(event->name);
+                }
+                p += sizeof(inotify_event) + event->len;
+            }
+        }
+
+        timeout = SHADER_WATCH_SETTLE_MS;
+    }
+}
+#else
+void ShaderWatcher::waitForChanges(std::set<std::string> &sources, std::set<std::string> &spirv)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(SHADER_WATCH_INTERVAL_MS));
+
+    auto scan = [&](const Path &dir, std::set<std::string> &changed) {
+        std::error_code error;
+        for (const auto &entry : std::filesystem::directory_iterator(dir, error)) {
+            if (!entry.is_regular_file(error))
+                continue;
+
+            std::filesystem::file_time_type writeTime = entry.last_write_time(error);
+            auto [it, inserted] = m_writeTimes.try_emplace(entry.path().string(), writeTime);
+            if (!inserted && it->second != writeTime) {
+                it->second = writeTime;
+                changed.insert(entry.path().filename().string());
+            }
+        }
+    };
+
+    scan(m_sourceDir, sources);
+    scan(m_spirvDir, spirv);
+}
+#endif
+
+void ShaderWatcher::compile(const std::string &source)
+{
+    std::vector<std::string> targets;
+
+    // Shader stages compile to <name>.spv, anything else is assumed to be
+    // an include and recompiles every stage
+    Path sourcePath = m_sourceDir / source;
+    if (std::filesystem::exists(m_spirvDir / (source + ".spv"))) {
+        targets.push_back(source);
+    } else if (sourcePath.extension() == ".glsl" || sourcePath.extension() == ".h") {
+        std::error_code error;
+        for (const auto &entry : std::filesystem::directory_iterator(m_sourceDir, error)) {
+            std::string name = entry.path().filename().string();
+            if (std::filesystem::exists(m_spirvDir / (name + ".spv")))
+                targets.push_back(name);
+        }
+    }
+
+    for (const std::string &target : targets) {
+        Path input = m_sourceDir / target;
+        Path output = m_spirvDir / (target + ".spv");
+        std::string command = std::string("\"") + VKLELU_GLSLC + "\" --target-env=vulkan1.3 \""
+                            + input.string() + "\" -o \"" + output.string() + "\"";
+
+        // glslc reports the errors itself, the old SPIR-V stays in place
+        if (std::system(command.c_str()) != 0)
+            fprintf(stderr, "Shader %s failed to compile\n", target.c_str());
+        else
+            fprintf(stderr, "Shader %s recompiled\n", target.c_str());
+    }
+}
+
+void ShaderWatcher::rebuild(const std::set<std::string> &spirv)
+{
+    std::vector<Watched> pipelines;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        pipelines = m_pipelines;
+    }
+
+    for (const Watched &watched : pipelines) {
+        bool affected = false;
+        for (const std::string &shader : watched.shaders)
+            affected |= spirv.count(shader) > 0;
+
+        if (!affected)
+            continue;
+
+        // A broken shader keeps the previous pipeline running
+        VkPipeline pipeline = VK_NULL_HANDLE;
+        try {
+            pipeline = watched.build();
+        } catch (const std::exception &e) {
+            fprintf(stderr, "Pipeline rebuild failed: %s\n", e.what());
+        }
+
+        if (!pipeline)
+            continue;
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_reloaded.push_back({ watched.slot, pipeline });
+    }
+
+    for (const std::string &shader : spirv)
+        fprintf(stderr, "Shader %s reloaded\n", shader.c_str());
+}
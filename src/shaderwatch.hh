@@ -0,0 +1,73 @@
+#pragma once
+
+#include "utils.hh"
+
+#include "vulkan/vulkan.h"
+
+#include <atomic>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#define SHADER_WATCH_INTERVAL_MS 100
+// Editors save in several steps, collect them into one rebuild
+#define SHADER_WATCH_SETTLE_MS 50
+
+// Watches the GLSL sources and the SPIR-V directory on a thread of its own.
+// Edited sources are recompiled with glslc and every pipeline using changed
+// SPIR-V is rebuilt on the same thread. The render loop swaps the results in
+// with takeReloaded() at a frame boundary and retires the old pipelines.
+class ShaderWatcher
+{
+public:
+    using BuildFunction = std::function<VkPipeline()>;
+
+    struct Reload {
+        VkPipeline *slot;
+        VkPipeline pipeline;
+    };
+
+    ShaderWatcher(VkDevice device, const Path &sourceDir, const Path &spirvDir);
+    ~ShaderWatcher();
+    ShaderWatcher(const ShaderWatcher &) = delete;
+    ShaderWatcher &operator=(const ShaderWatcher &) = delete;
+
+    void addPipeline(VkPipeline *slot, std::vector<std::string> shaders, BuildFunction &&build);
+    void start();
+    std::vector<Reload> takeReloaded();
+
+private:
+    struct Watched {
+        VkPipeline *slot;
+        std::vector<std::string> shaders;
+        BuildFunction build;
+    };
+
+    void run();
+    void waitForChanges(std::set<std::string> &sources, std::set<std::string> &spirv);
+    void compile(const std::string &source);
+    void rebuild(const std::set<std::string> &spirv);
+
+    VkDevice m_device;
+    Path m_sourceDir;
+    Path m_spirvDir;
+    std::vector<Watched> m_pipelines;
+
+    std::thread m_thread;
+    std::atomic<bool> m_running;
+    std::mutex m_mutex;
+    std::vector<Reload> m_reloaded;
+
+#ifdef __linux__
+    int m_inotify;
+    int m_sourceWatch;
+    int m_spirvWatch;
+#else
+    std::unordered_map<std::string, std::filesystem::file_time_type> m_writeTimes;
+#endif
+};
@@ -0,0 +1,101 @@
+#include "simulation.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+Simulation::Simulation(SimSnapshot &&initial, uint32_t rate, Step &&step):
+    m_tick(std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / rate))),
+    m_tickSeconds(1.0 / rate),
+    m_step(std::move(step)),
+    m_running(false),
+    m_stepNs(0)
+{
+    // Both start out as the initial state so that sample() works right away
+    m_latest = std::make_shared<const SimSnapshot>(std::move(initial));
+    m_previous = m_latest;
+}
+
+Simulation::~Simulation()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_running = false;
+    }
+    m_wake.notify_all();
+
+    if (m_thread.joinable())
+        m_thread.join();
+}
+
+void Simulation::start()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_start = Clock::now() - m_latest->tick * m_tick;
+    m_running = true;
+    m_thread = std::thread(&Simulation::run, this);
+}
+
+SimFrame Simulation::sample()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    // One tick behind real time the latest two snapshots bracket the frame
+    // as long as the simulation keeps up
+    double renderTime = std::chrono::duration<double>(Clock::now() - m_start).count() - m_tickSeconds;
+    float alpha = 1.0f;
+    if (m_latest->tick != m_previous->tick)
+        alpha = static_cast<float>(std::clamp((renderTime - m_previous->time) / (m_latest->time - m_previous->time), 0.0, 1.0));
+
+    return SimFrame {
+        .previous = m_previous,
+        .latest = m_latest,
+        .alpha = alpha
+    };
+}
+
+uint64_t Simulation::stepNs()
+{
+    return m_stepNs;
+}
+
+void Simulation::run()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    while (m_running) {
+        Clock::time_point due = m_start + static_cast<Clock::rep>(m_latest->tick + 1) * m_tick;
+
+        Clock::time_point now = Clock::now();
+        if (now - due > SIM_MAX_LAG_TICKS * m_tick) {
+            fprintf(stderr, "Simulation fell %.1f ms behind, skipping ahead\n",
+                    std::chrono::duration<double, std::milli>(now - due).count());
+            m_start += now - due;
+            due = now;
+        }
+
+        if (m_wake.wait_until(lock, due, [this]() { return !m_running; }))
+            break;
+
+        // The step runs unlocked on its own copy, the renderer keeps
+        // sampling the published ones meanwhile
+        std::shared_ptr<const SimSnapshot> base = m_latest;
+        lock.unlock();
+
+        Clock::time_point stepStart = Clock::now();
+        std::shared_ptr<SimSnapshot> next = std::make_shared<SimSnapshot>(*base);
+        ++next->tick;
+        next->time = static_cast<double>(next->tick) * m_tickSeconds;
+        m_step(*next);
+        m_stepNs = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - stepStart).count());
+
+        lock.lock();
+        m_previous = std::move(base);
+        m_latest = std::move(next);
+    }
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "glm/glm.hpp"
+#include "glm/gtc/quaternion.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A step that takes longer than this many ticks to catch up with drops the
+// time instead of spiralling
+#define SIM_MAX_LAG_TICKS 4
+
+// State of the world at one tick, in the dense order of the Scene it was
+// taken from. Never modified once published.
+struct SimSnapshot {
+    uint64_t tick = 0;
+    // Simulated seconds since the start, tick times the tick length
+    double time = 0.0;
+    std::vector<glm::vec3> positions;
+    std::vector<glm::quat> rotations;
+    std::vector<glm::vec3> scales;
+    std::vector<glm::vec3> pointLights;
+};
+
+// The two latest snapshots and how far between them the frame being
+// rendered is
+struct SimFrame {
+    std::shared_ptr<const SimSnapshot> previous;
+    std::shared_ptr<const SimSnapshot> latest;
+    float alpha;
+};
+
+// Advances the world at a fixed rate on a thread of its own. Each step gets
+// a copy of the latest snapshot with the tick and time already advanced.
+// The renderer samples one tick behind real time and interpolates, so the
+// next tick is simulated while the current frame is recorded.
+class Simulation
+{
+public:
+    using Step = std::function<void(SimSnapshot &snapshot)>;
+
+    Simulation(SimSnapshot &&initial, uint32_t rate, Step &&step);
+    ~Simulation();
+    Simulation(const Simulation &) = delete;
+    Simulation &operator=(const Simulation &) = delete;
+
+    void start();
+    SimFrame sample();
+
+    uint64_t stepNs();
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    void run();
+
+    Clock::duration m_tick;
+    double m_tickSeconds;
+    Step m_step;
+
+    std::thread m_thread;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    bool m_running;
+    Clock::time_point m_start;
+    std::shared_ptr<const SimSnapshot> m_previous;
+    std::shared_ptr<const SimSnapshot> m_latest;
+
+    std::atomic<uint64_t> m_stepNs;
+};
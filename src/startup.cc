@@ -0,0 +1,181 @@
+#include "startup.hh"
+
+#include <algorithm>
+#include <cstdio>
+#include <stdexcept>
+
+StartupGraph::StartupGraph() :
+    m_created(Clock::now()),
+    m_stopping(false)
+{
+}
+
+StartupGraph::~StartupGraph()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_queued.notify_all();
+
+    for (std::thread &thread : m_threads) {
+        if (thread.joinable())
+            thread.join();
+    }
+}
+
+StartupTask StartupGraph::worker(const std::string &name, std::vector<StartupTask> dependencies, std::function<void()> &&work)
+{
+    return add(name, std::move(dependencies), std::move(work), false);
+}
+
+StartupTask StartupGraph::main(const std::string &name, std::vector<StartupTask> dependencies, std::function<void()> &&work)
+{
+    return add(name, std::move(dependencies), std::move(work), true);
+}
+
+StartupTask StartupGraph::add(const std::string &name, std::vector<StartupTask> &&dependencies, std::function<void()> &&work, bool main)
+{
+    StartupTask task = static_cast<StartupTask>(m_tasks.size());
+    for (StartupTask dependency : dependencies) {
+        if (dependency >= task)
+            throw std::runtime_error("Startup task " + name + " depends on a task added after it");
+    }
+
+    m_tasks.push_back(Task {
+        .name = name,
+        .dependencies = std::move(dependencies),
+        .work = std::move(work),
+        .main = main
+    });
+
+    return task;
+}
+
+bool StartupGraph::ready(const Task &task)
+{
+    return std::all_of(task.dependencies.begin(), task.dependencies.end(), [this](StartupTask dependency) {
+        return m_tasks[dependency].state == TaskState::Done;
+    });
+}
+
+void StartupGraph::run()
+{
+    size_t workers = static_cast<size_t>(std::count_if(m_tasks.begin(), m_tasks.end(), [](const Task &task) {
+        return !task.main;
+    }));
+    workers = std::min<size_t>(workers, std::max(1u, std::thread::hardware_concurrency()));
+    m_stopping = false;
+    for (size_t i = 0; i < workers; ++i)
+        m_threads.emplace_back(&StartupGraph::workerLoop, this);
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    while (true) {
+        bool unfinished = false;
+        bool ranMain = false;
+
+        for (StartupTask i = 0; i < m_tasks.size(); ++i) {
+            Task &task = m_tasks[i];
+            if (task.state == TaskState::Waiting && m_error)
+                task.state = TaskState::Skipped;
+            if (task.state == TaskState::Waiting || task.state == TaskState::Running)
+                unfinished = true;
+            if (task.state != TaskState::Waiting || !ready(task))
+                continue;
+
+            task.state = TaskState::Running;
+            if (!task.main) {
+                m_queue.push_back(i);
+                m_queued.notify_one();
+                continue;
+            }
+
+            // Start over afterwards, whatever finished meanwhile may have
+            // made earlier tasks ready
+            lock.unlock();
+            execute(i);
+            lock.lock();
+            ranMain = true;
+            break;
+        }
+
+        if (!unfinished)
+            break;
+        if (!ranMain)
+            m_changed.wait(lock);
+    }
+
+    // Everything has finished, the pool is idle
+    m_stopping = true;
+    lock.unlock();
+    m_queued.notify_all();
+    for (std::thread &thread : m_threads)
+        thread.join();
+    m_threads.clear();
+
+    if (m_error)
+        std::rethrow_exception(m_error);
+}
+
+void StartupGraph::execute(StartupTask i)
+{
+    Task &task = m_tasks[i];
+    Clock::time_point start = Clock::now();
+
+    std::exception_ptr error;
+    try {
+        task.work();
+    } catch (...) {
+        error = std::current_exception();
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    task.start = start;
+    task.end = Clock::now();
+    task.state = TaskState::Done;
+    if (error && !m_error)
+        m_error = error;
+    m_changed.notify_all();
+}
+
+void StartupGraph::workerLoop()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    while (true) {
+        m_queued.wait(lock, [this]() { return m_stopping || !m_queue.empty(); });
+        if (m_queue.empty())
+            break;
+
+        StartupTask i = m_queue.front();
+        m_queue.pop_front();
+
+        lock.unlock();
+        execute(i);
+        lock.lock();
+    }
+}
+
+void StartupGraph::printTimeline()
+{
+    auto ms = [this](Clock::time_point time) {
+        return std::chrono::duration<double, std::milli>(time - m_created).count();
+    };
+
+    Clock::time_point end = m_created;
+    Clock::duration busy{};
+
+    fprintf(stderr, "Startup timeline:\n");
+    for (Task &task : m_tasks) {
+        if (task.state != TaskState::Done)
+            continue;
+
+        fprintf(stderr, "\t%8.1f -%8.1f ms\t%-6s\t%s\n", ms(task.start), ms(task.end), task.main ? "main" : "worker", task.name.c_str());
+        end = std::max(end, task.end);
+        busy += task.end - task.start;
+    }
+
+    fprintf(stderr, "Startup took %.1f ms for %.1f ms of work\n",
+            ms(end), std::chrono::duration<double, std::milli>(busy).count());
+}
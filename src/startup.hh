@@ -0,0 +1,74 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using StartupTask = uint32_t;
+
+// Startup work as a graph of tasks that may only depend on tasks added
+// before them. Worker tasks go to a pool of at most one thread per
+// hardware thread as soon as their dependencies are done, in the order
+// they became ready. Main tasks run in the order they were added on
+// the thread that calls run(), window and swapchain setup has to stay
+// there. After a failure nothing new is started and the first exception
+// is rethrown from run() once the running tasks have finished.
+class StartupGraph
+{
+public:
+    StartupGraph();
+    ~StartupGraph();
+    StartupGraph(const StartupGraph &) = delete;
+    StartupGraph &operator=(const StartupGraph &) = delete;
+
+    StartupTask worker(const std::string &name, std::vector<StartupTask> dependencies, std::function<void()> &&work);
+    StartupTask main(const std::string &name, std::vector<StartupTask> dependencies, std::function<void()> &&work);
+
+    void run();
+
+    // When each task ran, relative to the creation of the graph
+    void printTimeline();
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    enum class TaskState {
+        Waiting,
+        Running,
+        Done,
+        Skipped
+    };
+
+    struct Task {
+        std::string name;
+        std::vector<StartupTask> dependencies;
+        std::function<void()> work;
+        bool main;
+        TaskState state = TaskState::Waiting;
+        Clock::time_point start;
+        Clock::time_point end;
+    };
+
+    StartupTask add(const std::string &name, std::vector<StartupTask> &&dependencies, std::function<void()> &&work, bool main);
+    bool ready(const Task &task);
+    void execute(StartupTask task);
+    void workerLoop();
+
+    Clock::time_point m_created;
+    std::vector<Task> m_tasks;
+    std::vector<std::thread> m_threads;
+    // Ready worker tasks not yet picked up by the pool
+    std::deque<StartupTask> m_queue;
+    bool m_stopping;
+    std::mutex m_mutex;
+    std::condition_variable m_changed;
+    std::condition_variable m_queued;
+    std::exception_ptr m_error;
+};
@@ -0,0 +1,501 @@
+#include "context.hh"
+#include "himmeli.hh"
+#include "memory.hh"
+#include "upload.hh"
+#include "utils.hh"
+
+#include "glm/glm.hpp"
+#include "glm/gtc/matrix_transform.hpp"
+#include "SDL3/SDL.h"
+#include "stb_image_write.h"
+#include "vulkan/vulkan.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#define DEFAULT_THUMBNAIL_SIZE 256
+#define MAX_THUMBNAIL_LAYERS 32
+#define THUMBNAIL_FOV 40.0f
+#define THUMBNAIL_FORMAT VK_FORMAT_R8G8B8A8_SRGB
+#define THUMBNAIL_DEPTH_FORMAT VK_FORMAT_D32_SFLOAT
+
+struct ThumbnailOptions {
+    Path assets = assetdir();
+    Path output = "thumbnails";
+    uint32_t size = DEFAULT_THUMBNAIL_SIZE;
+    uint32_t repeat = 1;
+};
+
+struct ThumbnailAsset {
+    std::string name;
+    Mesh mesh;
+    Texture texture;
+    VkDescriptorSet textureSet;
+    // Fits the bounding sphere into the unit sphere at the origin
+    glm::mat4 model;
+};
+
+struct ThumbnailConstants {
+    glm::mat4 viewProj;
+    glm::mat4 model;
+};
+
+static ThumbnailOptions parseOptions(int argc, char *argv[])
+{
+    ThumbnailOptions options;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        bool hasValue = i + 1 < argc;
+
+        if (arg == "--output" && hasValue) {
+            options.output = argv[++i];
+        } else if (arg == "--size" && hasValue) {
+            options.size = static_cast<uint32_t>(std::max(1ul, strtoul(argv[++i], nullptr, 10)));
+        } else if (arg == "--repeat" && hasValue) {
+            options.repeat = static_cast<uint32_t>(std::max(1ul, strtoul(argv[++i], nullptr, 10)));
+        } else if (arg.starts_with("--")) {
+            throw std::runtime_error("Unknown argument: " + arg + "\n"
+                                     "Usage: vklelu_thumbnails [asset directory] [--output dir] [--size N] [--repeat N]");
+        } else {
+            options.assets = arg;
+        }
+    }
+
+    return options;
+}
+
+static std::vector<ThumbnailAsset> loadAssets(VulkanContext &ctx, Uploader &uploader, const Path &assetDirectory)
+{
+    // Absolute paths pass through getAssetPath untouched
+    Path directory = std::filesystem::absolute(assetDirectory);
+
+    std::vector<std::string> names;
+    for (const std::filesystem::directory_entry &entry : std::filesystem::directory_iterator(directory)) {
+        if (entry.path().extension() == ".obj")
+            names.push_back(entry.path().stem().string());
+    }
+    std::sort(names.begin(), names.end());
+
+    std::vector<ThumbnailAsset> assets(names.size());
+
+    for (size_t i = 0; i < names.size(); ++i) {
+        ThumbnailAsset &asset = assets[i];
+        asset.name = names[i];
+
+        ObjFile obj((directory / (asset.name + ".obj")).string());
+
+        size_t vertexBufferSize = obj.vertices.size() * sizeof(Vertex);
+        size_t indexBufferSize = obj.indices.size() * sizeof(uint32_t);
+        asset.mesh.vertexBuffer = ctx.allocateBuffer(vertexBufferSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+        asset.mesh.indexBuffer = ctx.allocateBuffer(indexBufferSize, VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+        asset.mesh.numVertices = static_cast<unsigned int>(obj.vertices.size());
+        asset.mesh.numIndices = static_cast<unsigned int>(obj.indices.size());
+        asset.mesh.boundingSphere = obj.boundingSphere();
+        uploader.uploadBuffer(obj.vertices.data(), vertexBufferSize, asset.mesh.vertexBuffer->buffer());
+        uploader.uploadBuffer(obj.indices.data(), indexBufferSize, asset.mesh.indexBuffer->buffer());
+
+        glm::vec4 sphere = asset.mesh.boundingSphere;
+        float radius = std::max(sphere.w, 1e-4f);
+        asset.model = glm::scale(glm::mat4{ 1.0f }, glm::vec3{ 1.0f / radius }) * glm::translate(glm::mat4{ 1.0f }, -glm::vec3{ sphere });
+
+        // Models are paired with a <name>_uv.png texture, untextured ones get the blank one
+        Path texturePath = directory / (asset.name + "_uv.png");
+        if (!std::filesystem::exists(texturePath))
+            texturePath = std::filesystem::absolute(getAssetPath("none.png"));
+
+        ImageFile image(texturePath.string());
+
+        VkExtent3D imageExtent {
+            .width = static_cast<uint32_t>(image.width),
+            .height = static_cast<uint32_t>(image.height),
+            .depth = 1
+        };
+
+        asset.texture.image = ctx.allocateImage(imageExtent, VK_FORMAT_R8G8B8A8_SRGB, VK_SAMPLE_COUNT_1_BIT, VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+        uploader.uploadImage(image.pixels, asset.texture.image->image(), imageExtent, 4);
+        asset.texture.imageView = asset.texture.image->createImageView(VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_ASPECT_COLOR_BIT);
+    }
+
+    uploader.flush();
+
+    return assets;
+}
+
+static int thumbnailMain(int argc, char *argv[])
+{
+    ThumbnailOptions options = parseOptions(argc, argv);
+
+    VulkanContext ctx(0, 0, true);
+    if (!ctx.outputLayerSupported()) {
+        throw std::runtime_error("Layered thumbnail rendering needs shaderOutputLayer, the device has no support for it");
+    }
+
+    VkDevice device = ctx.device();
+    Uploader uploader(ctx, STAGING_BUFFER_SIZE);
+
+    uint64_t loadStart = SDL_GetTicksNS();
+    std::vector<ThumbnailAsset> assets = loadAssets(ctx, uploader, options.assets);
+    if (assets.empty()) {
+        throw std::runtime_error("No models found in " + options.assets.string());
+    }
+
+    fprintf(stderr, "Loaded %zu models in %.1f ms\n", assets.size(), static_cast<double>(SDL_GetTicksNS() - loadStart) / 1e6);
+
+    // Every layer of a batch is rendered in a single layered pass, each
+    // model is drawn once into the layer its instance index names
+    uint32_t layers = std::min({ static_cast<uint32_t>(MAX_THUMBNAIL_LAYERS), ctx.physicalDeviceProperties().limits.maxFramebufferLayers, static_cast<uint32_t>(assets.size()) });
+    uint32_t size = options.size;
+
+    VkExtent3D targetExtent {
+        .width = size,
+        .height = size,
+        .depth = 1
+    };
+
+    std::unique_ptr<ImageAllocation> colorTarget = ctx.allocateImage(targetExtent, THUMBNAIL_FORMAT, VK_SAMPLE_COUNT_1_BIT, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_GPU_ONLY, 1, layers);
+    VkImageView colorView = colorTarget->createImageView(THUMBNAIL_FORMAT, VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, layers);
+    std::unique_ptr<ImageAllocation> depthTarget = ctx.allocateImage(targetExtent, THUMBNAIL_DEPTH_FORMAT, VK_SAMPLE_COUNT_1_BIT, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, VMA_MEMORY_USAGE_GPU_ONLY, 1, layers);
+    VkImageView depthView = depthTarget->createImageView(THUMBNAIL_DEPTH_FORMAT, VK_IMAGE_ASPECT_DEPTH_BIT, 0, 1, layers);
+
+    size_t layerSize = static_cast<size_t>(size) * size * 4;
+    std::unique_ptr<BufferAllocation> readback = ctx.allocateBuffer(layerSize * layers, VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_TO_CPU);
+    uint8_t *readbackMapping = static_cast<uint8_t *>(readback->map());
+
+    VkSamplerCreateInfo samplerInfo {
+        .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+        .magFilter = VK_FILTER_LINEAR,
+        .minFilter = VK_FILTER_LINEAR,
+        .mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR,
+        .addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT,
+        .addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT,
+        .addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT
+    };
+
+    VkSampler sampler;
+    VK_CHECK(vkCreateSampler(device, &samplerInfo, nullptr, &sampler));
+
+    VkDescriptorSetLayoutBinding textureBind {
+        .binding = 0,
+        .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+        .descriptorCount = 1,
+        .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT
+    };
+
+    VkDescriptorSetLayoutCreateInfo setInfo {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+        .bindingCount = 1,
+        .pBindings = &textureBind
+    };
+
+    VkDescriptorSetLayout setLayout;
+    VK_CHECK(vkCreateDescriptorSetLayout(device, &setInfo, nullptr, &setLayout));
+
+    VkDescriptorPoolSize poolSize { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, static_cast<uint32_t>(assets.size()) };
+
+    VkDescriptorPoolCreateInfo poolInfo {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+        .maxSets = static_cast<uint32_t>(assets.size()),
+        .poolSizeCount = 1,
+        .pPoolSizes = &poolSize
+    };
+
+    VkDescriptorPool descriptorPool;
+    VK_CHECK(vkCreateDescriptorPool(device, &poolInfo, nullptr, &descriptorPool));
+
+    for (ThumbnailAsset &asset : assets) {
+        VkDescriptorSetAllocateInfo allocInfo {
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+            .descriptorPool = descriptorPool,
+            .descriptorSetCount = 1,
+            .pSetLayouts = &setLayout
+        };
+
+        VK_CHECK(vkAllocateDescriptorSets(device, &allocInfo, &asset.textureSet));
+
+        VkDescriptorImageInfo imageInfo {
+            .sampler = sampler,
+            .imageView = asset.texture.imageView,
+            .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
+        };
+
+        VkWriteDescriptorSet write {
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .dstSet = asset.textureSet,
+            .dstBinding = 0,
+            .descriptorCount = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            .pImageInfo = &imageInfo
+        };
+
+        vkUpdateDescriptorSets(device, 1, &write, 0, nullptr);
+    }
+
+    VkPushConstantRange pushRange {
+        .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
+        .offset = 0,
+        .size = sizeof(ThumbnailConstants)
+    };
+
+    VkPipelineLayoutCreateInfo layoutInfo {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+        .setLayoutCount = 1,
+        .pSetLayouts = &setLayout,
+        .pushConstantRangeCount = 1,
+        .pPushConstantRanges = &pushRange
+    };
+
+    VkPipelineLayout pipelineLayout;
+    VK_CHECK(vkCreatePipelineLayout(device, &layoutInfo, nullptr, &pipelineLayout));
+
+    VkShaderModule vertShader = loadShaderModule(device, "thumbnail.vert.spv");
+    VkShaderModule fragShader = loadShaderModule(device, "thumbnail.frag.spv");
+
+    VertexInputDescription vertexDescription = Vertex::getDescription();
+
+    PipelineBuilder builder;
+    builder.useDefaultFF();
+    builder.shaderStages.push_back({ .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO, .stage = VK_SHADER_STAGE_VERTEX_BIT, .module = vertShader, .pName = "main" });
+    builder.shaderStages.push_back({ .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO, .stage = VK_SHADER_STAGE_FRAGMENT_BIT, .module = fragShader, .pName = "main" });
+    builder.vertexInputInfo = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
+        .vertexBindingDescriptionCount = static_cast<uint32_t>(vertexDescription.bindings.size()),
+        .pVertexBindingDescriptions = vertexDescription.bindings.data(),
+        .vertexAttributeDescriptionCount = static_cast<uint32_t>(vertexDescription.attributes.size()),
+        .pVertexAttributeDescriptions = vertexDescription.attributes.data(),
+    };
+    builder.viewport = { 0.0f, 0.0f, static_cast<float>(size), static_cast<float>(size), 0.0f, 1.0f };
+    builder.scissor = { { 0, 0 }, { size, size } };
+    builder.pipelineLayout = pipelineLayout;
+
+    VkPipeline pipeline = builder.buildPipeline(device, THUMBNAIL_FORMAT, THUMBNAIL_DEPTH_FORMAT);
+
+    vkDestroyShaderModule(device, vertShader, nullptr);
+    vkDestroyShaderModule(device, fragShader, nullptr);
+
+    if (!pipeline) {
+        throw std::runtime_error("Failed to create graphics pipeline \"thumbnail\"");
+    }
+
+    VkCommandPoolCreateInfo commandPoolInfo {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+        .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+        .queueFamilyIndex = ctx.graphicsQueueFamily()
+    };
+
+    VkCommandPool commandPool;
+    VK_CHECK(vkCreateCommandPool(device, &commandPoolInfo, nullptr, &commandPool));
+
+    VkCommandBufferAllocateInfo cmdAllocInfo {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+        .commandPool = commandPool,
+        .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+        .commandBufferCount = 1
+    };
+
+    VkCommandBuffer cmd;
+    VK_CHECK(vkAllocateCommandBuffers(device, &cmdAllocInfo, &cmd));
+
+    VkFenceCreateInfo fenceInfo {
+        .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO
+    };
+
+    VkFence fence;
+    VK_CHECK(vkCreateFence(device, &fenceInfo, nullptr, &fence));
+
+    // Same camera for every model, they are all normalized to the unit sphere
+    float distance = 1.05f / std::sin(glm::radians(THUMBNAIL_FOV) * 0.5f);
+    glm::vec3 eye = glm::normalize(glm::vec3{ 1.0f, 0.75f, 1.5f }) * distance;
+    glm::mat4 view = glm::lookAt(eye, glm::vec3{ 0.0f }, glm::vec3{ 0.0f, 1.0f, 0.0f });
+    glm::mat4 projection = glm::perspective(glm::radians(THUMBNAIL_FOV), 1.0f, distance - 1.5f, distance + 1.5f);
+    projection[1][1] *= -1;
+    glm::mat4 viewProj = projection * view;
+
+    std::vector<std::vector<uint8_t>> thumbnails(assets.size());
+    uint32_t submissions = 0;
+
+    uint64_t renderStart = SDL_GetTicksNS();
+
+    for (uint32_t repeat = 0; repeat < options.repeat; ++repeat) {
+        for (size_t first = 0; first < assets.size(); first += layers) {
+            uint32_t count = static_cast<uint32_t>(std::min(assets.size() - first, static_cast<size_t>(layers)));
+
+            VK_CHECK(vkResetCommandBuffer(cmd, 0));
+
+            VkCommandBufferBeginInfo cmdBeginInfo {
+                .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+                .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT
+            };
+
+            VK_CHECK(vkBeginCommandBuffer(cmd, &cmdBeginInfo));
+
+            imageLayoutTransition(cmd, colorTarget->image(),
+                                       VK_IMAGE_ASPECT_COLOR_BIT,
+                                       VK_PIPELINE_STAGE_2_ALL_TRANSFER_BIT,
+                                       0,
+                                       VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT,
+                                       VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT,
+                                       VK_IMAGE_LAYOUT_UNDEFINED,
+                                       VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+                                       1, layers);
+            imageLayoutTransition(cmd, depthTarget->image(),
+                                       VK_IMAGE_ASPECT_DEPTH_BIT,
+                                       VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT,
+                                       0,
+                                       VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT
+                                       | VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT,
+                                       VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+                                       VK_IMAGE_LAYOUT_UNDEFINED,
+                                       VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL,
+                                       1, layers);
+
+            VkRenderingAttachmentInfo colorInfo {
+                .sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO,
+                .imageView = colorView,
+                .imageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+                .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+                .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
+                .clearValue = { .color = { 0.0f, 0.0f, 0.0f, 0.0f } }
+            };
+
+            VkRenderingAttachmentInfo depthInfo {
+                .sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO,
+                .imageView = depthView,
+                .imageLayout = VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL,
+                .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+                .storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+                .clearValue = { .depthStencil = { 1.0f } }
+            };
+
+            VkRenderingInfo renderInfo {
+                .sType = VK_STRUCTURE_TYPE_RENDERING_INFO,
+                .renderArea = { { 0, 0 }, { size, size } },
+                .layerCount = layers,
+                .colorAttachmentCount = 1,
+                .pColorAttachments = &colorInfo,
+                .pDepthAttachment = &depthInfo
+            };
+
+            vkCmdBeginRendering(cmd, &renderInfo);
+
+            vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+
+            for (uint32_t layer = 0; layer < count; ++layer) {
+                ThumbnailAsset &asset = assets[first + layer];
+
+                ThumbnailConstants constants {
+                    .viewProj = viewProj,
+                    .model = asset.model
+                };
+
+                VkDeviceSize offset = 0;
+                VkBuffer vertexBuffer = asset.mesh.vertexBuffer->buffer();
+                vkCmdBindVertexBuffers(cmd, 0, 1, &vertexBuffer, &offset);
+                vkCmdBindIndexBuffer(cmd, asset.mesh.indexBuffer->buffer(), 0, VK_INDEX_TYPE_UINT32);
+                vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &asset.textureSet, 0, nullptr);
+                vkCmdPushConstants(cmd, pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(constants), &constants);
+                // The first instance picks the layer the model is drawn to
+                vkCmdDrawIndexed(cmd, asset.mesh.numIndices, 1, 0, 0, layer);
+            }
+
+            vkCmdEndRendering(cmd);
+
+            imageLayoutTransition(cmd, colorTarget->image(),
+                                       VK_IMAGE_ASPECT_COLOR_BIT,
+                                       VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT,
+                                       VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT,
+                                       VK_PIPELINE_STAGE_2_ALL_TRANSFER_BIT,
+                                       VK_ACCESS_2_TRANSFER_READ_BIT,
+                                       VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+                                       VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                                       1, layers);
+
+            // All layers of the batch in one copy, tightly packed one after another
+            VkBufferImageCopy copy {
+                .bufferOffset = 0,
+                .imageSubresource = {
+                    .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                    .mipLevel = 0,
+                    .baseArrayLayer = 0,
+                    .layerCount = count
+                },
+                .imageExtent = targetExtent
+            };
+
+            vkCmdCopyImageToBuffer(cmd, colorTarget->image(), VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, readback->buffer(), 1, &copy);
+
+            memoryBarrier(cmd, VK_PIPELINE_STAGE_2_ALL_TRANSFER_BIT,
+                               VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                               VK_PIPELINE_STAGE_2_HOST_BIT,
+                               VK_ACCESS_2_HOST_READ_BIT);
+
+            VK_CHECK(vkEndCommandBuffer(cmd));
+
+            VkSubmitInfo submit {
+                .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+                .commandBufferCount = 1,
+                .pCommandBuffers = &cmd
+            };
+
+            VK_CHECK(vkQueueSubmit(ctx.graphicsQueue(), 1, &submit, fence));
+            VK_CHECK(vkWaitForFences(device, 1, &fence, true, NS_IN_SEC));
+            VK_CHECK(vkResetFences(device, 1, &fence));
+            ++submissions;
+
+            readback->invalidate();
+            for (uint32_t layer = 0; layer < count; ++layer) {
+                std::vector<uint8_t> &pixels = thumbnails[first + layer];
+                pixels.resize(layerSize);
+                memcpy(pixels.data(), readbackMapping + layer * layerSize, layerSize);
+            }
+        }
+    }
+
+    double renderSeconds = static_cast<double>(SDL_GetTicksNS() - renderStart) / 1e9;
+    double rendered = static_cast<double>(assets.size() * options.repeat);
+    fprintf(stderr, "Rendered %.0f %ux%u thumbnails in %u submissions of up to %u layers: %.1f ms, %.1f thumbnails/s\n",
+            rendered, size, size, submissions, layers, renderSeconds * 1e3, rendered / renderSeconds);
+
+    uint64_t writeStart = SDL_GetTicksNS();
+    std::filesystem::create_directories(options.output);
+
+    for (size_t i = 0; i < assets.size(); ++i) {
+        Path file = options.output / (assets[i].name + ".png");
+        int stride = static_cast<int>(size * 4);
+        if (!stbi_write_png(file.string().c_str(), static_cast<int>(size), static_cast<int>(size), 4, thumbnails[i].data(), stride)) {
+            fprintf(stderr, "Failed to write %s\n", file.string().c_str());
+        }
+    }
+
+    fprintf(stderr, "Wrote %zu thumbnails to %s in %.1f ms\n", assets.size(), options.output.string().c_str(),
+            static_cast<double>(SDL_GetTicksNS() - writeStart) / 1e6);
+
+    vkDeviceWaitIdle(device);
+    vkDestroyFence(device, fence, nullptr);
+    vkDestroyCommandPool(device, commandPool, nullptr);
+    vkDestroyPipeline(device, pipeline, nullptr);
+    vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
+    vkDestroyDescriptorPool(device, descriptorPool, nullptr);
+    vkDestroyDescriptorSetLayout(device, setLayout, nullptr);
+    vkDestroySampler(device, sampler, nullptr);
+
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+    try {
+        return thumbnailMain(argc, argv);
+    } catch (std::runtime_error& e) {
+        fprintf(stderr, "Unhandled exception: %s\n", e.what());
+        return EXIT_FAILURE;
+    }
+}
@@ -0,0 +1,293 @@
+#include "upload.hh"
+
+#include "context.hh"
+#include "memory.hh"
+#include "utils.hh"
+
+#include "vulkan/vulkan.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+
+#define MIN_STAGING_ALIGNMENT 16
+
+Uploader::Uploader(VulkanContext &ctx, size_t stagingSize, bool direct):
+    m_ctx(ctx),
+    m_device(ctx.device()),
+    m_commandPool(VK_NULL_HANDLE),
+    m_commandBuffer(VK_NULL_HANDLE),
+    m_fence(VK_NULL_HANDLE),
+    m_recording(false),
+    m_direct(direct),
+    m_mapping(nullptr),
+    m_size(stagingSize),
+    m_alignment(MIN_STAGING_ALIGNMENT),
+    m_head(0),
+    m_highWater(0),
+    m_bytesUploaded(0),
+    m_bytesInPlace(0),
+    m_submits(0)
+{
+    VkCommandPoolCreateInfo poolInfo {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+        .queueFamilyIndex = m_ctx.graphicsQueueFamily()
+    };
+
+    VK_CHECK(vkCreateCommandPool(m_device, &poolInfo, nullptr, &m_commandPool));
+
+    VkCommandBufferAllocateInfo cmdAllocInfo {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+        .commandPool = m_commandPool,
+        .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+        .commandBufferCount = 1
+    };
+
+    VK_CHECK(vkAllocateCommandBuffers(m_device, &cmdAllocInfo, &m_commandBuffer));
+
+    VkFenceCreateInfo fenceInfo {
+        .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO
+    };
+
+    VK_CHECK(vkCreateFence(m_device, &fenceInfo, nullptr, &m_fence));
+
+    VkDeviceSize optimalAlignment = m_ctx.physicalDeviceProperties().limits.optimalBufferCopyOffsetAlignment;
+    m_alignment = std::max(m_alignment, static_cast<size_t>(optimalAlignment));
+
+    m_staging = m_ctx.allocateBuffer(m_size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_ONLY);
+    m_mapping = static_cast<uint8_t *>(m_staging->map());
+}
+
+Uploader::~Uploader()
+{
+    if (m_recording)
+        flush();
+
+    vkDestroyFence(m_device, m_fence, nullptr);
+    vkDestroyCommandPool(m_device, m_commandPool, nullptr);
+}
+
+void Uploader::uploadBuffer(const void *data, size_t size, VkBuffer dst, VkDeviceSize dstOffset)
+{
+    const uint8_t *src = static_cast<const uint8_t *>(data);
+    size_t done = 0;
+
+    while (done < size) {
+        VkDeviceSize stagingOffset;
+        size_t chunk = acquire(size - done, 1, stagingOffset);
+        memcpy(m_mapping + stagingOffset, src + done, chunk);
+
+        VkBufferCopy copy {
+            .srcOffset = stagingOffset,
+            .dstOffset = dstOffset + done,
+            .size = chunk
+        };
+        vkCmdCopyBuffer(m_commandBuffer, m_staging->buffer(), dst, 1, &copy);
+
+        done += chunk;
+    }
+
+    m_bytesUploaded += size;
+}
+
+void Uploader::uploadImage(const void *data, VkImage dst, VkExtent3D extent, uint32_t texelSize)
+{
+    const uint8_t *src = static_cast<const uint8_t *>(data);
+    size_t rowPitch = static_cast<size_t>(extent.width) * texelSize;
+    size_t size = rowPitch * extent.height * extent.depth;
+
+    imageLayoutTransition(begin(), dst,
+                          VK_IMAGE_ASPECT_COLOR_BIT,
+                          VK_PIPELINE_STAGE_2_NONE,
+                          0,
+                          VK_PIPELINE_STAGE_2_COPY_BIT,
+                          VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                          VK_IMAGE_LAYOUT_UNDEFINED,
+                          VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+
+    // Rows are counted across all the depth slices, a chunk never spans
+    // two slices so that each copy is a single box
+    uint32_t row = 0;
+    uint32_t rows = extent.height * extent.depth;
+
+    while (row < rows) {
+        uint32_t slice = row / extent.height;
+        uint32_t sliceRow = row % extent.height;
+
+        VkDeviceSize stagingOffset;
+        size_t chunk = acquire((extent.height - sliceRow) * rowPitch, rowPitch, stagingOffset);
+        uint32_t chunkRows = static_cast<uint32_t>(chunk / rowPitch);
+        memcpy(m_mapping + stagingOffset, src + static_cast<size_t>(row) * rowPitch, chunk);
+
+        VkImageSubresourceLayers subresource {
+            .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+            .mipLevel = 0,
+            .baseArrayLayer = 0,
+            .layerCount = 1
+        };
+
+        VkBufferImageCopy copyRegion {
+            .bufferOffset = stagingOffset,
+            .bufferRowLength = 0,
+            .bufferImageHeight = 0,
+            .imageSubresource = subresource,
+            .imageOffset = { 0, static_cast<int32_t>(sliceRow), static_cast<int32_t>(slice) },
+            .imageExtent = { extent.width, chunkRows, 1 }
+        };
+
+        vkCmdCopyBufferToImage(m_commandBuffer, m_staging->buffer(), dst, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copyRegion);
+
+        row += chunkRows;
+    }
+
+    imageLayoutTransition(begin(), dst,
+                          VK_IMAGE_ASPECT_COLOR_BIT,
+                          VK_PIPELINE_STAGE_2_COPY_BIT,
+                          VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                          VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT,
+                          VK_ACCESS_2_SHADER_SAMPLED_READ_BIT,
+                          VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                          VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+
+    m_bytesUploaded += size;
+}
+
+std::unique_ptr<BufferAllocation> Uploader::allocateBuffer(size_t size, VkBufferUsageFlags usage)
+{
+    // Without resizable BAR or unified memory VMA falls back to plain
+    // device memory and the writes go through staging
+    VmaAllocationCreateFlags flags = 0;
+    if (m_direct)
+        flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT | VMA_ALLOCATION_CREATE_HOST_ACCESS_ALLOW_TRANSFER_INSTEAD_BIT;
+
+    return std::make_unique<BufferAllocation>(m_ctx.allocator(), size, usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                              VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE, std::vector<uint32_t>{}, flags);
+}
+
+void Uploader::writeBuffer(BufferAllocation &dst, size_t count, size_t stride, const Fill &fill)
+{
+    size_t size = count * stride;
+
+    // Nothing reads a buffer that is still being uploaded, the next submit
+    // makes the host writes visible
+    if (m_direct && dst.hostVisible()) {
+        fill(dst.map(), 0, count);
+        dst.flush();
+        dst.unmap();
+
+        m_bytesUploaded += size;
+        m_bytesInPlace += size;
+        return;
+    }
+
+    size_t done = 0;
+
+    while (done < count) {
+        VkDeviceSize stagingOffset;
+        size_t chunk = acquire((count - done) * stride, stride, stagingOffset) / stride;
+        fill(m_mapping + stagingOffset, done, chunk);
+
+        VkBufferCopy copy {
+            .srcOffset = stagingOffset,
+            .dstOffset = done * stride,
+            .size = chunk * stride
+        };
+        vkCmdCopyBuffer(m_commandBuffer, m_staging->buffer(), dst.buffer(), 1, &copy);
+
+        done += chunk;
+    }
+
+    m_bytesUploaded += size;
+}
+
+void Uploader::record(std::function<void(VkCommandBuffer)> &&function)
+{
+    function(begin());
+}
+
+void Uploader::flush()
+{
+    if (!m_recording)
+        return;
+
+    VK_CHECK(vkEndCommandBuffer(m_commandBuffer));
+
+    VkSubmitInfo submit {
+        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+        .commandBufferCount = 1,
+        .pCommandBuffers = &m_commandBuffer
+    };
+
+    VK_CHECK(vkQueueSubmit(m_ctx.graphicsQueue(), 1, &submit, m_fence));
+
+    VK_CHECK(vkWaitForFences(m_device, 1, &m_fence, true, UINT64_MAX));
+    VK_CHECK(vkResetFences(m_device, 1, &m_fence));
+
+    VK_CHECK(vkResetCommandPool(m_device, m_commandPool, 0));
+
+    m_recording = false;
+    m_head = 0;
+    ++m_submits;
+}
+
+size_t Uploader::highWaterMark()
+{
+    return m_highWater;
+}
+
+size_t Uploader::bytesUploaded()
+{
+    return m_bytesUploaded;
+}
+
+size_t Uploader::bytesInPlace()
+{
+    return m_bytesInPlace;
+}
+
+uint32_t Uploader::submitCount()
+{
+    return m_submits;
+}
+
+size_t Uploader::acquire(size_t size, size_t granularity, VkDeviceSize &offset)
+{
+    if (granularity > m_size)
+        throw std::runtime_error("Upload does not fit in the staging buffer");
+
+    // Avoid splitting uploads into slivers at the end of the staging buffer
+    size_t minChunk = std::min(size, std::max(granularity, m_size / 8));
+
+    size_t start = (m_head + m_alignment - 1) / m_alignment * m_alignment;
+    if (start > m_size || m_size - start < minChunk) {
+        flush();
+        start = 0;
+    }
+
+    size_t available = (m_size - start) / granularity * granularity;
+    size_t chunk = std::min(size, available);
+
+    begin();
+    offset = start;
+    m_head = start + chunk;
+    m_highWater = std::max(m_highWater, m_head);
+
+    return chunk;
+}
+
+VkCommandBuffer Uploader::begin()
+{
+    if (!m_recording) {
+        VkCommandBufferBeginInfo cmdBeginInfo {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+            .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT
+        };
+
+        VK_CHECK(vkBeginCommandBuffer(m_commandBuffer, &cmdBeginInfo));
+        m_recording = true;
+    }
+    return m_commandBuffer;
+}
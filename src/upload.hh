@@ -0,0 +1,68 @@
+#pragma once
+
+#include "context.hh"
+#include "memory.hh"
+
+#include "vulkan/vulkan.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+#define STAGING_BUFFER_SIZE (32 * 1024 * 1024)
+
+// Copies are batched into one command buffer that is submitted only when the
+// staging buffer runs out or on flush(). Large uploads are split into chunks.
+// Buffers from allocateBuffer() that land in host visible device memory are
+// written in place without staging or copy commands.
+class Uploader
+{
+public:
+    // Element writer for writeBuffer(), fills elements [first, first + count)
+    using Fill = std::function<void(void *out, size_t first, size_t count)>;
+
+    Uploader(VulkanContext &ctx, size_t stagingSize, bool direct = true);
+    ~Uploader();
+    Uploader(const Uploader &) = delete;
+    Uploader &operator=(const Uploader &) = delete;
+
+    void uploadBuffer(const void *data, size_t size, VkBuffer dst, VkDeviceSize dstOffset = 0);
+    void uploadImage(const void *data, VkImage dst, VkExtent3D extent, uint32_t texelSize);
+    // Device local, in host visible memory when the device has some to spare
+    std::unique_ptr<BufferAllocation> allocateBuffer(size_t size, VkBufferUsageFlags usage);
+    // Hands fill the destination memory of count elements of stride bytes,
+    // either the buffer itself or staging in as many chunks as it takes
+    void writeBuffer(BufferAllocation &dst, size_t count, size_t stride, const Fill &fill);
+    void record(std::function<void(VkCommandBuffer)> &&function);
+    void flush();
+
+    size_t highWaterMark();
+    size_t bytesUploaded();
+    // Part of bytesUploaded() written straight into the destination
+    size_t bytesInPlace();
+    uint32_t submitCount();
+
+private:
+    size_t acquire(size_t size, size_t granularity, VkDeviceSize &offset);
+    VkCommandBuffer begin();
+
+    VulkanContext &m_ctx;
+    VkDevice m_device;
+    VkCommandPool m_commandPool;
+    VkCommandBuffer m_commandBuffer;
+    VkFence m_fence;
+    bool m_recording;
+    bool m_direct;
+
+    std::unique_ptr<BufferAllocation> m_staging;
+    uint8_t *m_mapping;
+    size_t m_size;
+    size_t m_alignment;
+    size_t m_head;
+
+    size_t m_highWater;
+    size_t m_bytesUploaded;
+    size_t m_bytesInPlace;
+    uint32_t m_submits;
+};
@@ -1,9 +1,14 @@
 #include "utils.hh"
 
+#include "embeddedshaders.hh"
+
 #include "vulkan/vulkan.h"
 
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <optional>
+#include <span>
 #include <string_view>
 #include <vector>
 
@@ -21,6 +26,13 @@ const Path SHADER_DIR = [](){
     return "./shaders";
 }();
 
+const Path SHADER_SOURCE_DIR = [](){
+    const char *env = getenv("VKLELU_SHADERSRCDIR");
+    if (env)
+        return env;
+    return "./src/glsl";
+}();
+
 Path assetdir()
 {
     return ASSET_DIR;
@@ -31,6 +43,11 @@ Path shaderdir()
     return SHADER_DIR;
 }
 
+Path shadersourcedir()
+{
+    return SHADER_SOURCE_DIR;
+}
+
 Path getAssetPath(std::string_view file)
 {
     return assetdir() / file;
@@ -45,18 +62,20 @@ void imageLayoutTransition(VkCommandBuffer cmd,
                            VkImage image,
                            VkImageAspectFlags aspectFlags,
                            VkPipelineStageFlags2 srcStageFlags,
-                           VkAccessFlags srcAccessFlags,
+                           VkAccessFlags2 srcAccessFlags,
                            VkPipelineStageFlags2 dstStageFlags,
-                           VkAccessFlags dstAccessFlags,
+                           VkAccessFlags2 dstAccessFlags,
                            VkImageLayout oldLayout,
-                           VkImageLayout newLayout)
+                           VkImageLayout newLayout,
+                           uint32_t levelCount,
+                           uint32_t layerCount)
 {
     VkImageSubresourceRange range {
         .aspectMask = aspectFlags,
         .baseMipLevel = 0,
-        .levelCount = 1,
+        .levelCount = levelCount,
         .baseArrayLayer = 0,
-        .layerCount = 1
+        .layerCount = layerCount
     };
 
     VkImageMemoryBarrier2 imgBarrier {
@@ -82,6 +101,98 @@ void imageLayoutTransition(VkCommandBuffer cmd,
     vkCmdPipelineBarrier2(cmd, &dep);
 }
 
+void memoryBarrier(VkCommandBuffer cmd,
+                   VkPipelineStageFlags2 srcStageFlags,
+                   VkAccessFlags2 srcAccessFlags,
+                   VkPipelineStageFlags2 dstStageFlags,
+                   VkAccessFlags2 dstAccessFlags)
+{
+    VkMemoryBarrier2 barrier {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2,
+        .srcStageMask = srcStageFlags,
+        .srcAccessMask = srcAccessFlags,
+        .dstStageMask = dstStageFlags,
+        .dstAccessMask = dstAccessFlags
+    };
+
+    VkDependencyInfo dep {
+        .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+        .memoryBarrierCount = 1,
+        .pMemoryBarriers = &barrier
+    };
+
+    vkCmdPipelineBarrier2(cmd, &dep);
+}
+
+VkShaderModule loadShaderModule(VkDevice device, const char *path, bool embedded)
+{
+    if (embedded) {
+        if (std::optional<std::span<const uint32_t>> code = findEmbeddedShader(path))
+            return createShaderModule(device, *code, path);
+    }
+
+    Path fullPath = getShaderPath(path);
+
+    FILE *f = fopen(cpath(fullPath), "rb");
+    if (!f) {
+        throw std::runtime_error("Failed to open file: " + std::string(path));
+    }
+
+    fseek(f, 0, SEEK_END);
+    long fileSize = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    std::vector<uint32_t> spv_data(fileSize / sizeof(uint32_t));
+    size_t ret = fread(&spv_data[0], sizeof(spv_data[0]), spv_data.size(), f);
+    fclose(f);
+
+    if ((ret * sizeof(uint32_t)) != static_cast<size_t>(fileSize)) {
+        throw std::runtime_error("Failed to read file: " + std::string(path));
+    }
+
+    return createShaderModule(device, spv_data, path);
+}
+
+VkShaderModule createShaderModule(VkDevice device, std::span<const uint32_t> code, const char *name)
+{
+    VkShaderModuleCreateInfo createInfo {
+        .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+        .codeSize = code.size_bytes(),
+        .pCode = code.data()
+    };
+
+    VkShaderModule module;
+    if (vkCreateShaderModule(device, &createInfo, nullptr, &module) != VK_SUCCESS) {
+        throw std::runtime_error("Failed to create shader module: " + std::string(name));
+    }
+
+    return module;
+}
+
+VkPipeline buildComputePipeline(VkDevice device, VkShaderModule module, VkPipelineLayout layout, VkPipelineCache cache)
+{
+    VkPipelineShaderStageCreateInfo stageInfo {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+        .stage = VK_SHADER_STAGE_COMPUTE_BIT,
+        .module = module,
+        .pName = "main"
+    };
+
+    VkComputePipelineCreateInfo pipelineInfo {
+        .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+        .stage = stageInfo,
+        .layout = layout
+    };
+
+    VkPipeline newPipeline;
+    if (vkCreateComputePipelines(device, cache, 1, &pipelineInfo, nullptr, &newPipeline) != VK_SUCCESS) {
+        fprintf(stderr, "Failed to create compute pipeline\n");
+        return VK_NULL_HANDLE;
+    } else {
+        return newPipeline;
+    }
+}
+
 void PipelineBuilder::useDefaultFF()
 {
     inputAssembly = {
@@ -142,17 +253,26 @@ VkPipeline PipelineBuilder::buildPipeline(VkDevice device, VkFormat colorFormat,
         .pScissors = &scissor,
     };
 
+    // Depth only without a color format
+    uint32_t colorAttachmentCount = colorFormat == VK_FORMAT_UNDEFINED ? 0 : 1;
+
     VkPipelineColorBlendStateCreateInfo colorBlending {
         .sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO,
         .logicOpEnable = VK_FALSE,
         .logicOp = VK_LOGIC_OP_COPY,
-        .attachmentCount = 1,
+        .attachmentCount = colorAttachmentCount,
         .pAttachments = &colorBlendAttachment
     };
 
+    VkPipelineDynamicStateCreateInfo dynamicState {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO,
+        .dynamicStateCount = static_cast<uint32_t>(dynamicStates.size()),
+        .pDynamicStates = dynamicStates.data()
+    };
+
     VkPipelineRenderingCreateInfo rendering {
         .sType = VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO,
-        .colorAttachmentCount = 1,
+        .colorAttachmentCount = colorAttachmentCount,
         .pColorAttachmentFormats = &colorFormat,
         .depthAttachmentFormat = depthFormat
     };
@@ -169,6 +289,7 @@ VkPipeline PipelineBuilder::buildPipeline(VkDevice device, VkFormat colorFormat,
         .pMultisampleState = &multisampling,
         .pDepthStencilState = &depthStencil,
         .pColorBlendState = &colorBlending,
+        .pDynamicState = &dynamicState,
         .layout = pipelineLayout,
         .renderPass = VK_NULL_HANDLE,
         .subpass = 0,
@@ -176,7 +297,7 @@ VkPipeline PipelineBuilder::buildPipeline(VkDevice device, VkFormat colorFormat,
     };
 
     VkPipeline newPipeline;
-    if (vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &newPipeline) != VK_SUCCESS) {
+    if (vkCreateGraphicsPipelines(device, pipelineCache, 1, &pipelineInfo, nullptr, &newPipeline) != VK_SUCCESS) {
         fprintf(stderr, "Failed to create pipeline\n");
         return VK_NULL_HANDLE;
     } else {
@@ -3,7 +3,9 @@
 #include "vulkan/vulkan.h"
 
 #include <cstdio>
+#include <cstdint>
 #include <filesystem>
+#include <span>
 #include <string_view>
 #include <vector>
 
@@ -33,6 +35,7 @@ using Path = std::filesystem::path;
 
 Path assetdir();
 Path shaderdir();
+Path shadersourcedir();
 Path getAssetPath(std::string_view file);
 Path getShaderPath(std::string_view file);
 
@@ -40,11 +43,25 @@ void imageLayoutTransition(VkCommandBuffer cmd,
                            VkImage image,
                            VkImageAspectFlags aspectFlags,
                            VkPipelineStageFlags2 srcStageFlags,
-                           VkAccessFlags srcAccessFlags,
+                           VkAccessFlags2 srcAccessFlags,
                            VkPipelineStageFlags2 dstStageFlags,
-                           VkAccessFlags dstAccessFlags,
+                           VkAccessFlags2 dstAccessFlags,
                            VkImageLayout oldLayout,
-                           VkImageLayout newLayout);
+                           VkImageLayout newLayout,
+                           uint32_t levelCount = 1,
+                           uint32_t layerCount = 1);
+
+void memoryBarrier(VkCommandBuffer cmd,
+                   VkPipelineStageFlags2 srcStageFlags,
+                   VkAccessFlags2 srcAccessFlags,
+                   VkPipelineStageFlags2 dstStageFlags,
+                   VkAccessFlags2 dstAccessFlags);
+
+// Embedded SPIR-V when the build has it, unless asked for the file in the
+// shader directory like hot reloading does
+VkShaderModule loadShaderModule(VkDevice device, const char *path, bool embedded = true);
+VkShaderModule createShaderModule(VkDevice device, std::span<const uint32_t> code, const char *name);
+VkPipeline buildComputePipeline(VkDevice device, VkShaderModule module, VkPipelineLayout layout, VkPipelineCache cache = VK_NULL_HANDLE);
 
 struct PipelineBuilder
 {
@@ -60,4 +77,6 @@ struct PipelineBuilder
     VkPipelineMultisampleStateCreateInfo multisampling;
     VkPipelineLayout pipelineLayout;
     VkPipelineDepthStencilStateCreateInfo depthStencil;
+    std::vector<VkDynamicState> dynamicStates;
+    VkPipelineCache pipelineCache = VK_NULL_HANDLE;
 };
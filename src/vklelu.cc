@@ -1,24 +1,34 @@
 #include "vklelu.hh"
 
 #include "context.hh"
+#include "embeddedshaders.hh"
 #include "himmeli.hh"
 #include "memory.hh"
+#include "scene.hh"
+#include "scenefile.hh"
+#include "simulation.hh"
+#include "startup.hh"
 #include "utils.hh"
 
 #include "glm/glm.hpp"
 #include "glm/gtc/matrix_transform.hpp"
+#include "glm/gtc/quaternion.hpp"
 #include "SDL3/SDL.h"
 #include "SDL3/SDL_vulkan.h"
 #include "vulkan/vulkan.h"
 
+#include <algorithm>
 #include <array>
 #include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <functional>
+#include <limits>
+#include <map>
 #include <memory>
 #include <stdexcept>
+#include <utility>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -26,12 +36,160 @@
 #define WINDOW_WIDTH 1024
 #define WINDOW_HEIGHT 768
 
+#define DRAW_KEY_MAX_PIPELINES (1 << 8)
+#define DRAW_KEY_MAX_MATERIALS (1 << 16)
+#define DRAW_KEY_MAX_MESHES (1 << 16)
+#define DRAW_KEY_MAX_OBJECTS (1 << 24)
+
+// Must match local_size in cull.comp and depthreduce.comp
+#define CULL_GROUP_SIZE 64
+#define DEPTH_REDUCE_GROUP_SIZE 8
+// Clusters per task or compute workgroup, must match the meshlet shaders
+#define MESHLET_GROUP_SIZE 32
+
+static Options parseOptions(int argc, char *argv[])
+{
+    Options options;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        bool hasValue = i + 1 < argc;
+
+        if (arg == "--stress" && hasValue) {
+            glm::uvec3 &grid = options.stressGrid;
+            if (sscanf(argv[++i], "%ux%ux%u", &grid.x, &grid.y, &grid.z) != 3 || !grid.x || !grid.y || !grid.z)
+                throw std::runtime_error("Invalid stress grid, expected WxHxD: " + std::string(argv[i]));
+        } else if (arg == "--lights" && hasValue) {
+            options.stressLights = static_cast<uint32_t>(strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--static" && hasValue) {
+            options.stressStatic = std::clamp(strtof(argv[++i], nullptr), 0.0f, 1.0f);
+        } else if (arg == "--seed" && hasValue) {
+            options.stressSeed = static_cast<uint32_t>(strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--frames" && hasValue) {
+            options.frameLimit = static_cast<uint32_t>(strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--headless") {
+            options.headless = true;
+        } else if (arg == "--no-occlusion") {
+            options.occlusionCulling = false;
+        } else if (arg == "--depth-prepass") {
+            options.depthPrepass = true;
+        } else if (arg == "--meshlets") {
+            options.meshlets = true;
+        } else if (arg == "--no-mesh-shaders") {
+            options.meshShaders = false;
+        } else if (arg == "--no-dynamic-state") {
+            options.dynamicState = false;
+        } else if (arg == "--vertex-pulling") {
+            options.vertexPulling = true;
+        } else if (arg == "--no-command-cache") {
+            options.commandCache = false;
+        } else if (arg == "--no-shadow-cache") {
+            options.shadowCache = false;
+        } else if (arg == "--pipeline-cache" && hasValue) {
+            options.pipelineCache = argv[++i];
+        } else if (arg == "--staged-uploads") {
+            options.directUpload = false;
+        } else if (arg == "--sim-rate" && hasValue) {
+            options.simulationRate = static_cast<uint32_t>(std::max(1ul, strtoul(argv[++i], nullptr, 10)));
+        } else if (arg == "--gpu-budget" && hasValue) {
+            options.gpuBudgetMs = strtof(argv[++i], nullptr);
+        } else if (arg == "--capture" && hasValue) {
+            options.captureFile = argv[++i];
+        } else if (arg == "--capture-fps" && hasValue) {
+            options.captureFps = static_cast<uint32_t>(std::max(1ul, strtoul(argv[++i], nullptr, 10)));
+        } else if (arg == "--hot-reload") {
+            options.hotReload = true;
+        } else if (arg.starts_with("--")) {
+            throw std::runtime_error("Unknown argument: " + arg + "\n"
+                                     "Usage: vklelu [scene file] [--stress WxHxD] [--lights N] [--static FRACTION] [--seed N] [--frames N] [--headless] [--no-occlusion] [--depth-prepass]\n"
+                                     "              [--meshlets] [--no-mesh-shaders] [--no-dynamic-state] [--gpu-budget MS] [--capture out.y4m|out.ppm|frame%05u.png|-] [--capture-fps N]\n"
+                                     "              [--hot-reload] [--vertex-pulling] [--no-command-cache] [--no-shadow-cache] [--sim-rate N]\n"
+                                     "              [--staged-uploads] [--pipeline-cache FILE]");
+        } else {
+            options.sceneFile = arg;
+        }
+    }
+
+    return options;
+}
+
+// Perspective from the light toward the center of the given bounds, just
+// wide enough for their bounding sphere
+static glm::mat4 shadowViewProj(glm::vec3 light, glm::vec3 lo, glm::vec3 hi)
+{
+    glm::vec3 center = 0.5f * (lo + hi);
+    float radius = std::max(0.5f * glm::length(hi - lo), 0.01f);
+    glm::vec3 toCenter = center - light;
+    float distance = glm::length(toCenter);
+
+    // No frustum covers everything from inside the bounds, settle for a
+    // wide one
+    float halfAngle = distance > radius ? std::asin(radius / distance) : glm::radians(60.0f);
+    glm::vec3 forward = distance > 0.0f ? toCenter / distance : glm::vec3{ 0.0f, -1.0f, 0.0f };
+    glm::vec3 up = std::abs(forward.y) > 0.99f ? glm::vec3{ 0.0f, 0.0f, 1.0f } : glm::vec3{ 0.0f, 1.0f, 0.0f };
+
+    glm::mat4 view = glm::lookAt(light, light + forward, up);
+    float zFar = distance + radius;
+    glm::mat4 projection = glm::perspectiveRH_ZO(2.0f * halfAngle, 1.0f, std::max(distance - radius, 0.001f * zFar), zFar);
+
+    return projection * view;
+}
+
+// Upload fill that copies from an array as it is
+template <typename T>
+static Uploader::Fill copyFrom(const std::vector<T> &data)
+{
+    return [&data](void *out, size_t first, size_t count) {
+        memcpy(out, data.data() + first, count * sizeof(T));
+    };
+}
+
+// Calls write(vertex, i) for vertices [first, first + count) of the meshes
+// laid end to end, bases holds the first vertex of each mesh
+template <typename F>
+static void forEachVertex(const std::vector<std::unique_ptr<ObjFile>> &objs, const std::vector<size_t> &bases, size_t first, size_t count, F &&write)
+{
+    size_t obj = static_cast<size_t>(std::upper_bound(bases.begin(), bases.end(), first) - bases.begin()) - 1;
+    for (size_t i = 0; i < count; ++i) {
+        while (first + i >= bases[obj] + objs[obj]->vertices.size())
+            ++obj;
+        write(objs[obj]->vertices[first + i - bases[obj]], i);
+    }
+}
+
 VKlelu::VKlelu(int argc, char *argv[]):
-    m_frameCount(0)
+    VKlelu(parseOptions(argc, argv))
 {
-    (void)argc;
-    (void)argv;
+}
 
+VKlelu::VKlelu(const Options &options):
+    m_options(options),
+    m_frameCount(0),
+    m_startupBegin(0),
+    m_frameStats{},
+    m_resolutionScale(1.0f),
+    m_loggedResolutionScale(1.0f),
+    m_shadowCacheVersion(UINT64_MAX),
+    m_shadowCacheLight{ 0.0f },
+    m_shadowCacheDirty(true),
+    m_shadowStaticMin{ 0.0f },
+    m_shadowStaticMax{ 0.0f },
+    m_shadowBoundsMin{ 0.0f },
+    m_shadowBoundsMax{ 0.0f },
+    m_pipelineCache(VK_NULL_HANDLE),
+    m_cmdDrawMeshTasksIndirect(nullptr),
+    m_dynamicState(false),
+    m_cmdSetColorBlendEnable(nullptr),
+    m_simulationVersion(UINT64_MAX),
+    m_simulationTransformVersion(UINT64_MAX),
+    m_meshShaders(false),
+    m_firstBlendedInstance(0),
+    m_drawBatchesVersion(UINT64_MAX),
+    m_commandCache(false),
+    m_drawCommandsVersion(0),
+    m_visibilityVersion(UINT64_MAX),
+    m_objectCapacity(INITIAL_OBJECT_CAPACITY)
+{
     fprintf(stderr, "Launching VKlelu\n"
                     "================\n");
 
@@ -42,22 +200,6 @@ VKlelu::VKlelu(int argc, char *argv[]):
             SDL_VERSIONNUM_MAJOR(linked),
             SDL_VERSIONNUM_MINOR(linked),
             SDL_VERSIONNUM_MICRO(linked));
-
-    m_ctx = std::make_unique<VulkanContext>(WINDOW_WIDTH, WINDOW_HEIGHT);
-    m_window = m_ctx->window();
-    m_device = m_ctx->device();
-
-    int drawableWidth;
-    int drawableHeight;
-    SDL_GetWindowSizeInPixels(m_window, &drawableWidth, &drawableHeight);
-    m_fbSize.width = (uint32_t)drawableWidth;
-    m_fbSize.height = (uint32_t)drawableHeight;
-
-    fprintf(stderr, "Window size:\t%ux%u\n", WINDOW_WIDTH, WINDOW_HEIGHT);
-    fprintf(stderr, "Drawable size:\t%ux%u\n", m_fbSize.width, m_fbSize.height);
-
-    fprintf(stderr, "Asset directory:\t%s\n", cpath(assetdir()));
-    fprintf(stderr, "Shader directory:\t%s\n", cpath(shaderdir()));
 }
 
 VKlelu::~VKlelu()
@@ -65,14 +207,20 @@ VKlelu::~VKlelu()
     if (m_ctx)
         vkDeviceWaitIdle(m_device);
 
+    // Hand over what is still in the readback ring, oldest frame first
+    if (m_capture) {
+        for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i)
+            collectCapture(m_frameData[(m_frameCount + i) % MAX_FRAMES_IN_FLIGHT]);
+        m_capture->finish();
+    }
+
     for (auto fn = m_resourceJanitor.rbegin(); fn != m_resourceJanitor.rend(); ++fn)
         (*fn)();
 }
 
 int VKlelu::run()
 {
-    initVulkan();
-    initScene();
+    init();
 
     bool quit = false;
     SDL_Event event;
@@ -92,20 +240,230 @@ int VKlelu::run()
             }
         }
 
-        update();
-        draw();
+        frame();
+
+        if (m_options.frameLimit && static_cast<uint32_t>(m_frameCount) >= m_options.frameLimit)
+            quit = true;
     }
 
+    fprintf(stderr, "GPU time of a recent frame: %.3f ms, cull %.3f ms, depth pyramid %.3f ms, pre-pass %.3f ms, shading %.3f ms, upscale %.3f ms\n",
+            static_cast<double>(m_frameStats.gpuFrameNs) / 1e6,
+            static_cast<double>(m_frameStats.gpuCullNs) / 1e6,
+            static_cast<double>(m_frameStats.gpuPyramidNs) / 1e6,
+            static_cast<double>(m_frameStats.gpuPrepassNs) / 1e6,
+            static_cast<double>(m_frameStats.gpuShadingNs) / 1e6,
+            static_cast<double>(m_frameStats.gpuUpscaleNs) / 1e6);
+    fprintf(stderr, "Light culling on the %s compute queue: %.3f ms, %.3f ms overlapped with graphics\n",
+            m_compute->async() ? "async" : "graphics",
+            static_cast<double>(m_frameStats.gpuLightCullNs) / 1e6,
+            static_cast<double>(m_frameStats.gpuAsyncOverlapNs) / 1e6);
+    fprintf(stderr, "Resolution scale %.2f, %ux%u\n", static_cast<double>(m_resolutionScale), m_renderExtent.width, m_renderExtent.height);
+    fprintf(stderr, "Simulation step %.3f ms at %u Hz\n", static_cast<double>(m_frameStats.simulationNs) / 1e6, m_options.simulationRate);
+    if (m_options.meshlets)
+        fprintf(stderr, "Meshlets of a recent frame: %u drawn, %u culled\n", m_frameStats.drawnMeshlets, m_frameStats.culledMeshlets);
+
     return EXIT_SUCCESS;
 }
 
+void VKlelu::init()
+{
+    m_startupBegin = SDL_GetTicksNS();
+    StartupGraph startup;
+
+    // The scene file itself is quick to parse, the assets it names are read
+    // and decoded on workers while the device, swapchain and pipelines are
+    // brought up on this thread
+    SceneFile sceneFile = m_options.stressGrid.x
+        ? SceneFile::stress(m_options.stressGrid, m_options.stressSeed, m_options.stressLights, m_options.stressStatic)
+        : SceneFile(m_options.sceneFile);
+
+    std::vector<std::unique_ptr<ObjFile>> objs(sceneFile.meshes.size());
+    std::vector<std::unique_ptr<ImageFile>> images(sceneFile.textures.size());
+    std::vector<StartupTask> sceneDependencies;
+
+    bool meshlets = m_options.meshlets;
+    for (size_t i = 0; i < objs.size(); ++i) {
+        const std::string &file = sceneFile.meshes[i].file;
+        sceneDependencies.push_back(startup.worker("decode " + file, {}, [&objs, &file, i, meshlets]() {
+            objs[i] = std::make_unique<ObjFile>(file);
+            if (meshlets)
+                objs[i]->buildMeshlets();
+        }));
+    }
+
+    for (size_t i = 0; i < images.size(); ++i) {
+        const std::string &file = sceneFile.textures[i].file;
+        sceneDependencies.push_back(startup.worker("decode " + file, {}, [&images, &file, i]() {
+            images[i] = std::make_unique<ImageFile>(file);
+        }));
+    }
+
+    StartupTask context = startup.main("instance and device", {}, [this]() { initContext(); });
+    sceneDependencies.push_back(startup.main("swapchain, descriptors and pipelines", { context }, [this]() { initVulkan(); }));
+    startup.main("scene upload", std::move(sceneDependencies), [&, this]() { initScene(sceneFile, objs, images); });
+
+    startup.run();
+    startup.printTimeline();
+}
+
+void VKlelu::initContext()
+{
+    m_ctx = std::make_unique<VulkanContext>(WINDOW_WIDTH, WINDOW_HEIGHT, m_options.headless);
+    m_window = m_ctx->window();
+    m_device = m_ctx->device();
+
+    int drawableWidth = WINDOW_WIDTH;
+    int drawableHeight = WINDOW_HEIGHT;
+    if (m_window)
+        SDL_GetWindowSizeInPixels(m_window, &drawableWidth, &drawableHeight);
+    m_fbSize.width = (uint32_t)drawableWidth;
+    m_fbSize.height = (uint32_t)drawableHeight;
+    m_renderExtent = m_fbSize;
+
+    if (m_options.meshlets) {
+        m_meshShaders = m_options.meshShaders && m_ctx->meshShaderSupported();
+        fprintf(stderr, "Meshlets culled and drawn with %s\n", m_meshShaders ? "mesh shaders" : "compute compaction");
+
+        // Mesh shader output isn't covered by the invariance the EQUAL
+        // depth test relies on
+        if (m_meshShaders && m_options.depthPrepass) {
+            fprintf(stderr, "Depth pre-pass is not supported with mesh shaders, disabling it\n");
+            m_options.depthPrepass = false;
+        }
+
+        if (m_meshShaders && m_options.vertexPulling) {
+            fprintf(stderr, "Mesh shaders always read vertices from storage buffers, ignoring vertex pulling\n");
+            m_options.vertexPulling = false;
+        }
+    }
+
+    fprintf(stderr, "Vertices %s\n", m_options.vertexPulling ? "pulled from storage buffers" : "fetched by fixed function input");
+
+    // Mesh shader draws push the camera every frame, nothing to replay
+    m_commandCache = m_options.commandCache && !m_meshShaders;
+    fprintf(stderr, "Draw commands %s\n", m_commandCache ? "cached in secondary command buffers" : "recorded every frame");
+    fprintf(stderr, "Static shadow casters %s\n", m_options.shadowCache ? "cached" : "rendered every frame");
+    fprintf(stderr, "Simulation ticks at %u Hz on its own thread\n", m_options.simulationRate);
+    fprintf(stderr, "Buffer uploads %s\n", m_options.directUpload ? "written in place to host visible device memory when possible" : "always staged");
+
+    m_dynamicState = m_options.dynamicState && m_ctx->dynamicBlendSupported();
+    fprintf(stderr, "Material state is %s\n", m_dynamicState ? "dynamic" : "baked into pipelines");
+
+    fprintf(stderr, "Window size:\t%ux%u\n", WINDOW_WIDTH, WINDOW_HEIGHT);
+    fprintf(stderr, "Drawable size:\t%ux%u\n", m_fbSize.width, m_fbSize.height);
+
+    fprintf(stderr, "Asset directory:\t%s\n", cpath(assetdir()));
+    fprintf(stderr, "Shader directory:\t%s\n", cpath(shaderdir()));
+    if (embeddedShaderHash())
+        fprintf(stderr, "Shaders embedded in the executable%s\n", m_options.hotReload ? ", hot reloading uses the shader directory" : "");
+}
+
+void VKlelu::frame()
+{
+    uint64_t start = SDL_GetTicksNS();
+
+    update();
+    draw();
+
+    m_frameStats.frameNs = SDL_GetTicksNS() - start;
+
+    if (m_frameCount == 1)
+        fprintf(stderr, "First frame submitted %.1f ms after startup began\n", static_cast<double>(SDL_GetTicksNS() - m_startupBegin) / 1e6);
+}
+
+const FrameStats &VKlelu::frameStats()
+{
+    return m_frameStats;
+}
+
+Scene &VKlelu::scene()
+{
+    return m_scene;
+}
+
 void VKlelu::update()
 {
-    for (Himmeli &himmeli : m_himmelit) {
-        himmeli.rotate = glm::rotate(glm::mat4{ 1.0f }, glm::radians(static_cast<float>(SDL_GetTicks()) / 20.0f), glm::vec3(0, 1, 0));
+    // Moving a dynamic Himmeli from outside restarts the simulation from
+    // the moved transform, it would be overwritten below otherwise
+    if (m_simulationVersion != m_scene.version() || m_simulationTransformVersion != m_scene.transformVersion())
+        startSimulation();
+
+    SimFrame sim = m_simulation->sample();
+    const SimSnapshot &previous = *sim.previous;
+    const SimSnapshot &latest = *sim.latest;
+    m_frameStats.simulationNs = m_simulation->stepNs();
+
+    std::vector<glm::vec3> &positions = m_scene.positions();
+    std::vector<glm::quat> &rotations = m_scene.rotations();
+    std::vector<glm::vec3> &scales = m_scene.scales();
+    std::vector<uint8_t> &statics = m_scene.statics();
+    for (size_t i = 0; i < positions.size(); ++i) {
+        if (statics[i])
+            continue;
+
+        positions[i] = glm::mix(previous.positions[i], latest.positions[i], sim.alpha);
+        rotations[i] = glm::slerp(previous.rotations[i], latest.rotations[i], sim.alpha);
+        scales[i] = glm::mix(previous.scales[i], latest.scales[i], sim.alpha);
+    }
+
+    for (size_t i = 0; i < m_pointLights.size(); ++i) {
+        glm::vec3 position = glm::mix(previous.pointLights[i], latest.pointLights[i], sim.alpha);
+        m_pointLights[i].positionRadius = glm::vec4{ position, m_pointLights[i].positionRadius.w };
     }
 }
 
+// Turn of every dynamic Himmeli at a simulated time, on top of the
+// rotation it was loaded or moved with
+static glm::quat simulationSpin(double time)
+{
+    return glm::angleAxis(glm::radians(static_cast<float>(time) * MS_IN_SEC / 20.0f), glm::vec3(0, 1, 0));
+}
+
+void VKlelu::startSimulation()
+{
+    // The old thread is joined before the new one starts from where the
+    // scene is now, the clock carries on from its latest tick
+    uint64_t tick = m_simulation ? m_simulation->sample().latest->tick : 0;
+    m_simulation.reset();
+
+    SimSnapshot initial {
+        .tick = tick,
+        .time = static_cast<double>(tick) / m_options.simulationRate,
+        .positions = m_scene.positions(),
+        .rotations = m_scene.rotations(),
+        .scales = m_scene.scales()
+    };
+    for (const PointLight &light : m_pointLights)
+        initial.pointLights.push_back(glm::vec3(light.positionRadius));
+
+    // The step owns copies of everything it reads, the scene belongs to
+    // the render thread. The spin so far is taken out of the rotations so
+    // that they carry on from where they are.
+    std::vector<uint8_t> statics = m_scene.statics();
+    std::vector<glm::vec3> lightOrigins = m_pointLightOrigins;
+    std::vector<glm::quat> baseRotations(initial.rotations.size());
+    glm::quat unspin = glm::inverse(simulationSpin(initial.time));
+    for (size_t i = 0; i < baseRotations.size(); ++i)
+        baseRotations[i] = unspin * initial.rotations[i];
+
+    auto step = [statics, lightOrigins, baseRotations](SimSnapshot &snapshot) {
+        float time = static_cast<float>(snapshot.time);
+        glm::quat spin = simulationSpin(snapshot.time);
+        for (size_t i = 0; i < snapshot.rotations.size(); ++i) {
+            if (!statics[i])
+                snapshot.rotations[i] = spin * baseRotations[i];
+        }
+
+        for (size_t i = 0; i < snapshot.pointLights.size(); ++i)
+            snapshot.pointLights[i] = lightOrigins[i] + glm::vec3{ 0.0f, std::sin(time + static_cast<float>(i)), 0.0f };
+    };
+
+    m_simulation = std::make_unique<Simulation>(std::move(initial), m_options.simulationRate, std::move(step));
+    m_simulation->start();
+    m_simulationVersion = m_scene.version();
+    m_simulationTransformVersion = m_scene.transformVersion();
+}
+
 void VKlelu::draw()
 {
     FrameData &currentFrame = getCurrentFrame();
@@ -113,11 +471,48 @@ void VKlelu::draw()
     VK_CHECK(vkWaitForFences(m_device, 1, &currentFrame.renderFence, true, NS_IN_SEC));
     VK_CHECK(vkResetFences(m_device, 1, &currentFrame.renderFence));
 
+    if (m_shaderWatcher)
+        applyShaderReloads();
+
+    // Counters of the last frame that used this slot are final after the fence
+    CullStats *cullStats = (CullStats *)currentFrame.cullStatsBufferMapping;
+    m_frameStats.drawnObjects = cullStats->drawnEarly + cullStats->drawnLate;
+    m_frameStats.occludedObjects = cullStats->occluded;
+    m_frameStats.frustumCulledObjects = cullStats->frustumCulled;
+    m_frameStats.drawnMeshlets = cullStats->meshletsDrawn;
+    m_frameStats.culledMeshlets = cullStats->meshletsCulled;
+
+    if (m_frameCount >= MAX_FRAMES_IN_FLIGHT)
+        readTimestamps(currentFrame);
+
+    updateResolutionScale();
+
+    collectCapture(currentFrame);
+
+    // Headless targets are owned per frame in flight so the fence is enough
     uint32_t swapchainImageIndex;
-    VK_CHECK(vkAcquireNextImageKHR(m_device, m_swapchain, NS_IN_SEC, currentFrame.imageAcquiredSemaphore, nullptr, &swapchainImageIndex));
+    if (m_options.headless)
+        swapchainImageIndex = static_cast<uint32_t>(m_frameCount % MAX_FRAMES_IN_FLIGHT);
+    else
+        VK_CHECK(vkAcquireNextImageKHR(m_device, m_swapchain, NS_IN_SEC, currentFrame.imageAcquiredSemaphore, nullptr, &swapchainImageIndex));
 
     SwapchainData &currentImage = m_swapchainData[swapchainImageIndex];
 
+    updateFrameData();
+
+    // Light binning only depends on the camera and the lights, so it goes
+    // out first and overlaps with recording and the culling passes
+    VkCommandBuffer computeCmd = m_compute->begin(static_cast<uint32_t>(m_frameCount % MAX_FRAMES_IN_FLIGHT));
+    bool computeTimestamps = m_ctx->computeQueueTimestamps();
+    if (computeTimestamps) {
+        vkCmdResetQueryPool(computeCmd, currentFrame.timestampPool, TIMESTAMP_LIGHT_CULL_START, 2);
+        vkCmdWriteTimestamp2(computeCmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, currentFrame.timestampPool, TIMESTAMP_LIGHT_CULL_START);
+    }
+    cullLights(computeCmd);
+    if (computeTimestamps)
+        vkCmdWriteTimestamp2(computeCmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, currentFrame.timestampPool, TIMESTAMP_LIGHT_CULL_END);
+    VkSemaphore lightCullSemaphore = m_compute->submit(static_cast<uint32_t>(m_frameCount % MAX_FRAMES_IN_FLIGHT));
+
     VK_CHECK(vkResetCommandBuffer(currentFrame.mainCommandBuffer, 0));
 
     VkCommandBuffer cmd = currentFrame.mainCommandBuffer;
@@ -129,14 +524,61 @@ void VKlelu::draw()
 
     VK_CHECK(vkBeginCommandBuffer(cmd, &cmdBeginInfo));
 
-    imageLayoutTransition(cmd, currentImage.image,
-                               VK_IMAGE_ASPECT_COLOR_BIT,
-                               VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT,
-                               0,
-                               VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT,
-                               VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT,
-                               VK_IMAGE_LAYOUT_UNDEFINED,
-                               VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
+    vkCmdResetQueryPool(cmd, currentFrame.timestampPool, 0, TIMESTAMP_GRAPHICS_COUNT);
+    vkCmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, currentFrame.timestampPool, TIMESTAMP_FRAME_START);
+
+    m_renderGraph->setImage(m_swapchainResource, currentImage.image, currentImage.imageView, VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT);
+
+    if (m_commandCache)
+        recordDrawCommands(currentFrame);
+
+    m_renderGraph->execute(cmd);
+
+    VK_CHECK(vkEndCommandBuffer(cmd));
+
+    // Only shading reads the clusters, culling and the pre-pass don't wait
+    VkSemaphore waitSemaphores[2] = { lightCullSemaphore, currentFrame.imageAcquiredSemaphore };
+    VkPipelineStageFlags waitStages[2] = { VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT };
+    uint32_t semaphoreCount = m_options.headless ? 0 : 1;
+
+    VkSubmitInfo submit {
+        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+        .waitSemaphoreCount = 1 + semaphoreCount,
+        .pWaitSemaphores = waitSemaphores,
+        .pWaitDstStageMask = waitStages,
+        .commandBufferCount = 1,
+        .pCommandBuffers = &cmd,
+        .signalSemaphoreCount = semaphoreCount,
+        .pSignalSemaphores = &currentImage.renderSemaphore
+    };
+
+    VK_CHECK(vkQueueSubmit(m_ctx->graphicsQueue(), 1, &submit, currentFrame.renderFence));
+
+    if (m_options.headless) {
+        ++m_frameCount;
+        return;
+    }
+
+    VkPresentInfoKHR present {
+        .sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
+        .waitSemaphoreCount = 1,
+        .pWaitSemaphores = &currentImage.renderSemaphore,
+        .swapchainCount = 1,
+        .pSwapchains = &m_swapchain,
+        .pImageIndices = &swapchainImageIndex
+    };
+
+    VK_CHECK(vkQueuePresentKHR(m_ctx->graphicsQueue(), &present));
+
+    ++m_frameCount;
+}
+
+void VKlelu::drawPhase(VkCommandBuffer cmd, uint32_t phase)
+{
+    FrameData &currentFrame = getCurrentFrame();
+
+    // The late phase adds what the early phase missed on top of it
+    VkAttachmentLoadOp loadOp = phase ? VK_ATTACHMENT_LOAD_OP_LOAD : VK_ATTACHMENT_LOAD_OP_CLEAR;
 
     VkClearValue clearColor {
         .color = { 0.0f, 0.0f, 0.5f, 1.0f }
@@ -144,9 +586,9 @@ void VKlelu::draw()
 
     VkRenderingAttachmentInfo colorInfo {
         .sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO,
-        .imageView = currentImage.imageView,
+        .imageView = m_renderGraph->imageView(m_renderTarget),
         .imageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
-        .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+        .loadOp = loadOp,
         .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
         .clearValue = clearColor
     };
@@ -157,20 +599,30 @@ void VKlelu::draw()
 
     VkRenderingAttachmentInfo depthInfo {
         .sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO,
-        .imageView = m_depthImage.imageView,
+        .imageView = m_renderGraph->imageView(m_depthImage),
         .imageLayout = VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL,
-        .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+        .loadOp = loadOp,
         .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
         .clearValue = depthValue
     };
 
     VkRect2D renderArea {
         .offset = { 0, 0 },
-        .extent = m_fbSize
+        .extent = m_renderExtent
+    };
+
+    VkViewport viewport {
+        .x = 0.0f,
+        .y = 0.0f,
+        .width = static_cast<float>(m_renderExtent.width),
+        .height = static_cast<float>(m_renderExtent.height),
+        .minDepth = 0.0f,
+        .maxDepth = 1.0f
     };
 
     VkRenderingInfo renderInfo {
         .sType = VK_STRUCTURE_TYPE_RENDERING_INFO,
+        .flags = static_cast<VkRenderingFlags>(m_commandCache ? VK_RENDERING_CONTENTS_SECONDARY_COMMAND_BUFFERS_BIT : 0),
         .renderArea = renderArea,
         .layerCount = 1,
         .colorAttachmentCount = 1,
@@ -180,58 +632,40 @@ void VKlelu::draw()
 
     vkCmdBeginRendering(cmd, &renderInfo);
 
-    drawObjects(cmd);
-
-    vkCmdEndRendering(cmd);
-
-    imageLayoutTransition(cmd, currentImage.image,
-                               VK_IMAGE_ASPECT_COLOR_BIT,
-                               VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT,
-                               VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT,
-                               VK_PIPELINE_STAGE_2_NONE,
-                               0,
-                               VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
-                               VK_IMAGE_LAYOUT_PRESENT_SRC_KHR);
+    if (m_commandCache) {
+        vkCmdExecuteCommands(cmd, 1, &currentFrame.drawCommands[phase]);
+    } else {
+        vkCmdSetViewport(cmd, 0, 1, &viewport);
+        vkCmdSetScissor(cmd, 0, 1, &renderArea);
 
-    VK_CHECK(vkEndCommandBuffer(cmd));
-
-    VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-
-    VkSubmitInfo submit {
-        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-        .waitSemaphoreCount = 1,
-        .pWaitSemaphores = &currentFrame.imageAcquiredSemaphore,
-        .pWaitDstStageMask = &waitStage,
-        .commandBufferCount = 1,
-        .pCommandBuffers = &cmd,
-        .signalSemaphoreCount = 1,
-        .pSignalSemaphores = &currentImage.renderSemaphore
-    };
+        if (m_options.depthPrepass)
+            drawObjects(cmd, phase, true);
 
-    VK_CHECK(vkQueueSubmit(m_ctx->graphicsQueue(), 1, &submit, currentFrame.renderFence));
+        vkCmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, currentFrame.timestampPool, phase ? TIMESTAMP_LATE_PREPASS : TIMESTAMP_EARLY_PREPASS);
 
-    VkPresentInfoKHR present {
-        .sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
-        .waitSemaphoreCount = 1,
-        .pWaitSemaphores = &currentImage.renderSemaphore,
-        .swapchainCount = 1,
-        .pSwapchains = &m_swapchain,
-        .pImageIndices = &swapchainImageIndex
-    };
+        drawObjects(cmd, phase, false);
+    }
 
-    VK_CHECK(vkQueuePresentKHR(m_ctx->graphicsQueue(), &present));
+    vkCmdEndRendering(cmd);
 
-    ++m_frameCount;
+    vkCmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, currentFrame.timestampPool, phase ? TIMESTAMP_LATE_SHADING : TIMESTAMP_EARLY_SHADING);
 }
 
-void VKlelu::drawObjects(VkCommandBuffer cmd)
+void VKlelu::updateFrameData()
 {
     FrameData &currentFrame = getCurrentFrame();
 
-    glm::vec3 camera = { 0.0f, 0.0f, -5.0f };
-    m_sceneParameters.cameraPos = glm::vec4{ camera, 1.0f };
-    glm::mat4 view = glm::translate(glm::mat4(1.0f), camera);
-    glm::mat4 projection = glm::perspective(glm::radians(70.0f), static_cast<float>(m_fbSize.width)/static_cast<float>(m_fbSize.height), 0.1f, 200.0f);
+    m_sceneParameters.cameraPos = glm::vec4{ m_camera.position, 1.0f };
+
+    // Fragments find their cluster from the tile they are in and the log of
+    // their view depth
+    float sliceScale = CLUSTER_GRID_Z / std::log(m_camera.farPlane / m_camera.nearPlane);
+    glm::vec2 tileSize{ (m_renderExtent.width + CLUSTER_GRID_X - 1) / CLUSTER_GRID_X,
+                        (m_renderExtent.height + CLUSTER_GRID_Y - 1) / CLUSTER_GRID_Y };
+    m_sceneParameters.clusterParams = glm::vec4{ tileSize, sliceScale, -sliceScale * std::log(m_camera.nearPlane) };
+    m_sceneParameters.clusterGrid = glm::uvec4{ CLUSTER_GRID_X, CLUSTER_GRID_Y, CLUSTER_GRID_Z, 0 };
+    glm::mat4 view = glm::lookAt(m_camera.position, m_camera.target, glm::vec3{ 0.0f, 1.0f, 0.0f });
+    glm::mat4 projection = glm::perspective(glm::radians(m_camera.fov), static_cast<float>(m_fbSize.width)/static_cast<float>(m_fbSize.height), m_camera.nearPlane, m_camera.farPlane);
     projection[1][1] *= -1;
 
     CameraData cam {
@@ -243,323 +677,1479 @@ void VKlelu::drawObjects(VkCommandBuffer cmd)
     void *camData = currentFrame.cameraBufferMapping;
     memcpy(camData, &cam, sizeof(cam));
 
+    memcpy(currentFrame.lightBufferMapping, m_pointLights.data(), m_pointLights.size() * sizeof(PointLight));
+
+    if (m_drawBatchesVersion != m_scene.version())
+        buildDrawBatches();
+
+    // The static bounds are gathered again only when a static Himmeli or
+    // the light moves, the dynamic ones every frame
+    bool staticsChanged = !m_options.shadowCache
+                       || m_shadowCacheVersion != m_scene.staticVersion()
+                       || m_shadowCacheLight != m_sceneParameters.lightPos;
+    glm::vec3 staticMin = staticsChanged ? glm::vec3{ std::numeric_limits<float>::max() } : m_shadowStaticMin;
+    glm::vec3 staticMax = staticsChanged ? glm::vec3{ std::numeric_limits<float>::lowest() } : m_shadowStaticMax;
+    glm::vec3 dynamicMin{ std::numeric_limits<float>::max() };
+    glm::vec3 dynamicMax{ std::numeric_limits<float>::lowest() };
+
+    uint64_t transformStart = SDL_GetTicksNS();
+
+    std::vector<glm::vec3> &positions = m_scene.positions();
+    std::vector<glm::quat> &rotations = m_scene.rotations();
+    std::vector<glm::vec3> &scales = m_scene.scales();
+    std::vector<uint8_t> &statics = m_scene.statics();
+
+    ObjectData *objectSSBO = (ObjectData *)currentFrame.objectBufferMapping;
+    CullData *cullSSBO = (CullData *)currentFrame.cullBufferMapping;
+    for (size_t i = 0; i < m_drawOrder.size(); ++i) {
+        uint32_t index = m_drawOrder[i];
+        glm::mat3 rotation = glm::mat3_cast(rotations[index]);
+        glm::vec3 scale = scales[index];
+
+        // For a TRS transform the inverse transpose is just the rotation
+        // with the inverse scale, no need for a full matrix inverse
+        objectSSBO[i].model = glm::mat4{ glm::vec4{ rotation[0] * scale.x, 0.0f },
+                                         glm::vec4{ rotation[1] * scale.y, 0.0f },
+                                         glm::vec4{ rotation[2] * scale.z, 0.0f },
+                                         glm::vec4{ positions[index], 1.0f } };
+        objectSSBO[i].normalMat = glm::mat4{ glm::vec4{ rotation[0] / scale.x, 0.0f },
+                                             glm::vec4{ rotation[1] / scale.y, 0.0f },
+                                             glm::vec4{ rotation[2] / scale.z, 0.0f },
+                                             glm::vec4{ 0.0f, 0.0f, 0.0f, 1.0f } };
+
+        uint32_t batch = m_instanceBatches[i];
+        glm::vec4 bounds = m_meshes[m_drawBatches[batch].mesh].boundingSphere;
+        glm::vec3 absScale = glm::abs(scale);
+        glm::vec4 sphere{ positions[index] + rotation * (scale * glm::vec3{ bounds }),
+                          bounds.w * std::max(absScale.x, std::max(absScale.y, absScale.z)) };
+        cullSSBO[i].sphere = sphere;
+        cullSSBO[i].batch = batch;
+        cullSSBO[i].order = CULL_UNORDERED;
+
+        if (i >= m_firstBlendedInstance) {
+            glm::vec3 toCamera = glm::vec3{ sphere } - m_camera.position;
+            m_blendDistances[i - m_firstBlendedInstance] = { glm::dot(toCamera, toCamera), static_cast<uint32_t>(i) };
+        }
+
+        if (!statics[index]) {
+            dynamicMin = glm::min(dynamicMin, glm::vec3{ sphere } - sphere.w);
+            dynamicMax = glm::max(dynamicMax, glm::vec3{ sphere } + sphere.w);
+        } else if (staticsChanged) {
+            staticMin = glm::min(staticMin, glm::vec3{ sphere } - sphere.w);
+            staticMax = glm::max(staticMax, glm::vec3{ sphere } + sphere.w);
+        }
+    }
+
+    // Culling places blended instances at their order instead of
+    // compacting them, so they are drawn back to front within the batch
+    for (uint32_t b = 0; b < m_drawBatches.size(); ++b) {
+        const DrawBatch &batch = m_drawBatches[b];
+        if (batch.firstInstance < m_firstBlendedInstance)
+            continue;
+
+        auto first = m_blendDistances.begin() + (batch.firstInstance - m_firstBlendedInstance);
+        std::sort(first, first + batch.instanceCount, std::greater<>());
+        for (uint32_t order = 0; order < batch.instanceCount; ++order)
+            cullSSBO[first[order].second].order = order;
+    }
+
+    m_frameStats.transformNs = SDL_GetTicksNS() - transformStart;
+    m_frameStats.recordNs = 0;
+
+    // Every caster has to stay inside the light frustum, a dynamic one
+    // that leaves it refits the frustum and with it the static cache
+    glm::vec3 castersMin = glm::min(staticMin, dynamicMin);
+    glm::vec3 castersMax = glm::max(staticMax, dynamicMax);
+    if (glm::any(glm::greaterThan(castersMin, castersMax)))
+        castersMin = castersMax = glm::vec3{ 0.0f };
+
+    m_shadowCacheDirty = staticsChanged
+                      || glm::any(glm::lessThan(castersMin, m_shadowBoundsMin))
+                      || glm::any(glm::greaterThan(castersMax, m_shadowBoundsMax));
+
+    if (m_shadowCacheDirty) {
+        // Without the cache the fit may as well be tight
+        glm::vec3 margin = m_options.shadowCache ? SHADOW_BOUNDS_MARGIN * (castersMax - castersMin) : glm::vec3{ 0.0f };
+        m_shadowBoundsMin = castersMin - margin;
+        m_shadowBoundsMax = castersMax + margin;
+        m_sceneParameters.lightViewProj = shadowViewProj(glm::vec3{ m_sceneParameters.lightPos }, m_shadowBoundsMin, m_shadowBoundsMax);
+        m_shadowStaticMin = staticMin;
+        m_shadowStaticMax = staticMax;
+        m_shadowCacheVersion = m_scene.staticVersion();
+        m_shadowCacheLight = m_sceneParameters.lightPos;
+    }
+
+    uint32_t shadowCasters = 0;
+    for (const DrawBatch &batch : m_drawBatches)
+        shadowCasters += m_shadowCacheDirty ? batch.instanceCount : batch.instanceCount - batch.staticCount;
+    m_frameStats.shadowCasters = shadowCasters;
+
     char *sceneData = (char *)m_sceneParameterBufferMapping;
     int frameIndex = m_frameCount % MAX_FRAMES_IN_FLIGHT;
     sceneData += sizeof(SceneData) * frameIndex;
     memcpy(sceneData, &m_sceneParameters, sizeof(SceneData));
 
-    void *objData = currentFrame.objectBufferMapping;;
-    ObjectData *objectSSBO = (ObjectData *)objData;
-    for (size_t i = 0; i < m_himmelit.size(); ++i) {
-        objectSSBO[i].model = m_himmelit[i].translate * m_himmelit[i].rotate * m_himmelit[i].scale;
-        objectSSBO[i].normalMat = glm::transpose(glm::inverse(objectSSBO[i].model));
+    // Instance counts are filled in by the cull shader, the late phase
+    // writes to the second half of the visible list
+    uint32_t batchCount = static_cast<uint32_t>(m_drawBatches.size());
+    VkDrawIndexedIndirectCommand *commands = (VkDrawIndexedIndirectCommand *)currentFrame.drawTemplateBufferMapping;
+    for (uint32_t b = 0; b < batchCount; ++b) {
+        commands[b] = {
+            .indexCount = m_meshes[m_drawBatches[b].mesh].numIndices,
+            .instanceCount = 0,
+            .firstIndex = 0,
+            .vertexOffset = static_cast<int32_t>(m_meshes[m_drawBatches[b].mesh].vertexOffset),
+            .firstInstance = m_drawBatches[b].firstInstance
+        };
+        commands[batchCount + b] = commands[b];
+        commands[batchCount + b].firstInstance += m_objectCapacity;
+
+        // Every blended instance is drawn in the late phase, after all of
+        // the opaque ones
+        if (m_drawBatches[b].firstInstance >= m_firstBlendedInstance)
+            commands[batchCount + b].instanceCount = m_drawBatches[b].instanceCount;
     }
 
-    Mesh *lastMesh = nullptr;
-    Material *lastMaterial = nullptr;
+    if (m_options.meshlets) {
+        MeshletBatch *meshletBatches = (MeshletBatch *)currentFrame.meshletBatchBufferMapping;
+        for (uint32_t b = 0; b < batchCount; ++b) {
+            const Mesh &mesh = m_meshes[m_drawBatches[b].mesh];
+            meshletBatches[b] = {
+                .meshletOffset = mesh.meshletOffset,
+                .meshletCount = mesh.meshletCount,
+                .drawOffset = m_drawBatches[b].meshletDrawOffset
+            };
+        }
+    }
 
-    for (size_t i = 0; i < m_himmelit.size(); ++i) {
-        Himmeli &himmeli = m_himmelit[i];
-        if (!himmeli.material || !himmeli.mesh)
-            continue;
+    // Symmetric frustum, so only the x and y side planes are needed
+    float p00 = projection[0][0];
+    float p11 = -projection[1][1];
+    glm::vec2 frustumX = glm::normalize(glm::vec2{ p00, 1.0f });
+    glm::vec2 frustumY = glm::normalize(glm::vec2{ p11, 1.0f });
 
-        if (himmeli.material != lastMaterial) {
-            vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, himmeli.material->pipeline);
-            lastMaterial = himmeli.material;
-            uint32_t uniformOffset = static_cast<uint32_t>(sizeof(SceneData)) * frameIndex;
-            vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, himmeli.material->pipelineLayout, 0, 1, &currentFrame.globalDescriptor, 1, &uniformOffset);
-            vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, himmeli.material->pipelineLayout, 1, 1, &currentFrame.objectDescriptor, 0, nullptr);
+    m_cullConstants = {
+        .view = view,
+        .frustum = glm::vec4{ frustumX, frustumY },
+        .projection = glm::vec4{ p00, p11, projection[2][2], projection[3][2] },
+        .znear = m_camera.nearPlane,
+        .zfar = m_camera.farPlane,
+        .pyramidWidth = static_cast<float>(m_depthPyramidSize.width),
+        .pyramidHeight = static_cast<float>(m_depthPyramidSize.height),
+        .instanceCount = static_cast<uint32_t>(m_drawOrder.size()),
+        .batchCount = batchCount,
+        .phase = 0,
+        .occlusion = m_options.occlusionCulling
+    };
+}
 
-            if (himmeli.material->textureSet != VK_NULL_HANDLE) {
-                vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, himmeli.material->pipelineLayout, 2, 1, &himmeli.material->textureSet, 0, nullptr);
-            }
-        }
+void VKlelu::cullObjects(VkCommandBuffer cmd, uint32_t phase)
+{
+    FrameData &currentFrame = getCurrentFrame();
 
-        int ii = static_cast<int>(i);
-        vkCmdPushConstants(cmd, himmeli.material->pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(int), &ii);
+    m_cullConstants.phase = phase;
 
-        if (himmeli.mesh != lastMesh) {
-            VkDeviceSize offset = 0;
-            VkBuffer vertexBuffer = himmeli.mesh->vertexBuffer->buffer();
-            vkCmdBindVertexBuffers(cmd, 0, 1, &vertexBuffer, &offset);
-            vkCmdBindIndexBuffer(cmd, himmeli.mesh->indexBuffer->buffer(), 0, VK_INDEX_TYPE_UINT32);
-            lastMesh = himmeli.mesh;
-        }
-        vkCmdDrawIndexed(cmd, himmeli.mesh->numIndices, 1, 0, 0, 0);
-    }
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_cullPipeline);
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_cullPipelineLayout, 0, 1, &currentFrame.cullDescriptor, 0, nullptr);
+    vkCmdPushConstants(cmd, m_cullPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(CullConstants), &m_cullConstants);
+
+    if (m_cullConstants.instanceCount)
+        vkCmdDispatch(cmd, (m_cullConstants.instanceCount + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE, 1, 1);
+
+    if (m_options.meshlets)
+        cullMeshlets(cmd, phase);
 }
 
-FrameData &VKlelu::getCurrentFrame()
+void VKlelu::cullMeshlets(VkCommandBuffer cmd, uint32_t phase)
 {
-    return m_frameData[m_frameCount % MAX_FRAMES_IN_FLIGHT];
+    FrameData &currentFrame = getCurrentFrame();
+
+    uint32_t batchCount = static_cast<uint32_t>(m_drawBatches.size());
+    if (!batchCount)
+        return;
+
+    MeshletConstants constants {
+        .view = m_cullConstants.view,
+        .frustum = m_cullConstants.frustum,
+        .cameraPos = m_sceneParameters.cameraPos,
+        .znear = m_cullConstants.znear,
+        .zfar = m_cullConstants.zfar,
+        .batch = 0,
+        .batchCount = batchCount,
+        .phase = phase
+    };
+
+    memoryBarrier(cmd, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                       VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+                       VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                       VK_ACCESS_2_SHADER_STORAGE_READ_BIT);
+
+    // The culled instance counts become one workgroup per group of
+    // clusters of every visible instance
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_meshletTaskPipeline);
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_meshletCullPipelineLayout, 0, 1, &currentFrame.meshletDescriptor, 0, nullptr);
+    vkCmdPushConstants(cmd, m_meshletCullPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(MeshletConstants), &constants);
+    vkCmdDispatch(cmd, (batchCount + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE, 1, 1);
+
+    // The task shader culls the clusters itself, the render graph orders
+    // the draws after culling
+    if (m_meshShaders)
+        return;
+
+    memoryBarrier(cmd, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                       VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+                       VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT,
+                       VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT);
+
+    // Without mesh shaders the same tests run in compute and every cluster
+    // that passes is compacted into an indexed draw of its triangles
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_meshletCullPipeline);
+
+    for (uint32_t b = 0; b < batchCount; ++b) {
+        constants.batch = b;
+        vkCmdPushConstants(cmd, m_meshletCullPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(MeshletConstants), &constants);
+        vkCmdDispatchIndirect(cmd, currentFrame.meshletTaskBuffer->buffer(), (phase * batchCount + b) * sizeof(VkDispatchIndirectCommand));
+    }
 }
 
-void VKlelu::initScene()
+void VKlelu::buildDepthPyramid(VkCommandBuffer cmd)
 {
-    ObjFile monkeyObj("suzanne.obj");
-    uploadMesh(monkeyObj, "monkey");
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_depthReducePipeline);
 
-    ImageFile monkeyTexture("suzanne_uv.png");
-    uploadImage(monkeyTexture, "monkey_diffuse");
+    // Only the rendered part of the depth buffer is reduced, the pyramid
+    // maps it to its full uv range
+    VkExtent2D srcSize = m_renderExtent;
 
-    createMaterial(m_meshPipeline, m_meshPipelineLayout, "monkey_material");
+    for (uint32_t i = 0; i < m_depthPyramidLevels; ++i) {
+        VkExtent2D dstSize {
+            .width = std::max(1u, m_depthPyramidSize.width >> i),
+            .height = std::max(1u, m_depthPyramidSize.height >> i)
+        };
 
-    Himmeli monkey {
-        .mesh = getMesh("monkey"),
-        .material = getMaterial("monkey_material"),
-        .scale = glm::mat4{ 1.0f },
-        .rotate = glm::mat4{ 1.0f },
-        .translate = glm::mat4{ 1.0f }
-    };
-    m_himmelit.push_back(monkey);
+        int32_t constants[4] = { static_cast<int32_t>(srcSize.width), static_cast<int32_t>(srcSize.height),
+                                 static_cast<int32_t>(dstSize.width), static_cast<int32_t>(dstSize.height) };
 
-    Material *monkeyMat = getMaterial("monkey_material");
+        vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_depthReducePipelineLayout, 0, 1, &m_depthReduceSets[i], 0, nullptr);
+        vkCmdPushConstants(cmd, m_depthReducePipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants), constants);
+        vkCmdDispatch(cmd, (dstSize.width + DEPTH_REDUCE_GROUP_SIZE - 1) / DEPTH_REDUCE_GROUP_SIZE,
+                           (dstSize.height + DEPTH_REDUCE_GROUP_SIZE - 1) / DEPTH_REDUCE_GROUP_SIZE, 1);
 
-    VkDescriptorSetAllocateInfo allocInfo {
-        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
-        .descriptorPool = m_descriptorPool,
-        .descriptorSetCount = 1,
-        .pSetLayouts = &m_singleTextureSetLayout
-    };
+        memoryBarrier(cmd, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                           VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+                           VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                           VK_ACCESS_2_SHADER_SAMPLED_READ_BIT);
 
-    VK_CHECK(vkAllocateDescriptorSets(m_device, &allocInfo, &monkeyMat->textureSet));
+        srcSize = dstSize;
+    }
+}
 
-    VkSamplerCreateInfo samplerInfo {
-        .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
-        .magFilter = VK_FILTER_LINEAR,
-        .minFilter = VK_FILTER_LINEAR,
-        .addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT,
-        .addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT,
-        .addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT
+void VKlelu::cullLights(VkCommandBuffer cmd)
+{
+    FrameData &currentFrame = getCurrentFrame();
+
+    LightCullConstants constants {
+        .grid = glm::uvec4{ CLUSTER_GRID_X, CLUSTER_GRID_Y, CLUSTER_GRID_Z, 0 },
+        .tileSize = glm::vec2{ m_sceneParameters.clusterParams },
+        .screenSize = glm::vec2{ m_renderExtent.width, m_renderExtent.height },
+        .znear = m_camera.nearPlane,
+        .zfar = m_camera.farPlane,
+        .lightCount = static_cast<uint32_t>(m_pointLights.size())
     };
 
-    VK_CHECK(vkCreateSampler(m_device, &samplerInfo, nullptr, &m_linearSampler));
-    deferCleanup([=, this](){ vkDestroySampler(m_device, m_linearSampler, nullptr); });
+    // One workgroup per cluster, every cluster is written so that empty
+    // ones get a zero count
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_lightCullPipeline);
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_lightCullPipelineLayout, 0, 1, &currentFrame.lightCullDescriptor, 0, nullptr);
+    vkCmdPushConstants(cmd, m_lightCullPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(LightCullConstants), &constants);
+    vkCmdDispatch(cmd, CLUSTER_GRID_X, CLUSTER_GRID_Y, CLUSTER_GRID_Z);
+}
 
-    VkDescriptorImageInfo imageInfo {
-        .imageView = m_textures["monkey_diffuse"].imageView,
-        .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
+void VKlelu::readTimestamps(FrameData &frame)
+{
+    uint64_t timestamps[TIMESTAMP_COUNT];
+    if (vkGetQueryPoolResults(m_device, frame.timestampPool, 0, TIMESTAMP_GRAPHICS_COUNT, TIMESTAMP_GRAPHICS_COUNT * sizeof(uint64_t), timestamps,
+                              sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) != VK_SUCCESS)
+        return;
+
+    double period = static_cast<double>(m_ctx->physicalDeviceProperties().limits.timestampPeriod);
+    auto elapsed = [&](int first, int last) {
+        return static_cast<uint64_t>(static_cast<double>(timestamps[last] - timestamps[first]) * period);
     };
 
-    VkWriteDescriptorSet texture {
-        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-        .dstSet = monkeyMat->textureSet,
-        .dstBinding = 0,
-        .descriptorCount = 1,
-        .descriptorType = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE,
-        .pImageInfo = &imageInfo
-    };
+    m_frameStats.gpuShadowCacheNs = elapsed(TIMESTAMP_FRAME_START, TIMESTAMP_SHADOW_CACHE);
+    m_frameStats.gpuShadowNs = elapsed(TIMESTAMP_SHADOW_CACHE, TIMESTAMP_SHADOWS);
+    m_frameStats.gpuCullNs = elapsed(TIMESTAMP_SHADOWS, TIMESTAMP_EARLY_CULL) + elapsed(TIMESTAMP_DEPTH_PYRAMID, TIMESTAMP_LATE_CULL);
+    m_frameStats.gpuPyramidNs = elapsed(TIMESTAMP_EARLY_SHADING, TIMESTAMP_DEPTH_PYRAMID);
+    m_frameStats.gpuPrepassNs = elapsed(TIMESTAMP_EARLY_CULL, TIMESTAMP_EARLY_PREPASS) + elapsed(TIMESTAMP_LATE_CULL, TIMESTAMP_LATE_PREPASS);
+    m_frameStats.gpuShadingNs = elapsed(TIMESTAMP_EARLY_PREPASS, TIMESTAMP_EARLY_SHADING) + elapsed(TIMESTAMP_LATE_PREPASS, TIMESTAMP_LATE_SHADING);
+    m_frameStats.gpuUpscaleNs = elapsed(TIMESTAMP_LATE_SHADING, TIMESTAMP_UPSCALE);
+    m_frameStats.gpuFrameNs = elapsed(TIMESTAMP_FRAME_START, TIMESTAMP_UPSCALE);
+
+    // Some compute families can't write timestamps at all
+    if (!m_ctx->computeQueueTimestamps()
+        || vkGetQueryPoolResults(m_device, frame.timestampPool, TIMESTAMP_LIGHT_CULL_START, 2, 2 * sizeof(uint64_t),
+                                 &timestamps[TIMESTAMP_LIGHT_CULL_START], sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) != VK_SUCCESS)
+        return;
+
+    m_frameStats.gpuLightCullNs = elapsed(TIMESTAMP_LIGHT_CULL_START, TIMESTAMP_LIGHT_CULL_END);
+
+    // Both queues count in the same time domain on a single device
+    uint64_t overlapStart = std::max(timestamps[TIMESTAMP_LIGHT_CULL_START], timestamps[TIMESTAMP_FRAME_START]);
+    uint64_t overlapEnd = std::min(timestamps[TIMESTAMP_LIGHT_CULL_END], timestamps[TIMESTAMP_UPSCALE]);
+    m_frameStats.gpuAsyncOverlapNs = overlapEnd > overlapStart
+                                   ? static_cast<uint64_t>(static_cast<double>(overlapEnd - overlapStart) * period)
+                                   : 0;
+}
 
-    VkDescriptorImageInfo imageSamplerInfo {
-        .sampler = m_linearSampler
-    };
+void VKlelu::captureFrame(VkCommandBuffer cmd, VkImage image)
+{
+    FrameData &currentFrame = getCurrentFrame();
 
-    VkWriteDescriptorSet sampler {
-        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-        .dstSet = monkeyMat->textureSet,
-        .dstBinding = 1,
-        .descriptorCount = 1,
-        .descriptorType = VK_DESCRIPTOR_TYPE_SAMPLER,
-        .pImageInfo = &imageSamplerInfo
+    VkBufferImageCopy copy {
+        .bufferOffset = 0,
+        .imageSubresource = {
+            .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+            .mipLevel = 0,
+            .baseArrayLayer = 0,
+            .layerCount = 1
+        },
+        .imageExtent = { m_fbSize.width, m_fbSize.height, 1 }
     };
 
-    VkWriteDescriptorSet writeSets[] = { texture, sampler };
-    vkUpdateDescriptorSets(m_device, 2, &writeSets[0], 0, nullptr);
+    vkCmdCopyImageToBuffer(cmd, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, currentFrame.readbackBuffer->buffer(), 1, &copy);
 
-    m_sceneParameters.lightPos = { -1.0f, 1.0f, 5.0f, 0.0f };
-    m_sceneParameters.lightColor = { 1.0f, 1.0f, 1.0f, 0.0f };
+    currentFrame.readbackPending = true;
 }
 
-Material *VKlelu::createMaterial(VkPipeline pipeline, VkPipelineLayout layout, const std::string name)
+void VKlelu::collectCapture(FrameData &frame)
 {
-    Material mat {
-        .pipeline = pipeline,
-        .pipelineLayout = layout
-    };
-    m_materials[name] = mat;
-    return &m_materials[name];
+    if (!frame.readbackPending)
+        return;
+
+    // The frame's fence has been waited on, copy out so that the slot can
+    // be reused while the writer thread encodes
+    std::vector<uint8_t> pixels = m_capture->acquire();
+    frame.readbackBuffer->invalidate();
+    memcpy(pixels.data(), frame.readbackBufferMapping, pixels.size());
+    m_capture->submit(std::move(pixels));
+
+    frame.readbackPending = false;
 }
 
-Mesh *VKlelu::getMesh(const std::string name)
+void VKlelu::updateResolutionScale()
 {
-    auto it = m_meshes.find(name);
-    if (it == m_meshes.end())
-        return nullptr;
-    return &(*it).second;
+    // Pixel cost follows the area, so aim for the square root of how far
+    // off the budget the measured frame was and ease towards it, the
+    // timings lag a couple of frames behind the scale they were taken at
+    if (m_options.gpuBudgetMs > 0.0f && m_frameStats.gpuFrameNs) {
+        double ratio = static_cast<double>(m_options.gpuBudgetMs) * 1e6 / static_cast<double>(m_frameStats.gpuFrameNs);
+        float target = m_resolutionScale * static_cast<float>(std::sqrt(ratio));
+        m_resolutionScale += (target - m_resolutionScale) * RESOLUTION_SCALE_RATE;
+        m_resolutionScale = std::clamp(m_resolutionScale, MIN_RESOLUTION_SCALE, 1.0f);
+    }
+
+    VkExtent2D extent = m_renderExtent;
+    m_renderExtent.width = std::max(1u, static_cast<uint32_t>(static_cast<float>(m_fbSize.width) * m_resolutionScale));
+    m_renderExtent.height = std::max(1u, static_cast<uint32_t>(static_cast<float>(m_fbSize.height) * m_resolutionScale));
+    if (m_renderExtent.width != extent.width || m_renderExtent.height != extent.height)
+        ++m_drawCommandsVersion;
+    m_frameStats.resolutionScale = m_resolutionScale;
+
+    if (std::abs(m_resolutionScale - m_loggedResolutionScale) >= 0.05f) {
+        fprintf(stderr, "Resolution scale %.2f, rendering at %ux%u\n",
+                static_cast<double>(m_resolutionScale), m_renderExtent.width, m_renderExtent.height);
+        m_loggedResolutionScale = m_resolutionScale;
+    }
 }
 
-Material *VKlelu::getMaterial(const std::string name)
+void VKlelu::upscale(VkCommandBuffer cmd, VkImageView target)
 {
-    auto it = m_materials.find(name);
-    if (it == m_materials.end())
-        return nullptr;
-    return &(*it).second;
+    VkRenderingAttachmentInfo colorInfo {
+        .sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO,
+        .imageView = target,
+        .imageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+        .loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+        .storeOp = VK_ATTACHMENT_STORE_OP_STORE
+    };
+
+    VkRect2D renderArea {
+        .offset = { 0, 0 },
+        .extent = m_fbSize
+    };
+
+    VkRenderingInfo renderInfo {
+        .sType = VK_STRUCTURE_TYPE_RENDERING_INFO,
+        .renderArea = renderArea,
+        .layerCount = 1,
+        .colorAttachmentCount = 1,
+        .pColorAttachments = &colorInfo
+    };
+
+    VkViewport viewport {
+        .x = 0.0f,
+        .y = 0.0f,
+        .width = static_cast<float>(m_fbSize.width),
+        .height = static_cast<float>(m_fbSize.height),
+        .minDepth = 0.0f,
+        .maxDepth = 1.0f
+    };
+
+    UpscaleConstants constants {
+        .uvScale = glm::vec2{ m_renderExtent.width, m_renderExtent.height } / glm::vec2{ m_fbSize.width, m_fbSize.height },
+        .texelSize = glm::vec2{ 1.0f } / glm::vec2{ m_fbSize.width, m_fbSize.height },
+        // Nothing to bring back at native resolution
+        .sharpness = m_resolutionScale < 1.0f ? UPSCALE_SHARPNESS : 0.0f
+    };
+
+    vkCmdBeginRendering(cmd, &renderInfo);
+
+    vkCmdSetViewport(cmd, 0, 1, &viewport);
+    vkCmdSetScissor(cmd, 0, 1, &renderArea);
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, m_upscalePipeline);
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, m_upscalePipelineLayout, 0, 1, &m_upscaleSet, 0, nullptr);
+    vkCmdPushConstants(cmd, m_upscalePipelineLayout, VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof(constants), &constants);
+    vkCmdDraw(cmd, 3, 1, 0, 0);
+
+    vkCmdEndRendering(cmd);
 }
 
-void VKlelu::uploadMesh(ObjFile &obj, std::string name)
+void VKlelu::drawObjects(VkCommandBuffer cmd, uint32_t phase, bool depthOnly)
 {
-    Mesh mesh;
-    mesh.numVertices = static_cast<uint32_t>(obj.vertices.size());
-    mesh.numIndices = static_cast<uint32_t>(obj.indices.size());
-    size_t vertexBufferSize = mesh.numVertices * sizeof(Vertex);
-    size_t indexBufferSize = mesh.numIndices * sizeof(uint32_t);
+    FrameData &currentFrame = getCurrentFrame();
 
-    auto stagingBuffer = m_ctx->allocateBuffer(vertexBufferSize + indexBufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_ONLY);
+    uint64_t recordStart = SDL_GetTicksNS();
+    uint32_t frameIndex = static_cast<uint32_t>(m_frameCount % MAX_FRAMES_IN_FLIGHT);
+    size_t batchCount = m_drawBatches.size();
+
+    // The depth pipeline shares the mesh pipeline layout and needs only the
+    // camera and object sets, materials don't matter
+    if (depthOnly) {
+        uint32_t uniformOffset = static_cast<uint32_t>(sizeof(SceneData)) * frameIndex;
+        vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, m_depthPipeline);
+        vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, m_meshPipelineLayout, 0, 1, &currentFrame.globalDescriptor, 1, &uniformOffset);
+        vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, m_meshPipelineLayout, 1, 1, &currentFrame.objectDescriptor, 0, nullptr);
+
+        MeshHandle lastMesh = INVALID_HANDLE;
+
+        for (size_t b = 0; b < batchCount; ++b) {
+            const DrawBatch &batch = m_drawBatches[b];
+            Mesh &mesh = m_meshes[batch.mesh];
+
+            // Blended surfaces must not hide the opaque ones behind them
+            if (m_materials[batch.material].state.blend)
+                continue;
+
+            if (batch.mesh != lastMesh) {
+                if (mesh.positionBuffer) {
+                    VkDeviceSize offset = 0;
+                    VkBuffer positionBuffer = mesh.positionBuffer->buffer();
+                    vkCmdBindVertexBuffers(cmd, 0, 1, &positionBuffer, &offset);
+                }
+                vkCmdBindIndexBuffer(cmd, mesh.indexBuffer->buffer(), 0, VK_INDEX_TYPE_UINT32);
+                lastMesh = batch.mesh;
+            }
 
-    void *data = stagingBuffer->map();
-    memcpy(data, obj.vertices.data(), vertexBufferSize);
-    memcpy((uint8_t *)data + vertexBufferSize, obj.indices.data(), indexBufferSize);
+            VkDeviceSize commandOffset = (phase * batchCount + b) * sizeof(VkDrawIndexedIndirectCommand);
+            vkCmdDrawIndexedIndirect(cmd, currentFrame.drawCommandBuffer->buffer(), commandOffset, 1, sizeof(VkDrawIndexedIndirectCommand));
+        }
 
-    mesh.vertexBuffer = m_ctx->allocateBuffer(vertexBufferSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
-    mesh.indexBuffer = m_ctx->allocateBuffer(indexBufferSize, VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+        m_frameStats.recordNs += SDL_GetTicksNS() - recordStart;
+        return;
+    }
 
-    immediateSubmit([&](VkCommandBuffer cmd) {
-        VkBufferCopy copy {
-            .srcOffset = 0,
-            .dstOffset = 0,
-            .size = vertexBufferSize
-        };
-        vkCmdCopyBuffer(cmd, stagingBuffer->buffer(), mesh.vertexBuffer->buffer(), 1, &copy);
+    if (m_meshShaders) {
+        drawMeshlets(cmd, phase);
+        m_frameStats.recordNs += SDL_GetTicksNS() - recordStart;
+        return;
+    }
 
-        copy.srcOffset = vertexBufferSize;
-        copy.size = indexBufferSize;
-        vkCmdCopyBuffer(cmd, stagingBuffer->buffer(), mesh.indexBuffer->buffer(), 1, &copy);
-    });
+    VkPipeline lastPipeline = VK_NULL_HANDLE;
+    VkPipelineLayout lastLayout = VK_NULL_HANDLE;
+    MaterialHandle lastMaterial = INVALID_HANDLE;
+    MeshHandle lastMesh = INVALID_HANDLE;
+    const MaterialState *lastState = nullptr;
 
-    m_meshes[name] = std::move(mesh);
+    // Compacted clusters of every mesh index into the same vertices, the
+    // pulled streams are concatenated in the same order
+    if (m_options.meshlets) {
+        if (!m_options.vertexPulling) {
+            VkDeviceSize offset = 0;
+            VkBuffer vertexBuffer = m_sceneVertexBuffer->buffer();
+            vkCmdBindVertexBuffers(cmd, 0, 1, &vertexBuffer, &offset);
+        }
+        vkCmdBindIndexBuffer(cmd, m_meshletIndexBuffer->buffer(), 0, VK_INDEX_TYPE_UINT32);
+    }
+
+    for (size_t b = 0; b < batchCount; ++b) {
+        const DrawBatch &batch = m_drawBatches[b];
+        Material &material = m_materials[batch.material];
+        Mesh &mesh = m_meshes[batch.mesh];
+
+        if (material.pipeline != lastPipeline) {
+            vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, material.pipeline);
+            lastPipeline = material.pipeline;
+            lastState = nullptr;
+        }
+
+        if (m_dynamicState && (!lastState || !(material.state == *lastState))) {
+            setMaterialState(cmd, material.state, lastState);
+            lastState = &material.state;
+        }
+
+        if (material.pipelineLayout != lastLayout) {
+            uint32_t uniformOffset = static_cast<uint32_t>(sizeof(SceneData)) * frameIndex;
+            vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, material.pipelineLayout, 0, 1, &currentFrame.globalDescriptor, 1, &uniformOffset);
+            vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, material.pipelineLayout, 1, 1, &currentFrame.objectDescriptor, 0, nullptr);
+            lastLayout = material.pipelineLayout;
+            lastMaterial = INVALID_HANDLE;
+        }
+
+        if (batch.material != lastMaterial) {
+            if (material.textureSet != VK_NULL_HANDLE) {
+                vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, material.pipelineLayout, 2, 1, &material.textureSet, 0, nullptr);
+            }
+            lastMaterial = batch.material;
+        }
+
+        if (m_options.meshlets) {
+            VkDeviceSize drawOffset = (static_cast<VkDeviceSize>(phase) * MAX_MESHLET_DRAWS + batch.meshletDrawOffset) * sizeof(VkDrawIndexedIndirectCommand);
+            VkDeviceSize countOffset = (phase * batchCount + b) * sizeof(uint32_t);
+            vkCmdDrawIndexedIndirectCount(cmd, currentFrame.meshletDrawBuffer->buffer(), drawOffset,
+                                          currentFrame.meshletDrawCountBuffer->buffer(), countOffset,
+                                          batch.instanceCount * mesh.meshletCount, sizeof(VkDrawIndexedIndirectCommand));
+            continue;
+        }
+
+        if (batch.mesh != lastMesh) {
+            if (mesh.vertexBuffer) {
+                VkDeviceSize offset = 0;
+                VkBuffer vertexBuffer = mesh.vertexBuffer->buffer();
+                vkCmdBindVertexBuffers(cmd, 0, 1, &vertexBuffer, &offset);
+            }
+            vkCmdBindIndexBuffer(cmd, mesh.indexBuffer->buffer(), 0, VK_INDEX_TYPE_UINT32);
+            lastMesh = batch.mesh;
+        }
+
+        VkDeviceSize commandOffset = (phase * batchCount + b) * sizeof(VkDrawIndexedIndirectCommand);
+        vkCmdDrawIndexedIndirect(cmd, currentFrame.drawCommandBuffer->buffer(), commandOffset, 1, sizeof(VkDrawIndexedIndirectCommand));
+    }
+
+    m_frameStats.recordNs += SDL_GetTicksNS() - recordStart;
 }
 
-void VKlelu::uploadImage(ImageFile &image, std::string name)
+void VKlelu::recordDrawCommands(FrameData &frame)
 {
-    Texture texture;
-    VkDeviceSize imageSize = image.width * image.height * 4;
-    VkFormat imageFormat = VK_FORMAT_R8G8B8A8_SRGB;
+    if (frame.drawCommandsVersion == m_drawCommandsVersion)
+        return;
 
-    auto stagingBuffer = m_ctx->allocateBuffer(imageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_ONLY);
+    // Only buffer contents change from frame to frame, the draws themselves
+    // are replayed until the batches, materials or render extent change
+    VkCommandBufferInheritanceRenderingInfo renderingInfo {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_RENDERING_INFO,
+        .colorAttachmentCount = 1,
+        .pColorAttachmentFormats = &m_renderTargetFormat,
+        .depthAttachmentFormat = m_depthImageFormat,
+        .rasterizationSamples = VK_SAMPLE_COUNT_1_BIT
+    };
 
-    void *data = stagingBuffer->map();
-    memcpy(data, image.pixels, imageSize);
+    VkCommandBufferInheritanceInfo inheritanceInfo {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO,
+        .pNext = &renderingInfo
+    };
 
-    VkExtent3D imageExtent {
-        .width = static_cast<uint32_t>(image.width),
-        .height = static_cast<uint32_t>(image.height),
-        .depth = 1
+    VkCommandBufferBeginInfo beginInfo {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+        .flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT,
+        .pInheritanceInfo = &inheritanceInfo
     };
 
-    texture.image = m_ctx->allocateImage(imageExtent, imageFormat, VK_SAMPLE_COUNT_1_BIT, VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+    // Dynamic state isn't inherited from the primary
+    VkRect2D renderArea {
+        .offset = { 0, 0 },
+        .extent = m_renderExtent
+    };
 
-    immediateSubmit([&](VkCommandBuffer cmd) {
-        VkImageSubresourceRange range {
-            .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-            .baseMipLevel = 0,
-            .levelCount = 1,
-            .baseArrayLayer = 0,
-            .layerCount = 1
-        };
- 
-        VkImageMemoryBarrier barrier {
-            .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-            .srcAccessMask = 0,
-            .dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
-            .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-            .newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-            .image = texture.image->image(),
-            .subresourceRange = range
+    VkViewport viewport {
+        .x = 0.0f,
+        .y = 0.0f,
+        .width = static_cast<float>(m_renderExtent.width),
+        .height = static_cast<float>(m_renderExtent.height),
+        .minDepth = 0.0f,
+        .maxDepth = 1.0f
+    };
+
+    for (uint32_t phase = 0; phase < 2; ++phase) {
+        VkCommandBuffer cmd = frame.drawCommands[phase];
+        VK_CHECK(vkBeginCommandBuffer(cmd, &beginInfo));
+
+        vkCmdSetViewport(cmd, 0, 1, &viewport);
+        vkCmdSetScissor(cmd, 0, 1, &renderArea);
+
+        if (m_options.depthPrepass)
+            drawObjects(cmd, phase, true);
+
+        vkCmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, frame.timestampPool, phase ? TIMESTAMP_LATE_PREPASS : TIMESTAMP_EARLY_PREPASS);
+
+        drawObjects(cmd, phase, false);
+
+        VK_CHECK(vkEndCommandBuffer(cmd));
+    }
+
+    frame.drawCommandsVersion = m_drawCommandsVersion;
+}
+
+void VKlelu::drawMeshlets(VkCommandBuffer cmd, uint32_t phase)
+{
+    FrameData &currentFrame = getCurrentFrame();
+
+    uint32_t frameIndex = static_cast<uint32_t>(m_frameCount % MAX_FRAMES_IN_FLIGHT);
+    uint32_t batchCount = static_cast<uint32_t>(m_drawBatches.size());
+    uint32_t uniformOffset = static_cast<uint32_t>(sizeof(SceneData)) * frameIndex;
+
+    MeshletConstants constants {
+        .view = m_cullConstants.view,
+        .frustum = m_cullConstants.frustum,
+        .cameraPos = m_sceneParameters.cameraPos,
+        .znear = m_cullConstants.znear,
+        .zfar = m_cullConstants.zfar,
+        .batch = 0,
+        .batchCount = batchCount,
+        .phase = phase
+    };
+
+    // Every pipeline permutation shares the layout, the sets stay bound
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, m_meshletPipelineLayout, 0, 1, &currentFrame.globalDescriptor, 1, &uniformOffset);
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, m_meshletPipelineLayout, 1, 1, &currentFrame.objectDescriptor, 0, nullptr);
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, m_meshletPipelineLayout, 3, 1, &currentFrame.meshletDescriptor, 0, nullptr);
+
+    VkPipeline lastPipeline = VK_NULL_HANDLE;
+    MaterialHandle lastMaterial = INVALID_HANDLE;
+    const MaterialState *lastState = nullptr;
+
+    for (uint32_t b = 0; b < batchCount; ++b) {
+        const DrawBatch &batch = m_drawBatches[b];
+        Material &material = m_materials[batch.material];
+
+        VkPipeline pipeline = meshletPipeline(material.state);
+        if (pipeline != lastPipeline) {
+            vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+            lastPipeline = pipeline;
+            lastState = nullptr;
+        }
+
+        if (m_dynamicState && (!lastState || !(material.state == *lastState))) {
+            setMaterialState(cmd, material.state, lastState);
+            lastState = &material.state;
+        }
+
+        if (batch.material != lastMaterial) {
+            if (material.textureSet != VK_NULL_HANDLE) {
+                vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, m_meshletPipelineLayout, 2, 1, &material.textureSet, 0, nullptr);
+            }
+            lastMaterial = batch.material;
+        }
+
+        constants.batch = b;
+        vkCmdPushConstants(cmd, m_meshletPipelineLayout, VK_SHADER_STAGE_TASK_BIT_EXT, 0, sizeof(MeshletConstants), &constants);
+        m_cmdDrawMeshTasksIndirect(cmd, currentFrame.meshletTaskBuffer->buffer(),
+                                   (phase * batchCount + b) * sizeof(VkDrawMeshTasksIndirectCommandEXT), 1,
+                                   sizeof(VkDrawMeshTasksIndirectCommandEXT));
+    }
+}
+
+void VKlelu::drawShadows(VkCommandBuffer cmd, VkImageView target, bool statics, bool dynamics)
+{
+    FrameData &currentFrame = getCurrentFrame();
+
+    uint64_t recordStart = SDL_GetTicksNS();
+    uint32_t frameIndex = static_cast<uint32_t>(m_frameCount % MAX_FRAMES_IN_FLIGHT);
+
+    // The static casters start the map over, the dynamic ones go on top of
+    // whatever is already there
+    VkClearValue depthValue {
+        .depthStencil = { 1.0f }
+    };
+
+    VkRenderingAttachmentInfo depthInfo {
+        .sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO,
+        .imageView = target,
+        .imageLayout = VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL,
+        .loadOp = statics ? VK_ATTACHMENT_LOAD_OP_CLEAR : VK_ATTACHMENT_LOAD_OP_LOAD,
+        .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
+        .clearValue = depthValue
+    };
+
+    VkRect2D renderArea {
+        .offset = { 0, 0 },
+        .extent = { SHADOW_MAP_SIZE, SHADOW_MAP_SIZE }
+    };
+
+    VkViewport viewport {
+        .x = 0.0f,
+        .y = 0.0f,
+        .width = static_cast<float>(SHADOW_MAP_SIZE),
+        .height = static_cast<float>(SHADOW_MAP_SIZE),
+        .minDepth = 0.0f,
+        .maxDepth = 1.0f
+    };
+
+    VkRenderingInfo renderInfo {
+        .sType = VK_STRUCTURE_TYPE_RENDERING_INFO,
+        .renderArea = renderArea,
+        .layerCount = 1,
+        .pDepthAttachment = &depthInfo
+    };
+
+    vkCmdBeginRendering(cmd, &renderInfo);
+
+    vkCmdSetViewport(cmd, 0, 1, &viewport);
+    vkCmdSetScissor(cmd, 0, 1, &renderArea);
+
+    // Every caster is drawn, the camera culling results don't apply to the
+    // light and the object data is indexed by the instance directly
+    uint32_t uniformOffset = static_cast<uint32_t>(sizeof(SceneData)) * frameIndex;
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, m_shadowPipeline);
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, m_meshPipelineLayout, 0, 1, &currentFrame.globalDescriptor, 1, &uniformOffset);
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, m_meshPipelineLayout, 1, 1, &currentFrame.objectDescriptor, 0, nullptr);
+
+    MeshHandle lastMesh = INVALID_HANDLE;
+
+    for (const DrawBatch &batch : m_drawBatches) {
+        uint32_t first = statics ? 0 : batch.staticCount;
+        uint32_t last = dynamics ? batch.instanceCount : batch.staticCount;
+        if (first >= last)
+            continue;
+
+        Mesh &mesh = m_meshes[batch.mesh];
+
+        if (batch.mesh != lastMesh) {
+            if (mesh.vertexBuffer) {
+                VkDeviceSize offset = 0;
+                VkBuffer vertexBuffer = mesh.vertexBuffer->buffer();
+                vkCmdBindVertexBuffers(cmd, 0, 1, &vertexBuffer, &offset);
+            }
+            vkCmdBindIndexBuffer(cmd, mesh.indexBuffer->buffer(), 0, VK_INDEX_TYPE_UINT32);
+            lastMesh = batch.mesh;
+        }
+
+        vkCmdDrawIndexed(cmd, mesh.numIndices, last - first, 0, static_cast<int32_t>(mesh.vertexOffset), batch.firstInstance + first);
+    }
+
+    vkCmdEndRendering(cmd);
+
+    m_frameStats.recordNs += SDL_GetTicksNS() - recordStart;
+}
+
+void VKlelu::buildDrawBatches()
+{
+    m_drawKeys.clear();
+    m_drawOrder.clear();
+    m_drawBatches.clear();
+    m_instanceBatches.clear();
+
+    if (m_materials.size() > DRAW_KEY_MAX_MATERIALS || m_meshes.size() > DRAW_KEY_MAX_MESHES)
+        throw std::runtime_error("Too many materials or meshes for the draw sort key");
+    if (m_scene.size() > DRAW_KEY_MAX_OBJECTS)
+        throw std::runtime_error("Too many Himmelit for the draw sort key");
+
+    // Rank pipelines so that they can be packed into the sort key, with
+    // dynamic state materials of the same state are kept together too.
+    // Blended materials all share the last rank so that they are drawn
+    // after every opaque surface they could blend over.
+    std::map<std::pair<VkPipeline, uint32_t>, uint64_t> pipelineRanks;
+    std::vector<uint64_t> materialRanks(m_materials.size());
+    for (uint32_t i = 0; i < m_materials.size(); ++i) {
+        if (m_materials[i].state.blend)
+            continue;
+        auto [it, inserted] = pipelineRanks.emplace(std::make_pair(m_materials[i].pipeline, m_materials[i].state.key()), pipelineRanks.size());
+        materialRanks[i] = it->second;
+    }
+
+    uint64_t blendRank = pipelineRanks.size();
+    if (blendRank >= DRAW_KEY_MAX_PIPELINES)
+        throw std::runtime_error("Too many pipelines for the draw sort key");
+    for (uint32_t i = 0; i < m_materials.size(); ++i) {
+        if (m_materials[i].state.blend)
+            materialRanks[i] = blendRank;
+    }
+
+    std::vector<MeshHandle> &meshes = m_scene.meshes();
+    std::vector<MaterialHandle> &materials = m_scene.materials();
+
+    // Key layout from most to least significant:
+    // pipeline and state (8 bits), material (16 bits), mesh (16 bits), dense index (24 bits)
+    for (size_t i = 0; i < m_scene.size(); ++i) {
+        if (meshes[i] == INVALID_HANDLE || materials[i] == INVALID_HANDLE)
+            continue;
+
+        uint64_t key = materialRanks[materials[i]] << 56 |
+                       static_cast<uint64_t>(materials[i]) << 40 |
+                       static_cast<uint64_t>(meshes[i]) << 24 |
+                       static_cast<uint64_t>(i);
+        m_drawKeys.push_back(key);
+    }
+
+    growObjectBuffers(m_drawKeys.size());
+
+    std::sort(m_drawKeys.begin(), m_drawKeys.end());
+
+    for (uint64_t key : m_drawKeys) {
+        uint32_t index = static_cast<uint32_t>(key & 0xffffff);
+        uint32_t instance = static_cast<uint32_t>(m_drawOrder.size());
+        m_drawOrder.push_back(index);
+
+        if (!m_drawBatches.empty() &&
+            m_drawBatches.back().mesh == meshes[index] &&
+            m_drawBatches.back().material == materials[index]) {
+            ++m_drawBatches.back().instanceCount;
+            m_instanceBatches.push_back(static_cast<uint32_t>(m_drawBatches.size() - 1));
+            continue;
+        }
+
+        if (m_drawBatches.size() >= MAX_DRAW_BATCHES)
+            throw std::runtime_error("Too many mesh and material combinations for the draw batches");
+
+        DrawBatch batch {
+            .mesh = meshes[index],
+            .material = materials[index],
+            .firstInstance = instance,
+            .instanceCount = 1,
+            .staticCount = 0,
+            .meshletDrawOffset = 0
         };
+        m_drawBatches.push_back(batch);
+        m_instanceBatches.push_back(static_cast<uint32_t>(m_drawBatches.size() - 1));
+    }
 
-        vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+    // Static instances go first so that the shadow passes can draw either
+    // kind as one range, the sort key has no bits left for this
+    std::vector<uint8_t> &statics = m_scene.statics();
+    for (DrawBatch &batch : m_drawBatches) {
+        auto first = m_drawOrder.begin() + batch.firstInstance;
+        auto dynamic = std::stable_partition(first, first + batch.instanceCount, [&statics](uint32_t index) {
+            return statics[index] != 0;
+        });
+        batch.staticCount = static_cast<uint32_t>(dynamic - first);
+    }
 
-        VkImageSubresourceLayers subresource {
-            .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-            .mipLevel = 0,
-            .baseArrayLayer = 0,
-            .layerCount = 1
+    m_firstBlendedInstance = static_cast<uint32_t>(m_drawOrder.size());
+    for (const DrawBatch &batch : m_drawBatches) {
+        if (m_materials[batch.material].state.blend) {
+            m_firstBlendedInstance = batch.firstInstance;
+            break;
+        }
+    }
+    m_blendDistances.resize(m_drawOrder.size() - m_firstBlendedInstance);
+
+    // Every cluster of every instance could pass, so the fallback reserves
+    // that many draws per batch
+    uint32_t meshletDraws = 0;
+    for (DrawBatch &batch : m_drawBatches) {
+        batch.meshletDrawOffset = meshletDraws;
+        meshletDraws += batch.instanceCount * m_meshes[batch.mesh].meshletCount;
+    }
+
+    if (m_options.meshlets && !m_meshShaders && meshletDraws > MAX_MESHLET_DRAWS)
+        throw std::runtime_error("Too many meshlets in the scene for the compute fallback");
+
+    m_drawBatchesVersion = m_scene.version();
+    ++m_drawCommandsVersion;
+
+    fprintf(stderr, "Scene has %zu objects in %zu draw batches\n", m_drawOrder.size(), m_drawBatches.size());
+}
+
+FrameData &VKlelu::getCurrentFrame()
+{
+    return m_frameData[m_frameCount % MAX_FRAMES_IN_FLIGHT];
+}
+
+void VKlelu::initScene(SceneFile &sceneFile, std::vector<std::unique_ptr<ObjFile>> &objs, std::vector<std::unique_ptr<ImageFile>> &images)
+{
+    VkSamplerCreateInfo samplerInfo {
+        .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+        .magFilter = VK_FILTER_LINEAR,
+        .minFilter = VK_FILTER_LINEAR,
+        .addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT,
+        .addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT,
+        .addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT
+    };
+
+    VK_CHECK(vkCreateSampler(m_device, &samplerInfo, nullptr, &m_linearSampler));
+    deferCleanup([=, this](){ vkDestroySampler(m_device, m_linearSampler, nullptr); });
+
+    loadScene(sceneFile, objs, images);
+}
+
+void VKlelu::loadScene(SceneFile &sceneFile, std::vector<std::unique_ptr<ObjFile>> &objs, std::vector<std::unique_ptr<ImageFile>> &images)
+{
+    uint64_t start = SDL_GetTicksNS();
+
+    // The assets come in decoded, record all the uploads into as few
+    // staging submits as possible
+    bool meshlets = m_options.meshlets;
+
+    // Meshlets and pulled vertices of all the meshes go into shared
+    // buffers once they're all in
+    bool shared = meshlets || m_options.vertexPulling;
+    std::vector<std::unique_ptr<ObjFile>> sharedObjs;
+    std::vector<MeshHandle> sharedMeshes;
+
+    for (size_t i = 0; i < objs.size(); ++i) {
+        std::unique_ptr<ObjFile> obj = std::move(objs[i]);
+        MeshHandle mesh = uploadMesh(*obj, sceneFile.meshes[i].name);
+        if (shared) {
+            sharedObjs.push_back(std::move(obj));
+            sharedMeshes.push_back(mesh);
+        }
+    }
+
+    if (meshlets)
+        uploadMeshlets(sharedObjs, sharedMeshes);
+    if (m_options.vertexPulling)
+        uploadVertexStreams(sharedObjs, sharedMeshes);
+
+    for (size_t i = 0; i < images.size(); ++i) {
+        std::unique_ptr<ImageFile> image = std::move(images[i]);
+        uploadImage(*image, sceneFile.textures[i].name);
+    }
+
+    for (SceneFile::MaterialEntry &entry : sceneFile.materials) {
+        TextureHandle texture = m_textures.find(entry.texture);
+        if (texture == INVALID_HANDLE)
+            throw std::runtime_error("Material " + entry.name + " uses unknown texture " + entry.texture);
+
+        MaterialState state {
+            .cullMode = static_cast<VkCullModeFlags>(entry.cull ? VK_CULL_MODE_BACK_BIT : VK_CULL_MODE_NONE),
+            .blend = entry.blend
         };
 
-        VkBufferImageCopy copyRegion {
-            .bufferOffset = 0,
-            .bufferRowLength = 0,
-            .bufferImageHeight = 0,
-            .imageSubresource = subresource,
-            .imageExtent = imageExtent
+        MaterialHandle material = createMaterial(materialPipeline(state), m_meshPipelineLayout, entry.name, state);
+        if (m_meshShaders)
+            meshletPipeline(state);
+        setMaterialTexture(material, texture);
+    }
+
+    fprintf(stderr, "%zu mesh pipelines for %zu materials\n", m_materialPipelines.size() + 1, m_materials.size());
+
+    for (SceneFile::HimmeliEntry &entry : sceneFile.himmelit) {
+        Himmeli himmeli {
+            .mesh = getMesh(entry.mesh),
+            .material = getMaterial(entry.material),
+            .position = entry.position,
+            .rotation = glm::quat(glm::radians(entry.rotation)),
+            .scale = entry.scale
         };
 
-        vkCmdCopyBufferToImage(cmd, stagingBuffer->buffer(), texture.image->image(), VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copyRegion);
+        if (himmeli.mesh == INVALID_HANDLE || himmeli.material == INVALID_HANDLE)
+            throw std::runtime_error("Himmeli uses unknown mesh " + entry.mesh + " or material " + entry.material);
+
+        m_scene.add(himmeli);
+    }
+
+    if (sceneFile.pointLights.size() > MAX_POINT_LIGHTS)
+        fprintf(stderr, "Too many point lights, using only the first %d\n", MAX_POINT_LIGHTS);
+
+    for (SceneFile::PointLightEntry &entry : sceneFile.pointLights) {
+        if (m_pointLights.size() >= MAX_POINT_LIGHTS)
+            break;
 
-        VkImageMemoryBarrier barrier2 {
-            .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-            .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
-            .dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
-            .oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-            .newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-            .image = texture.image->image(),
-            .subresourceRange = range
+        PointLight light {
+            .positionRadius = glm::vec4{ entry.position, entry.radius },
+            .color = glm::vec4{ entry.color, 1.0f }
         };
+        m_pointLights.push_back(light);
+        m_pointLightOrigins.push_back(entry.position);
+    }
 
-        vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier2);
-    });
+    m_camera = sceneFile.camera;
+    m_sceneParameters.lightPos = glm::vec4{ sceneFile.light.position, 0.0f };
+    m_sceneParameters.lightColor = glm::vec4{ sceneFile.light.color, 0.0f };
 
-    texture.imageView = texture.image->createImageView(VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_ASPECT_COLOR_BIT);
-    m_textures[name] = std::move(texture);
+    m_uploader->flush();
+
+    fprintf(stderr, "Scene uploaded in %.1f ms: %zu meshes, %zu textures, %zu materials, %zu Himmelit, %zu point lights\n",
+            static_cast<double>(SDL_GetTicksNS() - start) / 1e6,
+            m_meshes.size(), m_textures.size(), m_materials.size(), m_scene.size(), m_pointLights.size());
+    fprintf(stderr, "Uploaded %zu bytes in %u submits, %zu written in place, staging high-water mark %zu bytes\n",
+            m_uploader->bytesUploaded(), m_uploader->submitCount(), m_uploader->bytesInPlace(), m_uploader->highWaterMark());
+    fprintf(stderr, "Descriptors from %zu pools, %zu distinct set layouts\n",
+            m_descriptorAllocator->poolCount(), m_layoutCache->size());
 }
 
-void VKlelu::immediateSubmit(std::function<void(VkCommandBuffer)> &&function)
+void VKlelu::setMaterialTexture(MaterialHandle material, TextureHandle texture)
 {
-    VkCommandBuffer cmd = m_uploadContext.commandBuffer;
-    VkCommandBufferBeginInfo cmdBeginInfo {
-        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
-        .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT
+    Material &mat = m_materials[material];
+
+    mat.textureSet = m_descriptorAllocator->allocate(m_singleTextureSetLayout);
+    ++m_drawCommandsVersion;
+
+    VkDescriptorImageInfo imageInfo {
+        .imageView = m_textures[texture].imageView,
+        .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
     };
 
-    VK_CHECK(vkBeginCommandBuffer(cmd, &cmdBeginInfo));
+    VkWriteDescriptorSet textureWrite {
+        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .dstSet = mat.textureSet,
+        .dstBinding = 0,
+        .descriptorCount = 1,
+        .descriptorType = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE,
+        .pImageInfo = &imageInfo
+    };
 
-    function(cmd);
+    VkDescriptorImageInfo imageSamplerInfo {
+        .sampler = m_linearSampler
+    };
 
-    VK_CHECK(vkEndCommandBuffer(cmd));
+    VkWriteDescriptorSet samplerWrite {
+        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .dstSet = mat.textureSet,
+        .dstBinding = 1,
+        .descriptorCount = 1,
+        .descriptorType = VK_DESCRIPTOR_TYPE_SAMPLER,
+        .pImageInfo = &imageSamplerInfo
+    };
 
-    VkSubmitInfo submit {
-        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-        .commandBufferCount = 1,
-        .pCommandBuffers = &cmd
+    VkWriteDescriptorSet writeSets[] = { textureWrite, samplerWrite };
+    vkUpdateDescriptorSets(m_device, 2, &writeSets[0], 0, nullptr);
+}
+
+MaterialHandle VKlelu::createMaterial(VkPipeline pipeline, VkPipelineLayout layout, const std::string name, const MaterialState &state)
+{
+    Material mat {
+        .pipeline = pipeline,
+        .pipelineLayout = layout,
+        .state = state
     };
+    ++m_drawCommandsVersion;
+    return m_materials.add(name, std::move(mat));
+}
 
-    VK_CHECK(vkQueueSubmit(m_ctx->graphicsQueue(), 1, &submit, m_uploadContext.uploadFence));
+// What a permutation bakes in when the material state can't be dynamic,
+// must match setMaterialState
+static void bakeMaterialState(PipelineBuilder &builder, const MaterialState &state)
+{
+    builder.rasterizer.cullMode = state.cullMode;
+    builder.colorBlendAttachment.blendEnable = state.blend;
+    if (state.blend) {
+        builder.depthStencil.depthWriteEnable = VK_FALSE;
+        builder.depthStencil.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+    }
+}
 
-    vkWaitForFences(m_device, 1, &m_uploadContext.uploadFence, true, UINT64_MAX);
-    vkResetFences(m_device, 1, &m_uploadContext.uploadFence);
+VkPipeline VKlelu::materialPipeline(const MaterialState &state)
+{
+    if (m_dynamicState || state == MaterialState{})
+        return m_meshPipeline;
+
+    auto it = m_materialPipelines.find(state.key());
+    if (it != m_materialPipelines.end())
+        return it->second;
+
+    PipelineBuilder builder = m_meshPipelineBuilder;
+    bakeMaterialState(builder, state);
 
-    vkResetCommandPool(m_device, m_uploadContext.commandPool, 0);
+    // References into the map survive rehashing, the slot stays valid
+    // for reloads
+    VkPipeline &pipeline = m_materialPipelines[state.key()];
+    reloadableGraphicsPipeline(pipeline, builder, m_options.vertexPulling ? VertexInputDescription{} : Vertex::getDescription(),
+                               { { VK_SHADER_STAGE_VERTEX_BIT, m_options.vertexPulling ? "pulled.vert.spv" : "shader.vert.spv" },
+                                 { VK_SHADER_STAGE_FRAGMENT_BIT, "shader.frag.spv" } },
+                               m_renderTargetFormat, m_depthImageFormat);
+
+    if (!pipeline)
+        throw std::runtime_error("Failed to create a material pipeline permutation");
+
+    return pipeline;
 }
 
-void VKlelu::loadShader(const char *path, VkShaderModule &module)
+VkPipeline VKlelu::meshletPipeline(const MaterialState &state)
 {
-    Path fullPath = getShaderPath(path);
+    if (m_dynamicState || state == MaterialState{})
+        return m_meshletPipeline;
+
+    auto it = m_meshletPipelines.find(state.key());
+    if (it != m_meshletPipelines.end())
+        return it->second;
+
+    PipelineBuilder builder = m_meshletPipelineBuilder;
+    bakeMaterialState(builder, state);
+
+    VkPipeline &pipeline = m_meshletPipelines[state.key()];
+    reloadableGraphicsPipeline(pipeline, builder, VertexInputDescription{},
+                               { { VK_SHADER_STAGE_TASK_BIT_EXT, "meshlet.task.spv" },
+                                 { VK_SHADER_STAGE_MESH_BIT_EXT, "meshlet.mesh.spv" },
+                                 { VK_SHADER_STAGE_FRAGMENT_BIT, "shader.frag.spv" } },
+                               m_renderTargetFormat, m_depthImageFormat);
+
+    if (!pipeline)
+        throw std::runtime_error("Failed to create a meshlet pipeline permutation");
+
+    return pipeline;
+}
 
-    FILE *f = fopen(cpath(fullPath), "rb");
-    if (!f) {
-        throw std::runtime_error("Failed to open file: " + std::string(path));
+void VKlelu::setMaterialState(VkCommandBuffer cmd, const MaterialState &state, const MaterialState *previous)
+{
+    // Only what differs from the previous batch is set
+    if (!previous || state.cullMode != previous->cullMode)
+        vkCmdSetCullMode(cmd, state.cullMode);
+
+    if (!previous || state.blend != previous->blend) {
+        VkBool32 blendEnable = state.blend;
+        m_cmdSetColorBlendEnable(cmd, 0, 1, &blendEnable);
+        // Blended surfaces don't occlude, with the pre-pass nothing writes.
+        // The pre-pass leaves out blended surfaces, so they are tested
+        // against the opaque depth instead of matching their own.
+        vkCmdSetDepthWriteEnable(cmd, !state.blend && !m_options.depthPrepass);
+        vkCmdSetDepthCompareOp(cmd, m_options.depthPrepass && !state.blend ? VK_COMPARE_OP_EQUAL : VK_COMPARE_OP_LESS_OR_EQUAL);
     }
+}
 
-    fseek(f, 0, SEEK_END);
-    long fileSize = ftell(f);
-    fseek(f, 0, SEEK_SET);
+MeshHandle VKlelu::getMesh(const std::string name)
+{
+    return m_meshes.find(name);
+}
 
-    std::vector<uint32_t> spv_data(fileSize / sizeof(uint32_t));
-    size_t ret = fread(&spv_data[0], sizeof(spv_data[0]), spv_data.size(), f);
-    fclose(f);
+MaterialHandle VKlelu::getMaterial(const std::string name)
+{
+    return m_materials.find(name);
+}
 
-    if ((ret * sizeof(uint32_t)) != static_cast<size_t>(fileSize)) {
-        throw std::runtime_error("Failed to read file: " + std::string(path));
+MeshHandle VKlelu::uploadMesh(ObjFile &obj, std::string name)
+{
+    size_t uploaded = m_uploader->bytesUploaded();
+    size_t inPlace = m_uploader->bytesInPlace();
+
+    Mesh mesh;
+    mesh.numVertices = static_cast<uint32_t>(obj.vertices.size());
+    mesh.numIndices = static_cast<uint32_t>(obj.indices.size());
+    mesh.boundingSphere = obj.boundingSphere();
+    size_t indexBufferSize = mesh.numIndices * sizeof(uint32_t);
+
+    mesh.indexBuffer = m_uploader->allocateBuffer(indexBufferSize, VK_BUFFER_USAGE_INDEX_BUFFER_BIT);
+    m_uploader->writeBuffer(*mesh.indexBuffer, obj.indices.size(), sizeof(uint32_t), copyFrom(obj.indices));
+
+    // Pulled vertices go into the shared streams with the rest of the scene
+    if (!m_options.vertexPulling) {
+        size_t vertexBufferSize = mesh.numVertices * sizeof(Vertex);
+        mesh.vertexBuffer = m_uploader->allocateBuffer(vertexBufferSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
+        m_uploader->writeBuffer(*mesh.vertexBuffer, obj.vertices.size(), sizeof(Vertex), copyFrom(obj.vertices));
+
+        // Positions are picked out straight into the destination
+        if (m_options.depthPrepass) {
+            size_t positionBufferSize = obj.vertices.size() * sizeof(glm::vec3);
+            mesh.positionBuffer = m_uploader->allocateBuffer(positionBufferSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
+            m_uploader->writeBuffer(*mesh.positionBuffer, obj.vertices.size(), sizeof(glm::vec3), [&obj](void *out, size_t first, size_t count) {
+                glm::vec3 *positions = static_cast<glm::vec3 *>(out);
+                for (size_t i = 0; i < count; ++i)
+                    positions[i] = obj.vertices[first + i].position;
+            });
+        }
+    }
+
+    fprintf(stderr, "Mesh %s: %zu bytes uploaded, %zu written in place\n", name.c_str(),
+            m_uploader->bytesUploaded() - uploaded, m_uploader->bytesInPlace() - inPlace);
+
+    return m_meshes.add(name, std::move(mesh));
+}
+
+void VKlelu::uploadMeshlets(std::vector<std::unique_ptr<ObjFile>> &objs, const std::vector<MeshHandle> &meshes)
+{
+    std::vector<size_t> vertexBases;
+    size_t vertexCount = 0;
+    std::vector<Meshlet> meshlets;
+    std::vector<uint32_t> meshletVertices;
+    std::vector<uint32_t> meshletTriangles;
+
+    for (size_t i = 0; i < objs.size(); ++i) {
+        ObjFile &obj = *objs[i];
+        Mesh &mesh = m_meshes[meshes[i]];
+
+        uint32_t vertexBase = static_cast<uint32_t>(vertexCount);
+        uint32_t meshletVertexBase = static_cast<uint32_t>(meshletVertices.size());
+        uint32_t triangleBase = static_cast<uint32_t>(meshletTriangles.size());
+
+        mesh.meshletOffset = static_cast<uint32_t>(meshlets.size());
+        mesh.meshletCount = static_cast<uint32_t>(obj.meshlets.size());
+
+        for (Meshlet meshlet : obj.meshlets) {
+            meshlet.vertexOffset += meshletVertexBase;
+            meshlet.triangleOffset += triangleBase;
+            meshlets.push_back(meshlet);
+        }
+
+        for (uint32_t vertex : obj.meshletVertices)
+            meshletVertices.push_back(vertexBase + vertex);
+
+        meshletTriangles.insert(meshletTriangles.end(), obj.meshletTriangles.begin(), obj.meshletTriangles.end());
+        vertexBases.push_back(vertexCount);
+        vertexCount += obj.vertices.size();
+    }
+
+    // The fallback draws a cluster as a range of a plain index buffer in
+    // cluster order
+    std::vector<uint32_t> indices;
+    if (!m_meshShaders) {
+        indices.reserve(3 * meshletTriangles.size());
+        for (const Meshlet &meshlet : meshlets) {
+            for (uint32_t t = 0; t < meshlet.triangleCount; ++t) {
+                uint32_t packed = meshletTriangles[meshlet.triangleOffset + t];
+                for (uint32_t k = 0; k < 3; ++k)
+                    indices.push_back(meshletVertices[meshlet.vertexOffset + ((packed >> (8 * k)) & 0xff)]);
+            }
+        }
+    }
+
+    // Never empty so that the descriptors stay valid without meshes
+    auto upload = [&](size_t count, size_t stride, VkBufferUsageFlags usage, const Uploader::Fill &fill) {
+        std::unique_ptr<BufferAllocation> buffer = m_uploader->allocateBuffer(std::max<size_t>(count * stride, sizeof(uint32_t)), usage);
+        if (count)
+            m_uploader->writeBuffer(*buffer, count, stride, fill);
+        return buffer;
+    };
+
+    // The vertices are gathered from the meshes straight into the buffer
+    m_meshletBuffer = upload(meshlets.size(), sizeof(Meshlet), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, copyFrom(meshlets));
+    m_meshletVertexBuffer = upload(meshletVertices.size(), sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, copyFrom(meshletVertices));
+    m_meshletTriangleBuffer = upload(meshletTriangles.size(), sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, copyFrom(meshletTriangles));
+    m_sceneVertexBuffer = upload(vertexCount, sizeof(Vertex), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, [&](void *out, size_t first, size_t count) {
+        Vertex *vertices = static_cast<Vertex *>(out);
+        forEachVertex(objs, vertexBases, first, count, [vertices](const Vertex &vertex, size_t i) {
+            vertices[i] = vertex;
+        });
+    });
+    m_meshletIndexBuffer = upload(indices.size(), sizeof(uint32_t), VK_BUFFER_USAGE_INDEX_BUFFER_BIT, copyFrom(indices));
+
+    VkDescriptorBufferInfo bufferInfos[4] = {
+        { .buffer = m_meshletBuffer->buffer(), .offset = 0, .range = VK_WHOLE_SIZE },
+        { .buffer = m_meshletVertexBuffer->buffer(), .offset = 0, .range = VK_WHOLE_SIZE },
+        { .buffer = m_meshletTriangleBuffer->buffer(), .offset = 0, .range = VK_WHOLE_SIZE },
+        { .buffer = m_sceneVertexBuffer->buffer(), .offset = 0, .range = VK_WHOLE_SIZE }
+    };
+
+    for (FrameData &frame : m_frameData) {
+        VkWriteDescriptorSet writeSet[4];
+        for (uint32_t b = 0; b < 4; ++b) {
+            writeSet[b] = {
+                .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                .dstSet = frame.meshletDescriptor,
+                .dstBinding = b,
+                .descriptorCount = 1,
+                .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                .pBufferInfo = &bufferInfos[b]
+            };
+        }
+        vkUpdateDescriptorSets(m_device, 4, writeSet, 0, nullptr);
+    }
+
+    fprintf(stderr, "Built %zu meshlets, %.1f triangles per meshlet on average\n", meshlets.size(),
+            meshlets.empty() ? 0.0 : static_cast<double>(meshletTriangles.size()) / static_cast<double>(meshlets.size()));
+}
+
+void VKlelu::uploadVertexStreams(std::vector<std::unique_ptr<ObjFile>> &objs, const std::vector<MeshHandle> &meshes)
+{
+    std::vector<size_t> vertexBases;
+    size_t vertexCount = 0;
+
+    for (size_t i = 0; i < objs.size(); ++i) {
+        m_meshes[meshes[i]].vertexOffset = static_cast<uint32_t>(vertexCount);
+        vertexBases.push_back(vertexCount);
+        vertexCount += objs[i]->vertices.size();
+    }
+
+    // Never empty so that the descriptors stay valid without meshes
+    auto upload = [&](size_t stride, const Uploader::Fill &fill) {
+        std::unique_ptr<BufferAllocation> buffer = m_uploader->allocateBuffer(std::max<size_t>(vertexCount * stride, sizeof(float)), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+        if (vertexCount)
+            m_uploader->writeBuffer(*buffer, vertexCount, stride, fill);
+        return buffer;
+    };
+
+    // Positions apart from the rest so that depth only passes fetch just
+    // what they use, both as plain floats without vec3 padding and split
+    // out of the meshes straight into the destination
+    m_positionStreamBuffer = upload(3 * sizeof(float), [&](void *out, size_t first, size_t count) {
+        float *positions = static_cast<float *>(out);
+        forEachVertex(objs, vertexBases, first, count, [positions](const Vertex &vertex, size_t i) {
+            float *position = positions + 3 * i;
+            position[0] = vertex.position.x;
+            position[1] = vertex.position.y;
+            position[2] = vertex.position.z;
+        });
+    });
+    m_attributeStreamBuffer = upload(5 * sizeof(float), [&](void *out, size_t first, size_t count) {
+        float *attributes = static_cast<float *>(out);
+        forEachVertex(objs, vertexBases, first, count, [attributes](const Vertex &vertex, size_t i) {
+            float *attribute = attributes + 5 * i;
+            attribute[0] = vertex.normal.x;
+            attribute[1] = vertex.normal.y;
+            attribute[2] = vertex.normal.z;
+            attribute[3] = vertex.texcoord.x;
+            attribute[4] = vertex.texcoord.y;
+        });
+    });
+
+    VkDescriptorBufferInfo bufferInfos[2] = {
+        { .buffer = m_positionStreamBuffer->buffer(), .offset = 0, .range = VK_WHOLE_SIZE },
+        { .buffer = m_attributeStreamBuffer->buffer(), .offset = 0, .range = VK_WHOLE_SIZE }
+    };
+
+    for (FrameData &frame : m_frameData) {
+        VkWriteDescriptorSet writeSet[2];
+        for (uint32_t b = 0; b < 2; ++b) {
+            writeSet[b] = {
+                .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                .dstSet = frame.objectDescriptor,
+                .dstBinding = 2 + b,
+                .descriptorCount = 1,
+                .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                .pBufferInfo = &bufferInfos[b]
+            };
+        }
+        vkUpdateDescriptorSets(m_device, 2, writeSet, 0, nullptr);
+    }
+
+    fprintf(stderr, "Vertex streams: %zu vertices, %zu KiB positions, %zu KiB attributes\n", vertexCount,
+            vertexCount * 3 * sizeof(float) / 1024, vertexCount * 5 * sizeof(float) / 1024);
+}
+
+TextureHandle VKlelu::uploadImage(ImageFile &image, std::string name)
+{
+    Texture texture;
+    VkFormat imageFormat = VK_FORMAT_R8G8B8A8_SRGB;
+
+    VkExtent3D imageExtent {
+        .width = static_cast<uint32_t>(image.width),
+        .height = static_cast<uint32_t>(image.height),
+        .depth = 1
+    };
+
+    texture.image = m_ctx->allocateImage(imageExtent, imageFormat, VK_SAMPLE_COUNT_1_BIT, VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+
+    // Optimally tiled images always go through staging
+    size_t uploaded = m_uploader->bytesUploaded();
+    m_uploader->uploadImage(image.pixels, texture.image->image(), imageExtent, 4);
+    fprintf(stderr, "Texture %s: %zu bytes uploaded through staging\n", name.c_str(), m_uploader->bytesUploaded() - uploaded);
+
+    texture.imageView = texture.image->createImageView(VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_ASPECT_COLOR_BIT);
+    return m_textures.add(name, std::move(texture));
+}
+
+void VKlelu::immediateSubmit(std::function<void(VkCommandBuffer)> &&function)
+{
+    m_uploader->record(std::move(function));
+    m_uploader->flush();
+}
+
+void VKlelu::loadShader(const char *path, VkShaderModule &module)
+{
+    // Hot reloading writes the rebuilt shaders to disk
+    module = loadShaderModule(m_device, path, !m_options.hotReload);
+}
+
+VkPipeline VKlelu::buildGraphicsPipeline(PipelineBuilder builder, const VertexInputDescription &vertexInput,
+                                         const std::vector<ShaderStage> &stages, VkFormat colorFormat, VkFormat depthFormat)
+{
+    std::vector<VkShaderModule> modules;
+
+    try {
+        for (const ShaderStage &stage : stages) {
+            VkShaderModule module;
+            loadShader(stage.file.c_str(), module);
+            modules.push_back(module);
+            fprintf(stderr, "Shader module %s created\n", stage.file.c_str());
+
+            builder.shaderStages.push_back({
+                .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+                .stage = stage.stage,
+                .module = module,
+                .pName = "main"
+            });
+        }
+    } catch (...) {
+        for (VkShaderModule module : modules)
+            vkDestroyShaderModule(m_device, module, nullptr);
+        throw;
     }
 
-    VkShaderModuleCreateInfo createInfo {
-        .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
-        .codeSize = spv_data.size() * sizeof(uint32_t),
-        .pCode = &spv_data[0]
+    builder.vertexInputInfo = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
+        .vertexBindingDescriptionCount = static_cast<uint32_t>(vertexInput.bindings.size()),
+        .pVertexBindingDescriptions = vertexInput.bindings.data(),
+        .vertexAttributeDescriptionCount = static_cast<uint32_t>(vertexInput.attributes.size()),
+        .pVertexAttributeDescriptions = vertexInput.attributes.data(),
     };
 
-    if (vkCreateShaderModule(m_device, &createInfo, nullptr, &module) != VK_SUCCESS) {
-        throw std::runtime_error("Failed to create shader module: " + std::string(path));
+    builder.pipelineCache = m_pipelineCache;
+    VkPipeline pipeline = builder.buildPipeline(m_device, colorFormat, depthFormat);
+
+    for (VkShaderModule module : modules)
+        vkDestroyShaderModule(m_device, module, nullptr);
+
+    return pipeline;
+}
+
+void VKlelu::reloadablePipeline(VkPipeline &pipeline, std::vector<std::string> shaders, std::function<VkPipeline()> &&build)
+{
+    pipeline = build();
+
+    // The janitor destroys whatever handle is current at shutdown
+    deferCleanup([=, this, &pipeline](){ vkDestroyPipeline(m_device, pipeline, nullptr); });
+
+    if (m_shaderWatcher)
+        m_shaderWatcher->addPipeline(&pipeline, std::move(shaders), std::move(build));
+}
+
+void VKlelu::reloadableGraphicsPipeline(VkPipeline &pipeline, const PipelineBuilder &builder, const VertexInputDescription &vertexInput,
+                                        std::vector<ShaderStage> stages, VkFormat colorFormat, VkFormat depthFormat)
+{
+    std::vector<std::string> shaders;
+    for (const ShaderStage &stage : stages)
+        shaders.push_back(stage.file);
+
+    // Everything is captured by value, the rebuild runs on the watcher
+    // thread long after the caller returned
+    reloadablePipeline(pipeline, std::move(shaders), [=, this]() {
+        return buildGraphicsPipeline(builder, vertexInput, stages, colorFormat, depthFormat);
+    });
+}
+
+void VKlelu::reloadableComputePipeline(VkPipeline &pipeline, const std::string &shader, VkPipelineLayout layout)
+{
+    reloadablePipeline(pipeline, { shader }, [=, this]() {
+        VkShaderModule module;
+        loadShader(shader.c_str(), module);
+        fprintf(stderr, "Shader module %s created\n", shader.c_str());
+
+        VkPipeline newPipeline = buildComputePipeline(m_device, module, layout, m_pipelineCache);
+        vkDestroyShaderModule(m_device, module, nullptr);
+        return newPipeline;
+    });
+}
+
+void VKlelu::applyShaderReloads()
+{
+    // The fence only covers this frame slot, wait until every frame that
+    // could have bound a retired pipeline is done
+    auto retired = std::remove_if(m_retiredPipelines.begin(), m_retiredPipelines.end(), [&](const std::pair<VkPipeline, int> &entry) {
+        if (m_frameCount < entry.second + MAX_FRAMES_IN_FLIGHT)
+            return false;
+        vkDestroyPipeline(m_device, entry.first, nullptr);
+        return true;
+    });
+    m_retiredPipelines.erase(retired, m_retiredPipelines.end());
+
+    for (const ShaderWatcher::Reload &reload : m_shaderWatcher->takeReloaded()) {
+        VkPipeline old = *reload.slot;
+
+        for (uint32_t i = 0; i < m_materials.size(); ++i) {
+            if (m_materials[i].pipeline == old)
+                m_materials[i].pipeline = reload.pipeline;
+        }
+
+        *reload.slot = reload.pipeline;
+        m_retiredPipelines.push_back({ old, m_frameCount });
+        ++m_drawCommandsVersion;
     }
 }
 
@@ -1,8 +1,17 @@
 #pragma once
 
+#include "capture.hh"
+#include "compute.hh"
 #include "context.hh"
+#include "descriptors.hh"
 #include "himmeli.hh"
 #include "memory.hh"
+#include "rendergraph.hh"
+#include "scene.hh"
+#include "scenefile.hh"
+#include "shaderwatch.hh"
+#include "simulation.hh"
+#include "upload.hh"
 #include "utils.hh"
 
 #include "SDL3/SDL.h"
@@ -14,21 +23,168 @@
 #include <memory>
 #include <string>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 #define MAX_FRAMES_IN_FLIGHT 2
+// The per-object buffers start this large and grow with the scene
+#define INITIAL_OBJECT_CAPACITY (1 << 17)
+#define MAX_DRAW_BATCHES (1 << 12)
+// Must match UNORDERED in cull.comp
+#define CULL_UNORDERED UINT32_MAX
+#define MAX_PYRAMID_LEVELS 16
+#define MAX_POINT_LIGHTS (1 << 14)
+
+// Froxel grid for the clustered point lights, screen tiles in x and y and
+// exponential depth slices in z
+#define CLUSTER_GRID_X 16
+#define CLUSTER_GRID_Y 9
+#define CLUSTER_GRID_Z 24
+#define CLUSTER_COUNT (CLUSTER_GRID_X * CLUSTER_GRID_Y * CLUSTER_GRID_Z)
+#define MAX_LIGHTS_PER_CLUSTER 256
+
+// Per-cluster draws of one culling phase on the meshlet fallback path,
+// must match meshletcull.comp
+#define MAX_MESHLET_DRAWS (1 << 19)
+
+// Shadow map of the main light, square
+#define SHADOW_MAP_SIZE 2048
+// Slack around the casters when the cached light frustum is fitted, as a
+// fraction of their extent, so that dynamic casters moving near the edge
+// don't refit it every frame
+#define SHADOW_BOUNDS_MARGIN 0.1f
+
+// GPU timestamps written every frame, in submission order
+#define TIMESTAMP_FRAME_START 0
+#define TIMESTAMP_SHADOW_CACHE 1
+#define TIMESTAMP_SHADOWS 2
+#define TIMESTAMP_EARLY_CULL 3
+#define TIMESTAMP_EARLY_PREPASS 4
+#define TIMESTAMP_EARLY_SHADING 5
+#define TIMESTAMP_DEPTH_PYRAMID 6
+#define TIMESTAMP_LATE_CULL 7
+#define TIMESTAMP_LATE_PREPASS 8
+#define TIMESTAMP_LATE_SHADING 9
+#define TIMESTAMP_UPSCALE 10
+#define TIMESTAMP_GRAPHICS_COUNT 11
+// Written on the compute queue
+#define TIMESTAMP_LIGHT_CULL_START 11
+#define TIMESTAMP_LIGHT_CULL_END 12
+#define TIMESTAMP_COUNT 13
+
+// Dynamic resolution, the main pass renders into a part of the offscreen
+// target that is scaled to keep the GPU frame time within the budget
+#define MIN_RESOLUTION_SCALE 0.5f
+#define RESOLUTION_SCALE_RATE 0.1f
+#define UPSCALE_SHARPNESS 0.5f
+
+struct Options {
+    std::string sceneFile = "default.scene";
+    glm::uvec3 stressGrid = glm::uvec3{ 0 };
+    uint32_t stressSeed = 1;
+    uint32_t stressLights = 0;
+    // Share of the stress Himmelit that never move, 0 to 1
+    float stressStatic = 0.0f;
+    bool headless = false;
+    uint32_t frameLimit = 0;
+    bool occlusionCulling = true;
+    bool depthPrepass = false;
+    bool meshlets = false;
+    // Off forces the compute fallback for meshlets even with mesh shaders
+    bool meshShaders = true;
+    // Off builds a pipeline per material state even when the device could
+    // set it dynamically
+    bool dynamicState = true;
+    // Fetch vertices from storage buffers instead of fixed function input
+    bool vertexPulling = false;
+    // Off records the draws into the main command buffer every frame
+    bool commandCache = true;
+    // Off renders the static shadow casters every frame too
+    bool shadowCache = true;
+    // File the pipeline cache is loaded from and saved to, none when empty
+    std::string pipelineCache;
+    // Off uploads through staging even to host visible device memory
+    bool directUpload = true;
+    // Fixed simulation ticks per second, the frames interpolate in between
+    uint32_t simulationRate = 60;
+    // Zero keeps the resolution fixed
+    float gpuBudgetMs = 0.0f;
+    // Empty disables frame capture
+    std::string captureFile;
+    uint32_t captureFps = 60;
+    // Recompile and rebuild pipelines when shaders change on disk
+    bool hotReload = false;
+};
+
+struct FrameStats {
+    uint64_t transformNs;
+    uint64_t recordNs;
+    uint64_t frameNs;
+    // Latest step on the simulation thread
+    uint64_t simulationNs;
+    // Culling counters lag MAX_FRAMES_IN_FLIGHT frames behind
+    uint32_t drawnObjects;
+    uint32_t occludedObjects;
+    uint32_t frustumCulledObjects;
+    uint32_t drawnMeshlets;
+    uint32_t culledMeshlets;
+    // Instances rendered into the shadow map, the static ones only on the
+    // frames the cache is rebuilt
+    uint32_t shadowCasters;
+    // GPU time per pass summed over both culling phases, also lagging
+    uint64_t gpuShadowCacheNs;
+    uint64_t gpuShadowNs;
+    uint64_t gpuCullNs;
+    uint64_t gpuPyramidNs;
+    uint64_t gpuPrepassNs;
+    uint64_t gpuShadingNs;
+    uint64_t gpuUpscaleNs;
+    uint64_t gpuFrameNs;
+    // Light culling on the compute queue and how much of it ran while the
+    // graphics queue was busy with the same frame
+    uint64_t gpuLightCullNs;
+    uint64_t gpuAsyncOverlapNs;
+    float resolutionScale;
+};
 
 struct FrameData {
     VkCommandPool commandPool;
     VkCommandBuffer mainCommandBuffer;
+    // Draws of each culling phase, replayed until m_drawCommandsVersion
+    // moves past the version they were recorded at
+    std::array<VkCommandBuffer, 2> drawCommands;
+    uint64_t drawCommandsVersion;
     VkSemaphore imageAcquiredSemaphore;
     VkFence renderFence;
+    VkQueryPool timestampPool;
     std::unique_ptr<BufferAllocation> cameraBuffer;
     void *cameraBufferMapping;
     std::unique_ptr<BufferAllocation> objectBuffer;
     void *objectBufferMapping;
     VkDescriptorSet globalDescriptor;
     VkDescriptorSet objectDescriptor;
+    std::unique_ptr<BufferAllocation> cullBuffer;
+    void *cullBufferMapping;
+    std::unique_ptr<BufferAllocation> drawTemplateBuffer;
+    void *drawTemplateBufferMapping;
+    std::unique_ptr<BufferAllocation> drawCommandBuffer;
+    std::unique_ptr<BufferAllocation> visibleBuffer;
+    std::unique_ptr<BufferAllocation> cullStatsBuffer;
+    void *cullStatsBufferMapping;
+    VkDescriptorSet cullDescriptor;
+    std::unique_ptr<BufferAllocation> lightBuffer;
+    void *lightBufferMapping;
+    std::unique_ptr<BufferAllocation> clusterBuffer;
+    VkDescriptorSet lightCullDescriptor;
+    std::unique_ptr<BufferAllocation> meshletBatchBuffer;
+    void *meshletBatchBufferMapping;
+    std::unique_ptr<BufferAllocation> meshletTaskBuffer;
+    std::unique_ptr<BufferAllocation> meshletDrawBuffer;
+    std::unique_ptr<BufferAllocation> meshletDrawCountBuffer;
+    VkDescriptorSet meshletDescriptor;
+    std::unique_ptr<BufferAllocation> readbackBuffer;
+    void *readbackBufferMapping;
+    bool readbackPending;
 };
 
 struct SwapchainData {
@@ -37,12 +193,6 @@ struct SwapchainData {
     VkImageView imageView;
 };
 
-struct UploadContext {
-    VkFence uploadFence;
-    VkCommandPool commandPool;
-    VkCommandBuffer commandBuffer;
-};
-
 struct CameraData {
     glm::mat4 view;
     glm::mat4 proj;
@@ -54,43 +204,194 @@ struct ObjectData {
     glm::mat4 normalMat;
 };
 
+struct PointLight {
+    // World space position in xyz, radius in w
+    glm::vec4 positionRadius;
+    glm::vec4 color;
+};
+
+struct Cluster {
+    uint32_t count;
+    uint32_t lights[MAX_LIGHTS_PER_CLUSTER];
+};
+
+struct LightCullConstants {
+    glm::uvec4 grid;
+    glm::vec2 tileSize;
+    glm::vec2 screenSize;
+    float znear;
+    float zfar;
+    uint32_t lightCount;
+};
+
+struct CullData {
+    glm::vec4 sphere;
+    uint32_t batch;
+    // Place of a blended instance within its batch, CULL_UNORDERED for
+    // the ones culling compacts
+    uint32_t order;
+    uint32_t pad[2];
+};
+
+struct CullStats {
+    uint32_t drawnEarly;
+    uint32_t drawnLate;
+    uint32_t occluded;
+    uint32_t frustumCulled;
+    uint32_t meshletsDrawn;
+    uint32_t meshletsCulled;
+};
+
+struct CullConstants {
+    glm::mat4 view;
+    glm::vec4 frustum;
+    // P00, P11, P22, P32 of the projection matrix
+    glm::vec4 projection;
+    float znear;
+    float zfar;
+    float pyramidWidth;
+    float pyramidHeight;
+    uint32_t instanceCount;
+    uint32_t batchCount;
+    uint32_t phase;
+    uint32_t occlusion;
+};
+
+struct MeshletBatch {
+    uint32_t meshletOffset;
+    uint32_t meshletCount;
+    // Start of the batch's range of MAX_MESHLET_DRAWS, fallback path only
+    uint32_t drawOffset;
+    uint32_t pad;
+};
+
+struct MeshletConstants {
+    glm::mat4 view;
+    glm::vec4 frustum;
+    glm::vec4 cameraPos;
+    float znear;
+    float zfar;
+    uint32_t batch;
+    uint32_t batchCount;
+    uint32_t phase;
+};
+
+struct ShaderStage {
+    VkShaderStageFlagBits stage;
+    std::string file;
+};
+
+struct UpscaleConstants {
+    glm::vec2 uvScale;
+    glm::vec2 texelSize;
+    float sharpness;
+};
+
+struct DrawBatch {
+    MeshHandle mesh;
+    MaterialHandle material;
+    uint32_t firstInstance;
+    uint32_t instanceCount;
+    // Static instances come first in the batch
+    uint32_t staticCount;
+    uint32_t meshletDrawOffset;
+};
+
 struct SceneData {
     glm::vec4 cameraPos;
     glm::vec4 lightPos;
     glm::vec4 lightColor;
+    // Tile width and height, depth slice scale and bias
+    glm::vec4 clusterParams;
+    glm::uvec4 clusterGrid;
+    glm::mat4 lightViewProj;
 };
 
 class VKlelu
 {
 public:
     VKlelu(int argc, char *argv[]);
+    VKlelu(const Options &options);
     ~VKlelu();
     int run();
 
+    void init();
+    void frame();
+    const FrameStats &frameStats();
+    Scene &scene();
+
 private:
     void update();
+    void startSimulation();
     void draw();
-    void drawObjects(VkCommandBuffer cmd);
+    void updateFrameData();
+    void cullObjects(VkCommandBuffer cmd, uint32_t phase);
+    void buildDepthPyramid(VkCommandBuffer cmd);
+    void cullLights(VkCommandBuffer cmd);
+    void cullMeshlets(VkCommandBuffer cmd, uint32_t phase);
+    void drawPhase(VkCommandBuffer cmd, uint32_t phase);
+    void drawObjects(VkCommandBuffer cmd, uint32_t phase, bool depthOnly);
+    void drawMeshlets(VkCommandBuffer cmd, uint32_t phase);
+    void drawShadows(VkCommandBuffer cmd, VkImageView target, bool statics, bool dynamics);
+    void recordDrawCommands(FrameData &frame);
+    void readTimestamps(FrameData &frame);
+    void updateResolutionScale();
+    void upscale(VkCommandBuffer cmd, VkImageView target);
+    void captureFrame(VkCommandBuffer cmd, VkImage image);
+    void collectCapture(FrameData &frame);
+    void buildDrawBatches();
     FrameData &getCurrentFrame();
 
-    void initScene();
-    Material *createMaterial(VkPipeline pipeline, VkPipelineLayout layout, const std::string name);
-    Mesh *getMesh(const std::string name);
-    Material *getMaterial(const std::string name);
-    void uploadMesh(ObjFile &obj, std::string name);
-    void uploadImage(ImageFile &image, std::string name);
+    void initScene(SceneFile &sceneFile, std::vector<std::unique_ptr<ObjFile>> &objs, std::vector<std::unique_ptr<ImageFile>> &images);
+    void loadScene(SceneFile &sceneFile, std::vector<std::unique_ptr<ObjFile>> &objs, std::vector<std::unique_ptr<ImageFile>> &images);
+    void setMaterialTexture(MaterialHandle material, TextureHandle texture);
+    MaterialHandle createMaterial(VkPipeline pipeline, VkPipelineLayout layout, const std::string name, const MaterialState &state = {});
+    VkPipeline materialPipeline(const MaterialState &state);
+    VkPipeline meshletPipeline(const MaterialState &state);
+    void setMaterialState(VkCommandBuffer cmd, const MaterialState &state, const MaterialState *previous);
+    MeshHandle getMesh(const std::string name);
+    MaterialHandle getMaterial(const std::string name);
+    MeshHandle uploadMesh(ObjFile &obj, std::string name);
+    void uploadMeshlets(std::vector<std::unique_ptr<ObjFile>> &objs, const std::vector<MeshHandle> &meshes);
+    void uploadVertexStreams(std::vector<std::unique_ptr<ObjFile>> &objs, const std::vector<MeshHandle> &meshes);
+    TextureHandle uploadImage(ImageFile &image, std::string name);
     void immediateSubmit(std::function<void(VkCommandBuffer)> &&function);
     void loadShader(const char *path, VkShaderModule &module);
+    VkPipeline buildGraphicsPipeline(PipelineBuilder builder, const VertexInputDescription &vertexInput,
+                                     const std::vector<ShaderStage> &stages, VkFormat colorFormat, VkFormat depthFormat);
+    void reloadablePipeline(VkPipeline &pipeline, std::vector<std::string> shaders, std::function<VkPipeline()> &&build);
+    void reloadableGraphicsPipeline(VkPipeline &pipeline, const PipelineBuilder &builder, const VertexInputDescription &vertexInput,
+                                    std::vector<ShaderStage> stages, VkFormat colorFormat, VkFormat depthFormat);
+    void reloadableComputePipeline(VkPipeline &pipeline, const std::string &shader, VkPipelineLayout layout);
+    void applyShaderReloads();
     void deferCleanup(std::function<void()> &&cleanupFunc);
 
+    void initContext();
     void initVulkan();
     void initSwapchain();
+    void initShadows();
+    void initRenderGraph();
+    void initHeadlessTargets(VkExtent3D extent);
+    void initPresentSwapchain();
     void initCommands();
     void initSyncStructures();
+    void initPipelineCache();
     void initDescriptors();
+    void initCullDescriptors();
+    void growObjectBuffers(size_t count);
+    void initLightDescriptors();
     void initPipelines();
+    void initCullPipelines();
+    void initLightPipelines();
+    void initMeshlets();
+    void initUpscale();
+    void initCapture();
 
+    Options m_options;
     int m_frameCount;
+    // SDL ticks when init() started, for the time to the first frame
+    uint64_t m_startupBegin;
+    FrameStats m_frameStats;
 
     SDL_Window *m_window;
     VkExtent2D m_fbSize;
@@ -101,29 +402,149 @@ private:
     VkSwapchainKHR m_swapchain;
     VkFormat m_swapchainImageFormat;
     std::vector<SwapchainData> m_swapchainData;
+    std::vector<Texture> m_headlessImages;
 
-    Texture m_depthImage;
+    // Passes of a frame and the barriers between them, owns the transient
+    // targets below
+    std::unique_ptr<RenderGraph> m_renderGraph;
+    GraphResource m_swapchainResource;
+
+    // The main pass target, allocated at the full framebuffer size and
+    // rendered to m_renderExtent of it
+    GraphResource m_renderTarget;
+    VkFormat m_renderTargetFormat;
+    VkExtent2D m_renderExtent;
+    float m_resolutionScale;
+    float m_loggedResolutionScale;
+
+    GraphResource m_depthImage;
     VkFormat m_depthImageFormat;
 
-    VkDescriptorPool m_descriptorPool;
+    // Hi-Z pyramid of the farthest depth, sized to the previous power of
+    // two of the framebuffer
+    Texture m_depthPyramid;
+    GraphResource m_depthPyramidResource;
+    std::vector<VkImageView> m_depthPyramidMips;
+    VkExtent2D m_depthPyramidSize;
+    uint32_t m_depthPyramidLevels;
+    VkSampler m_depthSampler;
+
+    // Shadow map of the main light. Static casters are rendered into the
+    // cache only when they, the light or the light frustum move, every
+    // frame starts from a copy of it and adds the dynamic casters.
+    GraphResource m_shadowMap;
+    Texture m_shadowCache;
+    GraphResource m_shadowCacheResource;
+    uint64_t m_shadowCacheVersion;
+    glm::vec4 m_shadowCacheLight;
+    bool m_shadowCacheDirty;
+    // Bounds of the static casters as of the cache, and the box the light
+    // frustum is fitted to
+    glm::vec3 m_shadowStaticMin;
+    glm::vec3 m_shadowStaticMax;
+    glm::vec3 m_shadowBoundsMin;
+    glm::vec3 m_shadowBoundsMax;
+    VkSampler m_shadowSampler;
+
+    std::unique_ptr<DescriptorAllocator> m_descriptorAllocator;
+    std::unique_ptr<DescriptorLayoutCache> m_layoutCache;
     VkDescriptorSetLayout m_globalSetLayout;
     VkDescriptorSetLayout m_objectSetLayout;
     VkDescriptorSetLayout m_singleTextureSetLayout;
+    VkDescriptorSetLayout m_depthReduceSetLayout;
+    VkDescriptorSetLayout m_cullSetLayout;
+    VkDescriptorSetLayout m_lightCullSetLayout;
+    VkDescriptorSetLayout m_upscaleSetLayout;
+    VkDescriptorSetLayout m_meshletSetLayout;
+    std::vector<VkDescriptorSet> m_depthReduceSets;
+    VkDescriptorSet m_upscaleSet;
 
+    // Shared by every pipeline and kept on disk between runs
+    VkPipelineCache m_pipelineCache;
     VkPipeline m_meshPipeline;
     VkPipelineLayout m_meshPipelineLayout;
+    VkPipeline m_depthPipeline;
+    VkPipeline m_shadowPipeline;
+    VkPipeline m_depthReducePipeline;
+    VkPipelineLayout m_depthReducePipelineLayout;
+    VkPipeline m_cullPipeline;
+    VkPipelineLayout m_cullPipelineLayout;
+    VkPipeline m_lightCullPipeline;
+    VkPipelineLayout m_lightCullPipelineLayout;
+    VkPipeline m_meshletTaskPipeline;
+    VkPipeline m_meshletCullPipeline;
+    VkPipelineLayout m_meshletCullPipelineLayout;
+    VkPipeline m_meshletPipeline;
+    VkPipelineLayout m_meshletPipelineLayout;
+    PFN_vkCmdDrawMeshTasksIndirectEXT m_cmdDrawMeshTasksIndirect;
+    // Material state is either dynamic on m_meshPipeline or baked into a
+    // permutation built from the mesh pipeline builder on first use
+    bool m_dynamicState;
+    PFN_vkCmdSetColorBlendEnableEXT m_cmdSetColorBlendEnable;
+    PipelineBuilder m_meshPipelineBuilder;
+    std::unordered_map<uint32_t, VkPipeline> m_materialPipelines;
+    // The same for the mesh shader pipeline
+    PipelineBuilder m_meshletPipelineBuilder;
+    std::unordered_map<uint32_t, VkPipeline> m_meshletPipelines;
+    VkPipeline m_upscalePipeline;
+    VkPipelineLayout m_upscalePipelineLayout;
+    VkSampler m_upscaleSampler;
 
     std::array<FrameData, MAX_FRAMES_IN_FLIGHT> m_frameData;
     SceneData m_sceneParameters;
+    SceneFile::CameraEntry m_camera;
     std::unique_ptr<BufferAllocation> m_sceneParameterBuffer;
     void *m_sceneParameterBufferMapping;
-    UploadContext m_uploadContext;
+    std::unique_ptr<Uploader> m_uploader;
+    std::unique_ptr<ComputeScheduler> m_compute;
+    // Replaced pipelines wait here for the frames still using them
+    std::unique_ptr<ShaderWatcher> m_shaderWatcher;
+    std::vector<std::pair<VkPipeline, int>> m_retiredPipelines;
+    std::unique_ptr<FrameCapture> m_capture;
+    // Restarted from the current transforms whenever the scene changes or
+    // a Himmeli is moved
+    std::unique_ptr<Simulation> m_simulation;
+    uint64_t m_simulationVersion;
+    uint64_t m_simulationTransformVersion;
+
+    // Clusters of every mesh, vertex indices are global into the
+    // concatenated vertices, null without meshlets
+    bool m_meshShaders;
+    std::unique_ptr<BufferAllocation> m_meshletBuffer;
+    std::unique_ptr<BufferAllocation> m_meshletVertexBuffer;
+    std::unique_ptr<BufferAllocation> m_meshletTriangleBuffer;
+    std::unique_ptr<BufferAllocation> m_meshletIndexBuffer;
+    std::unique_ptr<BufferAllocation> m_sceneVertexBuffer;
+    // Split position and attribute streams of every mesh for vertex
+    // pulling, null without it
+    std::unique_ptr<BufferAllocation> m_positionStreamBuffer;
+    std::unique_ptr<BufferAllocation> m_attributeStreamBuffer;
     VkSampler m_linearSampler;
 
-    std::vector<Himmeli> m_himmelit;
-    std::unordered_map<std::string, Mesh> m_meshes;
-    std::unordered_map<std::string, Material> m_materials;
-    std::unordered_map<std::string, Texture> m_textures;
+    Scene m_scene;
+    std::vector<uint64_t> m_drawKeys;
+    std::vector<uint32_t> m_drawOrder;
+    std::vector<DrawBatch> m_drawBatches;
+    // Blended batches come after every opaque one, their instances are
+    // sorted back to front within the batch every frame
+    uint32_t m_firstBlendedInstance;
+    std::vector<std::pair<float, uint32_t>> m_blendDistances;
+    uint64_t m_drawBatchesVersion;
+    // Bumped by anything baked into the cached draws: batches, materials,
+    // pipelines and the render extent
+    bool m_commandCache;
+    uint64_t m_drawCommandsVersion;
+    std::vector<uint32_t> m_instanceBatches;
+    std::unique_ptr<BufferAllocation> m_visibilityBuffer;
+    uint64_t m_visibilityVersion;
+    // Objects the per-frame object, cull and visible buffers have room for
+    uint32_t m_objectCapacity;
+    CullConstants m_cullConstants;
+    std::vector<PointLight> m_pointLights;
+    std::vector<glm::vec3> m_pointLightOrigins;
+    AssetStore<Mesh> m_meshes;
+    AssetStore<Material> m_materials;
+    AssetStore<Texture> m_textures;
 
     std::vector<std::function<void()>> m_resourceJanitor;
 };
@@ -1,47 +1,473 @@
 #include "vklelu.hh"
 
 #include "context.hh"
+#include "embeddedshaders.hh"
 #include "himmeli.hh"
 #include "memory.hh"
+#include "upload.hh"
 #include "utils.hh"
 
 #include "VkBootstrap.h"
 #include "vulkan/vulkan.h"
 
+#include <algorithm>
 #include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
 #include <memory>
 #include <stdexcept>
 #include <vector>
 
-#define MAX_OBJECTS 10000
+#define PIPELINE_CACHE_MAGIC 0x434c4b56
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ull
+#define FNV_PRIME 0x100000001b3ull
+
+// In front of the driver's data in the pipeline cache file
+struct PipelineCacheHeader {
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t shaderHash;
+};
+
+// FNV-1a over the names and contents of the compiled shaders on disk, in
+// name order
+static uint64_t shaderDirectoryHash()
+{
+    std::vector<Path> files;
+    std::error_code error;
+    for (const std::filesystem::directory_entry &file : std::filesystem::directory_iterator(shaderdir(), error)) {
+        if (file.is_regular_file() && file.path().extension() == ".spv")
+            files.push_back(file.path());
+    }
+    std::sort(files.begin(), files.end());
+
+    uint64_t hash = FNV_OFFSET_BASIS;
+    auto add = [&hash](const std::string &bytes) {
+        for (char c : bytes) {
+            hash ^= static_cast<uint8_t>(c);
+            hash *= FNV_PRIME;
+        }
+    };
+    for (const Path &file : files) {
+        std::ifstream in(file, std::ios::binary);
+        add(file.filename().string());
+        add(std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()));
+    }
+
+    return hash;
+}
+
+static uint32_t previousPow2(uint32_t v)
+{
+    uint32_t result = 1;
+    while (result * 2 <= v)
+        result *= 2;
+    return result;
+}
 
 void VKlelu::initVulkan()
 {
     initSwapchain();
+    initShadows();
+    initRenderGraph();
     initCommands();
     initSyncStructures();
+
+    if (m_options.hotReload)
+        m_shaderWatcher = std::make_unique<ShaderWatcher>(m_device, shadersourcedir(), shaderdir());
+
+    initPipelineCache();
     initDescriptors();
+    initCullDescriptors();
+    initLightDescriptors();
     initPipelines();
+    initCullPipelines();
+    initLightPipelines();
+    if (m_options.meshlets)
+        initMeshlets();
+    initUpscale();
+    initCapture();
+
+    if (m_shaderWatcher) {
+        m_shaderWatcher->start();
 
-    immediateSubmit([&](VkCommandBuffer cmd) {
-        imageLayoutTransition(cmd, m_depthImage.image->image(),
-                              VK_IMAGE_ASPECT_DEPTH_BIT,
-                              VK_PIPELINE_STAGE_2_NONE,
-                              0,
-                              VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT
-                              | VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT,
-                              VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
-                              VK_IMAGE_LAYOUT_UNDEFINED,
-                              VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL);
+        // Stop rebuilding before the pipelines and layouts go away
+        deferCleanup([=, this](){
+            m_shaderWatcher.reset();
+            for (const std::pair<VkPipeline, int> &entry : m_retiredPipelines)
+                vkDestroyPipeline(m_device, entry.first, nullptr);
+        });
+    }
+}
+
+void VKlelu::initPipelineCache()
+{
+    // The driver checks its own header, ours drops caches built from other
+    // shaders so that stale pipelines don't pile up. Without embedded
+    // shaders they are hashed as they are on disk.
+    PipelineCacheHeader header {
+        .magic = PIPELINE_CACHE_MAGIC
+    };
+
+    std::vector<char> data;
+    if (!m_options.pipelineCache.empty()) {
+        header.shaderHash = embeddedShaderHash() && !m_options.hotReload ? embeddedShaderHash() : shaderDirectoryHash();
+
+        std::ifstream file(m_options.pipelineCache, std::ios::binary);
+        if (file)
+            data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+
+    PipelineCacheHeader stored{};
+    if (data.size() >= sizeof(stored))
+        memcpy(&stored, data.data(), sizeof(stored));
+    if (stored.magic != header.magic || stored.shaderHash != header.shaderHash)
+        data.clear();
+
+    size_t initialSize = data.empty() ? 0 : data.size() - sizeof(header);
+    VkPipelineCacheCreateInfo cacheInfo {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+        .initialDataSize = initialSize,
+        .pInitialData = initialSize ? data.data() + sizeof(header) : nullptr
+    };
+
+    VK_CHECK(vkCreatePipelineCache(m_device, &cacheInfo, nullptr, &m_pipelineCache));
+    if (!m_options.pipelineCache.empty())
+        fprintf(stderr, "Pipeline cache %s: %zu bytes loaded\n", m_options.pipelineCache.c_str(), initialSize);
+
+    deferCleanup([=, this](){
+        size_t size = 0;
+        std::vector<char> cacheData;
+        if (!m_options.pipelineCache.empty() && vkGetPipelineCacheData(m_device, m_pipelineCache, &size, nullptr) == VK_SUCCESS) {
+            cacheData.resize(size);
+            if (vkGetPipelineCacheData(m_device, m_pipelineCache, &size, cacheData.data()) == VK_SUCCESS) {
+                std::ofstream file(m_options.pipelineCache, std::ios::binary);
+                file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+                file.write(cacheData.data(), static_cast<std::streamsize>(size));
+                if (file)
+                    fprintf(stderr, "Pipeline cache %s: %zu bytes saved\n", m_options.pipelineCache.c_str(), size);
+            }
+        }
+
+        vkDestroyPipelineCache(m_device, m_pipelineCache, nullptr);
     });
 }
 
 void VKlelu::initSwapchain()
+{
+    VkExtent3D imageExtent {
+        .width = m_fbSize.width,
+        .height = m_fbSize.height,
+        .depth = 1
+    };
+
+    if (m_options.headless) {
+        initHeadlessTargets(imageExtent);
+    } else {
+        initPresentSwapchain();
+    }
+
+    // Memory for the transient targets is placed when the graph is compiled
+    m_renderGraph = std::make_unique<RenderGraph>(m_device, m_ctx->allocator());
+    deferCleanup([=, this](){ m_renderGraph.reset(); });
+
+    m_renderTargetFormat = VK_FORMAT_R16G16B16A16_SFLOAT;
+    m_renderTarget = m_renderGraph->createImage("render target", imageExtent, m_renderTargetFormat,
+                                                VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_IMAGE_ASPECT_COLOR_BIT);
+
+    m_depthImageFormat = VK_FORMAT_D32_SFLOAT;
+    m_depthImage = m_renderGraph->createImage("depth", imageExtent, m_depthImageFormat,
+                                              VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_IMAGE_ASPECT_DEPTH_BIT);
+
+    // Set to the acquired image every frame
+    m_swapchainResource = m_renderGraph->importImage("swapchain", VK_NULL_HANDLE, VK_NULL_HANDLE, VK_IMAGE_ASPECT_COLOR_BIT);
+
+    m_depthPyramidSize.width = previousPow2(m_fbSize.width);
+    m_depthPyramidSize.height = previousPow2(m_fbSize.height);
+    m_depthPyramidLevels = 1;
+    while ((std::max(m_depthPyramidSize.width, m_depthPyramidSize.height) >> m_depthPyramidLevels) > 0)
+        ++m_depthPyramidLevels;
+    m_depthPyramidLevels = std::min(m_depthPyramidLevels, static_cast<uint32_t>(MAX_PYRAMID_LEVELS));
+
+    VkExtent3D pyramidExtent {
+        .width = m_depthPyramidSize.width,
+        .height = m_depthPyramidSize.height,
+        .depth = 1
+    };
+
+    m_depthPyramid.image = m_ctx->allocateImage(pyramidExtent, VK_FORMAT_R32_SFLOAT, VK_SAMPLE_COUNT_1_BIT, VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VMA_MEMORY_USAGE_GPU_ONLY, m_depthPyramidLevels);
+    m_depthPyramid.imageView = m_depthPyramid.image->createImageView(VK_FORMAT_R32_SFLOAT, VK_IMAGE_ASPECT_COLOR_BIT, 0, m_depthPyramidLevels);
+    for (uint32_t i = 0; i < m_depthPyramidLevels; ++i)
+        m_depthPyramidMips.push_back(m_depthPyramid.image->createImageView(VK_FORMAT_R32_SFLOAT, VK_IMAGE_ASPECT_COLOR_BIT, i, 1));
+
+    // Not transient, the next frame's early culling reads it
+    m_depthPyramidResource = m_renderGraph->importImage("depth pyramid", m_depthPyramid.image->image(), m_depthPyramid.imageView,
+                                                        VK_IMAGE_ASPECT_COLOR_BIT, m_depthPyramidLevels);
+
+    fprintf(stderr, "Swapchain initialized\n");
+}
+
+void VKlelu::initShadows()
+{
+    VkExtent3D extent {
+        .width = SHADOW_MAP_SIZE,
+        .height = SHADOW_MAP_SIZE,
+        .depth = 1
+    };
+
+    // Rebuilt every frame from the cache and the dynamic casters
+    m_shadowMap = m_renderGraph->createImage("shadow map", extent, VK_FORMAT_D32_SFLOAT,
+                                             VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+                                             VK_IMAGE_ASPECT_DEPTH_BIT);
+
+    if (m_options.shadowCache) {
+        m_shadowCache.image = m_ctx->allocateImage(extent, VK_FORMAT_D32_SFLOAT, VK_SAMPLE_COUNT_1_BIT,
+                                                   VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+        m_shadowCache.imageView = m_shadowCache.image->createImageView(VK_FORMAT_D32_SFLOAT, VK_IMAGE_ASPECT_DEPTH_BIT, 0, 1);
+        m_shadowCacheResource = m_renderGraph->importImage("shadow cache", m_shadowCache.image->image(), m_shadowCache.imageView,
+                                                           VK_IMAGE_ASPECT_DEPTH_BIT);
+    }
+
+    // Hardware 2x2 PCF, everything outside the map is lit
+    VkSamplerCreateInfo samplerInfo {
+        .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+        .magFilter = VK_FILTER_LINEAR,
+        .minFilter = VK_FILTER_LINEAR,
+        .mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST,
+        .addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER,
+        .addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER,
+        .addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER,
+        .compareEnable = VK_TRUE,
+        .compareOp = VK_COMPARE_OP_LESS_OR_EQUAL,
+        .borderColor = VK_BORDER_COLOR_FLOAT_OPAQUE_WHITE
+    };
+
+    VK_CHECK(vkCreateSampler(m_device, &samplerInfo, nullptr, &m_shadowSampler));
+
+    deferCleanup([=, this](){ vkDestroySampler(m_device, m_shadowSampler, nullptr); });
+
+    fprintf(stderr, "Shadows initialized\n");
+}
+
+void VKlelu::initRenderGraph()
+{
+    RenderGraph &graph = *m_renderGraph;
+
+    // Per-frame copies share one resource, buffers are only ordered
+    GraphResource visibility = graph.importBuffer("visibility");
+    GraphResource drawCommands = graph.importBuffer("draw commands");
+    GraphResource visible = graph.importBuffer("visible instances");
+    GraphResource cullStats = graph.importBuffer("cull stats");
+    GraphResource meshletDraws = graph.importBuffer("meshlet draws");
+    GraphResource readback = graph.importBuffer("readback");
+
+    VkPipelineStageFlags2 vertexStages = VK_PIPELINE_STAGE_2_VERTEX_SHADER_BIT;
+    if (m_meshShaders)
+        vertexStages |= VK_PIPELINE_STAGE_2_TASK_SHADER_BIT_EXT | VK_PIPELINE_STAGE_2_MESH_SHADER_BIT_EXT;
+
+    VkAccessFlags2 storageReadWrite = VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT;
+
+    GraphAccess shadowWrite {
+        .resource = m_shadowMap,
+        .stage = VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT,
+        .access = VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+        .layout = VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL,
+        .write = true
+    };
+
+    if (m_options.shadowCache) {
+        GraphAccess cacheWrite = shadowWrite;
+        cacheWrite.resource = m_shadowCacheResource;
+
+        graph.addPass("shadow cache", { cacheWrite }, [this](VkCommandBuffer cmd) {
+            if (m_shadowCacheDirty)
+                drawShadows(cmd, m_shadowCache.imageView, true, false);
+            vkCmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, getCurrentFrame().timestampPool, TIMESTAMP_SHADOW_CACHE);
+        });
+
+        graph.addPass("shadow copy", {
+            { .resource = m_shadowCacheResource, .stage = VK_PIPELINE_STAGE_2_ALL_TRANSFER_BIT, .access = VK_ACCESS_2_TRANSFER_READ_BIT,
+              .layout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL },
+            { .resource = m_shadowMap, .stage = VK_PIPELINE_STAGE_2_ALL_TRANSFER_BIT, .access = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+              .layout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, .write = true }
+        }, [this](VkCommandBuffer cmd) {
+            VkImageCopy copy {
+                .srcSubresource = { .aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT, .layerCount = 1 },
+                .dstSubresource = { .aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT, .layerCount = 1 },
+                .extent = { SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, 1 }
+            };
+            vkCmdCopyImage(cmd, m_shadowCache.image->image(), VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                           m_renderGraph->image(m_shadowMap), VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copy);
+        });
+
+        graph.addPass("dynamic shadows", { shadowWrite }, [this](VkCommandBuffer cmd) {
+            drawShadows(cmd, m_renderGraph->imageView(m_shadowMap), false, true);
+            vkCmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, getCurrentFrame().timestampPool, TIMESTAMP_SHADOWS);
+        });
+    } else {
+        graph.addPass("shadows", { shadowWrite }, [this](VkCommandBuffer cmd) {
+            vkCmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, getCurrentFrame().timestampPool, TIMESTAMP_SHADOW_CACHE);
+            drawShadows(cmd, m_renderGraph->imageView(m_shadowMap), true, true);
+            vkCmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, getCurrentFrame().timestampPool, TIMESTAMP_SHADOWS);
+        });
+    }
+
+    std::vector<GraphAccess> reset = {
+        { .resource = cullStats, .stage = VK_PIPELINE_STAGE_2_ALL_TRANSFER_BIT, .access = VK_ACCESS_2_TRANSFER_WRITE_BIT, .write = true },
+        { .resource = drawCommands, .stage = VK_PIPELINE_STAGE_2_ALL_TRANSFER_BIT, .access = VK_ACCESS_2_TRANSFER_WRITE_BIT, .write = true },
+        { .resource = visibility, .stage = VK_PIPELINE_STAGE_2_ALL_TRANSFER_BIT, .access = VK_ACCESS_2_TRANSFER_WRITE_BIT, .write = true }
+    };
+    if (m_options.meshlets && !m_meshShaders)
+        reset.push_back({ .resource = meshletDraws, .stage = VK_PIPELINE_STAGE_2_ALL_TRANSFER_BIT, .access = VK_ACCESS_2_TRANSFER_WRITE_BIT, .write = true });
+
+    graph.addPass("reset", reset, [this](VkCommandBuffer cmd) {
+        FrameData &currentFrame = getCurrentFrame();
+
+        vkCmdFillBuffer(cmd, currentFrame.cullStatsBuffer->buffer(), 0, VK_WHOLE_SIZE, 0);
+
+        if (m_options.meshlets && !m_meshShaders)
+            vkCmdFillBuffer(cmd, currentFrame.meshletDrawCountBuffer->buffer(), 0, VK_WHOLE_SIZE, 0);
+
+        // The draw order changed, start over with everything visible
+        if (m_visibilityVersion != m_drawBatchesVersion) {
+            vkCmdFillBuffer(cmd, m_visibilityBuffer->buffer(), 0, VK_WHOLE_SIZE, 1);
+            m_visibilityVersion = m_drawBatchesVersion;
+        }
+
+        if (!m_drawBatches.empty()) {
+            VkBufferCopy copy {
+                .size = 2 * m_drawBatches.size() * sizeof(VkDrawIndexedIndirectCommand)
+            };
+            vkCmdCopyBuffer(cmd, currentFrame.drawTemplateBuffer->buffer(), currentFrame.drawCommandBuffer->buffer(), 1, &copy);
+        }
+    });
+
+    std::vector<GraphAccess> cull = {
+        { .resource = visibility, .stage = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, .access = storageReadWrite, .write = true },
+        { .resource = drawCommands, .stage = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, .access = storageReadWrite, .write = true },
+        { .resource = visible, .stage = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, .access = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT, .write = true },
+        { .resource = cullStats, .stage = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, .access = storageReadWrite, .write = true }
+    };
+    if (m_options.meshlets)
+        cull.push_back({ .resource = meshletDraws, .stage = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, .access = storageReadWrite, .write = true });
+    // Without occlusion culling nothing samples the pyramid and building
+    // it is culled
+    if (m_options.occlusionCulling)
+        cull.push_back({ .resource = m_depthPyramidResource, .stage = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                         .access = VK_ACCESS_2_SHADER_SAMPLED_READ_BIT, .layout = VK_IMAGE_LAYOUT_GENERAL });
+
+    std::vector<GraphAccess> render = {
+        { .resource = drawCommands, .stage = VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT, .access = VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT },
+        { .resource = visible, .stage = vertexStages, .access = VK_ACCESS_2_SHADER_STORAGE_READ_BIT },
+        { .resource = m_renderTarget, .stage = VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT,
+          .access = VK_ACCESS_2_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT,
+          .layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, .write = true },
+        { .resource = m_depthImage, .stage = VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT,
+          .access = VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+          .layout = VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL, .write = true },
+        { .resource = m_shadowMap, .stage = VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT, .access = VK_ACCESS_2_SHADER_SAMPLED_READ_BIT,
+          .layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL }
+    };
+    if (m_options.meshlets)
+        render.push_back({ .resource = meshletDraws, .stage = VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT | vertexStages,
+                           .access = VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_READ_BIT });
+
+    graph.addPass("early cull", cull, [this](VkCommandBuffer cmd) {
+        cullObjects(cmd, 0);
+        vkCmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, getCurrentFrame().timestampPool, TIMESTAMP_EARLY_CULL);
+    });
+
+    graph.addPass("early render", render, [this](VkCommandBuffer cmd) {
+        drawPhase(cmd, 0);
+    });
+
+    graph.addPass("depth pyramid", {
+        { .resource = m_depthImage, .stage = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, .access = VK_ACCESS_2_SHADER_SAMPLED_READ_BIT,
+          .layout = VK_IMAGE_LAYOUT_DEPTH_READ_ONLY_OPTIMAL },
+        // Each level reads the one before it, in GENERAL throughout
+        { .resource = m_depthPyramidResource, .stage = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+          .access = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT | VK_ACCESS_2_SHADER_SAMPLED_READ_BIT,
+          .layout = VK_IMAGE_LAYOUT_GENERAL, .write = true }
+    }, [this](VkCommandBuffer cmd) {
+        buildDepthPyramid(cmd);
+    });
+
+    graph.addPass("late cull", cull, [this](VkCommandBuffer cmd) {
+        // Written here rather than after the pyramid, which may be culled
+        vkCmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, getCurrentFrame().timestampPool, TIMESTAMP_DEPTH_PYRAMID);
+        cullObjects(cmd, 1);
+        vkCmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, getCurrentFrame().timestampPool, TIMESTAMP_LATE_CULL);
+    });
+
+    graph.addPass("late render", render, [this](VkCommandBuffer cmd) {
+        drawPhase(cmd, 1);
+    });
+
+    graph.addPass("upscale", {
+        { .resource = m_renderTarget, .stage = VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT, .access = VK_ACCESS_2_SHADER_SAMPLED_READ_BIT,
+          .layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL },
+        { .resource = m_swapchainResource, .stage = VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT, .access = VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT,
+          .layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, .write = true }
+    }, [this](VkCommandBuffer cmd) {
+        upscale(cmd, m_renderGraph->imageView(m_swapchainResource));
+        vkCmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, getCurrentFrame().timestampPool, TIMESTAMP_UPSCALE);
+    });
+
+    std::vector<GraphAccess> hostReads = {
+        { .resource = cullStats, .stage = VK_PIPELINE_STAGE_2_HOST_BIT, .access = VK_ACCESS_2_HOST_READ_BIT }
+    };
+
+    if (!m_options.captureFile.empty()) {
+        graph.addPass("capture", {
+            { .resource = m_swapchainResource, .stage = VK_PIPELINE_STAGE_2_ALL_TRANSFER_BIT, .access = VK_ACCESS_2_TRANSFER_READ_BIT,
+              .layout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL },
+            { .resource = readback, .stage = VK_PIPELINE_STAGE_2_ALL_TRANSFER_BIT, .access = VK_ACCESS_2_TRANSFER_WRITE_BIT, .write = true }
+        }, [this](VkCommandBuffer cmd) {
+            captureFrame(cmd, m_renderGraph->image(m_swapchainResource));
+        });
+
+        hostReads.push_back({ .resource = readback, .stage = VK_PIPELINE_STAGE_2_HOST_BIT, .access = VK_ACCESS_2_HOST_READ_BIT });
+        graph.setOutput(readback);
+    }
+
+    // Only barriers, the counters and the capture are read on the host
+    // after the fence and the image goes to the presentation engine
+    graph.addPass("host readback", hostReads);
+    graph.addPass("present", {
+        { .resource = m_swapchainResource, .stage = VK_PIPELINE_STAGE_2_NONE, .access = 0,
+          .layout = m_options.headless ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR }
+    });
+
+    graph.setOutput(cullStats);
+    graph.setOutput(m_swapchainResource);
+    graph.compile();
+}
+
+void VKlelu::initHeadlessTargets(VkExtent3D extent)
+{
+    // Same format the default swapchain selection prefers, so that the
+    // pipelines and the rendered output match the windowed path
+    m_swapchainImageFormat = VK_FORMAT_B8G8R8A8_SRGB;
+
+    m_headlessImages.resize(MAX_FRAMES_IN_FLIGHT);
+    m_swapchainData.resize(MAX_FRAMES_IN_FLIGHT);
+    for (size_t i = 0; i < m_swapchainData.size(); ++i) {
+        m_headlessImages[i].image = m_ctx->allocateImage(extent, m_swapchainImageFormat, VK_SAMPLE_COUNT_1_BIT, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+        m_headlessImages[i].imageView = m_headlessImages[i].image->createImageView(m_swapchainImageFormat, VK_IMAGE_ASPECT_COLOR_BIT);
+        m_swapchainData[i].image = m_headlessImages[i].image->image();
+        m_swapchainData[i].imageView = m_headlessImages[i].imageView;
+    }
+}
+
+void VKlelu::initPresentSwapchain()
 {
     vkb::SwapchainBuilder swapchainBuilder{ m_ctx->physicalDevice(), m_device, m_ctx->surface() };
     auto swapRet = swapchainBuilder.use_default_format_selection()
                                    .set_desired_present_mode(VK_PRESENT_MODE_FIFO_KHR)
                                    .set_desired_extent(m_fbSize.width, m_fbSize.height)
+                                   .add_image_usage_flags(m_options.captureFile.empty() ? 0 : VK_IMAGE_USAGE_TRANSFER_SRC_BIT)
                                    .build();
 
     if (!swapRet)
@@ -62,18 +488,6 @@ void VKlelu::initSwapchain()
     }
 
     deferCleanup([=, this](){ vkDestroySwapchainKHR(m_device, m_swapchain, nullptr); });
-
-    VkExtent3D imageExtent {
-        .width = m_fbSize.width,
-        .height = m_fbSize.height,
-        .depth = 1
-    };
-    m_depthImageFormat = VK_FORMAT_D32_SFLOAT;
-
-    m_depthImage.image = m_ctx->allocateImage(imageExtent, m_depthImageFormat, VK_SAMPLE_COUNT_1_BIT, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
-    m_depthImage.imageView = m_depthImage.image->createImageView(m_depthImageFormat, VK_IMAGE_ASPECT_DEPTH_BIT);
-
-    fprintf(stderr, "Swapchain initialized\n");
 }
 
 void VKlelu::initCommands()
@@ -96,26 +510,16 @@ void VKlelu::initCommands()
 
         VK_CHECK(vkAllocateCommandBuffers(m_device, &cmdAllocInfo, &m_frameData[i].mainCommandBuffer));
 
+        cmdAllocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+        cmdAllocInfo.commandBufferCount = static_cast<uint32_t>(m_frameData[i].drawCommands.size());
+        VK_CHECK(vkAllocateCommandBuffers(m_device, &cmdAllocInfo, m_frameData[i].drawCommands.data()));
+        m_frameData[i].drawCommandsVersion = UINT64_MAX;
+
         deferCleanup([=, this](){ vkDestroyCommandPool(m_device, m_frameData[i].commandPool, nullptr); });
     }
 
-    VkCommandPoolCreateInfo uploadPoolInfo {
-            .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
-            .queueFamilyIndex = m_ctx->graphicsQueueFamily()
-    };
-
-    VK_CHECK(vkCreateCommandPool(m_device, &uploadPoolInfo, nullptr, &m_uploadContext.commandPool));
-
-    VkCommandBufferAllocateInfo cmdAllocInfo {
-        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-        .commandPool = m_uploadContext.commandPool,
-        .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-        .commandBufferCount = 1
-    };
-
-    VK_CHECK(vkAllocateCommandBuffers(m_device, &cmdAllocInfo, &m_uploadContext.commandBuffer));
-
-    deferCleanup([=, this](){ vkDestroyCommandPool(m_device, m_uploadContext.commandPool, nullptr); });
+    m_uploader = std::make_unique<Uploader>(*m_ctx, STAGING_BUFFER_SIZE, m_options.directUpload);
+    m_compute = std::make_unique<ComputeScheduler>(*m_ctx, MAX_FRAMES_IN_FLIGHT);
 
     fprintf(stderr, "Command pool initialized\n");
 }
@@ -136,9 +540,18 @@ void VKlelu::initSyncStructures()
 
         VK_CHECK(vkCreateSemaphore(m_device, &semaphoreInfo, nullptr, &m_frameData[i].imageAcquiredSemaphore));
 
+        VkQueryPoolCreateInfo queryPoolInfo {
+            .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+            .queryType = VK_QUERY_TYPE_TIMESTAMP,
+            .queryCount = TIMESTAMP_COUNT
+        };
+
+        VK_CHECK(vkCreateQueryPool(m_device, &queryPoolInfo, nullptr, &m_frameData[i].timestampPool));
+
         deferCleanup([=, this](){
             vkDestroyFence(m_device, m_frameData[i].renderFence, nullptr);
             vkDestroySemaphore(m_device, m_frameData[i].imageAcquiredSemaphore, nullptr);
+            vkDestroyQueryPool(m_device, m_frameData[i].timestampPool, nullptr);
         });
     }
 
@@ -154,13 +567,6 @@ void VKlelu::initSyncStructures()
         });
     }
 
-    VkFenceCreateInfo uploadFenceInfo {
-        .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO
-    };
-
-    VK_CHECK(vkCreateFence(m_device, &uploadFenceInfo, nullptr, &m_uploadContext.uploadFence));
-    deferCleanup([=, this](){ vkDestroyFence(m_device, m_uploadContext.uploadFence, nullptr); });
-
     fprintf(stderr, "Sync structures initialized\n");
 }
 
@@ -170,11 +576,34 @@ void VKlelu::initDescriptors()
     m_sceneParameterBuffer = m_ctx->allocateBuffer(sceneParamBufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
     m_sceneParameterBufferMapping = m_sceneParameterBuffer->map();
 
+    // Pools are sized per set by roughly what the layouts below use, every
+    // textured material takes one image and one sampler
+    m_layoutCache = std::make_unique<DescriptorLayoutCache>(m_device);
+    m_descriptorAllocator = std::make_unique<DescriptorAllocator>(m_device, std::vector<DescriptorAllocator::PoolRatio>{
+        { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 0.5f },
+        { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 0.5f },
+        { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 2.0f },
+        { VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE, 1.0f },
+        { VK_DESCRIPTOR_TYPE_SAMPLER, 1.0f },
+        { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1.0f },
+        { VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1.0f }
+    });
+
+    deferCleanup([=, this](){
+        m_descriptorAllocator.reset();
+        m_layoutCache.reset();
+    });
+
+    // The mesh shader of the meshlet path transforms vertices too
+    VkShaderStageFlags vertexStages = VK_SHADER_STAGE_VERTEX_BIT;
+    if (m_meshShaders)
+        vertexStages |= VK_SHADER_STAGE_MESH_BIT_EXT;
+
     VkDescriptorSetLayoutBinding camBind {
         .binding = 0,
         .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
         .descriptorCount = 1,
-        .stageFlags = VK_SHADER_STAGE_VERTEX_BIT
+        .stageFlags = vertexStages
     };
 
     VkDescriptorSetLayoutBinding sceneBind {
@@ -184,34 +613,75 @@ void VKlelu::initDescriptors()
         .stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT
     };
 
-    VkDescriptorSetLayoutBinding bindings[2] = { camBind, sceneBind };
+    VkDescriptorSetLayoutBinding lightBind {
+        .binding = 2,
+        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .descriptorCount = 1,
+        .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT
+    };
+
+    VkDescriptorSetLayoutBinding clusterBind {
+        .binding = 3,
+        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .descriptorCount = 1,
+        .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT
+    };
+
+    VkDescriptorSetLayoutBinding shadowBind {
+        .binding = 4,
+        .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+        .descriptorCount = 1,
+        .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT
+    };
+
+    VkDescriptorSetLayoutBinding bindings[5] = { camBind, sceneBind, lightBind, clusterBind, shadowBind };
 
     VkDescriptorSetLayoutCreateInfo setInfo {
         .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
-        .bindingCount = 2,
+        .bindingCount = 5,
         .pBindings = bindings,
     };
 
-    VK_CHECK(vkCreateDescriptorSetLayout(m_device, &setInfo, nullptr, &m_globalSetLayout));
-
-    deferCleanup([=, this](){ vkDestroyDescriptorSetLayout(m_device, m_globalSetLayout, nullptr); });
+    m_globalSetLayout = m_layoutCache->create(setInfo);
 
     VkDescriptorSetLayoutBinding objectBind {
         .binding = 0,
         .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
         .descriptorCount = 1,
+        .stageFlags = vertexStages
+    };
+
+    VkDescriptorSetLayoutBinding visibleBind {
+        .binding = 1,
+        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .descriptorCount = 1,
+        .stageFlags = vertexStages
+    };
+
+    // Vertex pulling streams, written once the scene is loaded
+    VkDescriptorSetLayoutBinding positionBind {
+        .binding = 2,
+        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .descriptorCount = 1,
+        .stageFlags = VK_SHADER_STAGE_VERTEX_BIT
+    };
+
+    VkDescriptorSetLayoutBinding attributeBind {
+        .binding = 3,
+        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .descriptorCount = 1,
         .stageFlags = VK_SHADER_STAGE_VERTEX_BIT
     };
 
+    VkDescriptorSetLayoutBinding set2Bind[] = { objectBind, visibleBind, positionBind, attributeBind };
+
     VkDescriptorSetLayoutCreateInfo set2Info {
         .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
-        .bindingCount = 1,
-        .pBindings = &objectBind
+        .bindingCount = m_options.vertexPulling ? 4u : 2u,
+        .pBindings = &set2Bind[0]
     };
 
-    VK_CHECK(vkCreateDescriptorSetLayout(m_device, &set2Info, nullptr, &m_objectSetLayout));
-
-    deferCleanup([=, this](){ vkDestroyDescriptorSetLayout(m_device, m_objectSetLayout, nullptr); });
+    m_objectSetLayout = m_layoutCache->create(set2Info);
 
     VkDescriptorSetLayoutBinding textureBind {
         .binding = 0,
@@ -235,50 +705,17 @@ void VKlelu::initDescriptors()
         .pBindings = &set3Bind[0]
     };
 
-    VK_CHECK(vkCreateDescriptorSetLayout(m_device, &set3Info, nullptr, &m_singleTextureSetLayout));
-
-    deferCleanup([=, this](){ vkDestroyDescriptorSetLayout(m_device, m_singleTextureSetLayout, nullptr); });
-
-    std::vector<VkDescriptorPoolSize> sizes = { { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 10 },
-                                                { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 10 },
-                                                { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 10 },
-                                                { VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE, 10 },
-                                                { VK_DESCRIPTOR_TYPE_SAMPLER, 10 } };
-
-    VkDescriptorPoolCreateInfo poolInfo {
-        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
-        .maxSets = 10,
-        .poolSizeCount = static_cast<uint32_t>(sizes.size()),
-        .pPoolSizes = sizes.data()
-    };
-
-    VK_CHECK(vkCreateDescriptorPool(m_device, &poolInfo, nullptr, &m_descriptorPool));
-
-    deferCleanup([=, this](){ vkDestroyDescriptorPool(m_device, m_descriptorPool, nullptr); });
+    m_singleTextureSetLayout = m_layoutCache->create(set3Info);
 
     for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
-        m_frameData[i].cameraBuffer = m_ctx->allocateBuffer(sizeof(CameraData), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
+        m_frameData[i].cameraBuffer = m_ctx->allocateSharedBuffer(sizeof(CameraData), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
         m_frameData[i].cameraBufferMapping = m_frameData[i].cameraBuffer->map();
-        m_frameData[i].objectBuffer = m_ctx->allocateBuffer(sizeof(ObjectData) * MAX_OBJECTS, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
+        m_frameData[i].objectBuffer = m_ctx->allocateBuffer(sizeof(ObjectData) * m_objectCapacity, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
         m_frameData[i].objectBufferMapping = m_frameData[i].objectBuffer->map();
 
-        VkDescriptorSetAllocateInfo allocInfo {
-            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
-            .descriptorPool = m_descriptorPool,
-            .descriptorSetCount = 1,
-            .pSetLayouts = &m_globalSetLayout
-        };
+        m_frameData[i].globalDescriptor = m_descriptorAllocator->allocate(m_globalSetLayout);
 
-        VK_CHECK(vkAllocateDescriptorSets(m_device, &allocInfo, &m_frameData[i].globalDescriptor));
-
-        VkDescriptorSetAllocateInfo objAllocInfo {
-            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
-            .descriptorPool = m_descriptorPool,
-            .descriptorSetCount = 1,
-            .pSetLayouts = &m_objectSetLayout
-        };
-
-        VK_CHECK(vkAllocateDescriptorSets(m_device, &objAllocInfo, &m_frameData[i].objectDescriptor));
+        m_frameData[i].objectDescriptor = m_descriptorAllocator->allocate(m_objectSetLayout);
 
         VkDescriptorBufferInfo camInfo {
             .buffer = m_frameData[i].cameraBuffer->buffer(),
@@ -295,7 +732,7 @@ void VKlelu::initDescriptors()
         VkDescriptorBufferInfo objInfo {
             .buffer = m_frameData[i].objectBuffer->buffer(),
             .offset = 0,
-            .range = sizeof(ObjectData) * MAX_OBJECTS
+            .range = sizeof(ObjectData) * m_objectCapacity
         };
 
         VkWriteDescriptorSet camWrite {
@@ -325,71 +762,624 @@ void VKlelu::initDescriptors()
             .pBufferInfo = &objInfo,
         };
 
-        VkWriteDescriptorSet writeSet[3] = { camWrite, sceneWrite, objWrite };
-        vkUpdateDescriptorSets(m_device, 3, writeSet, 0 , nullptr);
+        VkDescriptorImageInfo shadowInfo {
+            .sampler = m_shadowSampler,
+            .imageView = m_renderGraph->imageView(m_shadowMap),
+            .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
+        };
+
+        VkWriteDescriptorSet shadowWrite {
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .dstSet = m_frameData[i].globalDescriptor,
+            .dstBinding = 4,
+            .descriptorCount = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            .pImageInfo = &shadowInfo,
+        };
+
+        VkWriteDescriptorSet writeSet[4] = { camWrite, sceneWrite, objWrite, shadowWrite };
+        vkUpdateDescriptorSets(m_device, 4, writeSet, 0 , nullptr);
     }
 
     fprintf(stderr, "Descriptors initialized\n");
 }
 
-void VKlelu::initPipelines()
+void VKlelu::initCullDescriptors()
 {
-    VkShaderModule fragShader;
-    loadShader("shader.frag.spv", fragShader);
-    fprintf(stderr, "Shader module shader.frag.spv created\n");
+    VkSamplerCreateInfo samplerInfo {
+        .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+        .magFilter = VK_FILTER_NEAREST,
+        .minFilter = VK_FILTER_NEAREST,
+        .mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST,
+        .addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+        .addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+        .addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+        .maxLod = VK_LOD_CLAMP_NONE
+    };
+
+    VK_CHECK(vkCreateSampler(m_device, &samplerInfo, nullptr, &m_depthSampler));
+    deferCleanup([=, this](){ vkDestroySampler(m_device, m_depthSampler, nullptr); });
+
+    VkDescriptorSetLayoutBinding reduceBind[] = {
+        { .binding = 0, .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, .descriptorCount = 1, .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT },
+        { .binding = 1, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, .descriptorCount = 1, .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT }
+    };
+
+    VkDescriptorSetLayoutCreateInfo reduceSetInfo {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+        .bindingCount = 2,
+        .pBindings = &reduceBind[0]
+    };
 
-    VkShaderModule vertShader;
-    loadShader("shader.vert.spv", vertShader);
-    fprintf(stderr, "Shader module shader.vert.spv created\n");
+    m_depthReduceSetLayout = m_layoutCache->create(reduceSetInfo);
 
-    VkPushConstantRange pushConstant {
-        .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
-        .size = sizeof(int)
+    // Cull data, draw commands, visible list, visibility flags, stats and the pyramid
+    VkDescriptorSetLayoutBinding cullBind[6];
+    for (uint32_t i = 0; i < 6; ++i) {
+        cullBind[i] = {
+            .binding = i,
+            .descriptorType = i < 5 ? VK_DESCRIPTOR_TYPE_STORAGE_BUFFER : VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            .descriptorCount = 1,
+            .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT
+        };
+    }
+
+    VkDescriptorSetLayoutCreateInfo cullSetInfo {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+        .bindingCount = 6,
+        .pBindings = &cullBind[0]
     };
 
+    m_cullSetLayout = m_layoutCache->create(cullSetInfo);
+
+    m_depthReduceSets.resize(m_depthPyramidLevels);
+    for (uint32_t i = 0; i < m_depthPyramidLevels; ++i) {
+        m_depthReduceSets[i] = m_descriptorAllocator->allocate(m_depthReduceSetLayout);
+
+        // The first level reduces the depth buffer itself
+        VkDescriptorImageInfo srcInfo {
+            .sampler = m_depthSampler,
+            .imageView = i ? m_depthPyramidMips[i - 1] : m_renderGraph->imageView(m_depthImage),
+            .imageLayout = i ? VK_IMAGE_LAYOUT_GENERAL : VK_IMAGE_LAYOUT_DEPTH_READ_ONLY_OPTIMAL
+        };
+
+        VkDescriptorImageInfo dstInfo {
+            .imageView = m_depthPyramidMips[i],
+            .imageLayout = VK_IMAGE_LAYOUT_GENERAL
+        };
+
+        VkWriteDescriptorSet srcWrite {
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .dstSet = m_depthReduceSets[i],
+            .dstBinding = 0,
+            .descriptorCount = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            .pImageInfo = &srcInfo
+        };
+
+        VkWriteDescriptorSet dstWrite {
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .dstSet = m_depthReduceSets[i],
+            .dstBinding = 1,
+            .descriptorCount = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+            .pImageInfo = &dstInfo
+        };
+
+        VkWriteDescriptorSet writeSet[2] = { srcWrite, dstWrite };
+        vkUpdateDescriptorSets(m_device, 2, writeSet, 0, nullptr);
+    }
+
+    // Visibility of the previous frame carries over so it's shared by all frames
+    m_visibilityBuffer = m_ctx->allocateBuffer(sizeof(uint32_t) * m_objectCapacity, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+
+    size_t drawCommandsSize = 2 * MAX_DRAW_BATCHES * sizeof(VkDrawIndexedIndirectCommand);
+
+    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+        FrameData &frame = m_frameData[i];
+
+        frame.cullBuffer = m_ctx->allocateBuffer(sizeof(CullData) * m_objectCapacity, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
+        frame.cullBufferMapping = frame.cullBuffer->map();
+        frame.drawTemplateBuffer = m_ctx->allocateBuffer(drawCommandsSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
+        frame.drawTemplateBufferMapping = frame.drawTemplateBuffer->map();
+        frame.drawCommandBuffer = m_ctx->allocateBuffer(drawCommandsSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+        frame.visibleBuffer = m_ctx->allocateBuffer(2 * sizeof(uint32_t) * m_objectCapacity, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+        frame.cullStatsBuffer = m_ctx->allocateBuffer(sizeof(CullStats), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_CPU_ONLY);
+        frame.cullStatsBufferMapping = frame.cullStatsBuffer->map();
+        memset(frame.cullStatsBufferMapping, 0, sizeof(CullStats));
+
+        frame.cullDescriptor = m_descriptorAllocator->allocate(m_cullSetLayout);
+
+        VkDescriptorBufferInfo bufferInfos[5] = {
+            { .buffer = frame.cullBuffer->buffer(), .offset = 0, .range = VK_WHOLE_SIZE },
+            { .buffer = frame.drawCommandBuffer->buffer(), .offset = 0, .range = VK_WHOLE_SIZE },
+            { .buffer = frame.visibleBuffer->buffer(), .offset = 0, .range = VK_WHOLE_SIZE },
+            { .buffer = m_visibilityBuffer->buffer(), .offset = 0, .range = VK_WHOLE_SIZE },
+            { .buffer = frame.cullStatsBuffer->buffer(), .offset = 0, .range = VK_WHOLE_SIZE }
+        };
+
+        VkDescriptorImageInfo pyramidInfo {
+            .sampler = m_depthSampler,
+            .imageView = m_depthPyramid.imageView,
+            .imageLayout = VK_IMAGE_LAYOUT_GENERAL
+        };
+
+        VkWriteDescriptorSet writeSet[7];
+        for (uint32_t b = 0; b < 5; ++b) {
+            writeSet[b] = {
+                .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                .dstSet = frame.cullDescriptor,
+                .dstBinding = b,
+                .descriptorCount = 1,
+                .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                .pBufferInfo = &bufferInfos[b]
+            };
+        }
+
+        writeSet[5] = {
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .dstSet = frame.cullDescriptor,
+            .dstBinding = 5,
+            .descriptorCount = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            .pImageInfo = &pyramidInfo
+        };
+
+        // The vertex shader reads object data through the visible list
+        writeSet[6] = {
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .dstSet = frame.objectDescriptor,
+            .dstBinding = 1,
+            .descriptorCount = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .pBufferInfo = &bufferInfos[2]
+        };
+
+        vkUpdateDescriptorSets(m_device, 7, writeSet, 0, nullptr);
+    }
+
+    fprintf(stderr, "Culling descriptors initialized\n");
+}
+
+void VKlelu::growObjectBuffers(size_t count)
+{
+    if (count <= m_objectCapacity)
+        return;
+
+    uint32_t capacity = m_objectCapacity;
+    while (capacity < count)
+        capacity *= 2;
+
+    fprintf(stderr, "Growing object buffers from %u to %u objects\n", m_objectCapacity, capacity);
+
+    // Both frames in flight and the compute queue may still read the old buffers
+    VK_CHECK(vkDeviceWaitIdle(m_device));
+    m_objectCapacity = capacity;
+
+    m_visibilityBuffer = m_ctx->allocateBuffer(sizeof(uint32_t) * m_objectCapacity, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+    m_visibilityVersion = UINT64_MAX;
+
+    for (FrameData &frame : m_frameData) {
+        frame.objectBuffer = m_ctx->allocateBuffer(sizeof(ObjectData) * m_objectCapacity, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
+        frame.objectBufferMapping = frame.objectBuffer->map();
+        frame.cullBuffer = m_ctx->allocateBuffer(sizeof(CullData) * m_objectCapacity, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
+        frame.cullBufferMapping = frame.cullBuffer->map();
+        frame.visibleBuffer = m_ctx->allocateBuffer(2 * sizeof(uint32_t) * m_objectCapacity, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+
+        VkDescriptorBufferInfo objInfo { .buffer = frame.objectBuffer->buffer(), .offset = 0, .range = VK_WHOLE_SIZE };
+        VkDescriptorBufferInfo cullInfo { .buffer = frame.cullBuffer->buffer(), .offset = 0, .range = VK_WHOLE_SIZE };
+        VkDescriptorBufferInfo visibleInfo { .buffer = frame.visibleBuffer->buffer(), .offset = 0, .range = VK_WHOLE_SIZE };
+        VkDescriptorBufferInfo visibilityInfo { .buffer = m_visibilityBuffer->buffer(), .offset = 0, .range = VK_WHOLE_SIZE };
+
+        auto write = [](VkDescriptorSet set, uint32_t binding, const VkDescriptorBufferInfo *info) {
+            return VkWriteDescriptorSet {
+                .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                .dstSet = set,
+                .dstBinding = binding,
+                .descriptorCount = 1,
+                .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                .pBufferInfo = info
+            };
+        };
+
+        std::vector<VkWriteDescriptorSet> writeSet = {
+            write(frame.objectDescriptor, 0, &objInfo),
+            write(frame.objectDescriptor, 1, &visibleInfo),
+            write(frame.cullDescriptor, 0, &cullInfo),
+            write(frame.cullDescriptor, 2, &visibleInfo),
+            write(frame.cullDescriptor, 3, &visibilityInfo)
+        };
+        if (m_options.meshlets) {
+            writeSet.push_back(write(frame.meshletDescriptor, 7, &visibleInfo));
+            writeSet.push_back(write(frame.meshletDescriptor, 8, &objInfo));
+        }
+
+        vkUpdateDescriptorSets(m_device, static_cast<uint32_t>(writeSet.size()), writeSet.data(), 0, nullptr);
+    }
+
+    // Recorded draws refer to the rewritten descriptor sets
+    ++m_drawCommandsVersion;
+}
+
+void VKlelu::initLightDescriptors()
+{
+    VkDescriptorSetLayoutBinding lightCullBind[] = {
+        { .binding = 0, .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, .descriptorCount = 1, .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT },
+        { .binding = 1, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .descriptorCount = 1, .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT },
+        { .binding = 2, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .descriptorCount = 1, .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT }
+    };
+
+    VkDescriptorSetLayoutCreateInfo lightCullSetInfo {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+        .bindingCount = 3,
+        .pBindings = &lightCullBind[0]
+    };
+
+    m_lightCullSetLayout = m_layoutCache->create(lightCullSetInfo);
+
+    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+        FrameData &frame = m_frameData[i];
+
+        // Written by light culling on the compute queue, read by shading
+        frame.lightBuffer = m_ctx->allocateSharedBuffer(sizeof(PointLight) * MAX_POINT_LIGHTS, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
+        frame.lightBufferMapping = frame.lightBuffer->map();
+        frame.clusterBuffer = m_ctx->allocateSharedBuffer(sizeof(Cluster) * CLUSTER_COUNT, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+
+        frame.lightCullDescriptor = m_descriptorAllocator->allocate(m_lightCullSetLayout);
+
+        VkDescriptorBufferInfo camInfo {
+            .buffer = frame.cameraBuffer->buffer(),
+            .offset = 0,
+            .range = sizeof(CameraData)
+        };
+
+        VkDescriptorBufferInfo lightInfo {
+            .buffer = frame.lightBuffer->buffer(),
+            .offset = 0,
+            .range = VK_WHOLE_SIZE
+        };
+
+        VkDescriptorBufferInfo clusterInfo {
+            .buffer = frame.clusterBuffer->buffer(),
+            .offset = 0,
+            .range = VK_WHOLE_SIZE
+        };
+
+        VkWriteDescriptorSet writeSet[5] = {
+            { .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET, .dstSet = frame.lightCullDescriptor, .dstBinding = 0,
+              .descriptorCount = 1, .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, .pBufferInfo = &camInfo },
+            { .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET, .dstSet = frame.lightCullDescriptor, .dstBinding = 1,
+              .descriptorCount = 1, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .pBufferInfo = &lightInfo },
+            { .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET, .dstSet = frame.lightCullDescriptor, .dstBinding = 2,
+              .descriptorCount = 1, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .pBufferInfo = &clusterInfo },
+            // The fragment shader reads the lights of its cluster from the global set
+            { .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET, .dstSet = frame.globalDescriptor, .dstBinding = 2,
+              .descriptorCount = 1, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .pBufferInfo = &lightInfo },
+            { .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET, .dstSet = frame.globalDescriptor, .dstBinding = 3,
+              .descriptorCount = 1, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .pBufferInfo = &clusterInfo }
+        };
+
+        vkUpdateDescriptorSets(m_device, 5, writeSet, 0, nullptr);
+    }
+
+    fprintf(stderr, "Light descriptors initialized\n");
+}
+
+void VKlelu::initPipelines()
+{
     VkDescriptorSetLayout setLayouts[3] = { m_globalSetLayout, m_objectSetLayout, m_singleTextureSetLayout };
 
     VkPipelineLayoutCreateInfo pipelineLayoutInfo {
         .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
         .setLayoutCount = 3,
-        .pSetLayouts = &setLayouts[0],
-        .pushConstantRangeCount = 1,
-        .pPushConstantRanges = &pushConstant
+        .pSetLayouts = &setLayouts[0]
     };
 
     VK_CHECK(vkCreatePipelineLayout(m_device, &pipelineLayoutInfo, nullptr, &m_meshPipelineLayout));
 
     deferCleanup([=, this](){ vkDestroyPipelineLayout(m_device, m_meshPipelineLayout, nullptr); });
 
-    VkPipelineShaderStageCreateInfo vertInfo {
-        .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
-        .stage = VK_SHADER_STAGE_VERTEX_BIT,
-        .module = vertShader,
-        .pName = "main"
+    PipelineBuilder builder;
+    builder.useDefaultFF();
+    builder.viewport.x = 0.0f;
+    builder.viewport.y = 0.0f;
+    builder.viewport.width = static_cast<float>(m_fbSize.width);
+    builder.viewport.height = static_cast<float>(m_fbSize.height);
+    builder.viewport.minDepth = 0.0f;
+    builder.viewport.maxDepth = 1.0f;
+    builder.scissor.offset = { 0, 0 };
+    builder.scissor.extent = m_fbSize;
+    builder.pipelineLayout = m_meshPipelineLayout;
+    // The rendered extent follows the resolution scale
+    builder.dynamicStates = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
+
+    // With the pre-pass the depth is final, only shade the visible surface
+    if (m_options.depthPrepass) {
+        builder.depthStencil.depthWriteEnable = VK_FALSE;
+        builder.depthStencil.depthCompareOp = VK_COMPARE_OP_EQUAL;
+    }
+
+    // Blended materials use straight alpha, enabled per material either
+    // dynamically or in a permutation
+    builder.colorBlendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
+    builder.colorBlendAttachment.dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+    builder.colorBlendAttachment.colorBlendOp = VK_BLEND_OP_ADD;
+    builder.colorBlendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+    builder.colorBlendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
+    builder.colorBlendAttachment.alphaBlendOp = VK_BLEND_OP_ADD;
+
+    m_meshPipelineBuilder = builder;
+
+    if (m_dynamicState) {
+        m_cmdSetColorBlendEnable = reinterpret_cast<PFN_vkCmdSetColorBlendEnableEXT>(vkGetDeviceProcAddr(m_device, "vkCmdSetColorBlendEnableEXT"));
+        if (!m_cmdSetColorBlendEnable)
+            throw std::runtime_error("Failed to load vkCmdSetColorBlendEnableEXT");
+
+        builder.dynamicStates.push_back(VK_DYNAMIC_STATE_CULL_MODE);
+        builder.dynamicStates.push_back(VK_DYNAMIC_STATE_DEPTH_WRITE_ENABLE);
+        builder.dynamicStates.push_back(VK_DYNAMIC_STATE_DEPTH_COMPARE_OP);
+        builder.dynamicStates.push_back(VK_DYNAMIC_STATE_COLOR_BLEND_ENABLE_EXT);
+    }
+
+    // Pulled vertices need no vertex input state at all
+    VertexInputDescription vertexInput = m_options.vertexPulling ? VertexInputDescription{} : Vertex::getDescription();
+    VertexInputDescription positionInput = m_options.vertexPulling ? VertexInputDescription{} : Vertex::getPositionDescription();
+
+    reloadableGraphicsPipeline(m_meshPipeline, builder, vertexInput,
+                               { { VK_SHADER_STAGE_VERTEX_BIT, m_options.vertexPulling ? "pulled.vert.spv" : "shader.vert.spv" },
+                                 { VK_SHADER_STAGE_FRAGMENT_BIT, "shader.frag.spv" } },
+                               m_renderTargetFormat, m_depthImageFormat);
+
+    if (!m_meshPipeline)
+        throw std::runtime_error("Failed to create graphics pipeline \"mesh\"");
+
+    m_depthPipeline = VK_NULL_HANDLE;
+
+    if (m_options.depthPrepass) {
+        // Same layout and attachments as the mesh pipeline so that both
+        // can be used in one rendering scope, just no fragment shader and
+        // no color writes
+        builder = m_meshPipelineBuilder;
+        builder.colorBlendAttachment.colorWriteMask = 0;
+        builder.depthStencil.depthWriteEnable = VK_TRUE;
+        builder.depthStencil.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+
+        reloadableGraphicsPipeline(m_depthPipeline, builder, positionInput,
+                                   { { VK_SHADER_STAGE_VERTEX_BIT, m_options.vertexPulling ? "pulleddepth.vert.spv" : "depth.vert.spv" } },
+                                   m_renderTargetFormat, m_depthImageFormat);
+
+        if (!m_depthPipeline)
+            throw std::runtime_error("Failed to create graphics pipeline \"depth\"");
+    }
+
+    // Depth only into the shadow map, both faces cast and the slope scaled
+    // bias keeps lit surfaces from shadowing themselves
+    builder = m_meshPipelineBuilder;
+    builder.rasterizer.depthBiasEnable = VK_TRUE;
+    builder.rasterizer.depthBiasConstantFactor = 1.25f;
+    builder.rasterizer.depthBiasSlopeFactor = 1.75f;
+    builder.depthStencil.depthWriteEnable = VK_TRUE;
+    builder.depthStencil.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+
+    // Only the positions of the interleaved vertices are read
+    VertexInputDescription shadowInput = vertexInput;
+    shadowInput.attributes.resize(std::min<size_t>(shadowInput.attributes.size(), 1));
+
+    reloadableGraphicsPipeline(m_shadowPipeline, builder, shadowInput,
+                               { { VK_SHADER_STAGE_VERTEX_BIT, m_options.vertexPulling ? "pulledshadow.vert.spv" : "shadow.vert.spv" } },
+                               VK_FORMAT_UNDEFINED, VK_FORMAT_D32_SFLOAT);
+
+    if (!m_shadowPipeline)
+        throw std::runtime_error("Failed to create graphics pipeline \"shadow\"");
+
+    fprintf(stderr, "Graphics pipelines initialized\n");
+}
+
+void VKlelu::initCullPipelines()
+{
+    VkPushConstantRange reduceRange {
+        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+        .offset = 0,
+        .size = 4 * sizeof(int32_t)
     };
 
-    VkPipelineShaderStageCreateInfo fragInfo {
-        .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
-        .stage = VK_SHADER_STAGE_FRAGMENT_BIT,
-        .module = fragShader,
-        .pName = "main"
+    VkPipelineLayoutCreateInfo reduceLayoutInfo {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+        .setLayoutCount = 1,
+        .pSetLayouts = &m_depthReduceSetLayout,
+        .pushConstantRangeCount = 1,
+        .pPushConstantRanges = &reduceRange
     };
 
-    VertexInputDescription vertexDescription = Vertex::getDescription();
+    VK_CHECK(vkCreatePipelineLayout(m_device, &reduceLayoutInfo, nullptr, &m_depthReducePipelineLayout));
 
-    VkPipelineVertexInputStateCreateInfo vertexInputInfo {
-        .sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
-        .vertexBindingDescriptionCount = static_cast<uint32_t>(vertexDescription.bindings.size()),
-        .pVertexBindingDescriptions = vertexDescription.bindings.data(),
-        .vertexAttributeDescriptionCount = static_cast<uint32_t>(vertexDescription.attributes.size()),
-        .pVertexAttributeDescriptions = vertexDescription.attributes.data(),
+    deferCleanup([=, this](){ vkDestroyPipelineLayout(m_device, m_depthReducePipelineLayout, nullptr); });
+
+    VkPushConstantRange cullRange {
+        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+        .offset = 0,
+        .size = sizeof(CullConstants)
+    };
+
+    VkPipelineLayoutCreateInfo cullLayoutInfo {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+        .setLayoutCount = 1,
+        .pSetLayouts = &m_cullSetLayout,
+        .pushConstantRangeCount = 1,
+        .pPushConstantRanges = &cullRange
     };
 
+    VK_CHECK(vkCreatePipelineLayout(m_device, &cullLayoutInfo, nullptr, &m_cullPipelineLayout));
+
+    deferCleanup([=, this](){ vkDestroyPipelineLayout(m_device, m_cullPipelineLayout, nullptr); });
+
+    reloadableComputePipeline(m_depthReducePipeline, "depthreduce.comp.spv", m_depthReducePipelineLayout);
+    reloadableComputePipeline(m_cullPipeline, "cull.comp.spv", m_cullPipelineLayout);
+
+    if (!m_depthReducePipeline || !m_cullPipeline)
+        throw std::runtime_error("Failed to create culling compute pipelines");
+
+    fprintf(stderr, "Compute pipelines initialized\n");
+}
+
+void VKlelu::initLightPipelines()
+{
+    VkPushConstantRange pushRange {
+        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+        .offset = 0,
+        .size = sizeof(LightCullConstants)
+    };
+
+    VkPipelineLayoutCreateInfo layoutInfo {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+        .setLayoutCount = 1,
+        .pSetLayouts = &m_lightCullSetLayout,
+        .pushConstantRangeCount = 1,
+        .pPushConstantRanges = &pushRange
+    };
+
+    VK_CHECK(vkCreatePipelineLayout(m_device, &layoutInfo, nullptr, &m_lightCullPipelineLayout));
+
+    deferCleanup([=, this](){ vkDestroyPipelineLayout(m_device, m_lightCullPipelineLayout, nullptr); });
+
+    reloadableComputePipeline(m_lightCullPipeline, "lightcull.comp.spv", m_lightCullPipelineLayout);
+
+    if (!m_lightCullPipeline)
+        throw std::runtime_error("Failed to create light culling compute pipeline");
+
+    fprintf(stderr, "Light pipelines initialized\n");
+}
+
+void VKlelu::initMeshlets()
+{
+    VkShaderStageFlags stages = VK_SHADER_STAGE_COMPUTE_BIT;
+    if (m_meshShaders)
+        stages |= VK_SHADER_STAGE_TASK_BIT_EXT | VK_SHADER_STAGE_MESH_BIT_EXT;
+
+    // Meshlets, meshlet vertices, triangles and vertices of all meshes,
+    // then the per frame batches, draw commands, task commands, visible
+    // list, objects, compacted draws, draw counts and stats
+    VkDescriptorSetLayoutBinding meshletBind[12];
+    for (uint32_t i = 0; i < 12; ++i) {
+        meshletBind[i] = {
+            .binding = i,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .descriptorCount = 1,
+            .stageFlags = stages
+        };
+    }
+
+    VkDescriptorSetLayoutCreateInfo meshletSetInfo {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+        .bindingCount = 12,
+        .pBindings = &meshletBind[0]
+    };
+
+    m_meshletSetLayout = m_layoutCache->create(meshletSetInfo);
+
+    // Only the fallback compacts draws, keep a stub buffer for the binding
+    // with mesh shaders
+    size_t meshletDrawsSize = m_meshShaders ? sizeof(VkDrawIndexedIndirectCommand)
+                                            : 2 * MAX_MESHLET_DRAWS * sizeof(VkDrawIndexedIndirectCommand);
+
+    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+        FrameData &frame = m_frameData[i];
+
+        frame.meshletBatchBuffer = m_ctx->allocateBuffer(MAX_DRAW_BATCHES * sizeof(MeshletBatch), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
+        frame.meshletBatchBufferMapping = frame.meshletBatchBuffer->map();
+        frame.meshletTaskBuffer = m_ctx->allocateBuffer(2 * MAX_DRAW_BATCHES * sizeof(VkDrawMeshTasksIndirectCommandEXT), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+        frame.meshletDrawBuffer = m_ctx->allocateBuffer(meshletDrawsSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+        frame.meshletDrawCountBuffer = m_ctx->allocateBuffer(2 * MAX_DRAW_BATCHES * sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+
+        frame.meshletDescriptor = m_descriptorAllocator->allocate(m_meshletSetLayout);
+
+        // The scene wide buffers in 0-3 are written once the meshes are loaded
+        VkDescriptorBufferInfo bufferInfos[8] = {
+            { .buffer = frame.meshletBatchBuffer->buffer(), .offset = 0, .range = VK_WHOLE_SIZE },
+            { .buffer = frame.drawCommandBuffer->buffer(), .offset = 0, .range = VK_WHOLE_SIZE },
+            { .buffer = frame.meshletTaskBuffer->buffer(), .offset = 0, .range = VK_WHOLE_SIZE },
+            { .buffer = frame.visibleBuffer->buffer(), .offset = 0, .range = VK_WHOLE_SIZE },
+            { .buffer = frame.objectBuffer->buffer(), .offset = 0, .range = VK_WHOLE_SIZE },
+            { .buffer = frame.meshletDrawBuffer->buffer(), .offset = 0, .range = VK_WHOLE_SIZE },
+            { .buffer = frame.meshletDrawCountBuffer->buffer(), .offset = 0, .range = VK_WHOLE_SIZE },
+            { .buffer = frame.cullStatsBuffer->buffer(), .offset = 0, .range = VK_WHOLE_SIZE }
+        };
+
+        VkWriteDescriptorSet writeSet[8];
+        for (uint32_t b = 0; b < 8; ++b) {
+            writeSet[b] = {
+                .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                .dstSet = frame.meshletDescriptor,
+                .dstBinding = 4 + b,
+                .descriptorCount = 1,
+                .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                .pBufferInfo = &bufferInfos[b]
+            };
+        }
+
+        vkUpdateDescriptorSets(m_device, 8, writeSet, 0, nullptr);
+    }
+
+    VkPushConstantRange computeRange {
+        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+        .offset = 0,
+        .size = sizeof(MeshletConstants)
+    };
+
+    VkPipelineLayoutCreateInfo computeLayoutInfo {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+        .setLayoutCount = 1,
+        .pSetLayouts = &m_meshletSetLayout,
+        .pushConstantRangeCount = 1,
+        .pPushConstantRanges = &computeRange
+    };
+
+    VK_CHECK(vkCreatePipelineLayout(m_device, &computeLayoutInfo, nullptr, &m_meshletCullPipelineLayout));
+
+    deferCleanup([=, this](){ vkDestroyPipelineLayout(m_device, m_meshletCullPipelineLayout, nullptr); });
+
+    reloadableComputePipeline(m_meshletTaskPipeline, "meshlettasks.comp.spv", m_meshletCullPipelineLayout);
+    reloadableComputePipeline(m_meshletCullPipeline, "meshletcull.comp.spv", m_meshletCullPipelineLayout);
+
+    if (!m_meshletTaskPipeline || !m_meshletCullPipeline)
+        throw std::runtime_error("Failed to create meshlet compute pipelines");
+
+    m_meshletPipeline = VK_NULL_HANDLE;
+    m_meshletPipelineLayout = VK_NULL_HANDLE;
+
+    if (!m_meshShaders) {
+        fprintf(stderr, "Meshlet pipelines initialized\n");
+        return;
+    }
+
+    m_cmdDrawMeshTasksIndirect = reinterpret_cast<PFN_vkCmdDrawMeshTasksIndirectEXT>(vkGetDeviceProcAddr(m_device, "vkCmdDrawMeshTasksIndirectEXT"));
+    if (!m_cmdDrawMeshTasksIndirect)
+        throw std::runtime_error("Failed to load vkCmdDrawMeshTasksIndirectEXT");
+
+    VkDescriptorSetLayout setLayouts[4] = { m_globalSetLayout, m_objectSetLayout, m_singleTextureSetLayout, m_meshletSetLayout };
+
+    VkPushConstantRange taskRange {
+        .stageFlags = VK_SHADER_STAGE_TASK_BIT_EXT,
+        .offset = 0,
+        .size = sizeof(MeshletConstants)
+    };
+
+    VkPipelineLayoutCreateInfo layoutInfo {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+        .setLayoutCount = 4,
+        .pSetLayouts = &setLayouts[0],
+        .pushConstantRangeCount = 1,
+        .pPushConstantRanges = &taskRange
+    };
+
+    VK_CHECK(vkCreatePipelineLayout(m_device, &layoutInfo, nullptr, &m_meshletPipelineLayout));
+
+    deferCleanup([=, this](){ vkDestroyPipelineLayout(m_device, m_meshletPipelineLayout, nullptr); });
+
+    // Vertex input and input assembly are ignored with a mesh shader, the
+    // rest matches the mesh pipeline
     PipelineBuilder builder;
     builder.useDefaultFF();
-    builder.shaderStages.push_back(vertInfo);
-    builder.shaderStages.push_back(fragInfo);
-    builder.vertexInputInfo = vertexInputInfo;
     builder.viewport.x = 0.0f;
     builder.viewport.y = 0.0f;
     builder.viewport.width = static_cast<float>(m_fbSize.width);
@@ -398,16 +1388,144 @@ void VKlelu::initPipelines()
     builder.viewport.maxDepth = 1.0f;
     builder.scissor.offset = { 0, 0 };
     builder.scissor.extent = m_fbSize;
-    builder.pipelineLayout = m_meshPipelineLayout;
-    m_meshPipeline = builder.buildPipeline(m_device, m_swapchainImageFormat, m_depthImageFormat);
+    builder.pipelineLayout = m_meshletPipelineLayout;
+    builder.dynamicStates = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
+    builder.colorBlendAttachment = m_meshPipelineBuilder.colorBlendAttachment;
+
+    // Material state is set like on the mesh pipeline, per batch or in
+    // permutations
+    m_meshletPipelineBuilder = builder;
+
+    if (m_dynamicState) {
+        builder.dynamicStates.push_back(VK_DYNAMIC_STATE_CULL_MODE);
+        builder.dynamicStates.push_back(VK_DYNAMIC_STATE_DEPTH_WRITE_ENABLE);
+        builder.dynamicStates.push_back(VK_DYNAMIC_STATE_DEPTH_COMPARE_OP);
+        builder.dynamicStates.push_back(VK_DYNAMIC_STATE_COLOR_BLEND_ENABLE_EXT);
+    }
 
-    deferCleanup([=, this](){ vkDestroyPipeline(m_device, m_meshPipeline, nullptr); });
+    reloadableGraphicsPipeline(m_meshletPipeline, builder, VertexInputDescription{},
+                               { { VK_SHADER_STAGE_TASK_BIT_EXT, "meshlet.task.spv" },
+                                 { VK_SHADER_STAGE_MESH_BIT_EXT, "meshlet.mesh.spv" },
+                                 { VK_SHADER_STAGE_FRAGMENT_BIT, "shader.frag.spv" } },
+                               m_renderTargetFormat, m_depthImageFormat);
 
-    vkDestroyShaderModule(m_device, vertShader, nullptr);
-    vkDestroyShaderModule(m_device, fragShader, nullptr);
+    if (!m_meshletPipeline)
+        throw std::runtime_error("Failed to create graphics pipeline \"meshlet\"");
 
-    if (!m_meshPipeline)
-        throw std::runtime_error("Failed to create graphics pipeline \"mesh\"");
+    fprintf(stderr, "Meshlet pipelines initialized\n");
+}
 
-    fprintf(stderr, "Graphics pipelines initialized\n");
+void VKlelu::initUpscale()
+{
+    VkSamplerCreateInfo samplerInfo {
+        .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+        .magFilter = VK_FILTER_LINEAR,
+        .minFilter = VK_FILTER_LINEAR,
+        .mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST,
+        .addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+        .addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+        .addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE
+    };
+
+    VK_CHECK(vkCreateSampler(m_device, &samplerInfo, nullptr, &m_upscaleSampler));
+
+    deferCleanup([=, this](){ vkDestroySampler(m_device, m_upscaleSampler, nullptr); });
+
+    VkDescriptorSetLayoutBinding sceneBind {
+        .binding = 0,
+        .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+        .descriptorCount = 1,
+        .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT
+    };
+
+    VkDescriptorSetLayoutCreateInfo setInfo {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+        .bindingCount = 1,
+        .pBindings = &sceneBind
+    };
+
+    m_upscaleSetLayout = m_layoutCache->create(setInfo);
+
+    m_upscaleSet = m_descriptorAllocator->allocate(m_upscaleSetLayout);
+
+    VkDescriptorImageInfo sceneInfo {
+        .sampler = m_upscaleSampler,
+        .imageView = m_renderGraph->imageView(m_renderTarget),
+        .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
+    };
+
+    VkWriteDescriptorSet sceneWrite {
+        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .dstSet = m_upscaleSet,
+        .dstBinding = 0,
+        .descriptorCount = 1,
+        .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+        .pImageInfo = &sceneInfo
+    };
+
+    vkUpdateDescriptorSets(m_device, 1, &sceneWrite, 0, nullptr);
+
+    VkPushConstantRange pushRange {
+        .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
+        .offset = 0,
+        .size = sizeof(UpscaleConstants)
+    };
+
+    VkPipelineLayoutCreateInfo layoutInfo {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+        .setLayoutCount = 1,
+        .pSetLayouts = &m_upscaleSetLayout,
+        .pushConstantRangeCount = 1,
+        .pPushConstantRanges = &pushRange
+    };
+
+    VK_CHECK(vkCreatePipelineLayout(m_device, &layoutInfo, nullptr, &m_upscalePipelineLayout));
+
+    deferCleanup([=, this](){ vkDestroyPipelineLayout(m_device, m_upscalePipelineLayout, nullptr); });
+
+    // Fullscreen triangle generated from the vertex index, no depth
+    PipelineBuilder builder;
+    builder.useDefaultFF();
+    builder.viewport = {};
+    builder.scissor = {};
+    builder.dynamicStates = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
+    builder.depthStencil.depthTestEnable = VK_FALSE;
+    builder.depthStencil.depthWriteEnable = VK_FALSE;
+    builder.pipelineLayout = m_upscalePipelineLayout;
+
+    reloadableGraphicsPipeline(m_upscalePipeline, builder, VertexInputDescription{},
+                               { { VK_SHADER_STAGE_VERTEX_BIT, "upscale.vert.spv" },
+                                 { VK_SHADER_STAGE_FRAGMENT_BIT, "upscale.frag.spv" } },
+                               m_swapchainImageFormat, VK_FORMAT_UNDEFINED);
+
+    if (!m_upscalePipeline)
+        throw std::runtime_error("Failed to create graphics pipeline \"upscale\"");
+
+    fprintf(stderr, "Upscale pipeline initialized\n");
+}
+
+void VKlelu::initCapture()
+{
+    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i)
+        m_frameData[i].readbackPending = false;
+
+    if (m_options.captureFile.empty())
+        return;
+
+    // One readback buffer per frame in flight, filled by the frame's own
+    // command buffer and read back once its fence signals
+    size_t readbackSize = static_cast<size_t>(m_fbSize.width) * m_fbSize.height * 4;
+    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+        m_frameData[i].readbackBuffer = m_ctx->allocateBuffer(readbackSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_TO_CPU);
+        m_frameData[i].readbackBufferMapping = m_frameData[i].readbackBuffer->map();
+    }
+
+    bool bgra = m_swapchainImageFormat == VK_FORMAT_B8G8R8A8_SRGB || m_swapchainImageFormat == VK_FORMAT_B8G8R8A8_UNORM;
+    bool rgba = m_swapchainImageFormat == VK_FORMAT_R8G8B8A8_SRGB || m_swapchainImageFormat == VK_FORMAT_R8G8B8A8_UNORM;
+    if (!bgra && !rgba)
+        throw std::runtime_error("Frame capture needs an 8 bit RGBA or BGRA swapchain");
+
+    m_capture = std::make_unique<FrameCapture>(m_options.captureFile, m_fbSize.width, m_fbSize.height, m_options.captureFps, bgra);
+
+    fprintf(stderr, "Frame capture initialized\n");
 }